@@ -279,9 +279,12 @@ void tlb_init(CPUState *cpu)
     int i;
 
     qemu_spin_init(&env_tlb(env)->c.lock);
+    qemu_spin_init(&env_tlb(env)->c.pending_lock);
 
     /* All tlbs are initialized flushed. */
     env_tlb(env)->c.dirty = 0;
+    env_tlb(env)->c.pending_flush = 0;
+    env_tlb(env)->c.pending_queued = 0;
 
     for (i = 0; i < NB_MMU_MODES; i++) {
         tlb_mmu_init(&env_tlb(env)->d[i], &env_tlb(env)->f[i], now);
@@ -294,6 +297,7 @@ void tlb_destroy(CPUState *cpu)
     int i;
 
     qemu_spin_destroy(&env_tlb(env)->c.lock);
+    qemu_spin_destroy(&env_tlb(env)->c.pending_lock);
     for (i = 0; i < NB_MMU_MODES; i++) {
         CPUTLBDesc *desc = &env_tlb(env)->d[i];
         CPUTLBDescFast *fast = &env_tlb(env)->f[i];
@@ -303,25 +307,6 @@ void tlb_destroy(CPUState *cpu)
     }
 }
 
-/* flush_all_helper: run fn across all cpus
- *
- * If the wait flag is set then the src cpu's helper will be queued as
- * "safe" work and the loop exited creating a synchronisation point
- * where all queued work will be finished before execution starts
- * again.
- */
-static void flush_all_helper(CPUState *src, run_on_cpu_func fn,
-                             run_on_cpu_data d)
-{
-    CPUState *cpu;
-
-    CPU_FOREACH(cpu) {
-        if (cpu != src) {
-            async_run_on_cpu(cpu, fn, d);
-        }
-    }
-}
-
 void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
 {
     CPUState *cpu;
@@ -380,13 +365,78 @@ static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
     }
 }
 
+static void tlb_flush_pending_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    uint16_t asked = data.host_int;
+
+    /*
+     * Claim the pending bits before flushing, so that a request arriving
+     * from now on queues work of its own instead of relying on this one.
+     */
+    qemu_spin_lock(&env_tlb(env)->c.pending_lock);
+    asked |= env_tlb(env)->c.pending_flush;
+    env_tlb(env)->c.pending_flush = 0;
+    env_tlb(env)->c.pending_queued--;
+    qemu_spin_unlock(&env_tlb(env)->c.pending_lock);
+
+    tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(asked));
+}
+
+/*
+ * Queue a flush of @idxmap on the remote @cpu, merging it with a flush
+ * that is already queued there.  Requests are only merged into work that
+ * is known to be on the work list, i.e. after pending_queued has been
+ * incremented for it, which keeps the guarantee of the _synced variants.
+ * The work itself is queued without holding pending_lock.
+ */
+static void tlb_flush_by_mmuidx_queue(CPUState *cpu, uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+
+    qemu_spin_lock(&env_tlb(env)->c.pending_lock);
+    if (env_tlb(env)->c.pending_queued > 0) {
+        env_tlb(env)->c.pending_flush |= idxmap;
+        qemu_spin_unlock(&env_tlb(env)->c.pending_lock);
+        return;
+    }
+    qemu_spin_unlock(&env_tlb(env)->c.pending_lock);
+
+    async_run_on_cpu(cpu, tlb_flush_pending_async_work,
+                     RUN_ON_CPU_HOST_INT(idxmap));
+
+    /*
+     * If the work has already claimed the pending bits, the count is back
+     * to zero and there is nothing left to merge with.
+     */
+    qemu_spin_lock(&env_tlb(env)->c.pending_lock);
+    if (++env_tlb(env)->c.pending_queued > 0) {
+        env_tlb(env)->c.pending_flush |= idxmap;
+    }
+    qemu_spin_unlock(&env_tlb(env)->c.pending_lock);
+}
+
+/*
+ * Returns true if a flush of all of @idxmap is queued on @cpu and has not
+ * started yet, which makes a flush of a subset of those mmu_idx redundant.
+ */
+static bool tlb_flush_is_pending(CPUState *cpu, uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    bool ret;
+
+    qemu_spin_lock(&env_tlb(env)->c.pending_lock);
+    ret = (env_tlb(env)->c.pending_flush & idxmap) == idxmap;
+    qemu_spin_unlock(&env_tlb(env)->c.pending_lock);
+    return ret;
+}
+
 void tlb_flush_by_mmuidx(CPUState *cpu, uint16_t idxmap)
 {
     tlb_debug("mmu_idx: 0x%" PRIx16 "\n", idxmap);
 
     if (cpu->created && !qemu_cpu_is_self(cpu)) {
-        async_run_on_cpu(cpu, tlb_flush_by_mmuidx_async_work,
-                         RUN_ON_CPU_HOST_INT(idxmap));
+        tlb_flush_by_mmuidx_queue(cpu, idxmap);
     } else {
         tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(idxmap));
     }
@@ -400,10 +450,15 @@ void tlb_flush(CPUState *cpu)
 void tlb_flush_by_mmuidx_all_cpus(CPUState *src_cpu, uint16_t idxmap)
 {
     const run_on_cpu_func fn = tlb_flush_by_mmuidx_async_work;
+    CPUState *cpu;
 
     tlb_debug("mmu_idx: 0x%"PRIx16"\n", idxmap);
 
-    flush_all_helper(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
+    CPU_FOREACH(cpu) {
+        if (cpu != src_cpu) {
+            tlb_flush_by_mmuidx_queue(cpu, idxmap);
+        }
+    }
     fn(src_cpu, RUN_ON_CPU_HOST_INT(idxmap));
 }
 
@@ -415,10 +470,15 @@ void tlb_flush_all_cpus(CPUState *src_cpu)
 void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu, uint16_t idxmap)
 {
     const run_on_cpu_func fn = tlb_flush_by_mmuidx_async_work;
+    CPUState *cpu;
 
     tlb_debug("mmu_idx: 0x%"PRIx16"\n", idxmap);
 
-    flush_all_helper(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
+    CPU_FOREACH(cpu) {
+        if (cpu != src_cpu) {
+            tlb_flush_by_mmuidx_queue(cpu, idxmap);
+        }
+    }
     async_safe_run_on_cpu(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
 }
 
@@ -597,6 +657,8 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, uint16_t idxmap)
 
     if (qemu_cpu_is_self(cpu)) {
         tlb_flush_page_by_mmuidx_async_0(cpu, addr, idxmap);
+    } else if (tlb_flush_is_pending(cpu, idxmap)) {
+        /* A queued flush of these mmu_idx already covers the page.  */
     } else if (idxmap < TARGET_PAGE_SIZE) {
         /*
          * Most targets have only a few mmu_idx.  In the case where
@@ -634,14 +696,20 @@ void tlb_flush_page_by_mmuidx_all_cpus(CPUState *src_cpu, target_ulong addr,
      * See tlb_flush_page_by_mmuidx for details.
      */
     if (idxmap < TARGET_PAGE_SIZE) {
-        flush_all_helper(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
+        CPUState *dst_cpu;
+
+        CPU_FOREACH(dst_cpu) {
+            if (dst_cpu != src_cpu && !tlb_flush_is_pending(dst_cpu, idxmap)) {
+                async_run_on_cpu(dst_cpu, tlb_flush_page_by_mmuidx_async_1,
+                                 RUN_ON_CPU_TARGET_PTR(addr | idxmap));
+            }
+        }
     } else {
         CPUState *dst_cpu;
 
         /* Allocate a separate data block for each destination cpu.  */
         CPU_FOREACH(dst_cpu) {
-            if (dst_cpu != src_cpu) {
+            if (dst_cpu != src_cpu && !tlb_flush_is_pending(dst_cpu, idxmap)) {
                 TLBFlushPageByMMUIdxData *d
                     = g_new(TLBFlushPageByMMUIdxData, 1);
 
@@ -675,8 +743,14 @@ void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
      * See tlb_flush_page_by_mmuidx for details.
      */
     if (idxmap < TARGET_PAGE_SIZE) {
-        flush_all_helper(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
+        CPUState *dst_cpu;
+
+        CPU_FOREACH(dst_cpu) {
+            if (dst_cpu != src_cpu && !tlb_flush_is_pending(dst_cpu, idxmap)) {
+                async_run_on_cpu(dst_cpu, tlb_flush_page_by_mmuidx_async_1,
+                                 RUN_ON_CPU_TARGET_PTR(addr | idxmap));
+            }
+        }
         async_safe_run_on_cpu(src_cpu, tlb_flush_page_by_mmuidx_async_1,
                               RUN_ON_CPU_TARGET_PTR(addr | idxmap));
     } else {
@@ -685,7 +759,7 @@ void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
 
         /* Allocate a separate data block for each destination cpu.  */
         CPU_FOREACH(dst_cpu) {
-            if (dst_cpu != src_cpu) {
+            if (dst_cpu != src_cpu && !tlb_flush_is_pending(dst_cpu, idxmap)) {
                 d = g_new(TLBFlushPageByMMUIdxData, 1);
                 d->addr = addr;
                 d->idxmap = idxmap;
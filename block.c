@@ -108,6 +108,8 @@ static void bdrv_reopen_abort(BDRVReopenState *reopen_state);
 
 static bool bdrv_backing_overridden(BlockDriverState *bs);
 
+static void bdrv_bsc_init(BlockDriverState *bs);
+
 /* If non-zero, use only whitelisted block drivers */
 static int use_bdrv_whitelist;
 
@@ -423,8 +425,7 @@ BlockDriverState *bdrv_new(void)
 
     qemu_co_queue_init(&bs->flush_queue);
 
-    qemu_co_mutex_init(&bs->bsc_modify_lock);
-    bs->block_status_cache = g_new0(BdrvBlockStatusCache, 1);
+    bdrv_bsc_init(bs);
 
     for (i = 0; i < bdrv_drain_all_count; i++) {
         bdrv_drained_begin(bs);
@@ -1442,6 +1443,7 @@ static void bdrv_child_cb_attach(BdrvChild *child)
 
     assert_bdrv_graph_writable(bs);
     QLIST_INSERT_HEAD(&bs->children, child, next);
+    bdrv_bsc_invalidate_all(bs);
 
     if (child->role & BDRV_CHILD_COW) {
         bdrv_backing_attach(child);
@@ -1462,6 +1464,7 @@ static void bdrv_child_cb_detach(BdrvChild *child)
 
     assert_bdrv_graph_writable(bs);
     QLIST_REMOVE(child, next);
+    bdrv_bsc_invalidate_all(bs);
 }
 
 static int bdrv_child_cb_update_filename(BdrvChild *c, BlockDriverState *base,
@@ -4895,6 +4898,9 @@ static void bdrv_reopen_commit(BDRVReopenState *reopen_state)
     qdict_del(bs->options, "backing");
 
     bdrv_refresh_limits(bs, NULL, NULL);
+
+    /* The driver may now report differently, or with another alignment */
+    bdrv_bsc_invalidate_all(bs);
 }
 
 /*
@@ -4956,8 +4962,7 @@ static void bdrv_close(BlockDriverState *bs)
     bs->explicit_options = NULL;
     qobject_unref(bs->full_open_options);
     bs->full_open_options = NULL;
-    g_free(bs->block_status_cache);
-    bs->block_status_cache = NULL;
+    bdrv_bsc_invalidate_all(bs);
 
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
@@ -5470,10 +5475,13 @@ fail:
  *
  * Returns 0 if the check could be completed (it doesn't mean that the image is
  * free of errors) or -errno when an internal error occurred. The results of the
- * check are stored in res.
+ * check are stored in res.  Drivers may report their progress through
+ * status_cb, which can be NULL.
  */
 int coroutine_fn bdrv_co_check(BlockDriverState *bs,
-                               BdrvCheckResult *res, BdrvCheckMode fix)
+                               BdrvCheckResult *res, BdrvCheckMode fix,
+                               BlockDriverCheckStatusCB *status_cb,
+                               void *cb_opaque)
 {
     IO_CODE();
     if (bs->drv == NULL) {
@@ -5484,7 +5492,7 @@ int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    return bs->drv->bdrv_co_check(bs, res, fix, status_cb, cb_opaque);
 }
 
 /*
@@ -6689,6 +6697,9 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
 
     assert(!(bs->open_flags & BDRV_O_INACTIVE));
 
+    /* Others may have written to the image while we did not own it */
+    bdrv_bsc_invalidate_all(bs);
+
     if (bs->drv->bdrv_co_invalidate_cache) {
         bs->drv->bdrv_co_invalidate_cache(bs, &local_err);
         if (local_err) {
@@ -8168,41 +8179,153 @@ BlockDriverState *bdrv_backing_chain_next(BlockDriverState *bs)
     return bdrv_skip_filters(bdrv_cow_bs(bdrv_skip_filters(bs)));
 }
 
+/*
+ * Bounds the memory that the block-status cache of a node may take; the
+ * least recently used extents are dropped beyond this.
+ */
+#define BDRV_BSC_MAX_EXTENTS 16384
+
+typedef struct BdrvBlockStatusExtent {
+    struct rcu_head rcu;
+    IntervalTreeNode node;
+    QTAILQ_ENTRY(BdrvBlockStatusExtent) lru;
+    int status;
+    /* Set by lookups, which do not take the lock to move the extent */
+    bool referenced;
+} BdrvBlockStatusExtent;
+
+static void bdrv_bsc_init(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+
+    qemu_mutex_init(&bsc->lock);
+    QTAILQ_INIT(&bsc->lru);
+}
+
+/* Called with bsc->lock held */
+static void bdrv_bsc_insert_locked(BdrvBlockStatusCache *bsc,
+                                   uint64_t start, uint64_t last, int status)
+{
+    BdrvBlockStatusExtent *e = g_new0(BdrvBlockStatusExtent, 1);
+
+    e->node.start = start;
+    e->node.last = last;
+    e->status = status;
+    interval_tree_insert(&e->node, &bsc->extents);
+    QTAILQ_INSERT_HEAD(&bsc->lru, e, lru);
+    qatomic_set(&bsc->nb_extents, bsc->nb_extents + 1);
+}
+
+/* Called with bsc->lock held */
+static void bdrv_bsc_drop_locked(BdrvBlockStatusCache *bsc,
+                                 BdrvBlockStatusExtent *e)
+{
+    interval_tree_remove(&e->node, &bsc->extents);
+    QTAILQ_REMOVE(&bsc->lru, e, lru);
+    qatomic_set(&bsc->nb_extents, bsc->nb_extents - 1);
+    g_free_rcu(e, rcu);
+}
+
+/*
+ * Called with bsc->lock held, or within an RCU read-side critical section;
+ * in the latter case the lookup may miss an extent that is being moved.
+ */
+static BdrvBlockStatusExtent *bdrv_bsc_find(BdrvBlockStatusCache *bsc,
+                                            uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *n = interval_tree_iter_first(&bsc->extents, start, last);
+
+    return n ? container_of(n, BdrvBlockStatusExtent, node) : NULL;
+}
+
+/*
+ * Called with bsc->lock held.  Drop the least recently used extent, giving
+ * those that were looked up since they were last considered a second
+ * chance.
+ */
+static void bdrv_bsc_evict_locked(BdrvBlockStatusCache *bsc)
+{
+    BdrvBlockStatusExtent *e = QTAILQ_LAST(&bsc->lru);
+    unsigned int i;
+
+    /* Bounded, because lookups may set the flag again concurrently */
+    for (i = 0; i < bsc->nb_extents && qatomic_read(&e->referenced); i++) {
+        qatomic_set(&e->referenced, false);
+        QTAILQ_REMOVE(&bsc->lru, e, lru);
+        QTAILQ_INSERT_HEAD(&bsc->lru, e, lru);
+        e = QTAILQ_LAST(&bsc->lru);
+    }
+    bdrv_bsc_drop_locked(bsc, e);
+}
+
 /**
- * Check whether [offset, offset + bytes) overlaps with the cached
- * block-status data region.
- *
- * If so, and @pnum is not NULL, set *pnum to `bsc.data_end - offset`,
- * which is what bdrv_bsc_is_data()'s interface needs.
- * Otherwise, *pnum is not touched.
+ * See block_int.h for this function's documentation.
  */
-static bool bdrv_bsc_range_overlaps_locked(BlockDriverState *bs,
-                                           int64_t offset, int64_t bytes,
-                                           int64_t *pnum)
+bool bdrv_bsc_lookup(BlockDriverState *bs, int64_t offset, int *status,
+                     int64_t *pnum)
 {
-    BdrvBlockStatusCache *bsc = qatomic_rcu_read(&bs->block_status_cache);
-    bool overlaps;
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    BdrvBlockStatusExtent *e;
+    IO_CODE();
 
-    overlaps =
-        qatomic_read(&bsc->valid) &&
-        ranges_overlap(offset, bytes, bsc->data_start,
-                       bsc->data_end - bsc->data_start);
+    RCU_READ_LOCK_GUARD();
 
-    if (overlaps && pnum) {
-        *pnum = bsc->data_end - offset;
+    e = bdrv_bsc_find(bsc, offset, offset);
+    if (!e) {
+        stat64_add(&bsc->misses, 1);
+        return false;
     }
 
-    return overlaps;
+    if (!qatomic_read(&e->referenced)) {
+        qatomic_set(&e->referenced, true);
+    }
+    stat64_add(&bsc->hits, 1);
+
+    *status = e->status;
+    *pnum = e->node.last + 1 - offset;
+    return true;
 }
 
 /**
  * See block_int.h for this function's documentation.
  */
-bool bdrv_bsc_is_data(BlockDriverState *bs, int64_t offset, int64_t *pnum)
+void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                   int status)
 {
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    uint64_t start = offset;
+    uint64_t last = offset + bytes - 1;
+    BdrvBlockStatusExtent *e;
     IO_CODE();
-    RCU_READ_LOCK_GUARD();
-    return bdrv_bsc_range_overlaps_locked(bs, offset, 1, pnum);
+
+    assert(status & BDRV_BLOCK_DATA && !(status & BDRV_BLOCK_ZERO));
+    if (bytes <= 0) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&bsc->lock);
+
+    /* What the driver just told us replaces whatever we knew before */
+    while ((e = bdrv_bsc_find(bsc, start, last))) {
+        bdrv_bsc_drop_locked(bsc, e);
+    }
+
+    /* Merge with the neighbours, to keep the number of extents low */
+    e = start ? bdrv_bsc_find(bsc, start - 1, start - 1) : NULL;
+    if (e && e->status == status) {
+        start = e->node.start;
+        bdrv_bsc_drop_locked(bsc, e);
+    }
+    e = bdrv_bsc_find(bsc, last + 1, last + 1);
+    if (e && e->status == status) {
+        last = e->node.last;
+        bdrv_bsc_drop_locked(bsc, e);
+    }
+
+    bdrv_bsc_insert_locked(bsc, start, last, status);
+    while (bsc->nb_extents > BDRV_BSC_MAX_EXTENTS) {
+        bdrv_bsc_evict_locked(bsc);
+    }
 }
 
 /**
@@ -8211,34 +8334,78 @@ bool bdrv_bsc_is_data(BlockDriverState *bs, int64_t offset, int64_t *pnum)
 void bdrv_bsc_invalidate_range(BlockDriverState *bs,
                                int64_t offset, int64_t bytes)
 {
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    uint64_t align = bs->bl.request_alignment ?: 1;
+    uint64_t start, last;
+    BdrvBlockStatusExtent *e;
     IO_CODE();
-    RCU_READ_LOCK_GUARD();
 
-    if (bdrv_bsc_range_overlaps_locked(bs, offset, bytes, NULL)) {
-        qatomic_set(&bs->block_status_cache->valid, false);
+    /*
+     * Most nodes never have their block status cached, skip the lock.
+     * An extent that is being filled concurrently may be missed, which
+     * is fine because it can only report zeroes as data.
+     */
+    if (bytes <= 0 || !qatomic_read(&bsc->nb_extents)) {
+        return;
+    }
+
+    /* Cached extents must stay aligned, or they would be no valid result */
+    start = QEMU_ALIGN_DOWN(offset, align);
+    last = offset + bytes - 1;
+    if (last <= INT64_MAX - align) {
+        last = QEMU_ALIGN_UP(last + 1, align) - 1;
+    }
+
+    QEMU_LOCK_GUARD(&bsc->lock);
+
+    while ((e = bdrv_bsc_find(bsc, start, last))) {
+        uint64_t e_start = e->node.start;
+        uint64_t e_last = e->node.last;
+        int status = e->status;
+
+        bdrv_bsc_drop_locked(bsc, e);
+        if (e_start < start) {
+            bdrv_bsc_insert_locked(bsc, e_start, start - 1, status);
+        }
+        if (e_last > last) {
+            bdrv_bsc_insert_locked(bsc, last + 1, e_last, status);
+        }
     }
 }
 
 /**
  * See block_int.h for this function's documentation.
  */
-void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes)
+void bdrv_bsc_invalidate_all(BlockDriverState *bs)
 {
-    BdrvBlockStatusCache *new_bsc = g_new(BdrvBlockStatusCache, 1);
-    BdrvBlockStatusCache *old_bsc;
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    BdrvBlockStatusExtent *e;
     IO_CODE();
 
-    *new_bsc = (BdrvBlockStatusCache) {
-        .valid = true,
-        .data_start = offset,
-        .data_end = offset + bytes,
-    };
+    QEMU_LOCK_GUARD(&bsc->lock);
+    while ((e = QTAILQ_FIRST(&bsc->lru))) {
+        bdrv_bsc_drop_locked(bsc, e);
+    }
+}
 
-    QEMU_LOCK_GUARD(&bs->bsc_modify_lock);
+/**
+ * See block_int.h for this function's documentation.
+ */
+BlockStatusCacheStats *bdrv_bsc_get_stats(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    BlockStatusCacheStats *stats;
+
+    uint64_t hits = stat64_get(&bsc->hits);
+    uint64_t misses = stat64_get(&bsc->misses);
 
-    old_bsc = qatomic_rcu_read(&bs->block_status_cache);
-    qatomic_rcu_set(&bs->block_status_cache, new_bsc);
-    if (old_bsc) {
-        g_free_rcu(old_bsc, rcu);
+    if (!hits && !misses) {
+        return NULL;
     }
+
+    stats = g_new0(BlockStatusCacheStats, 1);
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->extents = qatomic_read(&bsc->nb_extents);
+    return stats;
 }
@@ -34,6 +34,8 @@ typedef struct BackupBlockJob {
     BlockDriverState *cbw;
     BlockDriverState *source_bs;
     BlockDriverState *target_bs;
+    BlockDriverState **extra_targets;
+    int nb_extra_targets;
 
     BdrvDirtyBitmap *sync_bitmap;
 
@@ -53,12 +55,42 @@ typedef struct BackupBlockJob {
 
 static const BlockJobDriver backup_job_driver;
 
+/*
+ * Return the first extra target that couldn't be written to and its error,
+ * or NULL if all of them are fine.
+ */
+static BlockDriverState *backup_failed_extra_target(BackupBlockJob *job,
+                                                    int *error)
+{
+    uint64_t bytes_done;
+    int i;
+
+    for (i = 0; i < job->nb_extra_targets; i++) {
+        *error = block_copy_target_status(job->bcs, job->extra_targets[i],
+                                          &bytes_done);
+        if (*error < 0) {
+            return job->extra_targets[i];
+        }
+    }
+
+    return NULL;
+}
+
 static void backup_cleanup_sync_bitmap(BackupBlockJob *job, int ret)
 {
     BdrvDirtyBitmap *bm;
+    int error;
     bool sync = (((ret == 0) || (job->bitmap_mode == BITMAP_SYNC_MODE_ALWAYS)) \
                  && (job->bitmap_mode != BITMAP_SYNC_MODE_NEVER));
 
+    /*
+     * An extra target that failed misses data that the other targets got, so
+     * the bitmap must keep all bits for it.
+     */
+    if (backup_failed_extra_target(job, &error)) {
+        sync = false;
+    }
+
     if (sync) {
         /*
          * We succeeded, or we always intended to sync the bitmap.
@@ -103,6 +135,7 @@ static void backup_clean(Job *job)
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
     block_job_remove_all_bdrv(&s->common);
     bdrv_cbw_drop(s->cbw);
+    g_free(s->extra_targets);
 }
 
 void backup_do_checkpoint(BlockJob *job, Error **errp)
@@ -250,6 +283,7 @@ static void backup_init_bcs_bitmap(BackupBlockJob *job)
 static int coroutine_fn backup_run(Job *job, Error **errp)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
+    BlockDriverState *failed;
     int ret;
 
     backup_init_bcs_bitmap(s);
@@ -291,8 +325,23 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
              */
             job_yield(job);
         }
-    } else {
-        return backup_loop(s);
+        return 0;
+    }
+
+    ret = backup_loop(s);
+    if (ret < 0 || job_is_cancelled(job)) {
+        return ret;
+    }
+
+    /*
+     * Errors on extra targets didn't stop the copy to the others, but the
+     * backup on that target is incomplete, which must not go unnoticed.
+     */
+    failed = backup_failed_extra_target(s, &ret);
+    if (failed) {
+        error_setg_errno(errp, -ret, "Failed to write to extra target '%s'",
+                         bdrv_get_node_name(failed));
+        return ret;
     }
 
     return 0;
@@ -328,11 +377,37 @@ static void coroutine_fn backup_set_speed(BlockJob *job, int64_t speed)
 static bool backup_cancel(Job *job, bool force)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
+    int i;
 
     bdrv_cancel_in_flight(s->target_bs);
+    for (i = 0; i < s->nb_extra_targets; i++) {
+        bdrv_cancel_in_flight(s->extra_targets[i]);
+    }
     return true;
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+    BackupTargetInfoList **tail = &info->extra_targets;
+    int i;
+
+    for (i = 0; i < s->nb_extra_targets; i++) {
+        BackupTargetInfo *target = g_new0(BackupTargetInfo, 1);
+        int ret;
+
+        ret = block_copy_target_status(s->bcs, s->extra_targets[i],
+                                       &target->offset);
+        target->node_name = g_strdup(bdrv_get_node_name(s->extra_targets[i]));
+        if (ret < 0) {
+            target->has_error = true;
+            target->error = g_strdup(strerror(-ret));
+        }
+        QAPI_LIST_APPEND(tail, target);
+    }
+    info->has_extra_targets = !!info->extra_targets;
+}
+
 static const BlockJobDriver backup_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(BackupBlockJob),
@@ -347,10 +422,13 @@ static const BlockJobDriver backup_job_driver = {
         .cancel                 = backup_cancel,
     },
     .set_speed = backup_set_speed,
+    .query = backup_query,
 };
 
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
-                  BlockDriverState *target, int64_t speed,
+                  BlockDriverState *target,
+                  BlockDriverState **extra_targets, int nb_extra_targets,
+                  int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BitmapSyncMode bitmap_mode,
                   bool compress,
@@ -367,6 +445,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     int64_t cluster_size;
     BlockDriverState *cbw = NULL;
     BlockCopyState *bcs = NULL;
+    int i;
 
     assert(bs);
     assert(target);
@@ -407,6 +486,31 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    for (i = 0; i < nb_extra_targets; i++) {
+        BlockDriverState *extra = extra_targets[i];
+
+        if (bs == extra) {
+            error_setg(errp, "Source and target cannot be the same");
+            return NULL;
+        }
+
+        if (!bdrv_is_inserted(extra)) {
+            error_setg(errp, "Device is not inserted: %s",
+                       bdrv_get_device_name(extra));
+            return NULL;
+        }
+
+        if (compress && !bdrv_supports_compressed_writes(extra)) {
+            error_setg(errp, "Compression is not supported for this drive %s",
+                       bdrv_get_device_name(extra));
+            return NULL;
+        }
+
+        if (bdrv_op_is_blocked(extra, BLOCK_OP_TYPE_BACKUP_TARGET, errp)) {
+            return NULL;
+        }
+    }
+
     if (perf->max_workers < 1 || perf->max_workers > INT_MAX) {
         error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
         return NULL;
@@ -450,7 +554,22 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         goto error;
     }
 
-    cbw = bdrv_cbw_append(bs, target, filter_node_name, &bcs, errp);
+    for (i = 0; i < nb_extra_targets; i++) {
+        target_len = bdrv_getlength(extra_targets[i]);
+        if (target_len < 0) {
+            error_setg_errno(errp, -target_len, "Unable to get length for '%s'",
+                             bdrv_get_device_or_node_name(extra_targets[i]));
+            goto error;
+        }
+
+        if (target_len != len) {
+            error_setg(errp, "Source and target image have different sizes");
+            goto error;
+        }
+    }
+
+    cbw = bdrv_cbw_append(bs, target, extra_targets, nb_extra_targets,
+                          filter_node_name, &bcs, errp);
     if (!cbw) {
         goto error;
     }
@@ -474,6 +593,9 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->cbw = cbw;
     job->source_bs = bs;
     job->target_bs = target;
+    job->extra_targets = g_memdup2(extra_targets,
+                                   nb_extra_targets * sizeof(*extra_targets));
+    job->nb_extra_targets = nb_extra_targets;
     job->on_source_error = on_source_error;
     job->on_target_error = on_target_error;
     job->sync_mode = sync_mode;
@@ -491,6 +613,10 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     /* Required permissions are taken by copy-before-write filter target */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
+    for (i = 0; i < nb_extra_targets; i++) {
+        block_job_add_bdrv(&job->common, "extra-target", extra_targets[i], 0,
+                           BLK_PERM_ALL, &error_abort);
+    }
 
     return &job->common;
 
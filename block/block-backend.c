@@ -15,6 +15,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/coroutines.h"
+#include "block/request-trace.h"
 #include "block/throttle-groups.h"
 #include "hw/qdev-core.h"
 #include "sysemu/blockdev.h"
@@ -1273,9 +1274,13 @@ static void coroutine_fn blk_wait_while_drained(BlockBackend *blk)
     assert(blk->in_flight > 0);
 
     if (blk->quiesce_counter && !blk->disable_request_queuing) {
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_DRAIN_WAIT_START,
+                           blk_bs(blk), 0, 0);
         blk_dec_in_flight(blk);
         qemu_co_queue_wait(&blk->queued_requests, NULL);
         blk_inc_in_flight(blk);
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_DRAIN_WAIT_END,
+                           blk_bs(blk), 0, 0);
     }
 }
 
@@ -1304,8 +1309,12 @@ blk_co_do_preadv_part(BlockBackend *blk, int64_t offset, int64_t bytes,
 
     /* throttling disk I/O */
     if (blk->public.throttle_group_member.throttle_state) {
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_THROTTLE_START,
+                           bs, offset, bytes);
         throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
                 bytes, false);
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_THROTTLE_END,
+                           bs, offset, bytes);
     }
 
     ret = bdrv_co_preadv_part(blk->root, offset, bytes, qiov, qiov_offset,
@@ -1377,8 +1386,12 @@ blk_co_do_pwritev_part(BlockBackend *blk, int64_t offset, int64_t bytes,
     bdrv_inc_in_flight(bs);
     /* throttling disk I/O */
     if (blk->public.throttle_group_member.throttle_state) {
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_THROTTLE_START,
+                           bs, offset, bytes);
         throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
                 bytes, true);
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_THROTTLE_END,
+                           bs, offset, bytes);
     }
 
     if (!blk->enable_write_cache) {
@@ -2578,6 +2591,62 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/*
+ * Whether reads from @blk can be sent to a file descriptor with
+ * blk_co_sendfile() instead of going through a buffer.
+ */
+bool blk_can_sendfile(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    IO_CODE();
+
+    return bs && blk_is_available(blk) && bdrv_can_sendfile(bs);
+}
+
+/*
+ * Send @bytes at @offset of @blk directly to @out_fd.  Return the number
+ * of bytes sent, which is less than @bytes if @out_fd is non-blocking and
+ * became full; the caller should wait for @out_fd to become writable and
+ * send the rest.  Return -errno on failure.
+ */
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int64_t bytes, int out_fd)
+{
+    BlockDriverState *bs;
+    int ret;
+    IO_CODE();
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    /* Call blk_bs() only after waiting, the graph may have changed */
+    bs = blk_bs(blk);
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        goto out;
+    }
+
+    bdrv_inc_in_flight(bs);
+
+    /* throttling disk I/O */
+    if (blk->public.throttle_group_member.throttle_state) {
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_THROTTLE_START,
+                           bs, offset, bytes);
+        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
+                bytes, false);
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_THROTTLE_END,
+                           bs, offset, bytes);
+    }
+
+    ret = bdrv_co_sendfile(blk->root, offset, bytes, out_fd);
+    bdrv_dec_in_flight(bs);
+
+out:
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     GLOBAL_STATE_CODE();
@@ -24,6 +24,8 @@
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
 #include "qemu/memalign.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
@@ -31,6 +33,7 @@
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BLOCK_COPY_CHUNK_LATENCY_NS 10000000LL
 
 typedef enum {
     COPY_READ_WRITE_CLUSTER,
@@ -108,6 +111,30 @@ static int64_t task_end(BlockCopyTask *task)
     return task->req.offset + task->req.bytes;
 }
 
+typedef struct BlockCopyTarget {
+    BdrvChild *child;
+    bool is_fleecing;
+
+    /* Bytes of successful tasks that were written to @child */
+    Stat64 bytes_done;
+    /*
+     * First failure to write to @child, set atomically.  Once it is set,
+     * @child is not written to anymore.
+     */
+    int ret;
+} BlockCopyTarget;
+
+/* Write of a task to one of the extra targets */
+typedef struct BlockCopyWriteTask {
+    AioTask task;
+    BlockCopyState *s;
+    BlockCopyTarget *target;
+    int64_t offset;
+    int64_t bytes;
+    /* NULL to write zeroes */
+    void *buf;
+} BlockCopyWriteTask;
+
 typedef struct BlockCopyState {
     /*
      * BdrvChild objects are not owned or managed by block-copy. They are
@@ -117,6 +144,15 @@ typedef struct BlockCopyState {
     BdrvChild *source;
     BdrvChild *target;
 
+    /*
+     * Further targets added with block_copy_add_target() before the first
+     * copy request.  They get the same data as @target, read from @source
+     * only once.  Unlike for @target, failing to write to one of them
+     * doesn't fail the block-copy call: that target is just left behind.
+     */
+    BlockCopyTarget *extra_targets;
+    int nb_extra_targets;
+
     /*
      * Fields initialized in block_copy_state_new()
      * and never changed.
@@ -133,6 +169,12 @@ typedef struct BlockCopyState {
     CoMutex lock;
     int64_t in_flight_bytes;
     BlockCopyMethod method;
+    /*
+     * Chunk size with which copying a chunk takes about
+     * BLOCK_COPY_CHUNK_LATENCY_NS, estimated from the completed tasks.
+     * Zero until the first task completes.
+     */
+    int64_t chunk_estimate;
     BlockReqList reqs;
     QLIST_HEAD(, BlockCopyCallState) calls;
     /*
@@ -160,20 +202,58 @@ typedef struct BlockCopyState {
 /* Called with lock held */
 static int64_t block_copy_chunk_size(BlockCopyState *s)
 {
+    int64_t chunk;
+
     switch (s->method) {
     case COPY_READ_WRITE_CLUSTER:
         return s->cluster_size;
     case COPY_READ_WRITE:
     case COPY_RANGE_SMALL:
-        return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
-                   s->max_transfer);
+        chunk = MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
+                    s->max_transfer);
+        break;
     case COPY_RANGE_FULL:
-        return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
-                   s->max_transfer);
+        chunk = MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
+                    s->max_transfer);
+        break;
     default:
         /* Cannot have COPY_WRITE_ZEROES here.  */
         abort();
     }
+
+    if (s->chunk_estimate) {
+        chunk = MIN(chunk, MAX(QEMU_ALIGN_DOWN(s->chunk_estimate,
+                                               s->cluster_size),
+                               s->cluster_size));
+    }
+
+    return chunk;
+}
+
+/*
+ * Update the chunk size estimate with a task of @bytes that took @ns to
+ * copy.
+ *
+ * Large chunks make background copying cheaper, but guest writes that the
+ * copy-before-write filter intercepts wait for all tasks that overlap them
+ * to complete.  So on slow targets, chunks are limited to what can be
+ * copied in BLOCK_COPY_CHUNK_LATENCY_NS.
+ *
+ * Called with lock held.
+ */
+static void block_copy_adapt_chunk(BlockCopyState *s, int64_t bytes,
+                                   int64_t ns)
+{
+    int64_t chunk = bytes * BLOCK_COPY_CHUNK_LATENCY_NS / MAX(ns, 1);
+
+    chunk = MIN(chunk, BLOCK_COPY_MAX_COPY_RANGE);
+    if (!s->chunk_estimate) {
+        s->chunk_estimate = chunk;
+    } else {
+        s->chunk_estimate += (chunk - s->chunk_estimate) / 8;
+    }
+
+    trace_block_copy_adapt_chunk(s, bytes, ns, s->chunk_estimate);
 }
 
 /*
@@ -267,6 +347,7 @@ void block_copy_state_free(BlockCopyState *s)
     ratelimit_destroy(&s->rate_limit);
     bdrv_release_dirty_bitmap(s->copy_bitmap);
     shres_destroy(s->mem);
+    g_free(s->extra_targets);
     g_free(s);
 }
 
@@ -299,8 +380,11 @@ void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
         /*
          * If copy range enabled, start with COPY_RANGE_SMALL, until first
          * successful copy_range (look at block_copy_do_copy).
+         * copy_range can't write to more than one target, so it's not used
+         * with extra targets.
          */
-        s->method = use_copy_range ? COPY_RANGE_SMALL : COPY_READ_WRITE;
+        s->method = use_copy_range && !s->nb_extra_targets ?
+            COPY_RANGE_SMALL : COPY_READ_WRITE;
     }
 }
 
@@ -414,6 +498,70 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
     return s;
 }
 
+int block_copy_add_target(BlockCopyState *s, BdrvChild *target, Error **errp)
+{
+    int64_t cluster_size;
+    int i;
+
+    for (i = -1; i < s->nb_extra_targets; i++) {
+        BdrvChild *c = i < 0 ? s->target : s->extra_targets[i].child;
+
+        if (c->bs == target->bs) {
+            error_setg(errp, "Node '%s' is already a target",
+                       bdrv_get_node_name(target->bs));
+            return -EINVAL;
+        }
+    }
+
+    cluster_size = block_copy_calculate_cluster_size(target->bs, errp);
+    if (cluster_size < 0) {
+        return cluster_size;
+    }
+    if (!QEMU_IS_ALIGNED(s->cluster_size, cluster_size)) {
+        error_setg(errp, "Target '%s' needs a cluster size of %" PRIi64
+                   " bytes, which doesn't fit the block-copy cluster size "
+                   "of %" PRIi64 " bytes", bdrv_get_node_name(target->bs),
+                   cluster_size, s->cluster_size);
+        return -EINVAL;
+    }
+
+    s->extra_targets = g_renew(BlockCopyTarget, s->extra_targets,
+                               s->nb_extra_targets + 1);
+    s->extra_targets[s->nb_extra_targets++] = (BlockCopyTarget) {
+        .child = target,
+        .is_fleecing = bdrv_chain_contains(target->bs, s->source->bs),
+    };
+
+    s->max_transfer = MIN(s->max_transfer,
+                          QEMU_ALIGN_DOWN(block_copy_max_transfer(s->source,
+                                                                  target),
+                                          s->cluster_size));
+    if (s->max_transfer < s->cluster_size) {
+        s->method = COPY_READ_WRITE_CLUSTER;
+    } else if (s->method == COPY_RANGE_SMALL || s->method == COPY_RANGE_FULL) {
+        s->method = COPY_READ_WRITE;
+    }
+
+    return 0;
+}
+
+int block_copy_target_status(BlockCopyState *s, BlockDriverState *target,
+                             uint64_t *bytes_done)
+{
+    int i;
+
+    for (i = 0; i < s->nb_extra_targets; i++) {
+        BlockCopyTarget *t = &s->extra_targets[i];
+
+        if (t->child->bs == target) {
+            *bytes_done = stat64_get(&t->bytes_done);
+            return qatomic_read(&t->ret);
+        }
+    }
+
+    abort();
+}
+
 /* Only set before running the job, no need for locking. */
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm)
 {
@@ -452,6 +600,86 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
     return 0;
 }
 
+static int coroutine_fn block_copy_write(BdrvChild *target, int64_t offset,
+                                         int64_t bytes, void *buf,
+                                         BdrvRequestFlags flags)
+{
+    if (!buf) {
+        return bdrv_co_pwrite_zeroes(target, offset, bytes,
+                                     flags & ~BDRV_REQ_WRITE_COMPRESSED);
+    }
+
+    return bdrv_co_pwrite(target, offset, bytes, buf, flags);
+}
+
+static coroutine_fn int block_copy_write_task_entry(AioTask *task)
+{
+    BlockCopyWriteTask *t = container_of(task, BlockCopyWriteTask, task);
+    BdrvRequestFlags flags = t->s->write_flags & ~BDRV_REQ_SERIALISING;
+    int ret;
+
+    if (t->target->is_fleecing) {
+        flags |= BDRV_REQ_SERIALISING;
+    }
+
+    ret = block_copy_write(t->target->child, t->offset, t->bytes, t->buf,
+                           flags);
+    if (ret < 0) {
+        trace_block_copy_target_fail(t->s, t->target->child->bs, t->offset,
+                                     ret);
+        qatomic_cmpxchg(&t->target->ret, 0, ret);
+    }
+
+    return 0;
+}
+
+/*
+ * Write @buf, or zeroes if @buf is NULL, to all targets.  The extra targets
+ * are written in parallel to s->target; failing to write to one of them
+ * only marks that target as failed.  Returns the result of the write to
+ * s->target.
+ */
+static int coroutine_fn block_copy_write_all(BlockCopyState *s,
+                                             int64_t offset, int64_t bytes,
+                                             void *buf)
+{
+    AioTaskPool *aio = NULL;
+    int i, ret;
+
+    for (i = 0; i < s->nb_extra_targets; i++) {
+        BlockCopyTarget *target = &s->extra_targets[i];
+        BlockCopyWriteTask *task;
+
+        if (qatomic_read(&target->ret)) {
+            continue;
+        }
+
+        if (!aio) {
+            aio = aio_task_pool_new(s->nb_extra_targets);
+        }
+
+        task = g_new(BlockCopyWriteTask, 1);
+        *task = (BlockCopyWriteTask) {
+            .task.func = block_copy_write_task_entry,
+            .s = s,
+            .target = target,
+            .offset = offset,
+            .bytes = bytes,
+            .buf = buf,
+        };
+        aio_task_pool_start_task(aio, &task->task);
+    }
+
+    ret = block_copy_write(s->target, offset, bytes, buf, s->write_flags);
+
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        aio_task_pool_free(aio);
+    }
+
+    return ret;
+}
+
 /*
  * block_copy_do_copy
  *
@@ -484,8 +712,7 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
 
     switch (*method) {
     case COPY_WRITE_ZEROES:
-        ret = bdrv_co_pwrite_zeroes(s->target, offset, nbytes, s->write_flags &
-                                    ~BDRV_REQ_WRITE_COMPRESSED);
+        ret = block_copy_write_all(s, offset, nbytes, NULL);
         if (ret < 0) {
             trace_block_copy_write_zeroes_fail(s, offset, ret);
             *error_is_read = false;
@@ -494,6 +721,7 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
 
     case COPY_RANGE_SMALL:
     case COPY_RANGE_FULL:
+        assert(!s->nb_extra_targets);
         ret = bdrv_co_copy_range(s->source, offset, s->target, offset, nbytes,
                                  0, s->write_flags);
         if (ret >= 0) {
@@ -527,8 +755,7 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
             goto out;
         }
 
-        ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
-                             s->write_flags);
+        ret = block_copy_write_all(s, offset, nbytes, bounce_buffer);
         if (ret < 0) {
             trace_block_copy_write_fail(s, offset, ret);
             *error_is_read = false;
@@ -552,10 +779,13 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     BlockCopyState *s = t->s;
     bool error_is_read = false;
     BlockCopyMethod method = t->method;
-    int ret;
+    int64_t start_ns, ns;
+    int i, ret;
 
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = block_copy_do_copy(s, t->req.offset, t->req.bytes, &method,
                              &error_is_read);
+    ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
 
     WITH_QEMU_LOCK_GUARD(&s->lock) {
         if (s->method == t->method) {
@@ -567,8 +797,19 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
                 t->call_state->ret = ret;
                 t->call_state->error_is_read = error_is_read;
             }
-        } else if (s->progress) {
-            progress_work_done(s->progress, t->req.bytes);
+        } else {
+            if (s->progress) {
+                progress_work_done(s->progress, t->req.bytes);
+            }
+            for (i = 0; i < s->nb_extra_targets; i++) {
+                if (!qatomic_read(&s->extra_targets[i].ret)) {
+                    stat64_add(&s->extra_targets[i].bytes_done,
+                               t->req.bytes);
+                }
+            }
+            if (method != COPY_WRITE_ZEROES) {
+                block_copy_adapt_chunk(s, t->req.bytes, ns);
+            }
         }
     }
     co_put_to_shres(s->mem, t->req.bytes);
@@ -708,13 +949,18 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
     bool found_dirty = false;
     int64_t end = offset + bytes;
     AioTaskPool *aio = NULL;
+    int i;
 
     /*
-     * block_copy() user is responsible for keeping source and target in same
+     * block_copy() user is responsible for keeping source and targets in same
      * aio context
      */
     assert(bdrv_get_aio_context(s->source->bs) ==
            bdrv_get_aio_context(s->target->bs));
+    for (i = 0; i < s->nb_extra_targets; i++) {
+        assert(bdrv_get_aio_context(s->source->bs) ==
+               bdrv_get_aio_context(s->extra_targets[i].child->bs));
+    }
 
     assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
     assert(QEMU_IS_ALIGNED(bytes, s->cluster_size));
@@ -0,0 +1,1183 @@
+/*
+ * Host memory cache driver
+ *
+ * The driver keeps recently used data of its child in host memory, in
+ * lines of a fixed size.  It is meant to be inserted above slow nodes
+ * (network protocols in particular) to absorb their latency:
+ *
+ * - reads that miss fetch whole lines, and sequential reads additionally
+ *   fetch the following lines in the same request to the child;
+ * - in write-back mode, writes complete as soon as the data is in the
+ *   cache.  Dirty data is written to the child when its line is evicted,
+ *   when the amount of dirty data exceeds a limit, and on flush, which
+ *   completes only once all data that was dirty when it started has been
+ *   written and the child has been flushed.
+ *
+ * Each line tracks the part of it that holds valid data and the part that
+ * is dirty, so that partial writes do not need to read the line from the
+ * child first.
+ *
+ * In write-back mode the child does not hold the guest's data until it
+ * has been written back, so the driver is not a filter: the block layer
+ * must not skip it to read or write the child directly.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/aio_task.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define CACHE_OPT_SIZE          "size"
+#define CACHE_OPT_LINE_SIZE     "line-size"
+#define CACHE_OPT_READ_AHEAD    "read-ahead"
+#define CACHE_OPT_WRITE_BACK    "write-back"
+#define CACHE_OPT_MAX_DIRTY     "max-dirty"
+
+#define CACHE_DEFAULT_SIZE        (64 * MiB)
+#define CACHE_DEFAULT_LINE_SIZE   (64 * KiB)
+#define CACHE_DEFAULT_READ_AHEAD  (1 * MiB)
+#define CACHE_MIN_LINE_SIZE       (4 * KiB)
+#define CACHE_MAX_LINE_SIZE       (16 * MiB)
+
+/* Number of lines written back concurrently on flush */
+#define CACHE_FLUSH_WORKERS 16
+
+typedef struct CacheLine {
+    uint64_t index;
+    uint8_t *buf;
+
+    /*
+     * [valid_start, valid_end) holds data, [dirty_start, dirty_end) is the
+     * part of it that has not been written to the child yet.  A line that
+     * is only partially valid has been created by a write; its valid range
+     * is always contiguous.
+     */
+    uint32_t valid_start, valid_end;
+    uint32_t dirty_start, dirty_end;
+
+    /* Set while the line is filled from or written back to the child */
+    bool busy;
+    /* Set if the line was filled by read-ahead and not read since */
+    bool read_ahead;
+
+    QTAILQ_ENTRY(CacheLine) lru;
+} CacheLine;
+
+/* A write-zeroes, discard or truncate request that bypasses the cache */
+typedef struct CacheBypassReq {
+    int64_t offset;
+    int64_t bytes;
+    QLIST_ENTRY(CacheBypassReq) next;
+} CacheBypassReq;
+
+typedef struct CacheOpts {
+    uint64_t size;
+    uint64_t line_size;
+    uint64_t read_ahead;
+    bool write_back;
+    uint64_t max_dirty;
+} CacheOpts;
+
+typedef struct BDRVCacheState {
+    CacheOpts opts;
+    int line_bits;
+
+    /* The lock protects all fields below */
+    CoMutex lock;
+
+    /* index -> CacheLine */
+    GHashTable *lines;
+    /* Most recently used lines first */
+    QTAILQ_HEAD(, CacheLine) lru;
+    int nb_lines;
+    int max_lines;
+    GSList *free_bufs;
+
+    uint64_t dirty_bytes;
+    /* End of the last read, to detect sequential access */
+    int64_t next_seq_offset;
+
+    /* Coroutines waiting for a line to become idle */
+    CoQueue line_queue;
+
+    QLIST_HEAD(, CacheBypassReq) bypass_reqs;
+    CoQueue bypass_queue;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t read_ahead_hits;
+    uint64_t evictions;
+    uint64_t writebacks;
+} BDRVCacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "amount of memory used for caching, default 64M",
+        },
+        {
+            .name = CACHE_OPT_LINE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "granularity of the cache, default 64k",
+        },
+        {
+            .name = CACHE_OPT_READ_AHEAD,
+            .type = QEMU_OPT_SIZE,
+            .help = "amount of data read in advance on sequential reads, "
+                "default 1M",
+        },
+        {
+            .name = CACHE_OPT_WRITE_BACK,
+            .type = QEMU_OPT_BOOL,
+            .help = "complete writes before they reach the child, "
+                "default on",
+        },
+        {
+            .name = CACHE_OPT_MAX_DIRTY,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum amount of data not yet written to the child, "
+                "default half of the cache size",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool cache_absorb_opts(CacheOpts *dest, QDict *options,
+                              BlockDriverState *child_bs, Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return false;
+    }
+
+    dest->size = qemu_opt_get_size(opts, CACHE_OPT_SIZE, CACHE_DEFAULT_SIZE);
+    dest->line_size = qemu_opt_get_size(opts, CACHE_OPT_LINE_SIZE,
+                                        CACHE_DEFAULT_LINE_SIZE);
+    dest->read_ahead = qemu_opt_get_size(opts, CACHE_OPT_READ_AHEAD,
+                                         CACHE_DEFAULT_READ_AHEAD);
+    dest->write_back = qemu_opt_get_bool(opts, CACHE_OPT_WRITE_BACK, true);
+    dest->max_dirty = qemu_opt_get_size(opts, CACHE_OPT_MAX_DIRTY,
+                                        dest->size / 2);
+
+    qemu_opts_del(opts);
+
+    if (dest->line_size < CACHE_MIN_LINE_SIZE ||
+        dest->line_size > CACHE_MAX_LINE_SIZE ||
+        !is_power_of_2(dest->line_size)) {
+        error_setg(errp, "line-size of cache filter must be a power of 2 "
+                   "between %" PRId64 " and %" PRId64, CACHE_MIN_LINE_SIZE,
+                   CACHE_MAX_LINE_SIZE);
+        return false;
+    }
+
+    if (!QEMU_IS_ALIGNED(dest->line_size, child_bs->bl.request_alignment)) {
+        error_setg(errp, "line-size of cache filter is not aligned to "
+                   "underlying node request alignment (%" PRIu32 ")",
+                   child_bs->bl.request_alignment);
+        return false;
+    }
+
+    if (dest->size < dest->line_size * 4) {
+        error_setg(errp, "size of cache filter must be at least four times "
+                   "its line-size");
+        return false;
+    }
+
+    if (dest->size / dest->line_size > INT_MAX) {
+        error_setg(errp, "size of cache filter is too large for its "
+                   "line-size");
+        return false;
+    }
+
+    if (dest->max_dirty < dest->line_size) {
+        error_setg(errp, "max-dirty of cache filter must be at least its "
+                   "line-size");
+        return false;
+    }
+
+    return true;
+}
+
+static int cache_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_DATA | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    if (!cache_absorb_opts(&s->opts, options, bs->file->bs, errp)) {
+        return -EINVAL;
+    }
+
+    s->line_bits = ctz64(s->opts.line_size);
+    s->max_lines = s->opts.size / s->opts.line_size;
+    s->lines = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    QLIST_INIT(&s->bypass_reqs);
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->line_queue);
+    qemu_co_queue_init(&s->bypass_queue);
+    s->next_seq_offset = -1;
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static void cache_free_line(BDRVCacheState *s, CacheLine *line)
+{
+    g_hash_table_remove(s->lines, &line->index);
+    QTAILQ_REMOVE(&s->lru, line, lru);
+    s->nb_lines--;
+
+    s->free_bufs = g_slist_prepend(s->free_bufs, line->buf);
+    g_free(line);
+}
+
+/* Drop a line from the cache, including any dirty data it holds */
+static void cache_drop_line(BDRVCacheState *s, CacheLine *line)
+{
+    assert(!line->busy);
+
+    s->dirty_bytes -= line->dirty_end - line->dirty_start;
+    cache_free_line(s, line);
+    qemu_co_queue_restart_all(&s->line_queue);
+}
+
+static void cache_close(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheLine *line, *next;
+
+    if (s->dirty_bytes) {
+        warn_report("cache: discarding %" PRIu64 " bytes that could not be "
+                    "written to '%s'", s->dirty_bytes,
+                    bdrv_get_node_name(bs->file->bs));
+    }
+
+    QTAILQ_FOREACH_SAFE(line, &s->lru, lru, next) {
+        cache_free_line(s, line);
+    }
+    g_slist_free_full(s->free_bufs, qemu_vfree);
+    g_hash_table_destroy(s->lines);
+}
+
+static int cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                BlockReopenQueue *queue, Error **errp)
+{
+    BDRVCacheState *s = reopen_state->bs->opaque;
+    CacheOpts *opts = g_new0(CacheOpts, 1);
+
+    if (!cache_absorb_opts(opts, reopen_state->options,
+                           reopen_state->bs->file->bs, errp)) {
+        g_free(opts);
+        return -EINVAL;
+    }
+
+    if (opts->line_size != s->opts.line_size) {
+        error_setg(errp, "Cannot change line-size of cache filter");
+        g_free(opts);
+        return -EINVAL;
+    }
+
+    reopen_state->opaque = opts;
+
+    return 0;
+}
+
+static void cache_reopen_commit(BDRVReopenState *state)
+{
+    BDRVCacheState *s = state->bs->opaque;
+
+    /*
+     * A smaller cache or dirty limit takes effect as lines are
+     * allocated or written.  Switching to write-through is safe because
+     * bdrv_reopen_prepare() flushed the node.
+     */
+    s->opts = *(CacheOpts *)state->opaque;
+    s->max_lines = s->opts.size / s->opts.line_size;
+
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void cache_reopen_abort(BDRVReopenState *state)
+{
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static inline CacheLine *cache_lookup(BDRVCacheState *s, uint64_t index)
+{
+    return g_hash_table_lookup(s->lines, &index);
+}
+
+static void cache_touch(BDRVCacheState *s, CacheLine *line)
+{
+    QTAILQ_REMOVE(&s->lru, line, lru);
+    QTAILQ_INSERT_HEAD(&s->lru, line, lru);
+}
+
+static inline bool cache_line_is_full(BDRVCacheState *s, CacheLine *line)
+{
+    return line->valid_start == 0 && line->valid_end == s->opts.line_size;
+}
+
+/* Must be called with s->lock held and @line idle */
+static int coroutine_fn cache_writeback_line(BlockDriverState *bs,
+                                             CacheLine *line,
+                                             BdrvRequestFlags flags)
+{
+    BDRVCacheState *s = bs->opaque;
+    int64_t offset;
+    int64_t bytes = line->dirty_end - line->dirty_start;
+    int ret;
+
+    assert(!line->busy);
+    if (!bytes) {
+        return 0;
+    }
+
+    offset = (line->index << s->line_bits) + line->dirty_start;
+
+    line->busy = true;
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_co_pwrite(bs->file, offset, bytes,
+                         line->buf + line->dirty_start, flags);
+    qemu_co_mutex_lock(&s->lock);
+    line->busy = false;
+
+    trace_cache_writeback(bs, offset, bytes, ret);
+
+    /* The line was busy, so nobody could have written to it meanwhile */
+    if (ret >= 0) {
+        s->dirty_bytes -= bytes;
+        line->dirty_start = line->dirty_end = 0;
+        s->writebacks++;
+    }
+
+    qemu_co_queue_restart_all(&s->line_queue);
+    return ret;
+}
+
+/*
+ * Make room for and insert a new, empty line for @index.
+ *
+ * Returns 1 if a line for @index has been created by someone else while
+ * waiting for room, in which case *@pline is not set.  If @can_wait is
+ * false, returns -EAGAIN rather than wait for a busy line to become
+ * evictable.
+ *
+ * Must be called with s->lock held.
+ */
+static int coroutine_fn cache_alloc_line(BlockDriverState *bs, uint64_t index,
+                                         bool can_wait, CacheLine **pline)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheLine *line;
+    uint8_t *buf;
+    int ret;
+
+    while (s->nb_lines >= s->max_lines) {
+        CacheLine *victim = NULL;
+
+        QTAILQ_FOREACH_REVERSE(line, &s->lru, lru) {
+            if (!line->busy) {
+                victim = line;
+                break;
+            }
+        }
+
+        if (!victim) {
+            if (!can_wait) {
+                return -EAGAIN;
+            }
+            qemu_co_queue_wait(&s->line_queue, &s->lock);
+            continue;
+        }
+
+        if (victim->dirty_end > victim->dirty_start) {
+            ret = cache_writeback_line(bs, victim, 0);
+            if (ret < 0) {
+                return ret;
+            }
+            /* We yielded, so look for a victim again */
+            continue;
+        }
+
+        trace_cache_evict(bs, victim->index);
+        cache_drop_line(s, victim);
+        s->evictions++;
+    }
+
+    if (cache_lookup(s, index)) {
+        return 1;
+    }
+
+    if (s->free_bufs) {
+        buf = s->free_bufs->data;
+        s->free_bufs = g_slist_delete_link(s->free_bufs, s->free_bufs);
+    } else {
+        buf = qemu_try_blockalign(bs->file->bs, s->opts.line_size);
+        if (!buf) {
+            return -ENOMEM;
+        }
+    }
+
+    line = g_new0(CacheLine, 1);
+    line->index = index;
+    line->buf = buf;
+    g_hash_table_insert(s->lines, &line->index, line);
+    QTAILQ_INSERT_HEAD(&s->lru, line, lru);
+    s->nb_lines++;
+
+    *pline = line;
+    return 0;
+}
+
+static CacheBypassReq *cache_find_bypass(BDRVCacheState *s, int64_t offset,
+                                         int64_t bytes)
+{
+    CacheBypassReq *req;
+
+    QLIST_FOREACH(req, &s->bypass_reqs, next) {
+        if (offset < req->offset + req->bytes &&
+            req->offset < offset + bytes) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Fill the missing parts of a partially valid line from the child.
+ * Must be called with s->lock held and @line idle.
+ */
+static int coroutine_fn cache_fill_line(BlockDriverState *bs, CacheLine *line)
+{
+    BDRVCacheState *s = bs->opaque;
+    int64_t offset = line->index << s->line_bits;
+    uint8_t *tmp;
+    int ret;
+
+    assert(!line->busy);
+
+    if (cache_find_bypass(s, offset, s->opts.line_size)) {
+        qemu_co_queue_wait(&s->bypass_queue, &s->lock);
+        return 0;
+    }
+
+    tmp = qemu_try_blockalign(bs->file->bs, s->opts.line_size);
+    if (!tmp) {
+        return -ENOMEM;
+    }
+
+    line->busy = true;
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_co_pread(bs->file, offset, s->opts.line_size, tmp, 0);
+    qemu_co_mutex_lock(&s->lock);
+    line->busy = false;
+
+    trace_cache_fill(bs, offset, s->opts.line_size, ret);
+
+    if (ret >= 0) {
+        memcpy(line->buf, tmp, line->valid_start);
+        memcpy(line->buf + line->valid_end, tmp + line->valid_end,
+               s->opts.line_size - line->valid_end);
+        line->valid_start = 0;
+        line->valid_end = s->opts.line_size;
+        s->misses++;
+    }
+
+    qemu_vfree(tmp);
+    qemu_co_queue_restart_all(&s->line_queue);
+    return ret;
+}
+
+/*
+ * Read the missing lines starting at @index from the child, with a single
+ * request.  Lines up to @req_last_index are needed by the caller; if
+ * @read_ahead is true, more lines are read past it.
+ *
+ * Returns the number of lines filled, or 0 if the caller needs to look up
+ * the line at @index again.  Must be called with s->lock held.
+ */
+static int coroutine_fn cache_fill_lines(BlockDriverState *bs, uint64_t index,
+                                         uint64_t req_last_index,
+                                         bool read_ahead)
+{
+    BDRVCacheState *s = bs->opaque;
+    int64_t length = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t last_index = req_last_index;
+    int max_run = MAX(s->max_lines / 4, 1);
+    g_autofree CacheLine **run = NULL;
+    QEMUIOVector qiov;
+    int64_t offset;
+    uint64_t i;
+    int ret, n = 0;
+
+    if (read_ahead && s->opts.read_ahead) {
+        last_index += DIV_ROUND_UP(s->opts.read_ahead, s->opts.line_size);
+    }
+    if (length > 0) {
+        last_index = MIN(last_index, (length - 1) >> s->line_bits);
+    }
+
+    run = g_new(CacheLine *, max_run);
+    for (i = index; i <= last_index && n < max_run; i++) {
+        CacheLine *line;
+
+        if (cache_lookup(s, i)) {
+            break;
+        }
+
+        /* Don't wait for room while we hold busy lines ourselves */
+        ret = cache_alloc_line(bs, i, n == 0, &line);
+        if (ret == -EAGAIN || ret == 1) {
+            break;
+        } else if (ret < 0) {
+            goto fail;
+        }
+
+        line->busy = true;
+        run[n++] = line;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    offset = index << s->line_bits;
+    if (cache_find_bypass(s, offset, (int64_t)n << s->line_bits)) {
+        ret = 0;
+        goto fail;
+    }
+
+    qemu_iovec_init(&qiov, n);
+    for (i = 0; i < n; i++) {
+        qemu_iovec_add(&qiov, run[i]->buf, s->opts.line_size);
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_co_preadv(bs->file, offset, qiov.size, &qiov, 0);
+    qemu_co_mutex_lock(&s->lock);
+    qemu_iovec_destroy(&qiov);
+
+    trace_cache_fill(bs, offset, (int64_t)n << s->line_bits, ret);
+
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < n; i++) {
+        run[i]->busy = false;
+        run[i]->valid_start = 0;
+        run[i]->valid_end = s->opts.line_size;
+        run[i]->read_ahead = run[i]->index > req_last_index;
+        if (!run[i]->read_ahead) {
+            s->misses++;
+        }
+    }
+    qemu_co_queue_restart_all(&s->line_queue);
+
+    return n;
+
+fail:
+    for (i = 0; i < n; i++) {
+        run[i]->busy = false;
+        cache_drop_line(s, run[i]);
+    }
+    if (ret == 0) {
+        /* Overlapping bypass request, retry once it is done */
+        qemu_co_queue_wait(&s->bypass_queue, &s->lock);
+    }
+    return ret;
+}
+
+static int coroutine_fn cache_co_preadv_part(BlockDriverState *bs,
+                                             int64_t offset, int64_t bytes,
+                                             QEMUIOVector *qiov,
+                                             size_t qiov_offset,
+                                             BdrvRequestFlags flags)
+{
+    BDRVCacheState *s = bs->opaque;
+    uint64_t last_index = (offset + bytes - 1) >> s->line_bits;
+    uint64_t filled_until = 0;
+    bool sequential;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    sequential = offset == s->next_seq_offset;
+    s->next_seq_offset = offset + bytes;
+
+    while (bytes > 0) {
+        uint64_t index = offset >> s->line_bits;
+        uint32_t start = offset & (s->opts.line_size - 1);
+        uint32_t n = MIN(bytes, s->opts.line_size - start);
+        CacheLine *line = cache_lookup(s, index);
+
+        if (line && line->busy) {
+            qemu_co_queue_wait(&s->line_queue, &s->lock);
+            continue;
+        }
+
+        if (!line) {
+            ret = cache_fill_lines(bs, index, last_index, sequential);
+            if (ret < 0) {
+                break;
+            }
+            /* Lines we filled ourselves are misses, not hits */
+            filled_until = MAX(filled_until, index + ret);
+            continue;
+        }
+
+        if (start < line->valid_start || start + n > line->valid_end) {
+            ret = cache_fill_line(bs, line);
+            if (ret < 0) {
+                break;
+            }
+            filled_until = MAX(filled_until, index + 1);
+            continue;
+        }
+
+        qemu_iovec_from_buf(qiov, qiov_offset, line->buf + start, n);
+        if (index >= filled_until) {
+            s->hits++;
+            if (line->read_ahead) {
+                s->read_ahead_hits++;
+            }
+        }
+        line->read_ahead = false;
+        cache_touch(s, line);
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    return ret < 0 ? ret : 0;
+}
+
+/* Write back dirty lines until the dirty limit is respected again */
+static int coroutine_fn cache_enforce_dirty_limit(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheLine *line;
+    int ret;
+
+    while (s->dirty_bytes > s->opts.max_dirty) {
+        CacheLine *victim = NULL;
+
+        QTAILQ_FOREACH_REVERSE(line, &s->lru, lru) {
+            if (!line->busy && line->dirty_end > line->dirty_start) {
+                victim = line;
+                break;
+            }
+        }
+
+        if (!victim) {
+            /* All dirty lines are being written back already */
+            qemu_co_queue_wait(&s->line_queue, &s->lock);
+            continue;
+        }
+
+        ret = cache_writeback_line(bs, victim, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int coroutine_fn cache_co_pwritev_part(BlockDriverState *bs,
+                                              int64_t offset, int64_t bytes,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset,
+                                              BdrvRequestFlags flags)
+{
+    BDRVCacheState *s = bs->opaque;
+    uint64_t first_index = offset >> s->line_bits;
+    uint64_t last_index = (offset + bytes - 1) >> s->line_bits;
+    uint64_t i;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    while (bytes > 0) {
+        uint64_t index = offset >> s->line_bits;
+        uint32_t start = offset & (s->opts.line_size - 1);
+        uint32_t n = MIN(bytes, s->opts.line_size - start);
+        CacheLine *line = cache_lookup(s, index);
+        uint32_t old_dirty;
+
+        if (line && line->busy) {
+            qemu_co_queue_wait(&s->line_queue, &s->lock);
+            continue;
+        }
+
+        if (!line) {
+            ret = cache_alloc_line(bs, index, true, &line);
+            if (ret < 0) {
+                goto out;
+            } else if (ret == 1) {
+                continue;
+            }
+            line->valid_start = start;
+            line->valid_end = start + n;
+        } else if (start > line->valid_end ||
+                   start + n < line->valid_start) {
+            /* Keep the valid range contiguous */
+            ret = cache_fill_line(bs, line);
+            if (ret < 0) {
+                goto out;
+            }
+            continue;
+        }
+
+        qemu_iovec_to_buf(qiov, qiov_offset, line->buf + start, n);
+
+        line->valid_start = MIN(line->valid_start, start);
+        line->valid_end = MAX(line->valid_end, start + n);
+
+        old_dirty = line->dirty_end - line->dirty_start;
+        if (old_dirty) {
+            line->dirty_start = MIN(line->dirty_start, start);
+            line->dirty_end = MAX(line->dirty_end, start + n);
+        } else {
+            line->dirty_start = start;
+            line->dirty_end = start + n;
+        }
+        s->dirty_bytes += line->dirty_end - line->dirty_start - old_dirty;
+
+        line->read_ahead = false;
+        cache_touch(s, line);
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    i = first_index;
+    while ((!s->opts.write_back || (flags & BDRV_REQ_FUA)) &&
+           i <= last_index) {
+        CacheLine *line = cache_lookup(s, i);
+
+        if (line && line->busy) {
+            qemu_co_queue_wait(&s->line_queue, &s->lock);
+            continue;
+        }
+        if (line) {
+            ret = cache_writeback_line(bs, line, flags & BDRV_REQ_FUA);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+        i++;
+    }
+
+    ret = cache_enforce_dirty_limit(bs);
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Drop the cached lines in [offset, offset + bytes).  Dirty data in lines
+ * that are only partially covered, or all dirty data if @keep_dirty is
+ * true, is written back first.
+ *
+ * Must be called with s->lock held.
+ */
+static int coroutine_fn cache_invalidate(BlockDriverState *bs, int64_t offset,
+                                         int64_t bytes, bool keep_dirty)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheLine *line, *next;
+    int ret;
+
+restart:
+    QTAILQ_FOREACH_SAFE(line, &s->lru, lru, next) {
+        int64_t line_start = line->index << s->line_bits;
+        int64_t line_end = line_start + s->opts.line_size;
+
+        if (line_end <= offset || line_start >= offset + bytes) {
+            continue;
+        }
+
+        if (line->busy) {
+            qemu_co_queue_wait(&s->line_queue, &s->lock);
+            goto restart;
+        }
+
+        if (line->dirty_end > line->dirty_start &&
+            (keep_dirty || line_start < offset ||
+             line_end > offset + bytes)) {
+            ret = cache_writeback_line(bs, line, 0);
+            if (ret < 0) {
+                return ret;
+            }
+            goto restart;
+        }
+
+        cache_drop_line(s, line);
+    }
+
+    return 0;
+}
+
+typedef int coroutine_fn CacheBypassFunc(BlockDriverState *bs, void *opaque);
+
+/*
+ * Run @fn on the child with the cache bypassed for [offset, offset + bytes):
+ * cached data is dropped first, and lines are not filled until @fn is done.
+ */
+static int coroutine_fn cache_co_bypass(BlockDriverState *bs, int64_t offset,
+                                        int64_t bytes, bool keep_dirty,
+                                        CacheBypassFunc *fn,
+                                        void *opaque)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheBypassReq req = {
+        .offset = offset,
+        .bytes  = bytes,
+    };
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    QLIST_INSERT_HEAD(&s->bypass_reqs, &req, next);
+
+    ret = cache_invalidate(bs, offset, bytes, keep_dirty);
+    if (ret >= 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = fn(bs, opaque);
+        qemu_co_mutex_lock(&s->lock);
+    }
+
+    QLIST_REMOVE(&req, next);
+    qemu_co_queue_restart_all(&s->bypass_queue);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+typedef struct CacheBypassArgs {
+    int64_t offset;
+    int64_t bytes;
+    BdrvRequestFlags flags;
+    bool exact;
+    PreallocMode prealloc;
+    Error **errp;
+} CacheBypassArgs;
+
+static int coroutine_fn cache_do_pwrite_zeroes(BlockDriverState *bs,
+                                               void *opaque)
+{
+    CacheBypassArgs *args = opaque;
+
+    return bdrv_co_pwrite_zeroes(bs->file, args->offset, args->bytes,
+                                 args->flags);
+}
+
+static int coroutine_fn cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                               int64_t offset, int64_t bytes,
+                                               BdrvRequestFlags flags)
+{
+    CacheBypassArgs args = {
+        .offset = offset,
+        .bytes  = bytes,
+        .flags  = flags,
+    };
+
+    return cache_co_bypass(bs, offset, bytes, false, cache_do_pwrite_zeroes,
+                           &args);
+}
+
+static int coroutine_fn cache_do_pdiscard(BlockDriverState *bs, void *opaque)
+{
+    CacheBypassArgs *args = opaque;
+
+    return bdrv_co_pdiscard(bs->file, args->offset, args->bytes);
+}
+
+static int coroutine_fn cache_co_pdiscard(BlockDriverState *bs,
+                                          int64_t offset, int64_t bytes)
+{
+    CacheBypassArgs args = {
+        .offset = offset,
+        .bytes  = bytes,
+    };
+
+    return cache_co_bypass(bs, offset, bytes, false, cache_do_pdiscard,
+                           &args);
+}
+
+static int coroutine_fn cache_do_truncate(BlockDriverState *bs, void *opaque)
+{
+    CacheBypassArgs *args = opaque;
+
+    return bdrv_co_truncate(bs->file, args->offset, args->exact,
+                            args->prealloc, args->flags, args->errp);
+}
+
+static int coroutine_fn cache_co_truncate(BlockDriverState *bs, int64_t offset,
+                                          bool exact, PreallocMode prealloc,
+                                          BdrvRequestFlags flags, Error **errp)
+{
+    CacheBypassArgs args = {
+        .offset   = offset,
+        .flags    = flags,
+        .exact    = exact,
+        .prealloc = prealloc,
+        .errp     = errp,
+    };
+    int ret;
+
+    /* The last line may change contents, so drop everything */
+    ret = cache_co_bypass(bs, 0, INT64_MAX, true, cache_do_truncate, &args);
+    if (ret < 0 && errp && !*errp) {
+        error_setg_errno(errp, -ret, "Failed to write back cached data");
+    }
+    return ret;
+}
+
+typedef struct CacheFlushTask {
+    AioTask task;
+    BlockDriverState *bs;
+    uint64_t index;
+} CacheFlushTask;
+
+static int coroutine_fn cache_flush_task_entry(AioTask *task)
+{
+    CacheFlushTask *t = container_of(task, CacheFlushTask, task);
+    BDRVCacheState *s = t->bs->opaque;
+    CacheLine *line;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    while ((line = cache_lookup(s, t->index)) && line->busy) {
+        qemu_co_queue_wait(&s->line_queue, &s->lock);
+    }
+    if (line) {
+        ret = cache_writeback_line(t->bs, line, 0);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/*
+ * Write back all lines that are dirty now.  Lines dirtied while this runs
+ * may or may not be written back.
+ */
+static int coroutine_fn cache_writeback_all(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    g_autoptr(GArray) dirty = g_array_new(false, false, sizeof(uint64_t));
+    AioTaskPool *pool;
+    CacheLine *line;
+    int ret;
+    guint i;
+
+    qemu_co_mutex_lock(&s->lock);
+    QTAILQ_FOREACH(line, &s->lru, lru) {
+        if (line->dirty_end > line->dirty_start || line->busy) {
+            g_array_append_val(dirty, line->index);
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    pool = aio_task_pool_new(CACHE_FLUSH_WORKERS);
+    for (i = 0; i < dirty->len && aio_task_pool_status(pool) >= 0; i++) {
+        CacheFlushTask *t = g_new(CacheFlushTask, 1);
+
+        *t = (CacheFlushTask) {
+            .task.func = cache_flush_task_entry,
+            .bs = bs,
+            .index = g_array_index(dirty, uint64_t, i),
+        };
+        aio_task_pool_start_task(pool, &t->task);
+    }
+    aio_task_pool_wait_all(pool);
+    ret = aio_task_pool_status(pool);
+    aio_task_pool_free(pool);
+
+    return ret;
+}
+
+static int coroutine_fn cache_co_flush(BlockDriverState *bs)
+{
+    int ret;
+
+    ret = cache_writeback_all(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int coroutine_fn cache_co_block_status(BlockDriverState *bs,
+                                              bool want_zero, int64_t offset,
+                                              int64_t bytes, int64_t *pnum,
+                                              int64_t *map,
+                                              BlockDriverState **file)
+{
+    BDRVCacheState *s = bs->opaque;
+    uint64_t index = offset >> s->line_bits;
+    uint64_t last_index = (offset + bytes - 1) >> s->line_bits;
+    int64_t dirty_offset = offset + bytes;
+    CacheLine *line;
+    uint64_t i;
+
+    /*
+     * The child doesn't know about dirty data yet, so report it as data
+     * and pass through the status of everything up to the next dirty line.
+     * Probe the lines of the request, or walk the cache if it holds fewer
+     * lines than that.
+     */
+    qemu_co_mutex_lock(&s->lock);
+    if (last_index - index >= s->nb_lines) {
+        QTAILQ_FOREACH(line, &s->lru, lru) {
+            if (line->dirty_end > line->dirty_start &&
+                line->index >= index && line->index <= last_index) {
+                dirty_offset = MIN(dirty_offset, line->index << s->line_bits);
+            }
+        }
+    } else {
+        for (i = index; i <= last_index; i++) {
+            line = cache_lookup(s, i);
+            if (line && line->dirty_end > line->dirty_start) {
+                dirty_offset = i << s->line_bits;
+                break;
+            }
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (dirty_offset <= offset) {
+        *pnum = MIN(bytes, ((index + 1) << s->line_bits) - offset);
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_ALLOCATED;
+    }
+
+    *pnum = dirty_offset - offset;
+    *map = offset;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static void coroutine_fn cache_co_invalidate_cache(BlockDriverState *bs,
+                                                   Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    /* Someone else may have written to the child, drop everything */
+    qemu_co_mutex_lock(&s->lock);
+    ret = cache_invalidate(bs, 0, INT64_MAX, true);
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write back cached data");
+    }
+}
+
+static int64_t cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                             BdrvChildRole role,
+                             BlockReopenQueue *reopen_queue,
+                             uint64_t perm, uint64_t shared,
+                             uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /* Writes that bypass the cache would make its contents stale */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static BlockStatsSpecific *cache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_CACHE;
+    stats->u.cache = (BlockStatsSpecificCache) {
+        .hits            = s->hits,
+        .misses          = s->misses,
+        .read_ahead_hits = s->read_ahead_hits,
+        .evictions       = s->evictions,
+        .writebacks      = s->writebacks,
+        .cached_bytes    = (uint64_t)s->nb_lines * s->opts.line_size,
+        .dirty_bytes     = s->dirty_bytes,
+    };
+
+    return stats;
+}
+
+BlockDriver bdrv_cache = {
+    .format_name = "cache",
+    .instance_size = sizeof(BDRVCacheState),
+
+    .bdrv_open = cache_open,
+    .bdrv_close = cache_close,
+    .bdrv_getlength = cache_getlength,
+
+    .bdrv_reopen_prepare = cache_reopen_prepare,
+    .bdrv_reopen_commit = cache_reopen_commit,
+    .bdrv_reopen_abort = cache_reopen_abort,
+
+    .bdrv_co_preadv_part = cache_co_preadv_part,
+    .bdrv_co_pwritev_part = cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes = cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard = cache_co_pdiscard,
+    .bdrv_co_flush = cache_co_flush,
+    .bdrv_co_truncate = cache_co_truncate,
+    .bdrv_co_block_status = cache_co_block_status,
+    .bdrv_co_invalidate_cache = cache_co_invalidate_cache,
+
+    .bdrv_child_perm = cache_child_perm,
+    .bdrv_get_specific_stats = cache_get_specific_stats,
+};
+
+static void bdrv_cache_init(void)
+{
+    bdrv_register(&bdrv_cache);
+}
+
+block_init(bdrv_cache_init);
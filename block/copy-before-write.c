@@ -411,6 +411,9 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
     int64_t cluster_size;
     g_autoptr(BlockdevOptions) full_opts = NULL;
     BlockdevOptionsCbw *opts;
+    BlockdevRefList *ref;
+    g_autofree BdrvChild **extra_targets = NULL;
+    int i, nb_extra_targets = 0;
 
     full_opts = cbw_parse_options(options, errp);
     if (!full_opts) {
@@ -432,6 +435,21 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
+    for (ref = opts->extra_targets; ref; ref = ref->next) {
+        nb_extra_targets++;
+    }
+    extra_targets = g_new(BdrvChild *, nb_extra_targets);
+    for (i = 0; i < nb_extra_targets; i++) {
+        g_autofree char *key = g_strdup_printf("extra-targets.%d", i);
+
+        extra_targets[i] = bdrv_open_child(NULL, options, key, bs,
+                                           &child_of_bds, BDRV_CHILD_DATA,
+                                           false, errp);
+        if (!extra_targets[i]) {
+            return -EINVAL;
+        }
+    }
+
     if (opts->has_bitmap) {
         bitmap = block_dirty_bitmap_lookup(opts->bitmap->node,
                                            opts->bitmap->name, NULL, errp);
@@ -457,6 +475,12 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
+    for (i = 0; i < nb_extra_targets; i++) {
+        if (block_copy_add_target(s->bcs, extra_targets[i], errp) < 0) {
+            return -EINVAL;
+        }
+    }
+
     cluster_size = block_copy_cluster_size(s->bcs);
 
     s->done_bitmap = bdrv_create_dirty_bitmap(bs, cluster_size, NULL, errp);
@@ -518,6 +542,8 @@ BlockDriver bdrv_cbw_filter = {
 
 BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
                                   BlockDriverState *target,
+                                  BlockDriverState **extra_targets,
+                                  int nb_extra_targets,
                                   const char *filter_node_name,
                                   BlockCopyState **bcs,
                                   Error **errp)
@@ -526,6 +552,7 @@ BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
     BDRVCopyBeforeWriteState *state;
     BlockDriverState *top;
     QDict *opts;
+    int i;
 
     assert(source->total_sectors == target->total_sectors);
     GLOBAL_STATE_CODE();
@@ -537,6 +564,11 @@ BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
     }
     qdict_put_str(opts, "file", bdrv_get_node_name(source));
     qdict_put_str(opts, "target", bdrv_get_node_name(target));
+    for (i = 0; i < nb_extra_targets; i++) {
+        g_autofree char *key = g_strdup_printf("extra-targets.%d", i);
+
+        qdict_put_str(opts, key, bdrv_get_node_name(extra_targets[i]));
+    }
 
     top = bdrv_insert_node(source, opts, BDRV_O_RDWR, errp);
     if (!top) {
@@ -38,6 +38,8 @@
 
 BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
                                   BlockDriverState *target,
+                                  BlockDriverState **extra_targets,
+                                  int nb_extra_targets,
                                   const char *filter_node_name,
                                   BlockCopyState **bcs,
                                   Error **errp);
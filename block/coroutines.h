@@ -30,6 +30,9 @@
 /* For blk_bs() in generated block/block-gen.c */
 #include "sysemu/block-backend.h"
 
+/* Per-connection state of the NBD client, private to block/nbd.c */
+struct NBDConnState;
+
 /*
  * I/O API functions. These functions are thread-safe.
  *
@@ -38,7 +41,9 @@
  */
 
 int coroutine_fn bdrv_co_check(BlockDriverState *bs,
-                               BdrvCheckResult *res, BdrvCheckMode fix);
+                               BdrvCheckResult *res, BdrvCheckMode fix,
+                               BlockDriverCheckStatusCB *status_cb,
+                               void *cb_opaque);
 int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp);
 
 int coroutine_fn
@@ -59,8 +64,8 @@ int coroutine_fn bdrv_co_writev_vmstate(BlockDriverState *bs,
                                         QEMUIOVector *qiov, int64_t pos);
 
 int coroutine_fn
-nbd_co_do_establish_connection(BlockDriverState *bs, bool blocking,
-                               Error **errp);
+nbd_co_do_establish_connection(BlockDriverState *bs, struct NBDConnState *cs,
+                               bool blocking, Error **errp);
 
 
 /*
@@ -83,6 +88,7 @@ bdrv_common_block_status_above(BlockDriverState *bs,
                                BlockDriverState **file,
                                int *depth);
 int generated_co_wrapper
-nbd_do_establish_connection(BlockDriverState *bs, bool blocking, Error **errp);
+nbd_do_establish_connection(BlockDriverState *bs, struct NBDConnState *cs,
+                            bool blocking, Error **errp);
 
 #endif /* BLOCK_COROUTINES_H */
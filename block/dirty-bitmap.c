@@ -734,6 +734,18 @@ void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap)
     hbitmap_deserialize_finish(bitmap->bitmap);
 }
 
+/* Return whether the range may have changed since the last clear_changes. */
+bool bdrv_dirty_bitmap_changed(const BdrvDirtyBitmap *bitmap,
+                               uint64_t offset, uint64_t bytes)
+{
+    return hbitmap_changed(bitmap->bitmap, offset, bytes);
+}
+
+void bdrv_dirty_bitmap_clear_changes(BdrvDirtyBitmap *bitmap)
+{
+    hbitmap_clear_changes(bitmap->bitmap);
+}
+
 void bdrv_set_dirty(BlockDriverState *bs, int64_t offset, int64_t bytes)
 {
     BdrvDirtyBitmap *bitmap;
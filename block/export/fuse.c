@@ -19,7 +19,9 @@
 #define FUSE_USE_VERSION 31
 
 #include "qemu/osdep.h"
+#include "qemu/coroutine.h"
 #include "qemu/memalign.h"
+#include "qemu/units.h"
 #include "block/aio.h"
 #include "block/block.h"
 #include "block/export.h"
@@ -43,14 +45,45 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/* How many unused request buffers and pipes to keep around for reuse */
+#define FUSE_MAX_FREE_BUFS 16
+
+/* Size we try to give to pipes for spliced reads (the default maximum) */
+#define FUSE_SPLICE_PIPE_SIZE (1 * MiB)
+
+/* Buffer for one request read from /dev/fuse, kept until it is processed */
+typedef struct FuseRequestBuf {
+    struct fuse_buf fbuf;
+    QSLIST_ENTRY(FuseRequestBuf) next;
+} FuseRequestBuf;
+
+/* Pipe through which the data of a read reply is spliced */
+typedef struct FusePipe {
+    int fds[2];
+    QSLIST_ENTRY(FusePipe) next;
+} FusePipe;
 
 typedef struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     bool mounted, fd_handler_set_up;
 
+    /*
+     * Requests are processed in coroutines, so several can be in flight at
+     * once; each one needs its own buffer.  Unused ones are kept here.
+     */
+    QSLIST_HEAD(, FuseRequestBuf) free_bufs;
+    unsigned nr_free_bufs;
+
+    /* Whether the kernel accepts spliced replies */
+    bool splice_write;
+    QSLIST_HEAD(, FusePipe) free_pipes;
+    unsigned nr_free_pipes;
+
+    /* Serializes growing the export on writes past EOF */
+    CoMutex grow_lock;
+
     char *mountpoint;
     bool writable;
     bool growable;
@@ -131,6 +164,7 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->mountpoint = g_strdup(args->mountpoint);
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
+    qemu_co_mutex_init(&exp->grow_lock);
 
     /* set default */
     if (!args->has_allow_other) {
@@ -234,6 +268,56 @@ fail:
     return ret;
 }
 
+static FuseRequestBuf *fuse_get_request_buf(FuseExport *exp)
+{
+    FuseRequestBuf *buf = QSLIST_FIRST(&exp->free_bufs);
+
+    if (buf) {
+        QSLIST_REMOVE_HEAD(&exp->free_bufs, next);
+        exp->nr_free_bufs--;
+        return buf;
+    }
+
+    /* fuse_session_receive_buf() allocates fbuf.mem */
+    return g_new0(FuseRequestBuf, 1);
+}
+
+static void fuse_put_request_buf(FuseExport *exp, FuseRequestBuf *buf)
+{
+    if (exp->nr_free_bufs >= FUSE_MAX_FREE_BUFS) {
+        free(buf->fbuf.mem);
+        g_free(buf);
+        return;
+    }
+
+    QSLIST_INSERT_HEAD(&exp->free_bufs, buf, next);
+    exp->nr_free_bufs++;
+}
+
+typedef struct FuseRequestCo {
+    FuseExport *exp;
+    FuseRequestBuf *buf;
+} FuseRequestCo;
+
+static void coroutine_fn co_process_fuse_request(void *opaque)
+{
+    FuseRequestCo *data = opaque;
+    FuseExport *exp = data->exp;
+    FuseRequestBuf *buf = data->buf;
+
+    g_free(data);
+
+    /*
+     * The request handlers use the blk_*() wrappers, which do not leave the
+     * coroutine, so other requests can be processed while this one waits
+     * for I/O.
+     */
+    fuse_session_process_buf(exp->fuse_session, &buf->fbuf);
+
+    fuse_put_request_buf(exp, buf);
+    blk_exp_unref(&exp->common);
+}
+
 /**
  * Callback to be invoked when the FUSE session FD can be read from.
  * (This is basically the FUSE event loop.)
@@ -241,21 +325,31 @@ fail:
 static void read_from_fuse_export(void *opaque)
 {
     FuseExport *exp = opaque;
+    FuseRequestBuf *buf;
+    FuseRequestCo *data;
+    Coroutine *co;
     int ret;
 
     blk_exp_ref(&exp->common);
 
+    buf = fuse_get_request_buf(exp);
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, &buf->fbuf);
     } while (ret == -EINTR);
-    if (ret < 0) {
-        goto out;
+    if (ret <= 0) {
+        fuse_put_request_buf(exp, buf);
+        blk_exp_unref(&exp->common);
+        return;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
-
-out:
-    blk_exp_unref(&exp->common);
+    /* The reference and the buffer are released by the coroutine */
+    data = g_new(FuseRequestCo, 1);
+    *data = (FuseRequestCo) {
+        .exp = exp,
+        .buf = buf,
+    };
+    co = qemu_coroutine_create(co_process_fuse_request, data);
+    qemu_coroutine_enter(co);
 }
 
 static void fuse_export_shutdown(BlockExport *blk_exp)
@@ -294,7 +388,23 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    while (!QSLIST_EMPTY(&exp->free_bufs)) {
+        FuseRequestBuf *buf = QSLIST_FIRST(&exp->free_bufs);
+
+        QSLIST_REMOVE_HEAD(&exp->free_bufs, next);
+        free(buf->fbuf.mem);
+        g_free(buf);
+    }
+
+    while (!QSLIST_EMPTY(&exp->free_pipes)) {
+        FusePipe *fpipe = QSLIST_FIRST(&exp->free_pipes);
+
+        QSLIST_REMOVE_HEAD(&exp->free_pipes, next);
+        close(fpipe->fds[0]);
+        close(fpipe->fds[1]);
+        g_free(fpipe);
+    }
+
     g_free(exp->mountpoint);
 }
 
@@ -326,6 +436,8 @@ static bool is_regular_file(const char *path, Error **errp)
  */
 static void fuse_init(void *userdata, struct fuse_conn_info *conn)
 {
+    FuseExport *exp = userdata;
+
     /*
      * MIN_NON_ZERO() would not be wrong here, but what we set here
      * must equal what has been passed to fuse_session_new().
@@ -336,6 +448,20 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_read = FUSE_MAX_BOUNCE_BYTES;
 
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+
+    /*
+     * Let fuse_reply_data() splice read data from our pipes into /dev/fuse
+     * (see fuse_read_splice()).  Splicing requests (FUSE_CAP_SPLICE_READ)
+     * is not enabled: fuse_write() needs the data in memory anyway, so that
+     * would only add a copy out of the pipe.
+     */
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+        if (conn->capable & FUSE_CAP_SPLICE_MOVE) {
+            conn->want |= FUSE_CAP_SPLICE_MOVE;
+        }
+        exp->splice_write = true;
+    }
 }
 
 /**
@@ -517,6 +643,130 @@ static void fuse_open(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_open(req, fi);
 }
 
+static FusePipe *fuse_get_pipe(FuseExport *exp)
+{
+    FusePipe *fpipe = QSLIST_FIRST(&exp->free_pipes);
+
+    if (fpipe) {
+        QSLIST_REMOVE_HEAD(&exp->free_pipes, next);
+        exp->nr_free_pipes--;
+        return fpipe;
+    }
+
+    fpipe = g_new(FusePipe, 1);
+    if (!g_unix_open_pipe(fpipe->fds, FD_CLOEXEC, NULL)) {
+        g_free(fpipe);
+        return NULL;
+    }
+
+    /* The data is written by sendfile(), which must not block */
+    if (!g_unix_set_fd_nonblocking(fpipe->fds[1], true, NULL)) {
+        close(fpipe->fds[0]);
+        close(fpipe->fds[1]);
+        g_free(fpipe);
+        return NULL;
+    }
+
+#ifdef F_SETPIPE_SZ
+    /* Best effort; with the default size, larger reads are just split */
+    fcntl(fpipe->fds[1], F_SETPIPE_SZ, FUSE_SPLICE_PIPE_SIZE);
+#endif
+
+    return fpipe;
+}
+
+/**
+ * Return @fpipe to the pool.  @fpipe must be empty; pass @discard if it may
+ * still contain data, so it is closed instead.
+ */
+static void fuse_put_pipe(FuseExport *exp, FusePipe *fpipe, bool discard)
+{
+    if (discard || exp->nr_free_pipes >= FUSE_MAX_FREE_BUFS) {
+        close(fpipe->fds[0]);
+        close(fpipe->fds[1]);
+        g_free(fpipe);
+        return;
+    }
+
+    QSLIST_INSERT_HEAD(&exp->free_pipes, fpipe, next);
+    exp->nr_free_pipes++;
+}
+
+/**
+ * Try to reply to a read request by having the block layer sendfile() the
+ * data into a pipe, which fuse_reply_data() then splices into /dev/fuse,
+ * so it never has to be copied through a userspace buffer.
+ *
+ * Returns true if the request has been replied to.  Otherwise nothing has
+ * happened yet and the caller must fall back to a bounce buffer.
+ */
+static bool fuse_read_splice(FuseExport *exp, fuse_req_t req,
+                             size_t size, off_t offset)
+{
+    struct fuse_bufvec *bufv;
+    FusePipe *fpipe;
+    void *tail = NULL;
+    int64_t sent;
+    int ret;
+
+    if (!exp->splice_write || !blk_can_sendfile(exp->common.blk)) {
+        return false;
+    }
+
+    fpipe = fuse_get_pipe(exp);
+    if (!fpipe) {
+        return false;
+    }
+
+    /* Nobody reads from the pipe until we reply, so this may be short */
+    sent = blk_co_sendfile(exp->common.blk, offset, size, fpipe->fds[1]);
+    if (sent <= 0) {
+        fuse_put_pipe(exp, fpipe, sent < 0);
+        return false;
+    }
+
+    /* Room for a second buffer holding what did not fit into the pipe */
+    bufv = g_malloc0(sizeof(*bufv) + sizeof(struct fuse_buf));
+    bufv->count = 1;
+    bufv->buf[0] = (struct fuse_buf) {
+        .size  = sent,
+        .flags = FUSE_BUF_IS_FD,
+        .fd    = fpipe->fds[0],
+    };
+
+    if (sent < size) {
+        tail = qemu_try_blockalign(blk_bs(exp->common.blk), size - sent);
+        if (!tail) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+
+        ret = blk_pread(exp->common.blk, offset + sent, size - sent, tail, 0);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        bufv->buf[1] = (struct fuse_buf) {
+            .size = size - sent,
+            .mem  = tail,
+        };
+        bufv->count = 2;
+    }
+
+    ret = fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    /* On error, the pipe may not have been drained */
+    fuse_put_pipe(exp, fpipe, ret < 0);
+    goto out;
+
+fail:
+    fuse_reply_err(req, -ret);
+    fuse_put_pipe(exp, fpipe, true);
+out:
+    qemu_vfree(tail);
+    g_free(bufv);
+    return true;
+}
+
 /**
  * Handle client reads from the exported image.
  */
@@ -548,6 +798,10 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         size = length - offset;
     }
 
+    if (size > 0 && fuse_read_splice(exp, req, size, offset)) {
+        return;
+    }
+
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
         fuse_reply_err(req, ENOMEM);
@@ -597,7 +851,22 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            /*
+             * Concurrent writes past EOF must not shrink the export again
+             * after one of them has grown it further, so check the length
+             * again under the lock.
+             */
+            qemu_co_mutex_lock(&exp->grow_lock);
+            length = blk_getlength(exp->common.blk);
+            if (length < 0) {
+                ret = length;
+            } else if (offset + size > length) {
+                ret = fuse_do_truncate(exp, offset + size, true,
+                                       PREALLOC_MODE_OFF);
+            } else {
+                ret = 0;
+            }
+            qemu_co_mutex_unlock(&exp->grow_lock);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
@@ -35,6 +35,7 @@
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
 #include "block/raw-aio.h"
+#include "block/request-trace.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 
@@ -73,6 +74,9 @@
 #include <linux/hdreg.h>
 #include <linux/magic.h>
 #include <scsi/sg.h>
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
 #ifdef __s390__
 #include <asm/dasd.h>
 #endif
@@ -154,9 +158,15 @@ typedef struct BDRVRawState {
 
     bool has_discard:1;
     bool has_write_zeroes:1;
+    bool has_clone_range:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+#ifdef CONFIG_LINUX_IO_URING
+    /* Flags for luring_init(); if non-zero, @luring is a ring of our own */
+    int luring_flags;
+    LuringState *luring;
+#endif
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -191,6 +201,44 @@ static int fd_open(BlockDriverState *bs)
 
 static int64_t raw_getlength(BlockDriverState *bs);
 
+#ifdef CONFIG_LINUX_IO_URING
+static LuringState *raw_get_luring(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return s->luring ?: aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+}
+#endif
+
+/*
+ * With aio=io_uring, s->fd is registered with the ring, so that requests
+ * do not have to look up the file; the ring also uses registered bounce
+ * buffers for O_DIRECT files.  The registration must be dropped before
+ * s->fd is closed or replaced, or the ring changes.
+ */
+static void raw_luring_register_fd(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        luring_register_fd(raw_get_luring(bs), s->fd,
+                           s->open_flags & O_DIRECT);
+    }
+#endif
+}
+
+static void raw_luring_unregister_fd(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        luring_unregister_fd(raw_get_luring(bs), s->fd);
+    }
+#endif
+}
+
 typedef struct RawPosixAIOData {
     BlockDriverState *bs;
     int aio_type;
@@ -216,6 +264,9 @@ typedef struct RawPosixAIOData {
             PreallocMode prealloc;
             Error **errp;
         } truncate;
+        struct {
+            int out_fd;
+        } sendfile;
     };
 } RawPosixAIOData;
 
@@ -550,6 +601,18 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "submit from a kernel thread with aio=io_uring "
+                    "(default: off)",
+        },
+        {
+            .name = "io-uring-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll for completions with aio=io_uring "
+                    "(default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -631,6 +694,29 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
 
+    if (qemu_opt_get_bool(opts, "io-uring-sqpoll", false) ||
+        qemu_opt_get_bool(opts, "io-uring-iopoll", false)) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (!s->use_linux_io_uring) {
+            error_setg(errp, "io-uring-sqpoll and io-uring-iopoll require "
+                       "aio=io_uring");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (qemu_opt_get_bool(opts, "io-uring-sqpoll", false)) {
+            s->luring_flags |= LURING_SQPOLL;
+        }
+        if (qemu_opt_get_bool(opts, "io-uring-iopoll", false)) {
+            s->luring_flags |= LURING_IOPOLL;
+        }
+#else
+        error_setg(errp, "io-uring-sqpoll and io-uring-iopoll are not "
+                   "supported in this build");
+        ret = -EINVAL;
+        goto fail;
+#endif
+    }
+
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
                               ON_OFF_AUTO_AUTO, &local_err);
@@ -724,7 +810,20 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
+    if ((s->luring_flags & LURING_IOPOLL) && !(s->open_flags & O_DIRECT)) {
+        error_setg(errp, "io-uring-iopoll=on requires cache.direct=on");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->luring_flags) {
+        s->luring = luring_init(s->luring_flags, errp);
+        if (!s->luring) {
+            error_prepend(errp, "Unable to use io_uring: ");
+            ret = -EINVAL;
+            goto fail;
+        }
+        luring_attach_aio_context(s->luring, bdrv_get_aio_context(bs));
+    } else if (s->use_linux_io_uring) {
         if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
@@ -741,6 +840,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->has_discard = true;
     s->has_write_zeroes = true;
+    s->has_clone_range = true;
 
     if (fstat(s->fd, &st) < 0) {
         ret = -errno;
@@ -804,8 +904,16 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+    raw_luring_register_fd(bs);
     ret = 0;
 fail:
+#ifdef CONFIG_LINUX_IO_URING
+    if (ret < 0 && s->luring) {
+        luring_detach_aio_context(s->luring, bdrv_get_aio_context(bs));
+        luring_cleanup(s->luring);
+        s->luring = NULL;
+    }
+#endif
     if (ret < 0 && s->fd != -1) {
         qemu_close(s->fd);
     }
@@ -1164,7 +1272,11 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     s->drop_cache = rs->drop_cache;
     s->check_cache_dropped = rs->check_cache_dropped;
+
+    /* O_DIRECT may have changed, which decides the use of bounce buffers */
+    raw_luring_unregister_fd(state->bs);
     s->open_flags = rs->open_flags;
+    raw_luring_register_fd(state->bs);
     g_free(state->opaque);
     state->opaque = NULL;
 
@@ -1801,6 +1913,50 @@ static off_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
 }
 #endif
 
+/*
+ * Try to share the data between the files instead of copying it.  Returns
+ * -ENOTSUP if that is not possible for this request.
+ */
+static int handle_aiocb_clone_range(RawPosixAIOData *aiocb)
+{
+#ifdef FICLONERANGE
+    BDRVRawState *s = aiocb->bs->opaque;
+    struct file_clone_range range = {
+        .src_fd      = aiocb->aio_fildes,
+        .src_offset  = aiocb->aio_offset,
+        .src_length  = aiocb->aio_nbytes,
+        .dest_offset = aiocb->copy_range.aio_offset2,
+    };
+    int ret;
+
+    if (!s->has_clone_range) {
+        return -ENOTSUP;
+    }
+
+    do {
+        ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+    } while (ret < 0 && errno == EINTR);
+    trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                           aiocb->copy_range.aio_fd2,
+                           aiocb->copy_range.aio_offset2, aiocb->aio_nbytes,
+                           ret < 0 ? -errno : 0);
+    if (ret == 0) {
+        return 0;
+    }
+
+    switch (errno) {
+    case EINVAL:
+        /* Most likely not aligned to the file system block size */
+        break;
+    default:
+        /* No reflink support in this file system or across these files */
+        s->has_clone_range = false;
+        break;
+    }
+#endif
+    return -ENOTSUP;
+}
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -1808,6 +1964,10 @@ static int handle_aiocb_copy_range(void *opaque)
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
 
+    if (handle_aiocb_clone_range(aiocb) == 0) {
+        return 0;
+    }
+
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
                                       aiocb->copy_range.aio_fd2, &out_off,
@@ -1835,6 +1995,52 @@ static int handle_aiocb_copy_range(void *opaque)
     return 0;
 }
 
+#if defined(__linux__) && defined(CONFIG_SENDFILE)
+/*
+ * Returns the number of bytes sent, which is less than aio_nbytes if
+ * out_fd is non-blocking and full, or -errno if nothing could be sent.
+ */
+static int handle_aiocb_sendfile(void *opaque)
+{
+    static const uint8_t zeroes[4096];
+    RawPosixAIOData *aiocb = opaque;
+    int out_fd = aiocb->sendfile.out_fd;
+    off_t offset = aiocb->aio_offset;
+    uint64_t done = 0;
+    bool eof = false;
+
+    while (done < aiocb->aio_nbytes) {
+        uint64_t len = aiocb->aio_nbytes - done;
+        ssize_t ret;
+
+        if (!eof) {
+            ret = sendfile(out_fd, aiocb->aio_fildes, &offset, len);
+            trace_file_sendfile(aiocb->bs, aiocb->aio_fildes, out_fd,
+                                aiocb->aio_offset + done, len, ret);
+            if (ret == 0) {
+                eof = true;
+                continue;
+            }
+        } else {
+            /* Like handle_aiocb_rw(), read zeroes beyond the end of file */
+            ret = write(out_fd, zeroes, MIN(len, sizeof(zeroes)));
+        }
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return done ? done : -errno;
+        }
+        done += ret;
+    }
+    return done;
+}
+#endif
+
 static int handle_aiocb_discard(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -2061,8 +2267,9 @@ static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
     return thread_pool_submit_co(pool, func, arg);
 }
 
-static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
-                                   uint64_t bytes, QEMUIOVector *qiov, int type)
+static int coroutine_fn raw_co_do_prw(BlockDriverState *bs, uint64_t offset,
+                                      uint64_t bytes, QEMUIOVector *qiov,
+                                      int type)
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
@@ -2080,7 +2287,7 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         assert(qiov->size == bytes);
         return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
@@ -2109,6 +2316,18 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
     return raw_thread_pool_submit(bs, handle_aiocb_rw, &acb);
 }
 
+static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
+                                   uint64_t bytes, QEMUIOVector *qiov, int type)
+{
+    int ret;
+
+    block_trace_record(XDBG_BLOCK_TRACE_EVENT_HOST_IO_START, bs, offset, bytes);
+    ret = raw_co_do_prw(bs, offset, bytes, qiov, type);
+    block_trace_record(XDBG_BLOCK_TRACE_EVENT_HOST_IO_END, bs, offset, bytes);
+
+    return ret;
+}
+
 static int coroutine_fn raw_co_preadv(BlockDriverState *bs, int64_t offset,
                                       int64_t bytes, QEMUIOVector *qiov,
                                       BdrvRequestFlags flags)
@@ -2135,7 +2354,7 @@ static void raw_aio_plug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_plug(bs, aio);
     }
 #endif
@@ -2152,7 +2371,7 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_unplug(bs, aio);
     }
 #endif
@@ -2176,14 +2395,27 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
     };
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    /* A polled ring only accepts reads and writes */
+    if (s->use_linux_io_uring && !(s->luring_flags & LURING_IOPOLL)) {
+        LuringState *aio = raw_get_luring(bs);
         return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
     }
 #endif
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
+
+    raw_luring_unregister_fd(bs);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->luring) {
+        luring_detach_aio_context(s->luring, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
@@ -2199,7 +2431,9 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
+    if (s->luring) {
+        luring_attach_aio_context(s->luring, new_context);
+    } else if (s->use_linux_io_uring) {
         Error *local_err = NULL;
         if (!aio_setup_linux_io_uring(new_context, &local_err)) {
             error_reportf_err(local_err, "Unable to use linux io_uring, "
@@ -2208,12 +2442,21 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
         }
     }
 #endif
+    raw_luring_register_fd(bs);
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    raw_luring_unregister_fd(bs);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->luring) {
+        luring_detach_aio_context(s->luring, bdrv_get_aio_context(bs));
+        luring_cleanup(s->luring);
+        s->luring = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -3210,9 +3453,11 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_luring_unregister_fd(bs);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+        raw_luring_register_fd(bs);
     }
     s->perm_change_fd = 0;
 
@@ -3282,6 +3527,32 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
 }
 
+#if defined(__linux__) && defined(CONFIG_SENDFILE)
+static int coroutine_fn raw_co_sendfile(BlockDriverState *bs, int64_t offset,
+                                        int64_t bytes, int out_fd)
+{
+    BDRVRawState *s = bs->opaque;
+    RawPosixAIOData acb;
+
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_type       = QEMU_AIO_SENDFILE,
+        .aio_fildes     = s->fd,
+        .aio_offset     = offset,
+        .aio_nbytes     = bytes,
+        .sendfile       = {
+            .out_fd         = out_fd,
+        },
+    };
+
+    return raw_thread_pool_submit(bs, handle_aiocb_sendfile, &acb);
+}
+#endif
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
@@ -3308,9 +3579,13 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#if defined(__linux__) && defined(CONFIG_SENDFILE)
+    .bdrv_co_sendfile       = raw_co_sendfile,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
@@ -3683,6 +3958,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
@@ -3807,6 +4083,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -3937,6 +4214,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -30,6 +30,7 @@
 #include "block/blockjob_int.h"
 #include "block/block_int.h"
 #include "block/coroutines.h"
+#include "block/request-trace.h"
 #include "block/write-threshold.h"
 #include "qemu/cutils.h"
 #include "qemu/memalign.h"
@@ -731,6 +732,30 @@ void bdrv_drain_all(void)
     bdrv_drain_all_end();
 }
 
+static void tracked_request_trace(BdrvTrackedRequest *req, bool end)
+{
+    XDbgBlockTraceEvent event;
+
+    switch (req->type) {
+    case BDRV_TRACKED_READ:
+        event = end ? XDBG_BLOCK_TRACE_EVENT_READ_END
+                    : XDBG_BLOCK_TRACE_EVENT_READ_START;
+        break;
+    case BDRV_TRACKED_WRITE:
+        event = end ? XDBG_BLOCK_TRACE_EVENT_WRITE_END
+                    : XDBG_BLOCK_TRACE_EVENT_WRITE_START;
+        break;
+    case BDRV_TRACKED_DISCARD:
+        event = end ? XDBG_BLOCK_TRACE_EVENT_DISCARD_END
+                    : XDBG_BLOCK_TRACE_EVENT_DISCARD_START;
+        break;
+    default:
+        return;
+    }
+
+    block_trace_record(event, req->bs, req->offset, req->bytes);
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -746,6 +771,8 @@ static void coroutine_fn tracked_request_end(BdrvTrackedRequest *req)
     QLIST_REMOVE(req, list);
     qemu_co_queue_restart_all(&req->wait_queue);
     qemu_co_mutex_unlock(&req->bs->reqs_lock);
+
+    tracked_request_trace(req, true);
 }
 
 /**
@@ -772,6 +799,8 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_queue_init(&req->wait_queue);
 
+    tracked_request_trace(req, false);
+
     qemu_co_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
     qemu_co_mutex_unlock(&bs->reqs_lock);
@@ -836,7 +865,11 @@ bdrv_wait_serialising_requests_locked(BdrvTrackedRequest *self)
 
     while ((req = bdrv_find_conflicting_request(self))) {
         self->waiting_for = req;
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_SERIALISE_WAIT_START,
+                           self->bs, self->offset, self->bytes);
         qemu_co_queue_wait(&req->wait_queue, &self->bs->reqs_lock);
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_SERIALISE_WAIT_END,
+                           self->bs, self->offset, self->bytes);
         self->waiting_for = NULL;
         waited = true;
     }
@@ -1146,9 +1179,12 @@ static int coroutine_fn bdrv_driver_preadv(BlockDriverState *bs,
         return -ENOMEDIUM;
     }
 
+    block_trace_record(XDBG_BLOCK_TRACE_EVENT_DRIVER_START, bs, offset, bytes);
+
     if (drv->bdrv_co_preadv_part) {
-        return drv->bdrv_co_preadv_part(bs, offset, bytes, qiov, qiov_offset,
-                                        flags);
+        ret = drv->bdrv_co_preadv_part(bs, offset, bytes, qiov, qiov_offset,
+                                       flags);
+        goto out;
     }
 
     if (qiov_offset > 0 || bytes != qiov->size) {
@@ -1194,6 +1230,7 @@ out:
         qemu_iovec_destroy(&local_qiov);
     }
 
+    block_trace_record(XDBG_BLOCK_TRACE_EVENT_DRIVER_END, bs, offset, bytes);
     return ret;
 }
 
@@ -1217,6 +1254,8 @@ static int coroutine_fn bdrv_driver_pwritev(BlockDriverState *bs,
         return -ENOMEDIUM;
     }
 
+    block_trace_record(XDBG_BLOCK_TRACE_EVENT_DRIVER_START, bs, offset, bytes);
+
     if (drv->bdrv_co_pwritev_part) {
         ret = drv->bdrv_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset,
                                         flags & bs->supported_write_flags);
@@ -1276,6 +1315,7 @@ emulate_flags:
         qemu_iovec_destroy(&local_qiov);
     }
 
+    block_trace_record(XDBG_BLOCK_TRACE_EVENT_DRIVER_END, bs, offset, bytes);
     return ret;
 }
 
@@ -2442,45 +2482,47 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
          * drivers often need to get information from outside of qemu, so
          * we do not have control over the actual implementation.  There
          * have been cases where inquiring the status took an unreasonably
-         * long time, and we can do nothing in qemu to fix it.
-         * This is especially problematic for images with large data areas,
-         * because finding the few holes in them and giving them special
-         * treatment does not gain much performance.  Therefore, we try to
-         * cache the last-identified data region.
+         * long time, and we can do nothing in qemu to fix it.  Callers
+         * like mirror, block-copy, qemu-img map and NBD block-status
+         * queries walk the same ranges over and over, so we cache every
+         * data extent the driver has reported.
          *
          * Second, limiting ourselves to protocol nodes allows us to assume
-         * the block status for data regions to be DATA | OFFSET_VALID, and
-         * that the host offset is the same as the guest offset.
+         * that the host offset is the same as the guest offset whenever
+         * the status has BDRV_BLOCK_OFFSET_VALID.
          *
          * Note that it is possible that external writers zero parts of
          * the cached regions without the cache being invalidated, and so
          * we may report zeroes as data.  This is not catastrophic,
-         * however, because reporting zeroes as data is fine.
+         * however, because reporting zeroes as data is fine.  For the
+         * same reason, only data extents are cached: a zero or unallocated
+         * extent could be filled by such a writer (or by a concurrent
+         * request), and reporting data as zeroes is not fine.
          */
         if (QLIST_EMPTY(&bs->children) &&
-            bdrv_bsc_is_data(bs, aligned_offset, pnum))
+            bdrv_bsc_lookup(bs, aligned_offset, &ret, pnum))
         {
-            ret = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
-            local_file = bs;
+            local_file = ret & BDRV_BLOCK_OFFSET_VALID ? bs : NULL;
             local_map = aligned_offset;
         } else {
-            ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
-                                                aligned_bytes, pnum, &local_map,
-                                                &local_file);
-
             /*
              * Note that checking QLIST_EMPTY(&bs->children) is also done when
              * the cache is queried above.  Technically, we do not need to check
              * it here; the worst that can happen is that we fill the cache for
              * non-protocol nodes, and then it is never used.  However, filling
-             * the cache requires an RCU update, so double check here to avoid
-             * such an update if possible.
+             * the cache takes its lock, so double check here to avoid that if
+             * possible.
              *
              * Check want_zero, because we only want to update the cache when we
              * have accurate information about what is zero and what is data.
              */
+            ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
+                                                aligned_bytes, pnum, &local_map,
+                                                &local_file);
+
             if (want_zero &&
-                ret == (BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID) &&
+                (ret == BDRV_BLOCK_DATA ||
+                 ret == (BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID)) &&
                 QLIST_EMPTY(&bs->children))
             {
                 /*
@@ -2494,9 +2536,11 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
                  * result the cache delivers must be the same as the driver
                  * would deliver.
                  */
-                assert(local_file == bs);
-                assert(local_map == aligned_offset);
-                bdrv_bsc_fill(bs, aligned_offset, *pnum);
+                if (ret & BDRV_BLOCK_OFFSET_VALID) {
+                    assert(local_file == bs);
+                    assert(local_map == aligned_offset);
+                }
+                bdrv_bsc_fill(bs, aligned_offset, *pnum, ret);
             }
         }
     } else {
@@ -3430,6 +3474,72 @@ int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, int64_t src_offset,
                                        bytes, read_flags, write_flags, false);
 }
 
+/*
+ * Return whether bdrv_co_sendfile() can currently be used on @bs.  This
+ * is the case if @bs and every node down to the protocol node implement
+ * bdrv_co_sendfile, nothing in the chain needs to see or transform the
+ * data, and there are no alignment constraints (which in practice means
+ * that the file is not opened with O_DIRECT).
+ */
+bool bdrv_can_sendfile(BlockDriverState *bs)
+{
+    IO_CODE();
+
+    while (bs) {
+        BlockDriver *drv = bs->drv;
+
+        if (!drv || !drv->bdrv_co_sendfile || bs->encrypted ||
+            qatomic_read(&bs->copy_on_read) ||
+            bs->bl.request_alignment > 1) {
+            return false;
+        }
+        if (drv->bdrv_file_open) {
+            return true;
+        }
+        bs = bs->file ? bs->file->bs : NULL;
+    }
+
+    return false;
+}
+
+/*
+ * Send @bytes at @offset of @child directly to @out_fd.  Return the number
+ * of bytes sent, which may be short if @out_fd is non-blocking and became
+ * full, or -errno.  The caller must check bdrv_can_sendfile() first.
+ */
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, int out_fd)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvTrackedRequest req;
+    int ret;
+    IO_CODE();
+
+    trace_bdrv_co_sendfile(bs, offset, bytes, out_fd);
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!bs->drv->bdrv_co_sendfile) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_wait_serialising_requests(&req);
+
+    ret = bs->drv->bdrv_co_sendfile(bs, offset, bytes, out_fd);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                     BdrvChild *dst, int64_t dst_offset,
                                     int64_t bytes, BdrvRequestFlags read_flags,
@@ -3562,6 +3672,10 @@ int coroutine_fn bdrv_co_truncate(BdrvChild *child, int64_t offset, bool exact,
         ret = -ENOTSUP;
         goto out;
     }
+
+    /* The status of everything after the smaller of both sizes has changed */
+    bdrv_bsc_invalidate_range(bs, MIN(old_size, offset),
+                              INT64_MAX - MIN(old_size, offset));
     if (ret < 0) {
         goto out;
     }
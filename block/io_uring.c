@@ -12,7 +12,9 @@
 #include <liburing.h>
 #include "block/aio.h"
 #include "qemu/error-report.h"
+#include "qemu/memalign.h"
 #include "qemu/queue.h"
+#include "qemu/units.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
@@ -23,6 +25,20 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the registered file table, see luring_register_fd() */
+#define MAX_FIXED_FILES 64
+
+/*
+ * Registered bounce buffers for requests on O_DIRECT files.  The kernel
+ * does not have to look up and pin the pages of a registered buffer for
+ * every request, which is a noticeable part of the cost of small I/O.
+ */
+#define NR_BOUNCE_BUFS 32
+#define BOUNCE_BUF_SIZE (128 * KiB)
+
+/* Idle time after which the SQPOLL kernel thread goes to sleep */
+#define SQPOLL_IDLE_MS 100
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -31,6 +47,9 @@ typedef struct LuringAIOCB {
     bool is_read;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
+    /* Index of the registered bounce buffer in use, or -1 */
+    int bounce_idx;
+
     /*
      * Buffered reads may require resubmission, see
      * luring_resubmit_short_read().
@@ -51,10 +70,25 @@ typedef struct LuringState {
     AioContext *aio_context;
 
     struct io_uring ring;
+    int flags;
 
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
 
+    /*
+     * Registered files.  Free slots hold -1; if the kernel refused the
+     * file table, files_registered is false and plain fds are used.
+     */
+    bool files_registered;
+    int fixed_fds[MAX_FIXED_FILES];
+    bool fixed_direct[MAX_FIXED_FILES];
+
+    /* Registered bounce buffers, allocated with the first O_DIRECT file */
+    uint8_t *bounce_mem;
+    bool bounce_failed;
+    int bounce_free[NR_BOUNCE_BUFS];
+    int nr_bounce_free;
+
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
 } LuringState;
@@ -89,6 +123,14 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    if (luringcb->bounce_idx >= 0) {
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -107,6 +149,34 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luring_resubmit(s, luringcb);
 }
 
+static uint8_t *luring_bounce_buf(LuringState *s, int idx)
+{
+    return s->bounce_mem + (size_t)idx * BOUNCE_BUF_SIZE;
+}
+
+static int luring_fixed_slot(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->files_registered) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void luring_put_bounce(LuringState *s, LuringAIOCB *luringcb)
+{
+    if (luringcb->bounce_idx >= 0) {
+        s->bounce_free[s->nr_bounce_free++] = luringcb->bounce_idx;
+        luringcb->bounce_idx = -1;
+    }
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -141,6 +211,14 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
+    /*
+     * Completions of a polled ring are only found by entering the kernel,
+     * which io_uring_submit() always does for such rings.
+     */
+    if ((s->flags & LURING_IOPOLL) && s->io_q.in_flight) {
+        io_uring_submit(&s->ring);
+    }
+
     while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
@@ -191,6 +269,12 @@ static void luring_process_completions(LuringState *s)
                 if (ret > 0) {
                     luring_resubmit_short_read(s, luringcb, ret);
                     continue;
+                } else if (luringcb->bounce_idx >= 0) {
+                    /* Pad with zeroes, copied out below */
+                    memset(luring_bounce_buf(s, luringcb->bounce_idx) +
+                           total_bytes, 0,
+                           luringcb->qiov->size - total_bytes);
+                    ret = 0;
                 } else {
                     /* Pad with zeroes */
                     qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
@@ -201,7 +285,13 @@ static void luring_process_completions(LuringState *s)
                 ret = -ENOSPC;
             }
         }
+        if (luringcb->bounce_idx >= 0 && luringcb->is_read && ret == 0) {
+            qemu_iovec_from_buf(luringcb->qiov, 0,
+                                luring_bounce_buf(s, luringcb->bounce_idx),
+                                luringcb->qiov->size);
+        }
 end:
+        luring_put_bounce(s, luringcb);
         luringcb->ret = ret;
         qemu_iovec_destroy(&luringcb->resubmit_qiov);
 
@@ -215,7 +305,11 @@ end:
             aio_co_wake(luringcb->co);
         }
     }
-    qemu_bh_cancel(s->completion_bh);
+
+    /* A polled ring must be polled for as long as requests are in flight */
+    if (!(s->flags & LURING_IOPOLL) || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
 }
 
 static int ioq_submit(LuringState *s)
@@ -289,6 +383,9 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    if ((s->flags & LURING_IOPOLL) && s->io_q.in_flight) {
+        io_uring_submit(&s->ring);
+    }
     return io_uring_cq_ready(&s->ring);
 }
 
@@ -341,15 +438,37 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int slot = luring_fixed_slot(s, fd);
+    void *buf = NULL;
+
+    if (slot >= 0) {
+        fd = slot;
+        if (s->fixed_direct[slot] && (type & (QEMU_AIO_READ | QEMU_AIO_WRITE))
+            && luringcb->qiov->size <= BOUNCE_BUF_SIZE && s->nr_bounce_free) {
+            luringcb->bounce_idx = s->bounce_free[--s->nr_bounce_free];
+            buf = luring_bounce_buf(s, luringcb->bounce_idx);
+        }
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf) {
+            qemu_iovec_to_buf(luringcb->qiov, 0, buf, luringcb->qiov->size);
+            io_uring_prep_write_fixed(sqes, fd, buf, luringcb->qiov->size,
+                                      offset, luringcb->bounce_idx);
+        } else {
+            io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                                 luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf) {
+            io_uring_prep_read_fixed(sqes, fd, buf, luringcb->qiov->size,
+                                     offset, luringcb->bounce_idx);
+        } else {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -359,6 +478,9 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (slot >= 0) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -384,6 +506,7 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
         .ret        = -EINPROGRESS,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
+        .bounce_idx = -1,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
@@ -399,6 +522,80 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     return luringcb.ret;
 }
 
+static void luring_init_bounce(LuringState *s)
+{
+    struct iovec iov[NR_BOUNCE_BUFS];
+    uint8_t *mem;
+    int i, rc;
+
+    if (s->bounce_mem || s->bounce_failed) {
+        return;
+    }
+
+    mem = qemu_try_memalign(qemu_real_host_page_size(),
+                            NR_BOUNCE_BUFS * BOUNCE_BUF_SIZE);
+    if (!mem) {
+        s->bounce_failed = true;
+        return;
+    }
+    for (i = 0; i < NR_BOUNCE_BUFS; i++) {
+        iov[i].iov_base = mem + i * BOUNCE_BUF_SIZE;
+        iov[i].iov_len = BOUNCE_BUF_SIZE;
+    }
+
+    /* This fails if RLIMIT_MEMLOCK is too low; then requests are pinned */
+    rc = io_uring_register_buffers(&s->ring, iov, NR_BOUNCE_BUFS);
+    trace_luring_register_buffers(s, rc);
+    if (rc < 0) {
+        qemu_vfree(mem);
+        s->bounce_failed = true;
+        return;
+    }
+
+    for (i = 0; i < NR_BOUNCE_BUFS; i++) {
+        s->bounce_free[i] = i;
+    }
+    s->nr_bounce_free = NR_BOUNCE_BUFS;
+    s->bounce_mem = mem;
+}
+
+void luring_register_fd(LuringState *s, int fd, bool direct)
+{
+    int slot, rc;
+
+    slot = luring_fixed_slot(s, -1);
+    if (slot < 0) {
+        return;
+    }
+
+    rc = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    trace_luring_register_fd(s, fd, slot, rc);
+    if (rc != 1) {
+        return;
+    }
+    s->fixed_fds[slot] = fd;
+    s->fixed_direct[slot] = direct;
+
+    if (direct) {
+        luring_init_bounce(s);
+    }
+}
+
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int slot = luring_fixed_slot(s, fd);
+    int none = -1;
+
+    if (slot < 0) {
+        return;
+    }
+
+    /* Requests that were already submitted keep a reference to the file */
+    io_uring_register_files_update(&s->ring, slot, &none, 1);
+    trace_luring_unregister_fd(s, fd, slot);
+    s->fixed_fds[slot] = -1;
+}
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd, false,
@@ -416,22 +613,40 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(int flags, Error **errp)
 {
-    int rc;
+    int rc, i;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {};
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (flags & LURING_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+    if (flags & LURING_IOPOLL) {
+        params.flags |= IORING_SETUP_IOPOLL;
+    }
+    s->flags = flags;
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
 
     ioq_init(&s->io_q);
+
+    /* Start with an empty table, files are added by luring_register_fd() */
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_fds[i] = -1;
+    }
+    rc = io_uring_register_files(ring, s->fixed_fds, MAX_FIXED_FILES);
+    trace_luring_register_files(s, rc);
+    s->files_registered = (rc == 0);
 #ifdef CONFIG_LIBURING_REGISTER_RING_FD
     if (io_uring_register_ring_fd(&s->ring) < 0) {
         /*
@@ -448,6 +663,7 @@ LuringState *luring_init(Error **errp)
 void luring_cleanup(LuringState *s)
 {
     io_uring_queue_exit(&s->ring);
+    qemu_vfree(s->bounce_mem);
     trace_luring_cleanup_state(s);
     g_free(s);
 }
@@ -24,11 +24,27 @@
 #include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
 #include "qemu/memalign.h"
+#include "qemu/units.h"
+#include "block/aio_task.h"
 
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* Bounds for the adaptive queue depth, see mirror_adapt() */
+#define MIRROR_MIN_IN_FLIGHT 2
+#define MIRROR_MAX_IN_FLIGHT 64
+/* Smallest request size picked by mirror_adapt() */
+#define MIRROR_MIN_IO_BYTES (64 * KiB)
+/* Length of a measurement window, and the copy latency we aim for */
+#define MIRROR_ADAPT_INTERVAL_NS (500 * SCALE_MS)
+#define MIRROR_TARGET_LATENCY_NS (20 * SCALE_MS)
+
+/* Block status of the source is scanned in windows of this size by up
+ * to MIRROR_SCAN_WORKERS coroutines in parallel */
+#define MIRROR_SCAN_WINDOW (1 * GiB)
+#define MIRROR_SCAN_WORKERS 8
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -75,6 +91,21 @@ typedef struct MirrorBlockJob {
     unsigned long *in_flight_bitmap;
     unsigned in_flight;
     int64_t bytes_in_flight;
+    /* Number of block status scan tasks running in mirror_dirty_init() */
+    unsigned scan_in_flight;
+
+    /* Current limits for background copy requests, see mirror_adapt() */
+    unsigned max_in_flight;
+    int64_t max_io_bytes;
+    int adapt_direction;
+    /* Statistics for the current measurement window */
+    int64_t adapt_start_ns;
+    uint64_t adapt_bytes;
+    uint64_t adapt_ops;
+    uint64_t adapt_saturated_ops;
+    uint64_t adapt_latency_ns;
+    /* Copy throughput measured in the last complete window, bytes/s */
+    uint64_t throughput;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
     int ret;
     bool unmap;
@@ -105,6 +136,8 @@ struct MirrorOp {
     bool is_pseudo_op;
     bool is_active_write;
     bool is_in_flight;
+    /* When a background copy was started, 0 for other operations */
+    int64_t start_ns;
     CoQueue waiting_requests;
     Coroutine *co;
     MirrorOp *waiting_for_op;
@@ -184,6 +217,86 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+/* Tune the queue depth and the request size of background copies.
+ *
+ * The queue depth is adjusted by hill climbing on the throughput measured
+ * over MIRROR_ADAPT_INTERVAL_NS: keep moving in the same direction while
+ * throughput improves, turn around when it drops.  This only happens while
+ * the queue is full most of the time, i.e. when the job is limited by the
+ * speed of the source or target rather than by the amount of dirty data
+ * or by its rate limit.
+ *
+ * The request size is doubled when requests complete well within
+ * MIRROR_TARGET_LATENCY_NS and halved when they take much longer, so that
+ * fast storage gets large requests while slow storage doesn't delay
+ * guest I/O that conflicts with in-flight chunks.  The total amount of
+ * data in flight stays bounded by the buffer size.
+ */
+static void mirror_adapt(MirrorBlockJob *s, uint64_t bytes,
+                         int64_t latency_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->adapt_start_ns;
+    int64_t min_io_bytes, max_io_bytes, avg_latency;
+    uint64_t throughput;
+    unsigned step;
+
+    s->adapt_bytes += bytes;
+    s->adapt_ops++;
+    s->adapt_latency_ns += latency_ns;
+    if (s->in_flight + 1 >= s->max_in_flight) {
+        s->adapt_saturated_ops++;
+    }
+
+    if (elapsed < MIRROR_ADAPT_INTERVAL_NS) {
+        return;
+    }
+
+    throughput = s->adapt_bytes * NANOSECONDS_PER_SECOND / elapsed;
+    avg_latency = s->adapt_latency_ns / s->adapt_ops;
+
+    if (!s->common.speed && s->adapt_saturated_ops * 2 >= s->adapt_ops) {
+        if (throughput < s->throughput - s->throughput / 16) {
+            s->adapt_direction = -s->adapt_direction;
+        }
+        step = MAX(s->max_in_flight / 4, 1);
+        if (s->adapt_direction > 0) {
+            s->max_in_flight = MIN(s->max_in_flight + step,
+                                   MIRROR_MAX_IN_FLIGHT);
+            if (s->max_in_flight == MIRROR_MAX_IN_FLIGHT) {
+                s->adapt_direction = -1;
+            }
+        } else {
+            s->max_in_flight = MAX(s->max_in_flight - step,
+                                   MIRROR_MIN_IN_FLIGHT);
+            if (s->max_in_flight == MIRROR_MIN_IN_FLIGHT) {
+                s->adapt_direction = 1;
+            }
+        }
+    }
+
+    min_io_bytes = MAX(s->granularity, MIRROR_MIN_IO_BYTES);
+    max_io_bytes = MAX(s->buf_size / s->max_in_flight, min_io_bytes);
+    if (avg_latency < MIRROR_TARGET_LATENCY_NS / 2) {
+        s->max_io_bytes *= 2;
+    } else if (avg_latency > MIRROR_TARGET_LATENCY_NS * 2) {
+        s->max_io_bytes /= 2;
+    }
+    s->max_io_bytes = QEMU_ALIGN_DOWN(MIN(s->max_io_bytes, max_io_bytes),
+                                      s->granularity);
+    s->max_io_bytes = MAX(s->max_io_bytes, min_io_bytes);
+
+    trace_mirror_adapt(s, throughput, avg_latency, s->max_in_flight,
+                       s->max_io_bytes);
+
+    s->throughput = throughput;
+    s->adapt_start_ns = now;
+    s->adapt_bytes = 0;
+    s->adapt_ops = 0;
+    s->adapt_saturated_ops = 0;
+    s->adapt_latency_ns = 0;
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -214,6 +327,11 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
+        if (op->start_ns) {
+            mirror_adapt(s, op->bytes,
+                         qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                         op->start_ns);
+        }
     }
     qemu_iovec_destroy(&op->qiov);
 
@@ -391,6 +509,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->in_flight++;
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
     ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
@@ -482,7 +601,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->max_io_bytes;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -579,7 +698,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -806,13 +925,49 @@ static void coroutine_fn mirror_throttle(MirrorBlockJob *s)
     }
 }
 
+typedef struct MirrorScanTask {
+    AioTask task;
+    MirrorBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+} MirrorScanTask;
+
+/* Mark the allocated parts of one window of the source as dirty */
+static coroutine_fn int mirror_scan_task_entry(AioTask *task)
+{
+    MirrorScanTask *t = container_of(task, MirrorScanTask, task);
+    MirrorBlockJob *s = t->s;
+    BlockDriverState *bs = s->mirror_top_bs->backing->bs;
+    int64_t offset = t->offset;
+    int64_t end = t->offset + t->bytes;
+    int64_t count;
+    int ret = 0;
+
+    s->scan_in_flight++;
+    while (offset < end && !job_is_cancelled(&s->common.job)) {
+        ret = bdrv_is_allocated_above(bs, s->base_overlay, true, offset,
+                                      end - offset, &count);
+        if (ret < 0) {
+            break;
+        }
+
+        assert(count);
+        if (ret > 0) {
+            bdrv_set_dirty_bitmap(s->dirty_bitmap, offset, count);
+        }
+        offset += count;
+    }
+    s->scan_in_flight--;
+
+    return ret < 0 ? ret : 0;
+}
+
 static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
 {
     int64_t offset;
-    BlockDriverState *bs = s->mirror_top_bs->backing->bs;
     BlockDriverState *target_bs = blk_bs(s->target);
+    AioTaskPool *pool;
     int ret;
-    int64_t count;
 
     if (s->zero_target) {
         if (!bdrv_can_write_zeroes_with_unmap(target_bs)) {
@@ -832,7 +987,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -847,31 +1002,39 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
         s->initial_zeroing_ongoing = false;
     }
 
-    /* First part, loop on the sectors and initialize the dirty bitmap.  */
-    for (offset = 0; offset < s->bdev_length; ) {
-        /* Just to make sure we are not exceeding int limit. */
-        int bytes = MIN(s->bdev_length - offset,
-                        QEMU_ALIGN_DOWN(INT_MAX, s->granularity));
+    /* First part, scan the source and initialize the dirty bitmap.  Block
+     * status queries can be slow (e.g. for large sparse images on network
+     * storage), so several windows are scanned concurrently. */
+    pool = aio_task_pool_new(MIRROR_SCAN_WORKERS);
+    for (offset = 0; offset < s->bdev_length; offset += MIRROR_SCAN_WINDOW) {
+        MirrorScanTask *t;
 
         mirror_throttle(s);
 
         if (job_is_cancelled(&s->common.job)) {
-            return 0;
+            break;
         }
 
-        ret = bdrv_is_allocated_above(bs, s->base_overlay, true, offset, bytes,
-                                      &count);
-        if (ret < 0) {
-            return ret;
+        aio_task_pool_wait_slot(pool);
+        if (aio_task_pool_status(pool) < 0) {
+            break;
         }
 
-        assert(count);
-        if (ret > 0) {
-            bdrv_set_dirty_bitmap(s->dirty_bitmap, offset, count);
-        }
-        offset += count;
+        t = g_new(MirrorScanTask, 1);
+        *t = (MirrorScanTask) {
+            .task.func = mirror_scan_task_entry,
+            .s = s,
+            .offset = offset,
+            .bytes = MIN(s->bdev_length - offset, MIRROR_SCAN_WINDOW),
+        };
+        aio_task_pool_start_task(pool, &t->task);
     }
-    return 0;
+
+    aio_task_pool_wait_all(pool);
+    ret = aio_task_pool_status(pool);
+    aio_task_pool_free(pool);
+
+    return ret;
 }
 
 /* Called when going out of the streaming phase to flush the bulk of the
@@ -972,6 +1135,10 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     mirror_free_init(s);
 
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    s->adapt_direction = 1;
+
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
@@ -980,6 +1147,13 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         }
     }
 
+    /* Start measuring throughput once the bulk copy begins */
+    s->adapt_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->adapt_bytes = 0;
+    s->adapt_ops = 0;
+    s->adapt_saturated_ops = 0;
+    s->adapt_latency_ns = 0;
+
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap);
     for (;;) {
@@ -1018,7 +1192,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1177,7 +1351,19 @@ static bool mirror_drained_poll(BlockJob *job)
         return true;
     }
 
-    return !!s->in_flight;
+    return !!s->in_flight || !!s->scan_in_flight;
+}
+
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_throughput = true;
+    info->throughput = s->throughput;
+    info->has_queue_depth = true;
+    info->queue_depth = s->in_flight;
+    info->has_max_queue_depth = true;
+    info->max_queue_depth = s->max_in_flight;
 }
 
 static bool mirror_cancel(Job *job, bool force)
@@ -1217,6 +1403,7 @@ static const BlockJobDriver mirror_job_driver = {
         .cancel                 = mirror_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1233,6 +1420,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .cancel                 = commit_active_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
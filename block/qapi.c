@@ -537,6 +537,11 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
         s->has_driver_specific = true;
     }
 
+    s->block_status_cache = bdrv_bsc_get_stats(bs);
+    if (s->block_status_cache) {
+        s->has_block_status_cache = true;
+    }
+
     parent_child = bdrv_primary_child(bs);
     if (!parent_child ||
         !(parent_child->role & (BDRV_CHILD_DATA | BDRV_CHILD_FILTERED)))
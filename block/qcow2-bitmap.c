@@ -90,6 +90,9 @@ typedef struct Qcow2Bitmap {
 
     BdrvDirtyBitmap *dirty_bitmap;
 
+    /* Rewrite only the changed parts of the existing bitmap table */
+    bool in_place;
+
     QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
 } Qcow2Bitmap;
 typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
@@ -369,6 +372,9 @@ static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
+    /* The image now holds exactly what is in memory */
+    bdrv_dirty_bitmap_clear_changes(bitmap);
+
     g_free(bitmap_table);
     return bitmap;
 
@@ -1429,6 +1435,132 @@ fail:
     return ret;
 }
 
+/* store_bitmap_in_place()
+ * Store bm->dirty_bitmap to the bitmap table it was loaded from or last
+ * stored to, rewriting only the clusters whose part of the bitmap changed
+ * since then.  The bitmap must be marked in-use in the image, so that the
+ * data is not relied upon until the bitmap directory is updated.
+ * Clusters that are no longer referenced by the table are appended to
+ * @free_clusters, they may be freed once the table is written.
+ */
+static int store_bitmap_in_place(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                 GArray *free_clusters, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
+    const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    g_autoptr(GArray) new_clusters = g_array_new(false, false,
+                                                 sizeof(uint64_t));
+    uint64_t *tb = NULL;
+    uint8_t *buf = NULL;
+    uint64_t offset, limit;
+    guint nb_free = free_clusters->len;
+    bool tb_changed = false;
+    uint32_t i;
+
+    assert(bm->in_place && bm->table.offset != 0);
+
+    ret = bitmap_table_load(bs, &bm->table, &tb);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap_table table from "
+                         "image for bitmap '%s'", bm_name);
+        return ret;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
+    assert(DIV_ROUND_UP(bm_size, limit) == bm->table.size);
+
+    for (i = 0, offset = 0; i < bm->table.size; ++i, offset += limit) {
+        uint64_t count = MIN(bm_size - offset, limit);
+        uint64_t old = tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        uint64_t write_size;
+        int64_t off;
+
+        if (!bdrv_dirty_bitmap_changed(bitmap, offset, count)) {
+            continue;
+        }
+
+        if (bdrv_dirty_bitmap_next_dirty(bitmap, offset, count) < 0) {
+            if (tb[i] != 0) {
+                if (old) {
+                    g_array_append_val(free_clusters, old);
+                }
+                tb[i] = 0;
+                tb_changed = true;
+            }
+            continue;
+        }
+
+        if (old) {
+            off = old;
+        } else {
+            off = qcow2_alloc_clusters(bs, s->cluster_size);
+            if (off < 0) {
+                error_setg_errno(errp, -off,
+                                 "Failed to allocate clusters for bitmap '%s'",
+                                 bm_name);
+                ret = off;
+                goto fail;
+            }
+            g_array_append_val(new_clusters, off);
+            tb[i] = off;
+            tb_changed = true;
+        }
+
+        write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
+                                                          count);
+        assert(write_size <= s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, count);
+        if (write_size < s->cluster_size) {
+            memset(buf + write_size, 0, s->cluster_size - write_size);
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size, false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, off, s->cluster_size, buf, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+    }
+
+    if (tb_changed) {
+        bitmap_table_to_be(tb, bm->table.size);
+        ret = bdrv_pwrite(bs->file, bm->table.offset,
+                          bm->table.size * sizeof(tb[0]), tb, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+    }
+
+    g_free(buf);
+    g_free(tb);
+
+    return 0;
+
+fail:
+    /* The table in the image still points to the old clusters only */
+    for (i = 0; i < new_clusters->len; i++) {
+        qcow2_free_clusters(bs, g_array_index(new_clusters, uint64_t, i),
+                            s->cluster_size, QCOW2_DISCARD_ALWAYS);
+    }
+    g_array_set_size(free_clusters, nb_free);
+    g_free(buf);
+    g_free(tb);
+
+    return ret;
+}
+
 static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
                                         const char *name)
 {
@@ -1532,7 +1664,10 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
     Qcow2Bitmap *bm;
     QSIMPLEQ_HEAD(, Qcow2BitmapTable) drop_tables;
     Qcow2BitmapTable *tb, *tb_next;
+    g_autoptr(GArray) free_clusters = g_array_new(false, false,
+                                                  sizeof(uint64_t));
     bool need_write = false;
+    guint i;
 
     QSIMPLEQ_INIT(&drop_tables);
 
@@ -1594,15 +1729,31 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             bm->name = g_strdup(name);
             QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
         } else {
+            uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+            uint64_t tb_size = size_to_clusters(s,
+                bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
+
             if (!(bm->flags & BME_FLAG_IN_USE)) {
                 error_setg(errp, "Bitmap '%s' already exists in the image",
                            name);
                 goto fail;
             }
-            tb = g_memdup(&bm->table, sizeof(bm->table));
-            bm->table.offset = 0;
-            bm->table.size = 0;
-            QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+
+            /*
+             * The table still describes the bitmap as it was loaded or
+             * last stored; unless the bitmap was resized or recreated
+             * meanwhile, only the changed parts need to be written.
+             */
+            if (bm->table.offset != 0 && bm->table.size == tb_size &&
+                bm->granularity_bits == ctz32(granularity))
+            {
+                bm->in_place = true;
+            } else {
+                tb = g_memdup2(&bm->table, sizeof(bm->table));
+                bm->table.offset = 0;
+                bm->table.size = 0;
+                QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            }
         }
         bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
         bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
@@ -1626,7 +1777,11 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             continue;
         }
 
-        ret = store_bitmap(bs, bm, errp);
+        if (bm->in_place) {
+            ret = store_bitmap_in_place(bs, bm, free_clusters, errp);
+        } else {
+            ret = store_bitmap(bs, bm, errp);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1644,6 +1799,16 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
         free_bitmap_clusters(bs, tb);
         g_free(tb);
     }
+    for (i = 0; i < free_clusters->len; i++) {
+        qcow2_free_clusters(bs, g_array_index(free_clusters, uint64_t, i),
+                            s->cluster_size, QCOW2_DISCARD_ALWAYS);
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bm->dirty_bitmap && !bdrv_dirty_bitmap_readonly(bm->dirty_bitmap)) {
+            bdrv_dirty_bitmap_clear_changes(bm->dirty_bitmap);
+        }
+    }
 
 success:
     if (release_stored) {
@@ -1662,7 +1827,7 @@ success:
 fail:
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
         if (bm->dirty_bitmap == NULL || bm->table.offset == 0 ||
-            bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
+            bm->in_place || bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
         {
             continue;
         }
@@ -1670,6 +1835,15 @@ fail:
         free_bitmap_clusters(bs, &bm->table);
     }
 
+    /*
+     * Tables updated in place are still referenced by the (in-use) entries
+     * in the image, but no longer point to these clusters.
+     */
+    for (i = 0; i < free_clusters->len; i++) {
+        qcow2_free_clusters(bs, g_array_index(free_clusters, uint64_t, i),
+                            s->cluster_size, QCOW2_DISCARD_ALWAYS);
+    }
+
     QSIMPLEQ_FOREACH_SAFE(tb, &drop_tables, entry, tb_next) {
         g_free(tb);
     }
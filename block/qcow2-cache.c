@@ -24,14 +24,32 @@
 
 #include "qemu/osdep.h"
 #include "qemu/memalign.h"
+#include "block/request-trace.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Tables are found through a hash table with one chain per bucket, and
+ * replaced in CLOCK order: a hand sweeps over the entries, gives every
+ * entry that was used since it last came by a second chance and takes
+ * the first one that was not.
+ *
+ * Only the first nb_active entries are used.  The cache starts small and
+ * doubles nb_active whenever the hand finds all of them in use, so that
+ * a large l2-cache-size only costs memory if the working set needs it.
+ * qcow2_cache_clean_unused() shrinks it again.
+ */
+
+#define QCOW2_CACHE_MIN_ACTIVE 16
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
-    uint64_t lru_counter;
+    int64_t  loading_offset;
+    uint64_t lru_counter;   /* last use, for qcow2_cache_clean_unused() */
     int      ref;
+    int      hash_next;     /* next entry in the same bucket, or -1 */
     bool     dirty;
+    bool     referenced;    /* used since the CLOCK hand passed */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -43,6 +61,19 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    int                    *buckets;
+    int                     hash_bits;
+    int                     nb_active;
+    int                     clock_hand;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
+
+    /* Tables being read by qcow2_cache_co_load() with s->lock dropped */
+    int                     nb_loading;
+    CoQueue                 load_queue;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -58,6 +89,52 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+/* The key of an entry is the offset of the table it holds or is loading */
+static inline int64_t qcow2_cache_entry_key(Qcow2CachedTable *t)
+{
+    return t->offset ?: t->loading_offset;
+}
+
+static inline int *qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t hash = (offset / c->table_size) * 0x9e3779b97f4a7c15ULL;
+    return &c->buckets[hash >> (64 - c->hash_bits)];
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int64_t key = qcow2_cache_entry_key(&c->entries[i]);
+    int *p;
+
+    if (!key) {
+        return;
+    }
+    p = qcow2_cache_bucket(c, key);
+    while (*p != i) {
+        assert(*p != -1);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *p = qcow2_cache_bucket(c, qcow2_cache_entry_key(&c->entries[i]));
+
+    c->entries[i].hash_next = *p;
+    *p = i;
+}
+
+/* Drop the table held by entry @i, if any, and make it free */
+static void qcow2_cache_entry_reset(Qcow2Cache *c, int i)
+{
+    qcow2_cache_hash_remove(c, i);
+    c->entries[i].offset = 0;
+    c->entries[i].lru_counter = 0;
+    c->entries[i].referenced = false;
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -105,8 +182,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_reset(c, i);
             i++;
             to_clean++;
         }
@@ -116,6 +192,18 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
         }
     }
 
+    /* Give back the free entries at the end */
+    while (c->nb_active > MIN(c->size, QCOW2_CACHE_MIN_ACTIVE)) {
+        Qcow2CachedTable *t = &c->entries[c->nb_active - 1];
+        if (t->offset || t->loading_offset || t->ref) {
+            break;
+        }
+        c->nb_active--;
+    }
+    if (c->clock_hand >= c->nb_active) {
+        c->clock_hand = 0;
+    }
+
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
@@ -124,6 +212,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -132,16 +221,29 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->nb_active = MIN(num_tables, QCOW2_CACHE_MIN_ACTIVE);
     c->table_size = table_size;
+    c->hash_bits = MAX(ctz32(pow2ceil(num_tables)), 1);
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->hash_bits);
+    /* Only the pages of the tables that are actually used get populated */
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
+    qemu_co_queue_init(&c->load_queue);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+    }
+    for (i = 0; i < 1 << c->hash_bits; i++) {
+        c->buckets[i] = -1;
     }
 
     return c;
@@ -151,11 +253,13 @@ int qcow2_cache_destroy(Qcow2Cache *c)
 {
     int i;
 
+    assert(c->nb_loading == 0);
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -306,26 +410,81 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_reset(c, i);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
+    c->nb_active = MIN(c->size, QCOW2_CACHE_MIN_ACTIVE);
+    c->clock_hand = 0;
 
     return 0;
 }
 
+/*
+ * Returns the entry for the table at @offset, which may still be being
+ * loaded, or -1 if there is none.
+ */
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = *qcow2_cache_bucket(c, offset); i != -1;
+         i = c->entries[i].hash_next) {
+        if (qcow2_cache_entry_key(&c->entries[i]) == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the entry that should be replaced by a new table, growing the
+ * cache if the hand finds every entry in use, or -1 if all entries are
+ * referenced and the cache cannot grow any more.
+ */
+static int qcow2_cache_victim(Qcow2Cache *c)
+{
+    int scanned;
+
+    for (scanned = 0; scanned < 2 * c->nb_active; scanned++) {
+        Qcow2CachedTable *t = &c->entries[c->clock_hand];
+        int i = c->clock_hand;
+
+        if (scanned == c->nb_active && c->nb_active < c->size) {
+            /* A whole round without a victim: the working set is larger */
+            break;
+        }
+        if (++c->clock_hand == c->nb_active) {
+            c->clock_hand = 0;
+        }
+        if (t->ref) {
+            continue;
+        }
+        if (!t->offset || !t->referenced) {
+            return i;
+        }
+        t->referenced = false;
+    }
+
+    if (c->nb_active < c->size) {
+        int i = c->nb_active;
+        c->nb_active = MIN(c->size, c->nb_active * 2);
+        /* Fill the other new, never used entries before evicting again */
+        c->clock_hand = i + 1 < c->nb_active ? i + 1 : 0;
+        return i;
+    }
+    return -1;
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
+    int victim;
 
     assert(offset != 0);
 
@@ -340,29 +499,29 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+retry:
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        if (c->entries[i].loading_offset) {
+            /* Only coroutines drop s->lock to load a table */
+            assert(qemu_in_coroutine());
+            qemu_co_queue_wait(&c->load_queue, &s->lock);
+            goto retry;
         }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+        c->hits++;
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    victim = qcow2_cache_victim(c);
+    if (victim == -1) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = victim;
+    c->misses++;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -373,20 +532,28 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        c->evictions++;
+    }
+    qcow2_cache_entry_reset(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_CACHE_MISS_START,
+                           bs, offset, c->table_size);
         ret = bdrv_pread(bs->file, offset, c->table_size,
                          qcow2_cache_get_table_addr(c, i), 0);
+        block_trace_record(XDBG_BLOCK_TRACE_EVENT_CACHE_MISS_END,
+                           bs, offset, c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
@@ -399,6 +566,97 @@ found:
     return 0;
 }
 
+/*
+ * Read the table at @offset into the cache with s->lock dropped, so that
+ * other requests can use the cache (and the image) while the table is
+ * being read.  Requests for the same table wait until it has been loaded.
+ *
+ * Must be called in coroutine context with s->lock held.  Returns 0 without
+ * dropping the lock if the table is cached already, or if it should rather
+ * be loaded by qcow2_cache_get() because too many tables are being loaded
+ * at the same time.  Returns -EAGAIN if s->lock was dropped and the caller
+ * must revalidate whatever it found out before; the table is usually
+ * cached then.  Returns -errno on failure.
+ */
+int coroutine_fn qcow2_cache_co_load(BlockDriverState *bs, Qcow2Cache *c,
+                                     uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
+    int i, victim;
+    int ret;
+
+    assert(offset != 0);
+
+    if (!QEMU_IS_ALIGNED(offset, c->table_size)) {
+        /* Let qcow2_cache_get() report the corruption */
+        return 0;
+    }
+
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        if (!c->entries[i].loading_offset) {
+            return 0;
+        }
+        qemu_co_queue_wait(&c->load_queue, &s->lock);
+        return -EAGAIN;
+    }
+
+    /*
+     * Loading entries cannot be replaced, so keep enough of them for
+     * callers of qcow2_cache_get() that use several tables at once.
+     */
+    if (c->nb_loading >= c->size / 4) {
+        return 0;
+    }
+    i = qcow2_cache_victim(c);
+    if (i == -1) {
+        return 0;
+    }
+
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_qcow2_cache_co_load(qemu_coroutine_self(),
+                              c == s->l2_table_cache, offset, i);
+
+    t = &c->entries[i];
+    c->misses++;
+    if (t->offset) {
+        c->evictions++;
+    }
+    qcow2_cache_entry_reset(c, i);
+    t->loading_offset = offset;
+    qcow2_cache_hash_insert(c, i);
+    t->ref++;
+    c->nb_loading++;
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+    ret = bdrv_co_pread(bs->file, offset, c->table_size,
+                        qcow2_cache_get_table_addr(c, i), 0);
+
+    qemu_co_mutex_lock(&s->lock);
+    c->nb_loading--;
+    t->ref--;
+    if (ret == 0) {
+        /* The key stays the same, so the entry can stay in its bucket */
+        t->offset = offset;
+        t->loading_offset = 0;
+        t->lru_counter = ++c->lru_counter;
+    } else {
+        qcow2_cache_hash_remove(c, i);
+        t->loading_offset = 0;
+    }
+    qemu_co_queue_restart_all(&c->load_queue);
+
+    return ret < 0 ? ret : -EAGAIN;
+}
+
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
@@ -420,6 +678,7 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        c->entries[i].referenced = true;
     }
 
     assert(c->entries[i].ref >= 0);
@@ -434,12 +693,10 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
+    if (i >= 0 && c->entries[i].offset == offset) {
+        return qcow2_cache_get_table_addr(c, i);
     }
     return NULL;
 }
@@ -450,9 +707,19 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_reset(c, i);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats)
+{
+    *stats = (Qcow2CacheStats) {
+        .hits = c->hits,
+        .misses = c->misses,
+        .evictions = c->evictions,
+        .entries = c->nb_active,
+        .max_entries = c->size,
+    };
+}
@@ -216,6 +216,51 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                            (void **)l2_slice);
 }
 
+/*
+ * Returns the image file offset of the L2 slice for the guest @offset if
+ * its L2 table can be loaded with s->lock dropped, or 0 otherwise.  This
+ * is only the case for tables with the COPIED flag: their L1 entry stays
+ * the same while the lock is dropped, whereas other tables must first be
+ * copied by l2_allocate() with the lock held.
+ */
+static uint64_t l2_slice_offset_unlocked(BlockDriverState *bs,
+                                         uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index = offset_to_l1_index(s, offset);
+    uint64_t l2_offset;
+
+    if (l1_index >= s->l1_size ||
+        !(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        return 0;
+    }
+
+    return l2_offset + l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+}
+
+/*
+ * Load the L2 slice for the guest @offset into the cache with s->lock
+ * dropped, so that requests which do not need this slice are not held
+ * up by the I/O.  Returns -EAGAIN if the lock was dropped; see
+ * qcow2_cache_co_load().
+ */
+int coroutine_fn qcow2_co_load_l2_slice(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_offset = l2_slice_offset_unlocked(bs, offset);
+
+    if (!slice_offset) {
+        return 0;
+    }
+    return qcow2_cache_co_load(bs, s->l2_table_cache, slice_offset);
+}
+
 /*
  * Writes an L1 entry to disk (note that depending on the alignment
  * requirements this function may write more that just one entry in
@@ -780,6 +825,14 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
+    /* Snapshot refcount updates for the table must be complete first */
+    if (l2_offset) {
+        ret = qcow2_lazy_refcount_fixup(bs, l2_offset);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
         ret = l2_allocate(bs, l1_index);
@@ -1613,13 +1666,33 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == INV_OFFSET) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+        int64_t cluster_offset;
+
+        /*
+         * Other allocating writes are in flight, so allocate from the
+         * reservation.  Without them, allocate exactly what is needed
+         * to keep the image layout compact.
+         */
+        if (s->nb_reserved || !QLIST_EMPTY(&s->cluster_allocs)) {
+            cluster_offset = qcow2_alloc_reserved_clusters(bs, nb_clusters);
+        } else {
+            cluster_offset =
+                qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+        }
         if (cluster_offset < 0) {
             return cluster_offset;
         }
         *host_offset = cluster_offset;
         return 0;
+    } else if (s->nb_reserved && *host_offset == s->reserved_offset) {
+        /* Extend the allocation into the reservation */
+        int64_t cluster_offset = qcow2_alloc_reserved_clusters(bs,
+                                                               nb_clusters);
+        if (cluster_offset < 0) {
+            return cluster_offset;
+        }
+        assert(cluster_offset == *host_offset);
+        return 0;
     } else {
         int64_t ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
         if (ret < 0) {
@@ -1813,6 +1886,29 @@ again:
 
         cur_bytes = remaining;
 
+        /*
+         * Loading the L2 slice drops s->lock.  Do it before gathering
+         * anything and start over afterwards, because the situation may
+         * have changed meanwhile.  Once clusters have been gathered, stop
+         * at a slice that is not cached yet instead; the caller will load
+         * it in its next loop iteration.
+         */
+        if (cluster_offset == INV_OFFSET) {
+            ret = qcow2_co_load_l2_slice(bs, start);
+            if (ret == -EAGAIN) {
+                assert(*m == NULL);
+                goto again;
+            } else if (ret < 0) {
+                return ret;
+            }
+        } else {
+            uint64_t slice_offset = l2_slice_offset_unlocked(bs, start);
+            if (slice_offset &&
+                !qcow2_cache_is_table_offset(s->l2_table_cache, slice_offset)) {
+                break;
+            }
+        }
+
         /*
          * Now start gathering as many contiguous clusters as possible:
          *
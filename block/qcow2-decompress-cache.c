@@ -0,0 +1,243 @@
+/*
+ * Cache of decompressed clusters for qcow2
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/*
+ * Decompressed clusters are indexed by the range of the image file that
+ * holds their compressed data, so that freeing a host cluster can drop
+ * every entry whose data overlapped it.  A cache belongs to a file node
+ * and is shared by all qcow2 nodes on top of that node, e.g. by several
+ * read-only users of one compressed base image; its size is the sum of
+ * what its users asked for.
+ *
+ * Users run in the AioContexts of their nodes, so every cache has a lock
+ * of its own.
+ */
+
+typedef struct Qcow2DecompressedCluster {
+    IntervalTreeNode node;      /* compressed data in the image file */
+    QTAILQ_ENTRY(Qcow2DecompressedCluster) lru;
+    uint8_t data[];
+} Qcow2DecompressedCluster;
+
+struct Qcow2DecompressCache {
+    BlockDriverState *file;
+    int cluster_size;
+    int users;
+    uint64_t size;
+
+    QemuMutex lock;
+    IntervalTreeRoot clusters;
+    QTAILQ_HEAD(, Qcow2DecompressedCluster) lru;
+    uint64_t nb_clusters;
+    uint64_t generation;
+
+    QLIST_ENTRY(Qcow2DecompressCache) next;
+};
+
+/* Protected by decompress_caches_lock */
+static QLIST_HEAD(, Qcow2DecompressCache) decompress_caches =
+    QLIST_HEAD_INITIALIZER(decompress_caches);
+static QemuMutex decompress_caches_lock;
+
+static void __attribute__((__constructor__)) decompress_caches_init(void)
+{
+    qemu_mutex_init(&decompress_caches_lock);
+}
+
+Qcow2DecompressCache *qcow2_decompress_cache_attach(BlockDriverState *file,
+                                                    int cluster_size,
+                                                    uint64_t size)
+{
+    Qcow2DecompressCache *c;
+
+    qemu_mutex_lock(&decompress_caches_lock);
+    QLIST_FOREACH(c, &decompress_caches, next) {
+        if (c->file == file && c->cluster_size == cluster_size) {
+            break;
+        }
+    }
+
+    if (!c) {
+        c = g_new0(Qcow2DecompressCache, 1);
+        c->file = file;
+        c->cluster_size = cluster_size;
+        qemu_mutex_init(&c->lock);
+        QTAILQ_INIT(&c->lru);
+        QLIST_INSERT_HEAD(&decompress_caches, c, next);
+    }
+
+    qemu_mutex_lock(&c->lock);
+    c->users++;
+    c->size += size;
+    trace_qcow2_decompress_cache_attach(c, file, c->users, c->size);
+    qemu_mutex_unlock(&c->lock);
+    qemu_mutex_unlock(&decompress_caches_lock);
+
+    return c;
+}
+
+static void qcow2_decompress_cache_drop(Qcow2DecompressCache *c,
+                                        Qcow2DecompressedCluster *dc)
+{
+    interval_tree_remove(&dc->node, &c->clusters);
+    QTAILQ_REMOVE(&c->lru, dc, lru);
+    c->nb_clusters--;
+    g_free(dc);
+}
+
+/* Called with c->lock held */
+static void qcow2_decompress_cache_shrink(Qcow2DecompressCache *c)
+{
+    while (c->nb_clusters &&
+           c->nb_clusters * c->cluster_size > c->size) {
+        qcow2_decompress_cache_drop(c, QTAILQ_LAST(&c->lru));
+    }
+}
+
+void qcow2_decompress_cache_detach(Qcow2DecompressCache *c, uint64_t size)
+{
+    bool unused;
+
+    qemu_mutex_lock(&decompress_caches_lock);
+    qemu_mutex_lock(&c->lock);
+    assert(c->users > 0 && c->size >= size);
+    c->users--;
+    c->size -= size;
+    qcow2_decompress_cache_shrink(c);
+    trace_qcow2_decompress_cache_detach(c, c->users, c->size);
+    unused = c->users == 0;
+    qemu_mutex_unlock(&c->lock);
+
+    if (unused) {
+        assert(c->nb_clusters == 0);
+        QLIST_REMOVE(c, next);
+        qemu_mutex_destroy(&c->lock);
+        g_free(c);
+    }
+    qemu_mutex_unlock(&decompress_caches_lock);
+}
+
+BlockDriverState *qcow2_decompress_cache_file(Qcow2DecompressCache *c)
+{
+    return c->file;
+}
+
+/* Called with c->lock held */
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_find(Qcow2DecompressCache *c, uint64_t coffset)
+{
+    IntervalTreeNode *n;
+
+    for (n = interval_tree_iter_first(&c->clusters, coffset, coffset); n;
+         n = interval_tree_iter_next(n, coffset, coffset)) {
+        if (n->start == coffset) {
+            return container_of(n, Qcow2DecompressedCluster, node);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Copy @bytes at @offset_in_cluster of the cluster whose compressed data
+ * starts at @coffset into @qiov.  Returns false if it is not cached.
+ */
+bool qcow2_decompress_cache_read(Qcow2DecompressCache *c, uint64_t coffset,
+                                 int offset_in_cluster, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset)
+{
+    Qcow2DecompressedCluster *dc;
+
+    qemu_mutex_lock(&c->lock);
+    dc = qcow2_decompress_cache_find(c, coffset);
+    if (dc) {
+        QTAILQ_REMOVE(&c->lru, dc, lru);
+        QTAILQ_INSERT_HEAD(&c->lru, dc, lru);
+        qemu_iovec_from_buf(qiov, qiov_offset, dc->data + offset_in_cluster,
+                            bytes);
+    }
+    qemu_mutex_unlock(&c->lock);
+
+    return dc != NULL;
+}
+
+bool qcow2_decompress_cache_contains(Qcow2DecompressCache *c,
+                                     uint64_t coffset)
+{
+    bool ret;
+
+    qemu_mutex_lock(&c->lock);
+    ret = qcow2_decompress_cache_find(c, coffset) != NULL;
+    qemu_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+/*
+ * Returns a value to pass to qcow2_decompress_cache_insert() for data
+ * that is read from the image file after this call.  It must be taken
+ * together with the L2 entry that points to the data, under the lock
+ * that also covers freeing clusters.
+ */
+uint64_t qcow2_decompress_cache_generation(Qcow2DecompressCache *c)
+{
+    return qatomic_read(&c->generation);
+}
+
+/*
+ * Add the cluster that was decompressed from the @csize bytes at @coffset
+ * to the cache, unless part of the image file was freed since @generation
+ * was taken and the data might be stale.
+ */
+void qcow2_decompress_cache_insert(Qcow2DecompressCache *c, uint64_t coffset,
+                                   int csize, const void *data,
+                                   uint64_t generation)
+{
+    Qcow2DecompressedCluster *dc;
+
+    dc = g_malloc(sizeof(*dc) + c->cluster_size);
+    dc->node.start = coffset;
+    dc->node.last = coffset + csize - 1;
+    memcpy(dc->data, data, c->cluster_size);
+
+    qemu_mutex_lock(&c->lock);
+    if (c->generation != generation || c->size < c->cluster_size ||
+        qcow2_decompress_cache_find(c, coffset)) {
+        qemu_mutex_unlock(&c->lock);
+        g_free(dc);
+        return;
+    }
+    interval_tree_insert(&dc->node, &c->clusters);
+    QTAILQ_INSERT_HEAD(&c->lru, dc, lru);
+    c->nb_clusters++;
+    qcow2_decompress_cache_shrink(c);
+    qemu_mutex_unlock(&c->lock);
+}
+
+/* Called when the @bytes at @offset of the image file have been freed */
+void qcow2_decompress_cache_invalidate(Qcow2DecompressCache *c,
+                                       uint64_t offset, uint64_t bytes)
+{
+    uint64_t last = bytes ? offset + bytes - 1 : offset;
+    IntervalTreeNode *n, *next;
+
+    qemu_mutex_lock(&c->lock);
+    qatomic_set(&c->generation, c->generation + 1);
+    for (n = interval_tree_iter_first(&c->clusters, offset, last); n;
+         n = next) {
+        next = interval_tree_iter_next(n, offset, last);
+        qcow2_decompress_cache_drop(c,
+            container_of(n, Qcow2DecompressedCluster, node));
+    }
+    qemu_mutex_unlock(&c->lock);
+}
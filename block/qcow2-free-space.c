@@ -0,0 +1,362 @@
+/*
+ * Free space index for qcow2 cluster allocation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/*
+ * The free clusters of the image file are kept as maximal extents in a
+ * treap ordered by start cluster, in which every node also knows the
+ * length of the longest extent in its subtree.  This finds the first
+ * extent after a given cluster that can hold an allocation in O(log n),
+ * no matter how fragmented the free space is, whereas scanning the
+ * refcounts has to step over every used cluster and every hole that is
+ * too small.
+ *
+ * The index is built from the refcount blocks the first time clusters
+ * are allocated, and the refcount code keeps it up to date afterwards.
+ * It is dropped when the refcount structures are rebuilt as a whole and
+ * built again on the next allocation.  The last extent never ends: all
+ * clusters after the last refcount block are free.
+ */
+
+/* Give up on images whose free space is fragmented beyond this */
+#define QCOW2_FREE_SPACE_MAX_EXTENTS (1 << 20)
+
+typedef struct Qcow2FreeExtent {
+    uint64_t start;
+    uint64_t last;      /* inclusive */
+    uint64_t max_len;   /* of all extents in this subtree */
+    uint32_t prio;
+    struct Qcow2FreeExtent *left;
+    struct Qcow2FreeExtent *right;
+} Qcow2FreeExtent;
+
+struct Qcow2FreeSpace {
+    Qcow2FreeExtent *root;
+    uint64_t nb_extents;
+    uint32_t seed;
+};
+
+static inline uint64_t extent_len(const Qcow2FreeExtent *e)
+{
+    return e->last - e->start + 1;
+}
+
+static void extent_update(Qcow2FreeExtent *e)
+{
+    e->max_len = extent_len(e);
+    if (e->left) {
+        e->max_len = MAX(e->max_len, e->left->max_len);
+    }
+    if (e->right) {
+        e->max_len = MAX(e->max_len, e->right->max_len);
+    }
+}
+
+/* Split @t into the extents that start before @start and all others */
+static void extent_split(Qcow2FreeExtent *t, uint64_t start,
+                         Qcow2FreeExtent **l, Qcow2FreeExtent **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    if (t->start < start) {
+        extent_split(t->right, start, &t->right, r);
+        *l = t;
+    } else {
+        extent_split(t->left, start, l, &t->left);
+        *r = t;
+    }
+    extent_update(t);
+}
+
+/* All extents in @l must start before those in @r */
+static Qcow2FreeExtent *extent_merge(Qcow2FreeExtent *l, Qcow2FreeExtent *r)
+{
+    if (!l) {
+        return r;
+    }
+    if (!r) {
+        return l;
+    }
+    if (l->prio > r->prio) {
+        l->right = extent_merge(l->right, r);
+        extent_update(l);
+        return l;
+    } else {
+        r->left = extent_merge(l, r->left);
+        extent_update(r);
+        return r;
+    }
+}
+
+static void extent_insert(Qcow2FreeSpace *fs, uint64_t start, uint64_t last)
+{
+    Qcow2FreeExtent *e = g_new0(Qcow2FreeExtent, 1);
+    Qcow2FreeExtent *l, *r;
+
+    /* xorshift, deterministic so that allocations are reproducible */
+    fs->seed ^= fs->seed << 13;
+    fs->seed ^= fs->seed >> 17;
+    fs->seed ^= fs->seed << 5;
+
+    e->start = start;
+    e->last = last;
+    e->prio = fs->seed;
+    extent_update(e);
+
+    extent_split(fs->root, start, &l, &r);
+    fs->root = extent_merge(extent_merge(l, e), r);
+    fs->nb_extents++;
+}
+
+static void extent_remove(Qcow2FreeSpace *fs, Qcow2FreeExtent *e)
+{
+    Qcow2FreeExtent *l, *m, *r;
+
+    extent_split(fs->root, e->start, &l, &r);
+    extent_split(r, e->start + 1, &m, &r);
+    assert(m == e && !m->left && !m->right);
+    fs->root = extent_merge(l, r);
+    fs->nb_extents--;
+    g_free(e);
+}
+
+/* Returns the extent with the highest start that is <= @cluster */
+static Qcow2FreeExtent *extent_floor(Qcow2FreeSpace *fs, uint64_t cluster)
+{
+    Qcow2FreeExtent *t = fs->root;
+    Qcow2FreeExtent *found = NULL;
+
+    while (t) {
+        if (t->start <= cluster) {
+            found = t;
+            t = t->right;
+        } else {
+            t = t->left;
+        }
+    }
+    return found;
+}
+
+/* Returns the first extent that starts at or after @from and has @len */
+static Qcow2FreeExtent *extent_first_fit(Qcow2FreeExtent *t, uint64_t from,
+                                         uint64_t len)
+{
+    Qcow2FreeExtent *found;
+
+    if (!t || t->max_len < len) {
+        return NULL;
+    }
+    if (t->start >= from) {
+        found = extent_first_fit(t->left, from, len);
+        if (found) {
+            return found;
+        }
+        if (extent_len(t) >= len) {
+            return t;
+        }
+    }
+    return extent_first_fit(t->right, from, len);
+}
+
+static void extent_free_all(Qcow2FreeExtent *t)
+{
+    if (t) {
+        extent_free_all(t->left);
+        extent_free_all(t->right);
+        g_free(t);
+    }
+}
+
+static void qcow2_free_space_destroy(Qcow2FreeSpace *fs)
+{
+    extent_free_all(fs->root);
+    g_free(fs);
+}
+
+static int qcow2_free_space_build(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2FreeSpace *fs = g_new0(Qcow2FreeSpace, 1);
+    uint64_t end = QCOW_MAX_CLUSTER_OFFSET >> s->cluster_bits;
+    uint64_t run_start = 0;
+    bool in_run = false;
+    uint64_t i, j;
+    int ret;
+
+    fs->seed = 0x9e3779b9;
+
+    for (i = 0; i < s->refcount_table_size; i++) {
+        uint64_t first = i << s->refcount_block_bits;
+        uint64_t offset = s->refcount_table[i] & REFT_OFFSET_MASK;
+        void *refblock;
+
+        if (i > s->max_refcount_table_index) {
+            break;
+        }
+        if (!offset) {
+            if (!in_run) {
+                run_start = first;
+                in_run = true;
+            }
+            continue;
+        }
+        if (offset_into_cluster(s, offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                    PRIx64 " unaligned (reftable index: %#"
+                                    PRIx64 ")", offset, i);
+            ret = -EIO;
+            goto fail;
+        }
+
+        ret = qcow2_cache_get(bs, s->refcount_block_cache, offset, &refblock);
+        if (ret < 0) {
+            goto fail;
+        }
+        for (j = 0; j < s->refcount_block_size; j++) {
+            if (s->get_refcount(refblock, j) == 0) {
+                if (!in_run) {
+                    run_start = first + j;
+                    in_run = true;
+                }
+            } else if (in_run) {
+                extent_insert(fs, run_start, first + j - 1);
+                in_run = false;
+            }
+        }
+        qcow2_cache_put(s->refcount_block_cache, &refblock);
+
+        if (fs->nb_extents > QCOW2_FREE_SPACE_MAX_EXTENTS) {
+            ret = -E2BIG;
+            goto fail;
+        }
+    }
+
+    if (!in_run) {
+        run_start = i << s->refcount_block_bits;
+    }
+    extent_insert(fs, run_start, end);
+
+    trace_qcow2_free_space_build(bs, fs->nb_extents);
+    s->free_space = fs;
+    return 0;
+
+fail:
+    qcow2_free_space_destroy(fs);
+    return ret;
+}
+
+/*
+ * Find @nb_clusters free clusters in a row, starting as early as possible
+ * but not before @from.  Returns the index of the first cluster, -ENOTSUP
+ * if there is no index and the refcounts must be scanned instead, or
+ * another -errno on failure.
+ */
+int64_t qcow2_free_space_find(BlockDriverState *bs, uint64_t from,
+                              uint64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2FreeExtent *e;
+    int ret;
+
+    if (!s->free_space) {
+        if (s->free_space_disabled) {
+            return -ENOTSUP;
+        }
+        ret = qcow2_free_space_build(bs);
+        if (ret == -E2BIG) {
+            s->free_space_disabled = true;
+            return -ENOTSUP;
+        } else if (ret < 0) {
+            return ret;
+        }
+    }
+
+    e = extent_floor(s->free_space, from);
+    if (e && e->last >= from && e->last - from + 1 >= nb_clusters) {
+        return from;
+    }
+
+    e = extent_first_fit(s->free_space->root, from + 1, nb_clusters);
+    if (!e) {
+        return -EFBIG;
+    }
+    return e->start;
+}
+
+/* Called when the refcount of @cluster_index has become non-zero */
+void qcow2_free_space_set_used(BDRVQcow2State *s, uint64_t cluster_index)
+{
+    Qcow2FreeSpace *fs = s->free_space;
+    Qcow2FreeExtent *e;
+    uint64_t start, last;
+
+    if (!fs) {
+        return;
+    }
+
+    e = extent_floor(fs, cluster_index);
+    if (!e || e->last < cluster_index) {
+        return;
+    }
+
+    start = e->start;
+    last = e->last;
+    extent_remove(fs, e);
+    if (start < cluster_index) {
+        extent_insert(fs, start, cluster_index - 1);
+    }
+    if (cluster_index < last) {
+        extent_insert(fs, cluster_index + 1, last);
+    }
+
+    if (fs->nb_extents > QCOW2_FREE_SPACE_MAX_EXTENTS) {
+        qcow2_free_space_drop(s);
+        s->free_space_disabled = true;
+    }
+}
+
+/* Called when the refcount of @cluster_index has dropped to zero */
+void qcow2_free_space_set_free(BDRVQcow2State *s, uint64_t cluster_index)
+{
+    Qcow2FreeSpace *fs = s->free_space;
+    Qcow2FreeExtent *prev, *next;
+    uint64_t start = cluster_index, last = cluster_index;
+
+    if (!fs) {
+        return;
+    }
+
+    prev = extent_floor(fs, cluster_index);
+    if (prev && prev->last >= cluster_index) {
+        return;
+    }
+
+    next = extent_floor(fs, cluster_index + 1);
+    if (next && next->start == cluster_index + 1) {
+        last = next->last;
+        extent_remove(fs, next);
+    }
+    if (prev && prev->last + 1 == cluster_index) {
+        start = prev->start;
+        extent_remove(fs, prev);
+    }
+    extent_insert(fs, start, last);
+}
+
+/* Forget the index; it is built again from the refcounts when needed */
+void qcow2_free_space_drop(BDRVQcow2State *s)
+{
+    if (s->free_space) {
+        qcow2_free_space_destroy(s->free_space);
+        s->free_space = NULL;
+    }
+}
@@ -29,6 +29,7 @@
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
 #include "qemu/memalign.h"
+#include "block/aio_task.h"
 #include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
@@ -107,6 +108,8 @@ int qcow2_refcount_init(BlockDriverState *bs)
 
     s->get_refcount = get_refcount_funcs[s->refcount_order];
     s->set_refcount = set_refcount_funcs[s->refcount_order];
+    s->lazy_l2_tables = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                              NULL, g_free);
 
     assert(s->refcount_table_size <= INT_MAX / REFTABLE_ENTRY_SIZE);
     refcount_table_size2 = s->refcount_table_size * REFTABLE_ENTRY_SIZE;
@@ -135,7 +138,12 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    qcow2_free_space_drop(s);
     g_free(s->refcount_table);
+    if (s->lazy_l2_tables) {
+        g_hash_table_destroy(s->lazy_l2_tables);
+        s->lazy_l2_tables = NULL;
+    }
 }
 
 
@@ -400,6 +408,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             (s->refcount_block_size - 1);
         s->set_refcount(*refcount_block, block_index, 1);
+        qcow2_free_space_set_used(s, new_block >> s->cluster_bits);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -660,6 +669,8 @@ int64_t qcow2_refcount_area(BlockDriverState *bs, uint64_t start_offset,
                 /* The caller guaranteed us this space would be empty */
                 assert(s->get_refcount(refblock_data, j) == 0);
                 s->set_refcount(refblock_data, j, 1);
+                qcow2_free_space_set_used(s, ((uint64_t)i <<
+                                              s->refcount_block_bits) + j);
             }
 
             qcow2_cache_entry_mark_dirty(s->refcount_block_cache,
@@ -886,9 +897,20 @@ static int update_refcount(BlockDriverState *bs,
         }
         s->set_refcount(refcount_block, block_index, refcount);
 
+        if (!decrease && refcount == addend) {
+            qcow2_free_space_set_used(s, cluster_index);
+        }
+
         if (refcount == 0) {
             void *table;
 
+            qcow2_free_space_set_free(s, cluster_index);
+            if (s->decompress_cache) {
+                qcow2_decompress_cache_invalidate(s->decompress_cache,
+                                                  cluster_offset,
+                                                  s->cluster_size);
+            }
+
             table = qcow2_cache_is_table_offset(s->refcount_block_cache,
                                                 offset);
             if (table != NULL) {
@@ -971,6 +993,7 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t i, nb_clusters, refcount;
+    int64_t index;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -979,6 +1002,15 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
     }
 
     nb_clusters = size_to_clusters(s, size);
+
+    index = qcow2_free_space_find(bs, s->free_cluster_index, nb_clusters);
+    if (index >= 0) {
+        s->free_cluster_index = index + nb_clusters;
+        goto found;
+    } else if (index != -ENOTSUP) {
+        return index;
+    }
+
 retry:
     for(i = 0; i < nb_clusters; i++) {
         uint64_t next_cluster_index = s->free_cluster_index++;
@@ -991,6 +1023,8 @@ retry:
         }
     }
 
+found:
+
     /* Make sure that all offsets in the "allocated" range are representable
      * in the requested max */
     if (s->free_cluster_index > 0 &&
@@ -1066,6 +1100,59 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocate up to *@nb_clusters contiguous clusters for guest data from a
+ * reservation, and set *@nb_clusters to the number of clusters that were
+ * actually allocated.  Returns the offset of the first cluster, or -errno.
+ *
+ * The reservation is refilled with at least QCOW2_ALLOC_RESERVE_CLUSTERS
+ * clusters at a time, with a single refcount update.  This keeps the
+ * refcount blocks out of the way of most allocating writes when many of
+ * them are in flight, and keeps the clusters of parallel sequential
+ * writers close together.  Reserved clusters that have not been used
+ * must be returned with qcow2_release_reserved_clusters(); they are only
+ * leaked if QEMU does not get to do that.
+ */
+int64_t qcow2_alloc_reserved_clusters(BlockDriverState *bs,
+                                      uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+
+    assert(*nb_clusters > 0);
+
+    if (s->nb_reserved == 0) {
+        uint64_t count = MAX(*nb_clusters, QCOW2_ALLOC_RESERVE_CLUSTERS);
+
+        offset = qcow2_alloc_clusters(bs, count << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        s->reserved_offset = offset;
+        s->nb_reserved = count;
+    }
+
+    *nb_clusters = MIN(*nb_clusters, s->nb_reserved);
+    offset = s->reserved_offset;
+    s->reserved_offset += *nb_clusters << s->cluster_bits;
+    s->nb_reserved -= *nb_clusters;
+
+    return offset;
+}
+
+/* Free the clusters that were reserved but not used */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->nb_reserved) {
+        qcow2_free_clusters(bs, s->reserved_offset,
+                            s->nb_reserved << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        s->nb_reserved = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1241,25 +1328,253 @@ int coroutine_fn qcow2_flush_caches(BlockDriverState *bs)
 
 
 
-/* update the refcounts of snapshots and the copied flag */
+/*
+ * A refcount update of @addend that is pending for all data clusters of the
+ * L2 table at @l2_offset.
+ *
+ * A pending decrement leaves the refcounts too high, which can only leak
+ * clusters.  A pending increment leaves them too low: once the L2 table is
+ * modified or freed, a data cluster whose refcount has dropped to 0 would be
+ * freed while the snapshot still uses it.  Pending updates are therefore
+ * applied by qcow2_lazy_refcount_fixup() before that can happen.
+ */
+typedef struct Qcow2LazyL2Table {
+    uint64_t l2_offset;
+    int addend;
+} Qcow2LazyL2Table;
+
+/*
+ * Add @addend to the refcounts of all data clusters referenced by the L2
+ * table at @l2_offset and update their QCOW_OFLAG_COPIED flags
+ */
+static int update_l2_table_refcount(BlockDriverState *bs, uint64_t l2_offset,
+                                    int addend)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice, entry, refcount;
+    int64_t old_entry;
+    unsigned slice, slice_size2, n_slices;
+    int j, ret;
+
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
+
+    for (slice = 0; slice < n_slices; slice++) {
+        ret = qcow2_cache_get(bs, s->l2_table_cache,
+                              l2_offset + slice * slice_size2,
+                              (void **) &l2_slice);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (j = 0; j < s->l2_slice_size; j++) {
+            uint64_t cluster_index;
+            uint64_t offset;
+
+            entry = get_l2_entry(s, l2_slice, j);
+            old_entry = entry;
+            entry &= ~QCOW_OFLAG_COPIED;
+            offset = entry & L2E_OFFSET_MASK;
+
+            switch (qcow2_get_cluster_type(bs, entry)) {
+            case QCOW2_CLUSTER_COMPRESSED:
+                if (addend != 0) {
+                    uint64_t coffset;
+                    int csize;
+
+                    qcow2_parse_compressed_l2_entry(bs, entry,
+                                                    &coffset, &csize);
+                    ret = update_refcount(
+                        bs, coffset, csize,
+                        abs(addend), addend < 0,
+                        QCOW2_DISCARD_SNAPSHOT);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
+                /* compressed clusters are never modified */
+                refcount = 2;
+                break;
+
+            case QCOW2_CLUSTER_NORMAL:
+            case QCOW2_CLUSTER_ZERO_ALLOC:
+                if (offset_into_cluster(s, offset)) {
+                    /* Here l2_index means table (not slice) index */
+                    int l2_index = slice * s->l2_slice_size + j;
+                    qcow2_signal_corruption(
+                        bs, true, -1, -1, "Cluster "
+                        "allocation offset %#" PRIx64
+                        " unaligned (L2 offset: %#"
+                        PRIx64 ", L2 index: %#x)",
+                        offset, l2_offset, l2_index);
+                    ret = -EIO;
+                    goto fail;
+                }
+
+                cluster_index = offset >> s->cluster_bits;
+                assert(cluster_index);
+                if (addend != 0) {
+                    ret = qcow2_update_cluster_refcount(
+                        bs, cluster_index, abs(addend), addend < 0,
+                        QCOW2_DISCARD_SNAPSHOT);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
+
+                ret = qcow2_get_refcount(bs, cluster_index, &refcount);
+                if (ret < 0) {
+                    goto fail;
+                }
+                break;
+
+            case QCOW2_CLUSTER_ZERO_PLAIN:
+            case QCOW2_CLUSTER_UNALLOCATED:
+                refcount = 0;
+                break;
+
+            default:
+                abort();
+            }
+
+            if (refcount == 1) {
+                entry |= QCOW_OFLAG_COPIED;
+            }
+            if (entry != old_entry) {
+                if (addend > 0) {
+                    qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                               s->refcount_block_cache);
+                }
+                set_l2_entry(s, l2_slice, j, entry);
+                qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+            }
+        }
+
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+
+    return 0;
+
+fail:
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
+/*
+ * Apply the refcount update that a lazy snapshot operation left pending for
+ * the data clusters of the L2 table at @l2_offset, if there is one.
+ *
+ * This must happen before the L2 table is modified or freed.  If it fails,
+ * the update stays pending only if it increases refcounts: retrying it can
+ * then only leak clusters, but never free clusters that are still in use.
+ */
+int qcow2_lazy_refcount_fixup(BlockDriverState *bs, uint64_t l2_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2LazyL2Table *t;
+    int ret;
+
+    if (!g_hash_table_size(s->lazy_l2_tables)) {
+        return 0;
+    }
+
+    t = g_hash_table_lookup(s->lazy_l2_tables, &l2_offset);
+    if (!t) {
+        return 0;
+    }
+    g_hash_table_steal(s->lazy_l2_tables, &t->l2_offset);
+
+    trace_qcow2_lazy_refcount_fixup(bs, l2_offset, t->addend);
+
+    ret = update_l2_table_refcount(bs, l2_offset, t->addend);
+    if (ret < 0 && t->addend > 0) {
+        g_hash_table_insert(s->lazy_l2_tables, &t->l2_offset, t);
+    } else {
+        g_free(t);
+    }
+
+    return ret;
+}
+
+/*
+ * Apply the pending refcount updates of up to @max_tables L2 tables, or of
+ * all of them if @max_tables is 0.
+ *
+ * Returns the number of L2 tables that still have updates pending, or
+ * -errno on failure.
+ */
+int qcow2_lazy_refcount_process(BlockDriverState *bs, unsigned max_tables)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned n = 0;
+    int ret;
+
+    while (g_hash_table_size(s->lazy_l2_tables) &&
+           (max_tables == 0 || n < max_tables))
+    {
+        GHashTableIter iter;
+        Qcow2LazyL2Table *t;
+
+        g_hash_table_iter_init(&iter, s->lazy_l2_tables);
+        g_hash_table_iter_next(&iter, NULL, (void **) &t);
+
+        ret = qcow2_lazy_refcount_fixup(bs, t->l2_offset);
+        if (ret < 0) {
+            return ret;
+        }
+        n++;
+    }
+
+    return g_hash_table_size(s->lazy_l2_tables);
+}
+
+static void lazy_refcount_add(BDRVQcow2State *s, uint64_t l2_offset,
+                              int addend)
+{
+    Qcow2LazyL2Table *t = g_hash_table_lookup(s->lazy_l2_tables, &l2_offset);
+
+    if (!t) {
+        t = g_new0(Qcow2LazyL2Table, 1);
+        t->l2_offset = l2_offset;
+        g_hash_table_insert(s->lazy_l2_tables, &t->l2_offset, t);
+    }
+    t->addend += addend;
+}
+
+/*
+ * Update the refcounts of snapshots and the copied flag.
+ *
+ * If @lazy is true, only the refcounts of the L2 tables and the copied flags
+ * in the L1 table are updated right away, which takes time proportional to
+ * the L1 table size rather than to the image size.  The update for the data
+ * clusters of each L2 table is recorded and applied later, by
+ * qcow2_lazy_refcount_fixup() when the L2 table is written to, or in the
+ * background.  Until then the refcounts on disk are inconsistent, which is
+ * only allowed with lazy refcounts: the image is marked dirty, so that they
+ * are rebuilt on the next open if QEMU does not get to finish the update.
+ */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
-    int64_t l1_table_offset, int l1_size, int addend)
+    int64_t l1_table_offset, int l1_size, int addend, bool lazy)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table, *l2_slice, l2_offset, entry, l1_size2, refcount;
+    uint64_t *l1_table, l2_offset, l1_size2, refcount = 0;
     bool l1_allocated = false;
-    int64_t old_entry, old_l2_offset;
-    unsigned slice, slice_size2, n_slices;
-    int i, j, l1_modified = 0;
+    int64_t old_l2_offset;
+    int i, l1_modified = 0;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
+    assert(!lazy || s->use_lazy_refcounts);
+
+    if (lazy) {
+        ret = qcow2_mark_dirty(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
 
-    l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * L1E_SIZE;
-    slice_size2 = s->l2_slice_size * l2_entry_size(s);
-    n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
 
@@ -1302,99 +1617,29 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            for (slice = 0; slice < n_slices; slice++) {
-                ret = qcow2_cache_get(bs, s->l2_table_cache,
-                                      l2_offset + slice * slice_size2,
-                                      (void **) &l2_slice);
+            if (lazy && addend < 0) {
+                ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
+                                         &refcount);
                 if (ret < 0) {
                     goto fail;
                 }
+            }
 
-                for (j = 0; j < s->l2_slice_size; j++) {
-                    uint64_t cluster_index;
-                    uint64_t offset;
-
-                    entry = get_l2_entry(s, l2_slice, j);
-                    old_entry = entry;
-                    entry &= ~QCOW_OFLAG_COPIED;
-                    offset = entry & L2E_OFFSET_MASK;
-
-                    switch (qcow2_get_cluster_type(bs, entry)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        if (addend != 0) {
-                            uint64_t coffset;
-                            int csize;
-
-                            qcow2_parse_compressed_l2_entry(bs, entry,
-                                                            &coffset, &csize);
-                            ret = update_refcount(
-                                bs, coffset, csize,
-                                abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO_ALLOC:
-                        if (offset_into_cluster(s, offset)) {
-                            /* Here l2_index means table (not slice) index */
-                            int l2_index = slice * s->l2_slice_size + j;
-                            qcow2_signal_corruption(
-                                bs, true, -1, -1, "Cluster "
-                                "allocation offset %#" PRIx64
-                                " unaligned (L2 offset: %#"
-                                PRIx64 ", L2 index: %#x)",
-                                offset, l2_offset, l2_index);
-                            ret = -EIO;
-                            goto fail;
-                        }
-
-                        cluster_index = offset >> s->cluster_bits;
-                        assert(cluster_index);
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(
-                                bs, cluster_index, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
-
-                    case QCOW2_CLUSTER_ZERO_PLAIN:
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
-
-                    default:
-                        abort();
-                    }
-
-                    if (refcount == 1) {
-                        entry |= QCOW_OFLAG_COPIED;
-                    }
-                    if (entry != old_entry) {
-                        if (addend > 0) {
-                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                                       s->refcount_block_cache);
-                        }
-                        set_l2_entry(s, l2_slice, j, entry);
-                        qcow2_cache_entry_mark_dirty(s->l2_table_cache,
-                                                     l2_slice);
-                    }
+            /*
+             * An L2 table that is freed must release its data clusters right
+             * away, so only defer the update while it is still referenced.
+             */
+            if (lazy && (addend >= 0 || refcount > 1)) {
+                lazy_refcount_add(s, l2_offset, addend);
+            } else {
+                ret = qcow2_lazy_refcount_fixup(bs, l2_offset);
+                if (ret < 0) {
+                    goto fail;
+                }
+                ret = update_l2_table_refcount(bs, l2_offset, addend);
+                if (ret < 0) {
+                    goto fail;
                 }
-
-                qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
             }
 
             if (addend != 0) {
@@ -1422,13 +1667,13 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_slice) {
-        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
-    }
-
     s->cache_discards = false;
     qcow2_process_discards(bs, ret);
 
+    if (lazy && g_hash_table_size(s->lazy_l2_tables)) {
+        qcow2_lazy_refcount_schedule(bs);
+    }
+
     /* Update L1 only if it isn't deleted anyway (addend = -1) */
     if (ret == 0 && addend >= 0 && l1_modified) {
         for (i = 0; i < l1_size; i++) {
@@ -1590,6 +1835,35 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/*
+ * L2 tables are read ahead in batches of up to this many bytes, with up to
+ * QCOW2_MAX_WORKERS reads in flight
+ */
+#define CHECK_L2_BATCH_BYTES (8 * MiB)
+
+/*
+ * Progress of qcow2_check_refcounts(): one unit of work per L1 table entry
+ * and per refcount block compared
+ */
+typedef struct Qcow2CheckProgress {
+    BlockDriverState *bs;
+    BlockDriverCheckStatusCB *status_cb;
+    void *cb_opaque;
+    int64_t done;
+    int64_t total;
+} Qcow2CheckProgress;
+
+static void check_progress(Qcow2CheckProgress *progress, int64_t work)
+{
+    if (!progress || !progress->status_cb) {
+        return;
+    }
+
+    progress->done = MIN(progress->done + work, progress->total);
+    progress->status_cb(progress->bs, progress->done, progress->total,
+                        progress->cb_opaque);
+}
+
 /*
  * Fix L2 entry by making it QCOW2_CLUSTER_ZERO_PLAIN (or making all its present
  * subclusters QCOW2_SUBCLUSTER_ZERO_PLAIN).
@@ -1652,8 +1926,8 @@ fail:
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table @l2_table, which has been read from @l2_offset.
+ * While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1661,24 +1935,15 @@ fail:
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags, BdrvCheckMode fix, bool active)
+                              uint64_t *l2_table, int flags, BdrvCheckMode fix,
+                              bool active)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, ret;
-    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
-    g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_pread(bs->file, l2_offset, l2_size_bytes, l2_table, 0);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        return ret;
-    }
-
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1849,11 +2114,72 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     return 0;
 }
 
+typedef struct CheckReadL2Task {
+    AioTask task;
+
+    BlockDriverState *bs;
+    int64_t l2_offset;
+    size_t bytes;
+    void *buf;
+    int *ret;
+} CheckReadL2Task;
+
+static coroutine_fn int check_read_l2_task_entry(AioTask *task)
+{
+    CheckReadL2Task *t = container_of(task, CheckReadL2Task, task);
+
+    *t->ret = bdrv_co_pread(t->bs->file, t->l2_offset, t->bytes, t->buf, 0);
+    return 0;
+}
+
+/*
+ * Reads the @n L2 tables at @l2_offsets into consecutive buffers of
+ * @l2_tables and stores the result of each read in @ret.  In coroutine
+ * context, the tables are read concurrently.
+ */
+static void check_read_l2_tables(BlockDriverState *bs, int64_t *l2_offsets,
+                                 uint8_t *l2_tables, int *ret, int n)
+{
+    BDRVQcow2State *s = bs->opaque;
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
+    AioTaskPool *aio;
+    int i;
+
+    if (!qemu_in_coroutine()) {
+        for (i = 0; i < n; i++) {
+            ret[i] = bdrv_pread(bs->file, l2_offsets[i], l2_size_bytes,
+                                l2_tables + i * l2_size_bytes, 0);
+        }
+        return;
+    }
+
+    aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    for (i = 0; i < n; i++) {
+        CheckReadL2Task *t = g_new(CheckReadL2Task, 1);
+
+        *t = (CheckReadL2Task) {
+            .task.func  = check_read_l2_task_entry,
+            .bs         = bs,
+            .l2_offset  = l2_offsets[i],
+            .bytes      = l2_size_bytes,
+            .buf        = l2_tables + i * l2_size_bytes,
+            .ret        = &ret[i],
+        };
+        aio_task_pool_start_task(aio, &t->task);
+    }
+    aio_task_pool_wait_all(aio);
+    aio_task_pool_free(aio);
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * Most of the time of checking a large image goes into reading L2 tables,
+ * so they are read ahead in batches; the checks are still done one L2
+ * table after the other, in L1 order.
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
@@ -1862,13 +2188,19 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               void **refcount_table,
                               int64_t *refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
-                              int flags, BdrvCheckMode fix, bool active)
+                              int flags, BdrvCheckMode fix, bool active,
+                              Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     size_t l1_size_bytes = l1_size * L1E_SIZE;
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
+    int l2_batch = MIN(l1_size, MAX(1, CHECK_L2_BATCH_BYTES / l2_size_bytes));
     g_autofree uint64_t *l1_table = NULL;
+    g_autofree int64_t *l2_offsets = NULL;
+    g_autofree int *l2_ret = NULL;
+    g_autofree uint8_t *l2_tables = NULL;
     uint64_t l2_offset;
-    int i, ret;
+    int i, j, n, start, end, ret;
 
     if (!l1_size) {
         return 0;
@@ -1899,42 +2231,182 @@ static int check_refcounts_l1(BlockDriverState *bs,
         be64_to_cpus(&l1_table[i]);
     }
 
-    /* Do the actual checks */
-    for (i = 0; i < l1_size; i++) {
-        if (!l1_table[i]) {
-            continue;
+    l2_offsets = g_new(int64_t, l2_batch);
+    l2_ret = g_new(int, l2_batch);
+    l2_tables = g_try_malloc(l2_batch * l2_size_bytes);
+    if (l2_tables == NULL) {
+        res->check_errors++;
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < l1_size; i = end) {
+        /* Read ahead the next batch of L2 tables */
+        start = i;
+        n = 0;
+        for (end = i; end < l1_size && n < l2_batch; end++) {
+            if (l1_table[end]) {
+                l2_offsets[n++] = l1_table[end] & L1E_OFFSET_MASK;
+            }
         }
+        check_read_l2_tables(bs, l2_offsets, l2_tables, l2_ret, n);
 
-        if (l1_table[i] & L1E_RESERVED_MASK) {
-            fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
-                    "%" PRIx64 "\n", l1_table[i]);
-            res->corruptions++;
+        /* Do the actual checks */
+        for (j = 0; i < end; i++) {
+            uint64_t *l2_table;
+            int read_ret;
+
+            if (!l1_table[i]) {
+                continue;
+            }
+            l2_table = (uint64_t *)(l2_tables + j * l2_size_bytes);
+            read_ret = l2_ret[j++];
+
+            if (l1_table[i] & L1E_RESERVED_MASK) {
+                fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
+                        "%" PRIx64 "\n", l1_table[i]);
+                res->corruptions++;
+            }
+
+            l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+
+            /* Mark L2 table as used */
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           l2_offset, s->cluster_size);
+            if (ret < 0) {
+                return ret;
+            }
+
+            /* L2 tables are cluster aligned */
+            if (offset_into_cluster(s, l2_offset)) {
+                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                    "cluster aligned; L1 entry corrupted\n", l2_offset);
+                res->corruptions++;
+            }
+
+            if (read_ret < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+                res->check_errors++;
+                return read_ret;
+            }
+
+            /* Process and check L2 entries */
+            ret = check_refcounts_l2(bs, res, refcount_table,
+                                     refcount_table_size, l2_offset, l2_table,
+                                     flags, fix, active);
+            if (ret < 0) {
+                return ret;
+            }
         }
 
-        l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+        check_progress(progress, end - start);
+    }
 
-        /* Mark L2 table as used */
-        ret = qcow2_inc_refcounts_imrt(bs, res,
-                                       refcount_table, refcount_table_size,
-                                       l2_offset, s->cluster_size);
-        if (ret < 0) {
-            return ret;
+    return 0;
+}
+
+/*
+ * Checks the OFLAG_COPIED flag for L1 entry @i and the entries of its L2
+ * table, which has been read into @l2_table with the result @read_ret.
+ */
+static int check_oflag_copied_l2(BlockDriverState *bs, BdrvCheckResult *res,
+                                 int i, uint64_t *l2_table, int read_ret,
+                                 bool repair)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_entry = s->l1_table[i];
+    uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
+    int l2_dirty = 0;
+    uint64_t refcount;
+    int j, ret;
+
+    ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
+                             &refcount);
+    if (ret < 0) {
+        /* don't print message nor increment check_errors */
+        return 0;
+    }
+    if ((refcount == 1) != ((l1_entry & QCOW_OFLAG_COPIED) != 0)) {
+        res->corruptions++;
+        fprintf(stderr, "%s OFLAG_COPIED L2 cluster: l1_index=%d "
+                "l1_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
+                repair ? "Repairing" : "ERROR", i, l1_entry, refcount);
+        if (repair) {
+            s->l1_table[i] = refcount == 1
+                           ? l1_entry |  QCOW_OFLAG_COPIED
+                           : l1_entry & ~QCOW_OFLAG_COPIED;
+            ret = qcow2_write_l1_entry(bs, i);
+            if (ret < 0) {
+                res->check_errors++;
+                return ret;
+            }
+            res->corruptions--;
+            res->corruptions_fixed++;
         }
+    }
 
-        /* L2 tables are cluster aligned */
-        if (offset_into_cluster(s, l2_offset)) {
-            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                "cluster aligned; L1 entry corrupted\n", l2_offset);
-            res->corruptions++;
+    if (read_ret < 0) {
+        fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
+                strerror(-read_ret));
+        res->check_errors++;
+        return read_ret;
+    }
+
+    for (j = 0; j < s->l2_size; j++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, j);
+        uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
+        QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
+
+        if (cluster_type == QCOW2_CLUSTER_NORMAL ||
+            cluster_type == QCOW2_CLUSTER_ZERO_ALLOC) {
+            if (has_data_file(bs)) {
+                refcount = 1;
+            } else {
+                ret = qcow2_get_refcount(bs,
+                                         data_offset >> s->cluster_bits,
+                                         &refcount);
+                if (ret < 0) {
+                    /* don't print message nor increment check_errors */
+                    continue;
+                }
+            }
+            if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
+                res->corruptions++;
+                fprintf(stderr, "%s OFLAG_COPIED data cluster: "
+                        "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
+                        repair ? "Repairing" : "ERROR", l2_entry, refcount);
+                if (repair) {
+                    set_l2_entry(s, l2_table, j,
+                                 refcount == 1 ?
+                                 l2_entry |  QCOW_OFLAG_COPIED :
+                                 l2_entry & ~QCOW_OFLAG_COPIED);
+                    l2_dirty++;
+                }
+            }
         }
+    }
 
-        /* Process and check L2 entries */
-        ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
+    if (l2_dirty > 0) {
+        ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
+                                            l2_offset, s->cluster_size,
+                                            false);
         if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not write L2 table; metadata "
+                    "overlap check failed: %s\n", strerror(-ret));
+            res->check_errors++;
             return ret;
         }
+
+        ret = bdrv_pwrite(bs->file, l2_offset, s->cluster_size, l2_table,
+                          0);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not write L2 table: %s\n",
+                    strerror(-ret));
+            res->check_errors++;
+            return ret;
+        }
+        res->corruptions -= l2_dirty;
+        res->corruptions_fixed += l2_dirty;
     }
 
     return 0;
@@ -1949,13 +2421,17 @@ static int check_refcounts_l1(BlockDriverState *bs,
  * (qcow2_check_refcounts) by the time this function is called).
  */
 static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
-                              BdrvCheckMode fix)
+                              BdrvCheckMode fix, Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
+    int l2_batch = MIN(s->l1_size,
+                       MAX(1, CHECK_L2_BATCH_BYTES / l2_size_bytes));
+    g_autofree int64_t *l2_offsets = NULL;
+    g_autofree int *l2_ret = NULL;
+    uint8_t *l2_tables;
     int ret;
-    uint64_t refcount;
-    int i, j;
+    int i, j, n, start, end;
     bool repair;
 
     if (fix & BDRV_FIX_ERRORS) {
@@ -1970,111 +2446,51 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         repair = false;
     }
 
-    for (i = 0; i < s->l1_size; i++) {
-        uint64_t l1_entry = s->l1_table[i];
-        uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
-        int l2_dirty = 0;
-
-        if (!l2_offset) {
-            continue;
-        }
-
-        ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
-                                 &refcount);
-        if (ret < 0) {
-            /* don't print message nor increment check_errors */
-            continue;
-        }
-        if ((refcount == 1) != ((l1_entry & QCOW_OFLAG_COPIED) != 0)) {
-            res->corruptions++;
-            fprintf(stderr, "%s OFLAG_COPIED L2 cluster: l1_index=%d "
-                    "l1_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
-                    repair ? "Repairing" : "ERROR", i, l1_entry, refcount);
-            if (repair) {
-                s->l1_table[i] = refcount == 1
-                               ? l1_entry |  QCOW_OFLAG_COPIED
-                               : l1_entry & ~QCOW_OFLAG_COPIED;
-                ret = qcow2_write_l1_entry(bs, i);
-                if (ret < 0) {
-                    res->check_errors++;
-                    goto fail;
-                }
-                res->corruptions--;
-                res->corruptions_fixed++;
-            }
-        }
-
-        ret = bdrv_pread(bs->file, l2_offset, s->l2_size * l2_entry_size(s),
-                         l2_table, 0);
-        if (ret < 0) {
-            fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
-                    strerror(-ret));
-            res->check_errors++;
-            goto fail;
-        }
+    if (!s->l1_size) {
+        return 0;
+    }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
-            uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
-            QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
+    l2_offsets = g_new(int64_t, l2_batch);
+    l2_ret = g_new(int, l2_batch);
+    l2_tables = qemu_try_blockalign(bs, l2_batch * l2_size_bytes);
+    if (l2_tables == NULL) {
+        res->check_errors++;
+        return -ENOMEM;
+    }
 
-            if (cluster_type == QCOW2_CLUSTER_NORMAL ||
-                cluster_type == QCOW2_CLUSTER_ZERO_ALLOC) {
-                if (has_data_file(bs)) {
-                    refcount = 1;
-                } else {
-                    ret = qcow2_get_refcount(bs,
-                                             data_offset >> s->cluster_bits,
-                                             &refcount);
-                    if (ret < 0) {
-                        /* don't print message nor increment check_errors */
-                        continue;
-                    }
-                }
-                if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
-                    res->corruptions++;
-                    fprintf(stderr, "%s OFLAG_COPIED data cluster: "
-                            "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
-                            repair ? "Repairing" : "ERROR", l2_entry, refcount);
-                    if (repair) {
-                        set_l2_entry(s, l2_table, j,
-                                     refcount == 1 ?
-                                     l2_entry |  QCOW_OFLAG_COPIED :
-                                     l2_entry & ~QCOW_OFLAG_COPIED);
-                        l2_dirty++;
-                    }
-                }
+    for (i = 0; i < s->l1_size; i = end) {
+        /* Read ahead the next batch of L2 tables */
+        start = i;
+        n = 0;
+        for (end = i; end < s->l1_size && n < l2_batch; end++) {
+            if (s->l1_table[end] & L1E_OFFSET_MASK) {
+                l2_offsets[n++] = s->l1_table[end] & L1E_OFFSET_MASK;
             }
         }
+        check_read_l2_tables(bs, l2_offsets, l2_tables, l2_ret, n);
 
-        if (l2_dirty > 0) {
-            ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                                                l2_offset, s->cluster_size,
-                                                false);
-            if (ret < 0) {
-                fprintf(stderr, "ERROR: Could not write L2 table; metadata "
-                        "overlap check failed: %s\n", strerror(-ret));
-                res->check_errors++;
-                goto fail;
+        for (j = 0; i < end; i++) {
+            if (!(s->l1_table[i] & L1E_OFFSET_MASK)) {
+                continue;
             }
 
-            ret = bdrv_pwrite(bs->file, l2_offset, s->cluster_size, l2_table,
-                              0);
+            ret = check_oflag_copied_l2(bs, res, i,
+                                        (uint64_t *)(l2_tables +
+                                                     j * l2_size_bytes),
+                                        l2_ret[j], repair);
             if (ret < 0) {
-                fprintf(stderr, "ERROR: Could not write L2 table: %s\n",
-                        strerror(-ret));
-                res->check_errors++;
                 goto fail;
             }
-            res->corruptions -= l2_dirty;
-            res->corruptions_fixed += l2_dirty;
+            j++;
         }
+
+        check_progress(progress, end - start);
     }
 
     ret = 0;
 
 fail:
-    qemu_vfree(l2_table);
+    qemu_vfree(l2_tables);
     return ret;
 }
 
@@ -2198,7 +2614,8 @@ resize_fail:
  */
 static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                BdrvCheckMode fix, bool *rebuild,
-                               void **refcount_table, int64_t *nb_clusters)
+                               void **refcount_table, int64_t *nb_clusters,
+                               Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     int64_t i;
@@ -2225,7 +2642,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                              s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
-                             fix, true);
+                             fix, true, progress);
     if (ret < 0) {
         return ret;
     }
@@ -2255,7 +2672,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                                  sn->l1_table_offset, sn->l1_size, 0, fix,
-                                 false);
+                                 false, progress);
         if (ret < 0) {
             return ret;
         }
@@ -2301,7 +2718,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                               BdrvCheckMode fix, bool *rebuild,
                               int64_t *highest_cluster,
-                              void *refcount_table, int64_t nb_clusters)
+                              void *refcount_table, int64_t nb_clusters,
+                              Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     int64_t i;
@@ -2309,6 +2727,10 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     int ret;
 
     for (i = 0, *highest_cluster = 0; i < nb_clusters; i++) {
+        if (i % s->refcount_block_size == 0) {
+            check_progress(progress, 1);
+        }
+
         ret = qcow2_get_refcount(bs, i, &refcount1);
         if (ret < 0) {
             fprintf(stderr, "Can't get refcount for cluster %" PRId64 ": %s\n",
@@ -2621,6 +3043,7 @@ static int rebuild_refcount_structure(BlockDriverState *bs,
     } QEMU_PACKED reftable_offset_and_clusters;
 
     qcow2_cache_empty(bs, s->refcount_block_cache);
+    qcow2_free_space_drop(s);
 
     /*
      * For each refblock containing entries, we try to allocate a
@@ -2771,20 +3194,34 @@ fail:
 }
 
 /*
- * Checks an image for refcount consistency.
+ * Checks an image for refcount consistency.  Progress is reported through
+ * @status_cb if it is not NULL.
  *
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
-                          BdrvCheckMode fix)
+                          BdrvCheckMode fix,
+                          BlockDriverCheckStatusCB *status_cb,
+                          void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult pre_compare_res;
     int64_t size, highest_cluster, nb_clusters;
     void *refcount_table = NULL;
     bool rebuild = false;
-    int ret;
+    Qcow2CheckProgress progress = {
+        .bs         = bs,
+        .status_cb  = status_cb,
+        .cb_opaque  = cb_opaque,
+    };
+    int i, ret;
+
+    /* Repairs change refcounts behind the back of the free space index */
+    qcow2_free_space_drop(s);
+    if (fix && s->decompress_cache) {
+        qcow2_decompress_cache_invalidate(s->decompress_cache, 0, UINT64_MAX);
+    }
 
     size = bdrv_getlength(bs->file->bs);
     if (size < 0) {
@@ -2801,8 +3238,19 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     res->bfi.total_clusters =
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
+    /*
+     * The L1 tables are walked twice for the active layer (references and
+     * OFLAG_COPIED) and once for every snapshot
+     */
+    progress.total = 2 * s->l1_size +
+                     DIV_ROUND_UP(nb_clusters, s->refcount_block_size);
+    for (i = 0; i < s->nb_snapshots; i++) {
+        progress.total += s->snapshots[i].l1_size;
+    }
+    check_progress(&progress, 0);
+
     ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
-                              &nb_clusters);
+                              &nb_clusters, &progress);
     if (ret < 0) {
         goto fail;
     }
@@ -2812,7 +3260,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
      * result should be ignored */
     pre_compare_res = *res;
     compare_refcounts(bs, res, 0, &rebuild, &highest_cluster, refcount_table,
-                      nb_clusters);
+                      nb_clusters, &progress);
 
     if (rebuild && (fix & BDRV_FIX_ERRORS)) {
         BdrvCheckResult old_res = *res;
@@ -2835,7 +3283,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         rebuild = false;
         memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
         ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
-                                  &nb_clusters);
+                                  &nb_clusters, NULL);
         if (ret < 0) {
             goto fail;
         }
@@ -2848,7 +3296,8 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             *res = (BdrvCheckResult){ 0 };
 
             compare_refcounts(bs, res, BDRV_FIX_LEAKS, &rebuild,
-                              &highest_cluster, refcount_table, nb_clusters);
+                              &highest_cluster, refcount_table, nb_clusters,
+                              NULL);
             if (rebuild) {
                 fprintf(stderr, "ERROR rebuilt refcount structure is still "
                         "broken\n");
@@ -2879,20 +3328,22 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         if (res->leaks || res->corruptions) {
             *res = pre_compare_res;
             compare_refcounts(bs, res, fix, &rebuild, &highest_cluster,
-                              refcount_table, nb_clusters);
+                              refcount_table, nb_clusters, NULL);
         }
     }
 
     /* check OFLAG_COPIED */
-    ret = check_oflag_copied(bs, res, fix);
+    ret = check_oflag_copied(bs, res, fix, &progress);
     if (ret < 0) {
         goto fail;
     }
 
     res->image_end_offset = (highest_cluster + 1) * s->cluster_size;
+    check_progress(&progress, progress.total);
     ret = 0;
 
 fail:
+    qcow2_free_space_drop(s);
     g_free(refcount_table);
 
     return ret;
@@ -3508,6 +3959,7 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
 
     s->get_refcount = new_get_refcount;
     s->set_refcount = new_set_refcount;
+    qcow2_free_space_drop(s);
 
     /* For cleaning up all old refblocks and the old reftable below the "done"
      * label */
@@ -3596,6 +4048,7 @@ static int qcow2_discard_refcount_block(BlockDriverState *bs,
         return -EINVAL;
     }
     s->set_refcount(refblock, block_index, 0);
+    qcow2_free_space_set_free(s, cluster_index);
 
     qcow2_cache_entry_mark_dirty(s->refcount_block_cache, refblock);
 
@@ -3678,6 +4131,7 @@ int qcow2_shrink_reftable(BlockDriverState *bs)
     if (!s->cache_discards) {
         qcow2_process_discards(bs, ret);
     }
+    qcow2_free_space_drop(s);
 
 out:
     g_free(reftable_tmp);
@@ -708,7 +708,8 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
      * stable on disk before updating the snapshot table to contain a pointer
      * to the new L1 table.
      */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1);
+    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size,
+                                         1, s->use_lazy_refcounts);
     if (ret < 0) {
         goto fail;
     }
@@ -742,7 +743,7 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 #ifdef DEBUG_ALLOC
     {
       BdrvCheckResult result = {0};
-      qcow2_check_refcounts(bs, &result, 0);
+      qcow2_check_refcounts(bs, &result, 0, NULL, NULL);
     }
 #endif
     return 0;
@@ -837,7 +838,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     }
 
     ret = qcow2_update_snapshot_refcount(bs, sn->l1_table_offset,
-                                         sn->l1_size, 1);
+                                         sn->l1_size, 1, false);
     if (ret < 0) {
         goto fail;
     }
@@ -866,7 +867,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
      * which is why this works.
      */
     ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset,
-                                         s->l1_size, -1);
+                                         s->l1_size, -1, false);
 
     /*
      * Now update the in-memory L1 table to be in sync with the on-disk one. We
@@ -887,7 +888,8 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
      * Update QCOW_OFLAG_COPIED in the active L1 table (it may have changed
      * when we decreased the refcount of the old snapshot.
      */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 0);
+    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size,
+                                         0, false);
     if (ret < 0) {
         goto fail;
     }
@@ -895,7 +897,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result, 0);
+        qcow2_check_refcounts(bs, &result, 0, NULL, NULL);
     }
 #endif
     return 0;
@@ -958,7 +960,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
      * free the L1 table.
      */
     ret = qcow2_update_snapshot_refcount(bs, sn.l1_table_offset,
-                                         sn.l1_size, -1);
+                                         sn.l1_size, -1, s->use_lazy_refcounts);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to free the cluster and L1 table");
         return ret;
@@ -967,7 +969,8 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
                         QCOW2_DISCARD_SNAPSHOT);
 
     /* must update the copied flag on the current cluster offsets */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 0);
+    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size,
+                                         0, s->use_lazy_refcounts);
     if (ret < 0) {
         error_setg_errno(errp, -ret,
                          "Failed to update snapshot status in disk");
@@ -977,7 +980,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result, 0);
+        qcow2_check_refcounts(bs, &result, 0, NULL, NULL);
     }
 #endif
     return 0;
@@ -34,6 +34,7 @@
 #endif
 
 #include "qcow2.h"
+#include "block/aio_task.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
 
@@ -446,6 +447,18 @@ typedef struct Qcow2EncDecData {
     Qcow2EncDecFunc func;
 } Qcow2EncDecData;
 
+/*
+ * Requests of at least twice this size are split into chunks that are
+ * encrypted or decrypted in parallel, in up to QCOW2_MAX_THREADS threads.
+ */
+#define QCOW2_ENCDEC_MIN_CHUNK (64 * KiB)
+
+typedef struct Qcow2EncDecTask {
+    AioTask task;
+    BlockDriverState *bs;
+    Qcow2EncDecData arg;
+} Qcow2EncDecTask;
+
 static int qcow2_encdec_pool_func(void *opaque)
 {
     Qcow2EncDecData *data = opaque;
@@ -453,6 +466,13 @@ static int qcow2_encdec_pool_func(void *opaque)
     return data->func(data->block, data->offset, data->buf, data->len, NULL);
 }
 
+static coroutine_fn int qcow2_encdec_task_entry(AioTask *task)
+{
+    Qcow2EncDecTask *t = container_of(task, Qcow2EncDecTask, task);
+
+    return qcow2_co_process(t->bs, qcow2_encdec_pool_func, &t->arg);
+}
+
 static int coroutine_fn
 qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
                 uint64_t guest_offset, void *buf, size_t len,
@@ -467,6 +487,9 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
         .func = func,
     };
     uint64_t sector_size;
+    size_t nb_chunks, chunk_size, done;
+    AioTaskPool *pool;
+    int ret;
 
     assert(s->crypto);
 
@@ -475,7 +498,41 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
     assert(QEMU_IS_ALIGNED(host_offset, sector_size));
     assert(QEMU_IS_ALIGNED(len, sector_size));
 
-    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    if (len == 0) {
+        return 0;
+    }
+
+    nb_chunks = MIN(len / QCOW2_ENCDEC_MIN_CHUNK, QCOW2_MAX_THREADS);
+    if (nb_chunks <= 1) {
+        return qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    }
+
+    /* Each sector is encrypted independently, so we can split anywhere */
+    chunk_size = QEMU_ALIGN_UP(DIV_ROUND_UP(len, nb_chunks), sector_size);
+    pool = aio_task_pool_new(nb_chunks);
+
+    for (done = 0; done < len && aio_task_pool_status(pool) == 0;
+         done += chunk_size)
+    {
+        Qcow2EncDecTask *task = g_new(Qcow2EncDecTask, 1);
+
+        *task = (Qcow2EncDecTask) {
+            .task.func = qcow2_encdec_task_entry,
+            .bs = bs,
+            .arg = arg,
+        };
+        task->arg.offset += done;
+        task->arg.buf += done;
+        task->arg.len = MIN(chunk_size, len - done);
+
+        aio_task_pool_start_task(pool, &task->task);
+    }
+
+    aio_task_pool_wait_all(pool);
+    ret = aio_task_pool_status(pool);
+    aio_task_pool_free(pool);
+
+    return ret;
 }
 
 /*
@@ -43,6 +43,7 @@
 #include "qapi/qapi-visit-block-core.h"
 #include "crypto.h"
 #include "block/aio_task.h"
+#include "block/request-trace.h"
 
 /*
   Differences with QCOW:
@@ -76,6 +77,7 @@ typedef struct {
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t l2_entry,
+                           uint64_t dcache_generation,
                            uint64_t offset,
                            uint64_t bytes,
                            QEMUIOVector *qiov,
@@ -540,6 +542,12 @@ static int qcow2_mark_clean(BlockDriverState *bs)
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         int ret;
 
+        /* Refcounts aren't consistent before lazy updates are complete */
+        ret = qcow2_lazy_refcount_process(bs, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
         s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
 
         ret = qcow2_flush_caches(bs);
@@ -599,9 +607,10 @@ static void qcow2_add_check_result(BdrvCheckResult *out,
     }
 }
 
-static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
-                                              BdrvCheckResult *result,
-                                              BdrvCheckMode fix)
+static int coroutine_fn
+qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
+                      BdrvCheckMode fix, BlockDriverCheckStatusCB *status_cb,
+                      void *cb_opaque)
 {
     BdrvCheckResult snapshot_res = {};
     BdrvCheckResult refcount_res = {};
@@ -609,13 +618,19 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
     memset(result, 0, sizeof(*result));
 
+    /* Lazy snapshot refcount updates would look like corruption */
+    ret = qcow2_lazy_refcount_process(bs, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
         return ret;
     }
 
-    ret = qcow2_check_refcounts(bs, &refcount_res, fix);
+    ret = qcow2_check_refcounts(bs, &refcount_res, fix, status_cb, cb_opaque);
     qcow2_add_check_result(result, &refcount_res, true);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -640,13 +655,15 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
 static int coroutine_fn qcow2_co_check(BlockDriverState *bs,
                                        BdrvCheckResult *result,
-                                       BdrvCheckMode fix)
+                                       BdrvCheckMode fix,
+                                       BlockDriverCheckStatusCB *status_cb,
+                                       void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_co_check_locked(bs, result, fix);
+    ret = qcow2_co_check_locked(bs, result, fix, status_cb, cb_opaque);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -695,6 +712,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_DECOMPRESS_CACHE_SIZE,
     NULL
 };
 
@@ -806,6 +824,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_DECOMPRESS_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cache of decompressed clusters",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -856,15 +879,86 @@ static void cache_clean_timer_del(BlockDriverState *bs)
     }
 }
 
+/*
+ * Lazy snapshot refcount updates are applied in small batches in the
+ * background, so that they don't hold s->lock for long at a time
+ */
+#define LAZY_REFCOUNT_INTERVAL_MS   10
+#define LAZY_REFCOUNT_BATCH         16
+
+static void coroutine_fn lazy_refcount_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_lazy_refcount_process(bs, LAZY_REFCOUNT_BATCH);
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* On error, leave the rest to the next write or to qcow2_mark_clean() */
+    if (ret > 0) {
+        qcow2_lazy_refcount_schedule(bs);
+    }
+    bdrv_dec_in_flight(bs);
+}
+
+static void lazy_refcount_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    Coroutine *co;
+
+    /* Don't get in the way of whoever drained the node, e.g. snapshot code */
+    if (qatomic_read(&bs->quiesce_counter)) {
+        qcow2_lazy_refcount_schedule(bs);
+        return;
+    }
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(lazy_refcount_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+void qcow2_lazy_refcount_schedule(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->lazy_refcount_timer) {
+        s->lazy_refcount_timer = aio_timer_new(bdrv_get_aio_context(bs),
+                                               QEMU_CLOCK_REALTIME, SCALE_MS,
+                                               lazy_refcount_timer_cb, bs);
+    }
+    if (!timer_pending(s->lazy_refcount_timer)) {
+        timer_mod(s->lazy_refcount_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  LAZY_REFCOUNT_INTERVAL_MS);
+    }
+}
+
+static void lazy_refcount_timer_del(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->lazy_refcount_timer) {
+        timer_free(s->lazy_refcount_timer);
+        s->lazy_refcount_timer = NULL;
+    }
+}
+
 static void qcow2_detach_aio_context(BlockDriverState *bs)
 {
     cache_clean_timer_del(bs);
+    lazy_refcount_timer_del(bs);
 }
 
 static void qcow2_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
+    BDRVQcow2State *s = bs->opaque;
+
     cache_clean_timer_init(bs, new_context);
+    if (s->lazy_l2_tables && g_hash_table_size(s->lazy_l2_tables)) {
+        qcow2_lazy_refcount_schedule(bs);
+    }
 }
 
 static bool read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
@@ -967,6 +1061,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t decompress_cache_size;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1068,6 +1163,14 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->decompress_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_DECOMPRESS_CACHE_SIZE, 0);
+    if (r->decompress_cache_size > INT64_MAX) {
+        error_setg(errp, "Decompressed cluster cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1223,6 +1326,20 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    if (s->decompress_cache_size != r->decompress_cache_size) {
+        if (s->decompress_cache) {
+            qcow2_decompress_cache_detach(s->decompress_cache,
+                                          s->decompress_cache_size);
+            s->decompress_cache = NULL;
+        }
+        s->decompress_cache_size = r->decompress_cache_size;
+        if (s->decompress_cache_size) {
+            s->decompress_cache =
+                qcow2_decompress_cache_attach(bs->file->bs, s->cluster_size,
+                                              s->decompress_cache_size);
+        }
+    }
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1817,7 +1934,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         BdrvCheckResult result = {0};
 
         ret = qcow2_co_check_locked(bs, &result,
-                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS,
+                                    NULL, NULL);
         if (ret < 0 || result.check_errors) {
             if (ret >= 0) {
                 ret = -EIO;
@@ -1830,7 +1948,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result, 0);
+        qcow2_check_refcounts(bs, &result, 0, NULL, NULL);
     }
 #endif
 
@@ -1858,6 +1976,11 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    if (s->decompress_cache) {
+        qcow2_decompress_cache_detach(s->decompress_cache,
+                                      s->decompress_cache_size);
+        s->decompress_cache = NULL;
+    }
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -1944,6 +2067,8 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_release_reserved_clusters(state->bs);
+
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
         if (ret < 0) {
             goto fail;
@@ -2209,6 +2334,7 @@ typedef struct Qcow2AioTask {
     BlockDriverState *bs;
     QCow2SubclusterType subcluster_type; /* only for read */
     uint64_t host_offset; /* or l2_entry for compressed read */
+    uint64_t dcache_generation; /* only for compressed read */
     uint64_t offset;
     uint64_t bytes;
     QEMUIOVector *qiov;
@@ -2222,6 +2348,7 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
                                        AioTaskFunc func,
                                        QCow2SubclusterType subcluster_type,
                                        uint64_t host_offset,
+                                       uint64_t dcache_generation,
                                        uint64_t offset,
                                        uint64_t bytes,
                                        QEMUIOVector *qiov,
@@ -2237,6 +2364,7 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
         .subcluster_type = subcluster_type,
         .qiov = qiov,
         .host_offset = host_offset,
+        .dcache_generation = dcache_generation,
         .offset = offset,
         .bytes = bytes,
         .qiov_offset = qiov_offset,
@@ -2260,6 +2388,7 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
 static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
                                              QCow2SubclusterType subc_type,
                                              uint64_t host_offset,
+                                             uint64_t dcache_generation,
                                              uint64_t offset, uint64_t bytes,
                                              QEMUIOVector *qiov,
                                              size_t qiov_offset)
@@ -2281,7 +2410,7 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
                                    qiov, qiov_offset, 0);
 
     case QCOW2_SUBCLUSTER_COMPRESSED:
-        return qcow2_co_preadv_compressed(bs, host_offset,
+        return qcow2_co_preadv_compressed(bs, host_offset, dcache_generation,
                                           offset, bytes, qiov, qiov_offset);
 
     case QCOW2_SUBCLUSTER_NORMAL:
@@ -2308,8 +2437,21 @@ static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task)
     assert(!t->l2meta);
 
     return qcow2_co_preadv_task(t->bs, t->subcluster_type,
-                                t->host_offset, t->offset, t->bytes,
-                                t->qiov, t->qiov_offset);
+                                t->host_offset, t->dcache_generation,
+                                t->offset, t->bytes, t->qiov, t->qiov_offset);
+}
+
+/* Take s->lock for a guest request, recording the wait in the request trace */
+static void coroutine_fn qcow2_co_lock_request(BlockDriverState *bs,
+                                               int64_t offset, int64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    block_trace_record(XDBG_BLOCK_TRACE_EVENT_LOCK_WAIT_START,
+                       bs, offset, bytes);
+    qemu_co_mutex_lock(&s->lock);
+    block_trace_record(XDBG_BLOCK_TRACE_EVENT_LOCK_WAIT_END,
+                       bs, offset, bytes);
 }
 
 static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
@@ -2322,6 +2464,7 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
     int ret = 0;
     unsigned int cur_bytes; /* number of bytes in current iteration */
     uint64_t host_offset = 0;
+    uint64_t dcache_generation = 0;
     QCow2SubclusterType type;
     AioTaskPool *aio = NULL;
 
@@ -2333,9 +2476,22 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
+        qcow2_co_lock_request(bs, offset, cur_bytes);
+        ret = qcow2_co_load_l2_slice(bs, offset);
+        if (ret == 0 || ret == -EAGAIN) {
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+        }
+        if (ret >= 0 && type == QCOW2_SUBCLUSTER_COMPRESSED &&
+            s->decompress_cache) {
+            /*
+             * Clusters are freed under s->lock, so data read from the
+             * compressed cluster can be cached only if the cache has not
+             * been invalidated since the L2 entry was looked up.
+             */
+            dcache_generation =
+                qcow2_decompress_cache_generation(s->decompress_cache);
+        }
         qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto out;
@@ -2352,8 +2508,8 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                 aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
             }
             ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry, type,
-                                 host_offset, offset, cur_bytes,
-                                 qiov, qiov_offset, NULL);
+                                 host_offset, dcache_generation, offset,
+                                 cur_bytes, qiov, qiov_offset, NULL);
             if (ret < 0) {
                 goto out;
             }
@@ -2571,7 +2727,7 @@ static coroutine_fn int qcow2_co_pwritev_task(BlockDriverState *bs,
         }
     }
 
-    qemu_co_mutex_lock(&s->lock);
+    qcow2_co_lock_request(bs, offset, bytes);
 
     ret = qcow2_handle_l2meta(bs, &l2meta, true);
     goto out_locked;
@@ -2626,7 +2782,7 @@ static coroutine_fn int qcow2_co_pwritev_part(
                             - offset_in_cluster);
         }
 
-        qemu_co_mutex_lock(&s->lock);
+        qcow2_co_lock_request(bs, offset, cur_bytes);
 
         ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
                                       &host_offset, &l2meta);
@@ -2646,7 +2802,7 @@ static coroutine_fn int qcow2_co_pwritev_part(
             aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
         }
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_task_entry, 0,
-                             host_offset, offset,
+                             host_offset, 0, offset,
                              cur_bytes, qiov, qiov_offset, l2meta);
         l2meta = NULL; /* l2meta is consumed by qcow2_co_pwritev_task() */
         if (ret < 0) {
@@ -2687,6 +2843,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_release_reserved_clusters(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2728,8 +2886,14 @@ static void qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     }
 
     cache_clean_timer_del(bs);
+    lazy_refcount_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    if (s->decompress_cache) {
+        qcow2_decompress_cache_detach(s->decompress_cache,
+                                      s->decompress_cache_size);
+        s->decompress_cache = NULL;
+    }
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4220,6 +4384,9 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
 
     qemu_co_mutex_lock(&s->lock);
 
+    /* Do not keep unused clusters at the end of the image */
+    qcow2_release_reserved_clusters(bs);
+
     /*
      * Even though we store snapshot size for all images, it was not
      * required until v3, so it is not safe to proceed for v2.
@@ -4691,7 +4858,8 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
+                             0, 0, 0, offset, chunk_size, qiov, qiov_offset,
+                             NULL);
         if (ret < 0) {
             break;
         }
@@ -4711,19 +4879,22 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Read the compressed cluster described by @l2_entry and decompress it
+ * into @out_buf, which must be cluster-sized.  The result is added to
+ * @dcache unless that is NULL; @generation must have been taken from
+ * @dcache under s->lock together with @l2_entry.
+ */
 static int coroutine_fn
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t l2_entry,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset)
+qcow2_co_read_compressed_cluster(BlockDriverState *bs, uint64_t l2_entry,
+                                 uint8_t *out_buf,
+                                 Qcow2DecompressCache *dcache,
+                                 uint64_t generation)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize;
     uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
+    uint8_t *buf;
+    int ret, csize;
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
@@ -4732,8 +4903,6 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         return -ENOMEM;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
     BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
     ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
     if (ret < 0) {
@@ -4745,11 +4914,154 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         goto fail;
     }
 
+    if (dcache) {
+        qcow2_decompress_cache_insert(dcache, coffset, csize, out_buf,
+                                      generation);
+    }
+
+fail:
+    g_free(buf);
+    return ret;
+}
+
+typedef struct Qcow2ReadaheadCo {
+    BlockDriverState *bs;
+    uint64_t l2_entry;
+    uint64_t generation;
+} Qcow2ReadaheadCo;
+
+static void coroutine_fn qcow2_co_readahead_entry(void *opaque)
+{
+    Qcow2ReadaheadCo *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *out_buf = qemu_blockalign(bs, s->cluster_size);
+
+    /* Errors are reported when the cluster is actually read */
+    qcow2_co_read_compressed_cluster(bs, ra->l2_entry, out_buf,
+                                     s->decompress_cache, ra->generation);
+
+    qemu_vfree(out_buf);
+    g_free(ra);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Decompress the compressed clusters up to @end (in guest clusters) that
+ * are not cached yet in the background, starting at s->decompress_ra_end.
+ */
+static void coroutine_fn qcow2_co_readahead(BlockDriverState *bs,
+                                            uint64_t end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_clusters = size_to_clusters(s, bs->total_sectors *
+                                               BDRV_SECTOR_SIZE);
+    uint64_t l2_entries[QCOW2_DECOMPRESS_READAHEAD];
+    uint64_t cluster, generation;
+    int i, n = 0;
+
+    end = MIN(end, nb_clusters);
+
+    qemu_co_mutex_lock(&s->lock);
+    for (cluster = s->decompress_ra_end; cluster < end; cluster++) {
+        QCow2SubclusterType type;
+        unsigned int bytes = s->cluster_size;
+        uint64_t l2_entry, coffset;
+        int csize;
+
+        if (qcow2_get_host_offset(bs, cluster << s->cluster_bits, &bytes,
+                                  &l2_entry, &type) < 0) {
+            break;
+        }
+        if (type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            continue;
+        }
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        if (!qcow2_decompress_cache_contains(s->decompress_cache, coffset)) {
+            assert(n < QCOW2_DECOMPRESS_READAHEAD);
+            l2_entries[n++] = l2_entry;
+        }
+    }
+    s->decompress_ra_end = cluster;
+    generation = qcow2_decompress_cache_generation(s->decompress_cache);
+    qemu_co_mutex_unlock(&s->lock);
+
+    for (i = 0; i < n; i++) {
+        Qcow2ReadaheadCo *ra = g_new(Qcow2ReadaheadCo, 1);
+        Coroutine *co;
+
+        *ra = (Qcow2ReadaheadCo) {
+            .bs = bs,
+            .l2_entry = l2_entries[i],
+            .generation = generation,
+        };
+        bdrv_inc_in_flight(bs);
+        co = qemu_coroutine_create(qcow2_co_readahead_entry, ra);
+        aio_co_enter(bdrv_get_aio_context(bs), co);
+    }
+}
+
+static int coroutine_fn
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t l2_entry,
+                           uint64_t dcache_generation,
+                           uint64_t offset,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov,
+                           size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressCache *dcache = s->decompress_cache;
+    int ret = 0, csize;
+    uint64_t coffset;
+    uint8_t *out_buf;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+
+    if (dcache && qcow2_decompress_cache_file(dcache) != bs->file->bs) {
+        /* The file child was replaced, the cache is keyed by the old one */
+        dcache = NULL;
+    }
+
+    if (dcache) {
+        uint64_t cluster = offset >> s->cluster_bits;
+
+        /*
+         * Keep up to QCOW2_DECOMPRESS_READAHEAD clusters decompressed ahead
+         * of a sequential reader, topping up when half of them are used
+         */
+        if (cluster == s->decompress_ra_next) {
+            if (s->decompress_ra_end <= cluster) {
+                s->decompress_ra_end = cluster + 1;
+            }
+            if (s->decompress_ra_end <=
+                cluster + QCOW2_DECOMPRESS_READAHEAD / 2) {
+                qcow2_co_readahead(bs, cluster + 1 +
+                                   QCOW2_DECOMPRESS_READAHEAD);
+            }
+        } else {
+            s->decompress_ra_end = 0;
+        }
+        s->decompress_ra_next = cluster + 1;
+
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        if (qcow2_decompress_cache_read(dcache, coffset, offset_in_cluster,
+                                        bytes, qiov, qiov_offset)) {
+            return 0;
+        }
+    }
+
+    out_buf = qemu_blockalign(bs, s->cluster_size);
+
+    ret = qcow2_co_read_compressed_cluster(bs, l2_entry, out_buf, dcache,
+                                           dcache_generation);
+    if (ret < 0) {
+        goto fail;
+    }
+
     qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
 
 fail:
     qemu_vfree(out_buf);
-    g_free(buf);
 
     return ret;
 }
@@ -4864,6 +5176,10 @@ static int make_completely_empty(BlockDriverState *bs)
     }
     s->refcount_table[0] = 2 * s->cluster_size;
 
+    qcow2_free_space_drop(s);
+    if (s->decompress_cache) {
+        qcow2_decompress_cache_invalidate(s->decompress_cache, 0, UINT64_MAX);
+    }
     s->free_cluster_index = 0;
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
@@ -4912,6 +5228,13 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int step = QEMU_ALIGN_DOWN(INT_MAX, s->cluster_size);
     int l1_clusters, ret = 0;
 
+    qcow2_release_reserved_clusters(bs);
+
+    ret = qcow2_lazy_refcount_process(bs, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
@@ -5220,6 +5543,21 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+    BDRVQcow2State *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2.l2_cache = g_new(Qcow2CacheStats, 1);
+    stats->u.qcow2.refcount_cache = g_new(Qcow2CacheStats, 1);
+    qcow2_cache_get_stats(s->l2_table_cache, stats->u.qcow2.l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          stats->u.qcow2.refcount_cache);
+
+    return stats;
+}
+
 static int qcow2_has_zero_init(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -5674,6 +6012,12 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                             (encryption_update == true)
     };
 
+    ret = qcow2_lazy_refcount_process(bs, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update refcounts");
+        return ret;
+    }
+
     /* Upgrade first (some features may require compat=1.1) */
     if (new_version > old_version) {
         helper_cb_info.current_operation = QCOW2_UPGRADING;
@@ -6067,6 +6411,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
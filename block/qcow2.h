@@ -71,6 +71,12 @@
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
+/* Clusters reserved at once while allocating writes run in parallel */
+#define QCOW2_ALLOC_RESERVE_CLUSTERS 32
+
+/* Compressed clusters decompressed ahead of a sequential reader */
+#define QCOW2_DECOMPRESS_READAHEAD 8
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -149,6 +155,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_DECOMPRESS_CACHE_SIZE "decompress-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,6 +237,9 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2FreeSpace Qcow2FreeSpace;
+typedef struct Qcow2DecompressCache Qcow2DecompressCache;
+
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
@@ -347,8 +357,22 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Shared with other nodes on the same file; NULL if disabled */
+    Qcow2DecompressCache *decompress_cache;
+    uint64_t decompress_cache_size;
+    /* Read-ahead state of sequential compressed reads, in guest clusters */
+    uint64_t decompress_ra_next;
+    uint64_t decompress_ra_end;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
+    /*
+     * Clusters that have a refcount of 1 already but are not referenced
+     * yet; see qcow2_alloc_reserved_clusters().
+     */
+    uint64_t reserved_offset;
+    uint64_t nb_reserved;
+
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
@@ -356,6 +380,14 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Index of the free clusters, built from the refcounts when clusters
+     * are first allocated; see qcow2-free-space.c.  Disabled for images
+     * whose free space is too fragmented for it.
+     */
+    Qcow2FreeSpace *free_space;
+    bool free_space_disabled;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -398,6 +430,14 @@ typedef struct BDRVQcow2State {
     QTAILQ_HEAD (, Qcow2DiscardRegion) discards;
     bool cache_discards;
 
+    /*
+     * L2 tables whose data clusters still need a refcount update after a
+     * snapshot was created or deleted with lazy refcounts, keyed by their
+     * offset; see qcow2_update_snapshot_refcount()
+     */
+    GHashTable *lazy_l2_tables;
+    QEMUTimer *lazy_refcount_timer;
+
     /* Backing file path and format as stored in the image (this is not the
      * effective path/format, which may be the result of a runtime option
      * override) */
@@ -835,6 +875,7 @@ int qcow2_mark_dirty(BlockDriverState *bs);
 int qcow2_mark_corrupt(BlockDriverState *bs);
 int qcow2_mark_consistent(BlockDriverState *bs);
 int qcow2_update_header(BlockDriverState *bs);
+void qcow2_lazy_refcount_schedule(BlockDriverState *bs);
 
 void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
                              int64_t size, const char *message_format, ...)
@@ -865,6 +906,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_reserved_clusters(BlockDriverState *bs,
+                                      uint64_t *nb_clusters);
+void qcow2_release_reserved_clusters(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -872,12 +916,16 @@ void qcow2_free_any_cluster(BlockDriverState *bs, uint64_t l2_entry,
                             enum qcow2_discard_type type);
 
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
-    int64_t l1_table_offset, int l1_size, int addend);
+    int64_t l1_table_offset, int l1_size, int addend, bool lazy);
+int qcow2_lazy_refcount_fixup(BlockDriverState *bs, uint64_t l2_offset);
+int qcow2_lazy_refcount_process(BlockDriverState *bs, unsigned max_tables);
 
 int coroutine_fn qcow2_flush_caches(BlockDriverState *bs);
 int coroutine_fn qcow2_write_caches(BlockDriverState *bs);
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
-                          BdrvCheckMode fix);
+                          BdrvCheckMode fix,
+                          BlockDriverCheckStatusCB *status_cb,
+                          void *cb_opaque);
 
 void qcow2_process_discards(BlockDriverState *bs, int ret);
 
@@ -897,6 +945,31 @@ int qcow2_shrink_reftable(BlockDriverState *bs);
 int64_t qcow2_get_last_cluster(BlockDriverState *bs, int64_t size);
 int qcow2_detect_metadata_preallocation(BlockDriverState *bs);
 
+/* qcow2-free-space.c functions */
+int64_t qcow2_free_space_find(BlockDriverState *bs, uint64_t from,
+                              uint64_t nb_clusters);
+void qcow2_free_space_set_used(BDRVQcow2State *s, uint64_t cluster_index);
+void qcow2_free_space_set_free(BDRVQcow2State *s, uint64_t cluster_index);
+void qcow2_free_space_drop(BDRVQcow2State *s);
+
+/* qcow2-decompress-cache.c functions */
+Qcow2DecompressCache *qcow2_decompress_cache_attach(BlockDriverState *file,
+                                                    int cluster_size,
+                                                    uint64_t size);
+void qcow2_decompress_cache_detach(Qcow2DecompressCache *c, uint64_t size);
+BlockDriverState *qcow2_decompress_cache_file(Qcow2DecompressCache *c);
+bool qcow2_decompress_cache_read(Qcow2DecompressCache *c, uint64_t coffset,
+                                 int offset_in_cluster, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset);
+bool qcow2_decompress_cache_contains(Qcow2DecompressCache *c,
+                                     uint64_t coffset);
+uint64_t qcow2_decompress_cache_generation(Qcow2DecompressCache *c);
+void qcow2_decompress_cache_insert(Qcow2DecompressCache *c, uint64_t coffset,
+                                   int csize, const void *data,
+                                   uint64_t generation);
+void qcow2_decompress_cache_invalidate(Qcow2DecompressCache *c,
+                                       uint64_t offset, uint64_t bytes);
+
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
@@ -905,6 +978,8 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
 
+int coroutine_fn qcow2_co_load_l2_slice(BlockDriverState *bs,
+                                        uint64_t offset);
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
@@ -973,9 +1048,12 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int coroutine_fn qcow2_cache_co_load(BlockDriverState *bs, Qcow2Cache *c,
+                                     uint64_t offset);
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -0,0 +1,137 @@
+/*
+ * Block request flight recorder
+ *
+ * Block requests record the start and end of the stages they go through
+ * (waiting for a drained section or for throttling, waiting for
+ * overlapping requests, the driver, metadata locks and cache misses in
+ * image formats, host I/O) in a ring buffer of the AioContext they run
+ * in.  Only the most recent events are kept, so that after a latency
+ * spike the ring can be dumped to see where the time went.
+ *
+ * Recording is meant to be cheap enough to be always on: a clock read,
+ * an atomic increment and a store into a thread-local ring.  Dumping the
+ * ring of another thread is best effort; entries that are being
+ * overwritten at the same time may be inconsistent.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "block/aio.h"
+#include "block/request-trace.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/timer.h"
+
+#define BLOCK_TRACE_RING_SIZE   4096
+
+/* Also the layout of the binary dump, in little endian */
+typedef struct QEMU_PACKED BlockTraceEntry {
+    int64_t time;
+    uint64_t request;
+    uint64_t node;
+    int64_t offset;
+    uint32_t bytes;
+    uint16_t event;
+    uint16_t reserved;
+} BlockTraceEntry;
+
+QEMU_BUILD_BUG_ON(sizeof(BlockTraceEntry) != 40);
+QEMU_BUILD_BUG_ON(BLOCK_TRACE_RING_SIZE & (BLOCK_TRACE_RING_SIZE - 1));
+
+typedef struct BlockTraceRing {
+    /* Number of events recorded so far */
+    size_t head;
+    BlockTraceEntry entries[BLOCK_TRACE_RING_SIZE];
+} BlockTraceRing;
+
+static BlockTraceRing *block_trace_get_ring(AioContext *ctx)
+{
+    BlockTraceRing *ring = qatomic_read(&ctx->block_trace);
+
+    if (unlikely(!ring)) {
+        BlockTraceRing *old;
+
+        ring = g_new0(BlockTraceRing, 1);
+        old = qatomic_cmpxchg(&ctx->block_trace, NULL, ring);
+        if (old) {
+            g_free(ring);
+            ring = old;
+        }
+    }
+
+    return ring;
+}
+
+void block_trace_record(XDbgBlockTraceEvent event, BlockDriverState *bs,
+                        int64_t offset, int64_t bytes)
+{
+    BlockTraceRing *ring = block_trace_get_ring(qemu_get_current_aio_context());
+    size_t i = qatomic_fetch_inc(&ring->head);
+
+    ring->entries[i & (BLOCK_TRACE_RING_SIZE - 1)] = (BlockTraceEntry) {
+        .time       = get_clock(),
+        .request    = (uintptr_t)qemu_coroutine_self(),
+        .node       = (uintptr_t)bs,
+        .offset     = offset,
+        .bytes      = MIN(bytes, UINT32_MAX),
+        .event      = event,
+    };
+}
+
+XDbgBlockTraceContext *block_trace_dump(AioContext *ctx,
+                                        XDbgBlockTraceFormat format)
+{
+    XDbgBlockTraceContext *info = g_new0(XDbgBlockTraceContext, 1);
+    BlockTraceRing *ring = block_trace_get_ring(ctx);
+    XDbgBlockTraceRecordList **tail = &info->records;
+    g_autofree BlockTraceEntry *entries = NULL;
+    size_t head, n, i;
+
+    head = qatomic_read(&ring->head);
+    n = MIN(head, BLOCK_TRACE_RING_SIZE);
+    info->dropped = head - n;
+
+    entries = g_new(BlockTraceEntry, n);
+    for (i = 0; i < n; i++) {
+        entries[i] = ring->entries[(head - n + i) &
+                                   (BLOCK_TRACE_RING_SIZE - 1)];
+    }
+
+    if (format == XDBG_BLOCK_TRACE_FORMAT_BINARY) {
+        for (i = 0; i < n; i++) {
+            BlockTraceEntry *e = &entries[i];
+
+            e->time = cpu_to_le64(e->time);
+            e->request = cpu_to_le64(e->request);
+            e->node = cpu_to_le64(e->node);
+            e->offset = cpu_to_le64(e->offset);
+            e->bytes = cpu_to_le32(e->bytes);
+            e->event = cpu_to_le16(e->event);
+        }
+        info->has_data = true;
+        info->data = g_base64_encode((guchar *)entries,
+                                     n * sizeof(BlockTraceEntry));
+        return info;
+    }
+
+    info->has_records = true;
+    for (i = 0; i < n; i++) {
+        XDbgBlockTraceRecord *rec = g_new(XDbgBlockTraceRecord, 1);
+
+        *rec = (XDbgBlockTraceRecord) {
+            .time       = entries[i].time,
+            .request    = entries[i].request,
+            .node       = entries[i].node,
+            .event      = entries[i].event,
+            .offset     = entries[i].offset,
+            .bytes      = entries[i].bytes,
+        };
+        QAPI_LIST_APPEND(tail, rec);
+    }
+
+    return info;
+}
@@ -35,6 +35,16 @@
 #include "qom/object.h"
 #include "qom/object_interfaces.h"
 
+/* Number of requests a ThrottleGroupMember may account in advance, so that
+ * they can later be started without taking the group lock.  Tokens are only
+ * handed out while nobody in the group is waiting, and are returned to the
+ * group as soon as someone has to, so this does not change the round-robin
+ * order of throttled requests.
+ */
+#define THROTTLE_GROUP_CACHE_REQS        16
+#define THROTTLE_GROUP_CACHE_OPS_SHIFT   48
+#define THROTTLE_GROUP_CACHE_BYTES_MASK  ((1ULL << THROTTLE_GROUP_CACHE_OPS_SHIFT) - 1)
+
 static void throttle_group_obj_init(Object *obj);
 static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
 static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
@@ -70,12 +80,16 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
     QEMUClockType clock_type;
+    /* Number of requests waiting in all members of the group */
+    unsigned pending_reqs[2];
+    /* Whether any member may have cached tokens */
+    bool has_cached_tokens[2];
 
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
@@ -349,6 +363,125 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
     }
 }
 
+#ifdef CONFIG_ATOMIC64
+/* Try to start an I/O request using the tokens that were cached by
+ * throttle_group_refill_tokens(), without taking the group lock.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       true if the request can be started right away
+ */
+static bool throttle_group_take_cached_token(ThrottleGroupMember *tgm,
+                                             int64_t bytes, bool is_write)
+{
+    uint64_t orig, old, new;
+
+    orig = qatomic_read__nocheck(&tgm->cached_tokens[is_write]);
+    do {
+        old = orig;
+        if ((old >> THROTTLE_GROUP_CACHE_OPS_SHIFT) == 0 ||
+            (old & THROTTLE_GROUP_CACHE_BYTES_MASK) < bytes) {
+            return false;
+        }
+        new = old - (1ULL << THROTTLE_GROUP_CACHE_OPS_SHIFT) - bytes;
+        orig = qatomic_cmpxchg__nocheck(&tgm->cached_tokens[is_write],
+                                        old, new);
+    } while (orig != old);
+
+    return true;
+}
+#else
+static bool throttle_group_take_cached_token(ThrottleGroupMember *tgm,
+                                             int64_t bytes, bool is_write)
+{
+    return false;
+}
+#endif
+
+/* Give the unused cached tokens of a ThrottleGroupMember back to the group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ * @refund:    false if the ThrottleState has been reset in the meantime
+ */
+static void throttle_group_flush_tokens(ThrottleGroupMember *tgm,
+                                        bool is_write, bool refund)
+{
+#ifdef CONFIG_ATOMIC64
+    uint64_t tokens = qatomic_xchg__nocheck(&tgm->cached_tokens[is_write], 0);
+
+    if (tokens && refund) {
+        throttle_account_batch(tgm->throttle_state, is_write,
+                               -(int64_t)(tokens &
+                                          THROTTLE_GROUP_CACHE_BYTES_MASK),
+                               -(int64_t)(tokens >>
+                                          THROTTLE_GROUP_CACHE_OPS_SHIFT));
+    }
+#endif
+}
+
+/* Return all cached tokens of a group, so that they can be handed
+ * to the next member in round-robin order.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_flush_all_tokens(ThrottleGroup *tg, bool is_write,
+                                            bool refund)
+{
+    ThrottleGroupMember *tgm;
+
+    if (!tg->has_cached_tokens[is_write]) {
+        return;
+    }
+
+    QLIST_FOREACH(tgm, &tg->head, round_robin) {
+        throttle_group_flush_tokens(tgm, is_write, refund);
+    }
+    tg->has_cached_tokens[is_write] = false;
+}
+
+/* Account a batch of requests of @bytes each in advance, if the group
+ * is idle enough that they would not have to wait anyway.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes of the request that was just started
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_refill_tokens(ThrottleGroupMember *tgm,
+                                         int64_t bytes, bool is_write)
+{
+#ifdef CONFIG_ATOMIC64
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    int64_t cache_bytes = bytes * THROTTLE_GROUP_CACHE_REQS;
+
+    if (tg->pending_reqs[is_write] || tg->any_timer_armed[is_write] ||
+        ts->cfg.op_size || qatomic_read(&tgm->io_limits_disabled) ||
+        cache_bytes > THROTTLE_GROUP_CACHE_BYTES_MASK) {
+        return;
+    }
+
+    throttle_group_flush_tokens(tgm, is_write, true);
+    throttle_account_batch(ts, is_write, cache_bytes,
+                           THROTTLE_GROUP_CACHE_REQS);
+    if (throttle_must_wait(ts, tg->clock_type, is_write)) {
+        throttle_account_batch(ts, is_write, -cache_bytes,
+                               -THROTTLE_GROUP_CACHE_REQS);
+        return;
+    }
+
+    qatomic_set__nocheck(&tgm->cached_tokens[is_write],
+                         ((uint64_t)THROTTLE_GROUP_CACHE_REQS <<
+                          THROTTLE_GROUP_CACHE_OPS_SHIFT) | cache_bytes);
+    tg->has_cached_tokens[is_write] = true;
+#endif
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -367,8 +500,20 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     assert(bytes >= 0);
 
+    /* Fast path: the request has already been accounted for */
+    if (throttle_group_take_cached_token(tgm, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    /* If the group is running out of tokens, give back the cached ones so
+     * that the round-robin algorithm sees the real state of the group. */
+    if (tg->has_cached_tokens[is_write] &&
+        throttle_must_wait(tgm->throttle_state, tg->clock_type, is_write)) {
+        throttle_group_flush_all_tokens(tg, is_write, true);
+    }
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
@@ -376,6 +521,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
         tgm->pending_reqs[is_write]++;
+        tg->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[is_write],
@@ -383,11 +529,15 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+        tg->pending_reqs[is_write]--;
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, is_write, bytes);
 
+    /* Let the next requests of this tgm skip the lock if possible */
+    throttle_group_refill_tokens(tgm, bytes, is_write);
+
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
@@ -474,6 +624,9 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
+    /* throttle_config() resets the buckets, so there is nothing to refund */
+    throttle_group_flush_all_tokens(tg, false, false);
+    throttle_group_flush_all_tokens(tg, true, false);
     throttle_config(ts, tg->clock_type, cfg);
     qemu_mutex_unlock(&tg->lock);
 
@@ -600,6 +753,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
             assert(tgm->pending_reqs[i] == 0);
             assert(qemu_co_queue_empty(&tgm->throttled_reqs[i]));
             assert(!timer_pending(tgm->throttle_timers.timers[i]));
+            throttle_group_flush_tokens(tgm, i, true);
             if (tg->tokens[i] == tgm) {
                 token = throttle_group_next_tgm(tgm);
                 /* Take care of the case where this is the last tgm in the group */
@@ -274,7 +274,9 @@ static void vdi_header_print(VdiHeader *header)
 }
 
 static int coroutine_fn vdi_co_check(BlockDriverState *bs, BdrvCheckResult *res,
-                                     BdrvCheckMode fix)
+                                     BdrvCheckMode fix,
+                                     BlockDriverCheckStatusCB *status_cb,
+                                     void *cb_opaque)
 {
     /* TODO: additional checks possible. */
     BDRVVdiState *s = (BDRVVdiState *)bs->opaque;
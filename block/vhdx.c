@@ -2159,7 +2159,9 @@ fail:
  */
 static int coroutine_fn vhdx_co_check(BlockDriverState *bs,
                                       BdrvCheckResult *result,
-                                      BdrvCheckMode fix)
+                                      BdrvCheckMode fix,
+                                      BlockDriverCheckStatusCB *status_cb,
+                                      void *cb_opaque)
 {
     BDRVVHDXState *s = bs->opaque;
 
@@ -36,6 +36,7 @@
 #include "hw/block/block.h"
 #include "block/blockjob.h"
 #include "block/qdict.h"
+#include "block/request-trace.h"
 #include "block/throttle-groups.h"
 #include "monitor/monitor.h"
 #include "qemu/error-report.h"
@@ -1665,6 +1666,8 @@ typedef struct DriveBackupState {
 static BlockJob *do_backup_common(BackupCommon *backup,
                                   BlockDriverState *bs,
                                   BlockDriverState *target_bs,
+                                  BlockDriverState **extra_targets,
+                                  int nb_extra_targets,
                                   AioContext *aio_context,
                                   JobTxn *txn, Error **errp);
 
@@ -1805,7 +1808,7 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
     }
 
     state->job = do_backup_common(qapi_DriveBackup_base(backup),
-                                  bs, target_bs, aio_context,
+                                  bs, target_bs, NULL, 0, aio_context,
                                   common->block_job_txn, errp);
 
 unref:
@@ -1873,9 +1876,12 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
     BlockdevBackup *backup;
     BlockDriverState *bs;
     BlockDriverState *target_bs;
+    g_autofree BlockDriverState **extra_targets = NULL;
+    int nb_extra_targets = 0;
+    strList *name;
     AioContext *aio_context;
     AioContext *old_context;
-    int ret;
+    int i, ret;
 
     assert(common->action->type == TRANSACTION_ACTION_KIND_BLOCKDEV_BACKUP);
     backup = common->action->u.blockdev_backup.data;
@@ -1890,6 +1896,17 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
         return;
     }
 
+    for (name = backup->extra_targets; name; name = name->next) {
+        nb_extra_targets++;
+    }
+    extra_targets = g_new(BlockDriverState *, nb_extra_targets);
+    for (i = 0, name = backup->extra_targets; name; i++, name = name->next) {
+        extra_targets[i] = bdrv_lookup_bs(name->value, name->value, errp);
+        if (!extra_targets[i]) {
+            return;
+        }
+    }
+
     /* Honor bdrv_try_set_aio_context() context acquisition requirements. */
     aio_context = bdrv_get_aio_context(bs);
     old_context = bdrv_get_aio_context(target_bs);
@@ -1902,6 +1919,18 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
     }
 
     aio_context_release(old_context);
+
+    for (i = 0; i < nb_extra_targets; i++) {
+        old_context = bdrv_get_aio_context(extra_targets[i]);
+        aio_context_acquire(old_context);
+
+        ret = bdrv_try_set_aio_context(extra_targets[i], aio_context, errp);
+        aio_context_release(old_context);
+        if (ret < 0) {
+            return;
+        }
+    }
+
     aio_context_acquire(aio_context);
     state->bs = bs;
 
@@ -1909,7 +1938,8 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
     bdrv_drained_begin(state->bs);
 
     state->job = do_backup_common(qapi_BlockdevBackup_base(backup),
-                                  bs, target_bs, aio_context,
+                                  bs, target_bs, extra_targets,
+                                  nb_extra_targets, aio_context,
                                   common->block_job_txn, errp);
 
     aio_context_release(aio_context);
@@ -2790,6 +2820,8 @@ out:
 static BlockJob *do_backup_common(BackupCommon *backup,
                                   BlockDriverState *bs,
                                   BlockDriverState *target_bs,
+                                  BlockDriverState **extra_targets,
+                                  int nb_extra_targets,
                                   AioContext *aio_context,
                                   JobTxn *txn, Error **errp)
 {
@@ -2901,7 +2933,8 @@ static BlockJob *do_backup_common(BackupCommon *backup,
         job_flags |= JOB_MANUAL_DISMISS;
     }
 
-    job = backup_job_create(backup->job_id, bs, target_bs, backup->speed,
+    job = backup_job_create(backup->job_id, bs, target_bs, extra_targets,
+                            nb_extra_targets, backup->speed,
                             backup->sync, bmap, backup->bitmap_mode,
                             backup->compress,
                             backup->filter_node_name,
@@ -2935,6 +2968,57 @@ XDbgBlockGraph *qmp_x_debug_query_block_graph(Error **errp)
     return bdrv_get_xdbg_block_graph(errp);
 }
 
+typedef struct BlockTraceQuery {
+    XDbgBlockTraceFormat format;
+    XDbgBlockTraceContextList **tail;
+} BlockTraceQuery;
+
+static int block_trace_query_iothread(Object *object, void *opaque)
+{
+    BlockTraceQuery *query = opaque;
+    XDbgBlockTraceContext *info;
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    info = block_trace_dump(iothread_get_aio_context(iothread), query->format);
+    info->has_iothread = true;
+    info->iothread = iothread_get_id(iothread);
+    QAPI_LIST_APPEND(query->tail, info);
+    return 0;
+}
+
+XDbgBlockTrace *qmp_x_debug_query_block_trace(bool has_format,
+                                              XDbgBlockTraceFormat format,
+                                              Error **errp)
+{
+    XDbgBlockTrace *trace = g_new0(XDbgBlockTrace, 1);
+    XDbgBlockTraceNodeList **nodes_tail = &trace->nodes;
+    BlockTraceQuery query = {
+        .format = has_format ? format : XDBG_BLOCK_TRACE_FORMAT_JSON,
+        .tail = &trace->contexts,
+    };
+    BlockDriverState *bs = NULL;
+
+    while ((bs = bdrv_next_all_states(bs))) {
+        XDbgBlockTraceNode *node = g_new(XDbgBlockTraceNode, 1);
+
+        node->id = (uintptr_t)bs;
+        node->name = g_strdup(bdrv_get_node_name(bs));
+        QAPI_LIST_APPEND(nodes_tail, node);
+    }
+
+    QAPI_LIST_APPEND(query.tail,
+                     block_trace_dump(qemu_get_aio_context(), query.format));
+    object_child_foreach(object_get_objects_root(),
+                         block_trace_query_iothread, &query);
+
+    return trace;
+}
+
 void qmp_blockdev_backup(BlockdevBackup *backup, Error **errp)
 {
     TransactionAction action = {
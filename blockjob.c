@@ -314,6 +314,7 @@ int64_t block_job_ratelimit_get_delay(BlockJob *job, uint64_t n)
 BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
 {
     BlockJobInfo *info;
+    const BlockJobDriver *bjdrv = block_job_driver(job);
     uint64_t progress_current, progress_total;
 
     GLOBAL_STATE_CODE();
@@ -345,6 +346,9 @@ BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
                         g_strdup(error_get_pretty(job->job.err)) :
                         g_strdup(strerror(-job->job.ret));
     }
+    if (bjdrv->query) {
+        bjdrv->query(job, info);
+    }
     return info;
 }
 
@@ -123,18 +123,78 @@ CPUState *qemu_get_cpu(int index)
 __thread CPUState *current_cpu;
 
 struct qemu_work_item {
-    QSIMPLEQ_ENTRY(qemu_work_item) node;
+    QSLIST_ENTRY(qemu_work_item) node;
     run_on_cpu_func func;
     run_on_cpu_data data;
     bool free, exclusive, done;
 };
 
+/*
+ * Work items of async_run_on_cpu() are recycled instead of going back to
+ * the allocator.  The CPU that ran an item pushes it on work_item_pool;
+ * a thread that needs items takes the whole pool at once into a cache of
+ * its own.  Neither side takes a lock, and since nothing is ever popped
+ * from a shared list one element at a time, there is no ABA problem.
+ */
+#define WORK_ITEM_CACHE_SIZE 256
+
+static QSLIST_HEAD(, qemu_work_item) work_item_pool;
+static __thread QSLIST_HEAD(, qemu_work_item) work_item_cache;
+static __thread unsigned work_item_cache_len;
+
+static void work_item_free(struct qemu_work_item *wi)
+{
+    QSLIST_INSERT_HEAD_ATOMIC(&work_item_pool, wi, node);
+}
+
+static void work_item_cache_refill(void)
+{
+    QSLIST_HEAD(, qemu_work_item) pool;
+    struct qemu_work_item *wi;
+
+    QSLIST_MOVE_ATOMIC(&pool, &work_item_pool);
+    while ((wi = QSLIST_FIRST(&pool)) != NULL &&
+           work_item_cache_len < WORK_ITEM_CACHE_SIZE) {
+        QSLIST_REMOVE_HEAD(&pool, node);
+        QSLIST_INSERT_HEAD(&work_item_cache, wi, node);
+        work_item_cache_len++;
+    }
+
+    /*
+     * Bound what a thread holds on to, because the cache is not given
+     * back when the thread exits; the rest goes back to the pool.
+     */
+    while ((wi = QSLIST_FIRST(&pool)) != NULL) {
+        QSLIST_REMOVE_HEAD(&pool, node);
+        work_item_free(wi);
+    }
+}
+
+static struct qemu_work_item *work_item_alloc(void)
+{
+    struct qemu_work_item *wi;
+
+    if (QSLIST_EMPTY(&work_item_cache)) {
+        work_item_cache_refill();
+    }
+    wi = QSLIST_FIRST(&work_item_cache);
+    if (!wi) {
+        return g_new0(struct qemu_work_item, 1);
+    }
+    QSLIST_REMOVE_HEAD(&work_item_cache, node);
+    work_item_cache_len--;
+    memset(wi, 0, sizeof(*wi));
+    return wi;
+}
+
+/*
+ * The work list is a lock-free stack, onto which any thread can push.
+ * Only the CPU thread takes items, by detaching the whole list.
+ */
 static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
 {
-    qemu_mutex_lock(&cpu->work_mutex);
-    QSIMPLEQ_INSERT_TAIL(&cpu->work_list, wi, node);
     wi->done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
+    QSLIST_INSERT_HEAD_ATOMIC(&cpu->work_list, wi, node);
 
     qemu_cpu_kick(cpu);
 }
@@ -168,7 +228,7 @@ void async_run_on_cpu(CPUState *cpu, run_on_cpu_func func, run_on_cpu_data data)
 {
     struct qemu_work_item *wi;
 
-    wi = g_new0(struct qemu_work_item, 1);
+    wi = work_item_alloc();
     wi->func = func;
     wi->data = data;
     wi->free = true;
@@ -313,7 +373,7 @@ void async_safe_run_on_cpu(CPUState *cpu, run_on_cpu_func func,
 {
     struct qemu_work_item *wi;
 
-    wi = g_new0(struct qemu_work_item, 1);
+    wi = work_item_alloc();
     wi->func = func;
     wi->data = data;
     wi->free = true;
@@ -324,39 +384,50 @@ void async_safe_run_on_cpu(CPUState *cpu, run_on_cpu_func func,
 
 void process_queued_cpu_work(CPUState *cpu)
 {
+    QSLIST_HEAD(, qemu_work_item) work, fifo;
     struct qemu_work_item *wi;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (QSIMPLEQ_EMPTY(&cpu->work_list)) {
-        qemu_mutex_unlock(&cpu->work_mutex);
+    if (QSLIST_EMPTY_ATOMIC(&cpu->work_list)) {
         return;
     }
-    while (!QSIMPLEQ_EMPTY(&cpu->work_list)) {
-        wi = QSIMPLEQ_FIRST(&cpu->work_list);
-        QSIMPLEQ_REMOVE_HEAD(&cpu->work_list, node);
-        qemu_mutex_unlock(&cpu->work_mutex);
-        if (wi->exclusive) {
-            /* Running work items outside the BQL avoids the following deadlock:
-             * 1) start_exclusive() is called with the BQL taken while another
-             * CPU is running; 2) cpu_exec in the other CPU tries to takes the
-             * BQL, so it goes to sleep; start_exclusive() is sleeping too, so
-             * neither CPU can proceed.
-             */
-            qemu_mutex_unlock_iothread();
-            start_exclusive();
-            wi->func(cpu, wi->data);
-            end_exclusive();
-            qemu_mutex_lock_iothread();
-        } else {
-            wi->func(cpu, wi->data);
+    for (;;) {
+        QSLIST_MOVE_ATOMIC(&work, &cpu->work_list);
+        if (QSLIST_EMPTY(&work)) {
+            break;
         }
-        qemu_mutex_lock(&cpu->work_mutex);
-        if (wi->free) {
-            g_free(wi);
-        } else {
-            qatomic_mb_set(&wi->done, true);
+
+        /* Items were pushed at the head, run them in the order of queueing */
+        QSLIST_INIT(&fifo);
+        while ((wi = QSLIST_FIRST(&work)) != NULL) {
+            QSLIST_REMOVE_HEAD(&work, node);
+            QSLIST_INSERT_HEAD(&fifo, wi, node);
+        }
+
+        while ((wi = QSLIST_FIRST(&fifo)) != NULL) {
+            QSLIST_REMOVE_HEAD(&fifo, node);
+            if (wi->exclusive) {
+                /*
+                 * Running work items outside the BQL avoids the following
+                 * deadlock: 1) start_exclusive() is called with the BQL
+                 * taken while another CPU is running; 2) cpu_exec in the
+                 * other CPU tries to takes the BQL, so it goes to sleep;
+                 * start_exclusive() is sleeping too, so neither CPU can
+                 * proceed.
+                 */
+                qemu_mutex_unlock_iothread();
+                start_exclusive();
+                wi->func(cpu, wi->data);
+                end_exclusive();
+                qemu_mutex_lock_iothread();
+            } else {
+                wi->func(cpu, wi->data);
+            }
+            if (wi->free) {
+                work_item_free(wi);
+            } else {
+                qatomic_mb_set(&wi->done, true);
+            }
         }
     }
-    qemu_mutex_unlock(&cpu->work_mutex);
     qemu_cond_broadcast(&qemu_work_cond);
 }
@@ -27,6 +27,12 @@
 #include "qemu/bswap.h"
 #include "crypto/xts.h"
 
+/*
+ * Number of blocks handed to the cipher function at once; one 512 byte
+ * sector, which is what the block layer encrypts per IV.
+ */
+#define XTS_BATCH_BLOCKS 32
+
 typedef union {
     uint8_t b[XTS_BLOCK_SIZE];
     uint64_t u[2];
@@ -99,6 +105,73 @@ static inline void xts_tweak_encdec(const void *ctx,
 }
 
 
+/**
+ * xts_tweak_encdec_blocks:
+ * @param ctxt: the cipher context
+ * @param func: the cipher function
+ * @src: buffer providing the input text of @nblocks * XTS_BLOCK_SIZE bytes
+ * @dst: buffer to output the output text of @nblocks * XTS_BLOCK_SIZE bytes
+ * @nblocks: the number of blocks
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ *
+ * Encrypt/decrypt consecutive blocks with a tweak.  The tweaks for up to
+ * XTS_BATCH_BLOCKS blocks are computed up front, so that the cipher function
+ * is called only once for all of them and can process the blocks in parallel.
+ * On return, @iv holds the tweak for the block following the last one.
+ */
+static void xts_tweak_encdec_blocks(const void *ctx,
+                                    xts_cipher_func *func,
+                                    const uint8_t *src,
+                                    uint8_t *dst,
+                                    unsigned long nblocks,
+                                    xts_uint128 *iv)
+{
+    xts_uint128 tweak[XTS_BATCH_BLOCKS];
+    xts_uint128 buf[XTS_BATCH_BLOCKS];
+    unsigned long i, n;
+    uint64_t lo, hi, tt;
+
+    /* Do the LFSR in host byte order, and convert only the results */
+    lo = le64_to_cpu(iv->u[0]);
+    hi = le64_to_cpu(iv->u[1]);
+
+    while (nblocks > 0) {
+        n = MIN(nblocks, XTS_BATCH_BLOCKS);
+
+        for (i = 0; i < n; i++) {
+            tweak[i].u[0] = cpu_to_le64(lo);
+            tweak[i].u[1] = cpu_to_le64(hi);
+
+            tt = lo >> 63;
+            lo <<= 1;
+            if (hi >> 63) {
+                lo ^= 0x87;
+            }
+            hi = (hi << 1) | tt;
+        }
+
+        memcpy(buf, src, n * XTS_BLOCK_SIZE);
+        for (i = 0; i < n; i++) {
+            xts_uint128_xor(&buf[i], &buf[i], &tweak[i]);
+        }
+
+        func(ctx, n * XTS_BLOCK_SIZE, buf[0].b, buf[0].b);
+
+        for (i = 0; i < n; i++) {
+            xts_uint128_xor(&buf[i], &buf[i], &tweak[i]);
+        }
+        memcpy(dst, buf, n * XTS_BLOCK_SIZE);
+
+        src += n * XTS_BLOCK_SIZE;
+        dst += n * XTS_BLOCK_SIZE;
+        nblocks -= n;
+    }
+
+    iv->u[0] = cpu_to_le64(lo);
+    iv->u[1] = cpu_to_le64(hi);
+}
+
+
 void xts_decrypt(const void *datactx,
                  const void *tweakctx,
                  xts_cipher_func *encfunc,
@@ -127,24 +200,9 @@ void xts_decrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, decfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, decfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-            src += XTS_BLOCK_SIZE;
-            dst += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, decfunc, src, dst, lim, &T);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -203,25 +261,9 @@ void xts_encrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, encfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, encfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-
-            dst += XTS_BLOCK_SIZE;
-            src += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, encfunc, src, dst, lim, &T);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
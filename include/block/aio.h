@@ -252,6 +252,12 @@ struct AioContext {
     int epollfd;
 
     const FDMonOps *fdmon_ops;
+
+    /*
+     * Block request events recorded in this AioContext, allocated on the
+     * first event.  See block/request-trace.c.
+     */
+    struct BlockTraceRing *block_trace;
 };
 
 /**
@@ -28,6 +28,24 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      const BdrvDirtyBitmap *bitmap,
                                      Error **errp);
 
+/*
+ * Add a further target that gets the same data as the target given to
+ * block_copy_state_new().  The data is read from the source only once for
+ * all targets.  Errors writing to an extra target don't fail block-copy
+ * calls; the target is not written to anymore after its first error, which
+ * block_copy_target_status() reports.
+ *
+ * Function should be called prior any actual copy request.
+ */
+int block_copy_add_target(BlockCopyState *s, BdrvChild *target, Error **errp);
+
+/*
+ * Return 0 or the first write error of the extra target @target, and store
+ * the number of bytes copied to it so far in @bytes_done.
+ */
+int block_copy_target_status(BlockCopyState *s, BlockDriverState *target,
+                             uint64_t *bytes_done);
+
 /* Function should be called prior any actual copy request */
 void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
                               bool compress);
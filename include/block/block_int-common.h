@@ -32,6 +32,7 @@
 #include "qemu/stats64.h"
 #include "qemu/timer.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/throttle.h"
 #include "qemu/rcu.h"
@@ -568,6 +569,19 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /*
+     * Send [offset, offset + bytes) to the file descriptor @out_fd (usually
+     * a socket) without copying it through a userspace buffer.  Format and
+     * filter drivers whose data maps onto bs->file should map the range
+     * and invoke bdrv_co_sendfile(bs->file, ...).
+     *
+     * @out_fd may be non-blocking.  Return the number of bytes sent, which
+     * is less than @bytes if @out_fd became full, or -errno.
+     */
+    int coroutine_fn (*bdrv_co_sendfile)(BlockDriverState *bs,
+                                         int64_t offset, int64_t bytes,
+                                         int out_fd);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -705,11 +719,14 @@ struct BlockDriver {
 
     /*
      * Returns 0 for completed check, -errno for internal errors.
-     * The check results are stored in result.
+     * The check results are stored in result.  Progress can be reported
+     * through status_cb if it is not NULL.
      */
     int coroutine_fn (*bdrv_co_check)(BlockDriverState *bs,
                                       BdrvCheckResult *result,
-                                      BdrvCheckMode fix);
+                                      BdrvCheckMode fix,
+                                      BlockDriverCheckStatusCB *status_cb,
+                                      void *cb_opaque);
 
     void (*bdrv_debug_event)(BlockDriverState *bs, BlkdebugEvent event);
 
@@ -980,21 +997,30 @@ struct BdrvChild {
 };
 
 /*
- * Allows bdrv_co_block_status() to cache one data region for a
- * protocol node.
+ * Allows bdrv_co_block_status() to cache the status of a protocol node, as
+ * extents of the same status.  Only extents reported as data are cached:
+ * an external writer may zero a cached extent without the cache being
+ * invalidated, which just makes us report zeroes as data, but filling a
+ * hole would make us report data as zeroes.
+ *
+ * Lookups run without taking @lock, in an RCU read-side critical section;
+ * extents are freed after a grace period.
  *
- * @valid: Whether the cache is valid (should be accessed with atomic
- *         functions so this can be reset by RCU readers)
- * @data_start: Offset where we know (or strongly assume) is data
- * @data_end: Offset where the data region ends (which is not necessarily
- *            the start of a zeroed region)
+ * @lock: Serializes modifications of the fields below
+ * @extents: Cached extents by offset, they never overlap
+ * @lru: The same extents, most recently inserted or used first
+ * @nb_extents: Number of cached extents, also read without the lock to
+ *              skip invalidating a cache that is not in use
+ * @hits: Number of queries answered from the cache
+ * @misses: Number of queries that had to be passed to the driver
  */
 typedef struct BdrvBlockStatusCache {
-    struct rcu_head rcu;
-
-    bool valid;
-    int64_t data_start;
-    int64_t data_end;
+    QemuMutex lock;
+    IntervalTreeRoot extents;
+    QTAILQ_HEAD(, BdrvBlockStatusExtent) lru;
+    unsigned int nb_extents;
+    Stat64 hits;
+    Stat64 misses;
 } BdrvBlockStatusCache;
 
 struct BlockDriverState {
@@ -1178,10 +1204,7 @@ struct BlockDriverState {
     /* BdrvChild links to this node may never be frozen */
     bool never_freeze;
 
-    /* Lock for block-status cache RCU writers */
-    CoMutex bsc_modify_lock;
-    /* Always non-NULL, but must only be dereferenced under an RCU read guard */
-    BdrvBlockStatusCache *block_status_cache;
+    BdrvBlockStatusCache block_status_cache;
 };
 
 struct BlockBackendRootState {
@@ -162,6 +162,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * device name of @bs.
  * @bs: Block device to operate on.
  * @target: Block device to write to.
+ * @extra_targets: Further block devices that get the same data as @target.
+ * @nb_extra_targets: Number of elements in @extra_targets.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is 'bitmap' or 'incremental'
@@ -180,7 +182,9 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * until the job is cancelled or manually completed.
  */
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
-                            BlockDriverState *target, int64_t speed,
+                            BlockDriverState *target,
+                            BlockDriverState **extra_targets,
+                            int nb_extra_targets, int64_t speed,
                             MirrorSyncMode sync_mode,
                             BdrvDirtyBitmap *sync_bitmap,
                             BitmapSyncMode bitmap_mode,
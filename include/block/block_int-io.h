@@ -120,6 +120,10 @@ int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, int64_t src_offset,
                                        BdrvRequestFlags read_flags,
                                        BdrvRequestFlags write_flags);
 
+bool bdrv_can_sendfile(BlockDriverState *bs);
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, int out_fd);
+
 int refresh_total_sectors(BlockDriverState *bs, int64_t hint);
 
 BdrvChild *bdrv_cow_child(BlockDriverState *bs);
@@ -154,30 +158,41 @@ static inline BlockDriverState *bdrv_primary_bs(BlockDriverState *bs)
 }
 
 /**
- * Check whether the given offset is in the cached block-status data
- * region.
+ * Look up the cached block status at @offset.
  *
- * If it is, and @pnum is not NULL, *pnum is set to
- * `bsc.data_end - offset`, i.e. how many bytes, starting from
- * @offset, are data (according to the cache).
- * Otherwise, *pnum is not touched.
+ * If it is cached, *status is set to the status that the driver reported
+ * for it and *pnum to the number of bytes, starting from @offset, that
+ * have the same status, and true is returned.  Otherwise, *status and
+ * *pnum are not touched.
+ */
+bool bdrv_bsc_lookup(BlockDriverState *bs, int64_t offset, int *status,
+                     int64_t *pnum);
+
+/**
+ * Cache @status, which the driver reported for [offset, offset + bytes).
+ * @status must say that the range is data.
  */
-bool bdrv_bsc_is_data(BlockDriverState *bs, int64_t offset, int64_t *pnum);
+void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                   int status);
 
 /**
- * If [offset, offset + bytes) overlaps with the currently cached
- * block-status region, invalidate the cache.
+ * Forget the cached block status of [offset, offset + bytes).
  *
- * (To be used by I/O paths that cause data regions to be zero or
- * holes.)
+ * (To be used by I/O paths that may turn data into zeroes or holes.)
  */
 void bdrv_bsc_invalidate_range(BlockDriverState *bs,
                                int64_t offset, int64_t bytes);
 
 /**
- * Mark the range [offset, offset + bytes) as a data region.
+ * Forget the whole cached block status.
+ */
+void bdrv_bsc_invalidate_all(BlockDriverState *bs);
+
+/**
+ * Returns the statistics of the block-status cache of @bs, or NULL if no
+ * block status has been queried through the cache yet.
  */
-void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes);
+BlockStatusCacheStats *bdrv_bsc_get_stats(BlockDriverState *bs);
 
 
 /*
@@ -71,6 +71,9 @@ void bdrv_dirty_bitmap_deserialize_ones(BdrvDirtyBitmap *bitmap,
                                         uint64_t offset, uint64_t bytes,
                                         bool finish);
 void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap);
+bool bdrv_dirty_bitmap_changed(const BdrvDirtyBitmap *bitmap,
+                               uint64_t offset, uint64_t bytes);
+void bdrv_dirty_bitmap_clear_changes(BdrvDirtyBitmap *bitmap);
 
 void bdrv_dirty_bitmap_set_readonly(BdrvDirtyBitmap *bitmap, bool value);
 void bdrv_dirty_bitmap_set_persistence(BdrvDirtyBitmap *bitmap,
@@ -0,0 +1,32 @@
+/*
+ * Block request flight recorder
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_REQUEST_TRACE_H
+#define BLOCK_REQUEST_TRACE_H
+
+#include "qapi/qapi-types-block-core.h"
+
+/*
+ * Every AioContext has a ring buffer of the most recent block request
+ * events that happened in it.  Recording an event is cheap enough for
+ * this to be always on; the rings are dumped with
+ * x-debug-query-block-trace.
+ *
+ * Events are attributed to requests by the coroutine they run in, so
+ * start and end events of a stage must be recorded in the same coroutine.
+ */
+void block_trace_record(XDbgBlockTraceEvent event, BlockDriverState *bs,
+                        int64_t offset, int64_t bytes);
+
+/*
+ * Return the events recorded in @ctx, either as a list of records or in
+ * the packed binary format, depending on @format.
+ */
+XDbgBlockTraceContext *block_trace_dump(AioContext *ctx,
+                                        XDbgBlockTraceFormat format);
+
+#endif
@@ -49,6 +49,13 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /* Requests that have already been accounted in the group's
+     * ThrottleState and can be started without taking the group lock,
+     * packed as (ops << THROTTLE_GROUP_CACHE_OPS_SHIFT) | bytes.
+     * Accessed with atomic operations.
+     */
+    uint64_t cached_tokens[2];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
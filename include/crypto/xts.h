@@ -29,6 +29,10 @@
 
 #define XTS_BLOCK_SIZE 16
 
+/*
+ * Encrypts or decrypts @length bytes from @src to @dst in ECB mode.
+ * @length is a multiple of XTS_BLOCK_SIZE, and may cover many blocks.
+ */
 typedef void xts_cipher_func(const void *ctx,
                              size_t length,
                              uint8_t *dst,
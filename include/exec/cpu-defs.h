@@ -200,6 +200,17 @@ typedef struct CPUTLBCommon {
      * Protected by tlb_c.lock.
      */
     uint16_t dirty;
+    /*
+     * Within pending_flush, for each bit N, a flush of mmu_idx N has been
+     * queued on this cpu by another thread and has not started yet.  Any
+     * further request for that mmu_idx is covered by the queued work.
+     * pending_queued counts the queued flushes that have not started; it
+     * is only incremented once the work is on the list, so it can drop
+     * below zero for a moment.  Both are protected by pending_lock.
+     */
+    QemuSpin pending_lock;
+    uint16_t pending_flush;
+    int pending_queued;
     /*
      * Statistics.  These are not lock protected, but are read and
      * written atomically.  This allows the monitor to print a snapshot
@@ -253,6 +253,29 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
  */
 void hbitmap_deserialize_finish(HBitmap *hb);
 
+/**
+ * hbitmap_changed:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to check.
+ * @count: Number of bits to check.
+ *
+ * Return whether bits in the given range may have been modified since the
+ * last call to hbitmap_clear_changes(), or since the bitmap was created.
+ * Changes are tracked in blocks of several thousand bits, so this can
+ * return true for ranges that were not touched but are close to ones
+ * that were.
+ */
+bool hbitmap_changed(const HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_clear_changes:
+ * @hb: HBitmap to operate on.
+ *
+ * Forget about all modifications done so far, e.g. after the bitmap has
+ * been written out.
+ */
+void hbitmap_clear_changes(HBitmap *hb);
+
 /**
  * hbitmap_sha256:
  * @bitmap: HBitmap to operate on.
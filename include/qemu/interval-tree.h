@@ -0,0 +1,87 @@
+/*
+ * Interval tree of closed integer ranges, based on a red-black tree
+ * augmented with the highest last value of every subtree.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * The nodes are embedded in the user's structures, no memory is
+ * allocated by the tree itself.  Overlapping ranges are allowed.
+ *
+ * Modifications of the tree must be serialized by the caller.
+ * Lookups may run concurrently with modifications: they never
+ * dereference a stale pointer as long as removed nodes are freed
+ * after an RCU grace period, but they may fail to find a node
+ * which is being moved by a concurrent rebalancing.  In other words
+ * lockless lookups have no false positives but may have false
+ * negatives, and a negative result must be confirmed with the lock
+ * held.
+ */
+
+typedef struct IntervalTreeNode {
+    struct IntervalTreeNode *parent;
+    struct IntervalTreeNode *left;
+    struct IntervalTreeNode *right;
+    bool red;
+
+    uint64_t start;        /* Inclusive */
+    uint64_t last;         /* Inclusive */
+    uint64_t subtree_last; /* Maximum of @last in this subtree */
+} IntervalTreeNode;
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+    IntervalTreeNode *leftmost;
+} IntervalTreeRoot;
+
+/**
+ * interval_tree_insert:
+ * @node: the node to insert, with @start and @last filled in
+ * @root: the tree
+ *
+ * Insert @node into @root.  The other fields of @node are initialized
+ * by this function.
+ */
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_remove:
+ * @node: the node to remove
+ * @root: the tree containing @node
+ *
+ * Remove @node from @root.  The range of a node may be changed only
+ * while it is not in the tree: remove, modify and insert it again.
+ */
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_iter_first:
+ * @root: the tree
+ * @start: first value of the range to search
+ * @last: last value of the range to search
+ *
+ * Returns: the node with the lowest @start which intersects
+ * [@start, @last], or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_iter_next:
+ * @node: the node returned by the previous search
+ * @start: first value of the range to search
+ * @last: last value of the range to search
+ *
+ * Returns: the next node in the order of @start which intersects
+ * [@start, @last], or NULL if there is none.  Must be called with the
+ * same range as the interval_tree_iter_first() call which started
+ * the iteration.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last);
+
+#endif /* QEMU_INTERVAL_TREE_H */
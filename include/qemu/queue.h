@@ -262,6 +262,8 @@ struct {                                                                \
  * Singly-linked List access methods.
  */
 #define QSLIST_EMPTY(head)       ((head)->slh_first == NULL)
+#define QSLIST_EMPTY_ATOMIC(head) \
+    (qatomic_read(&((head)->slh_first)) == NULL)
 #define QSLIST_FIRST(head)       ((head)->slh_first)
 #define QSLIST_NEXT(elm, field)  ((elm)->field.sle_next)
 
@@ -151,7 +151,13 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+bool throttle_must_wait(ThrottleState *ts,
+                        QEMUClockType clock_type,
+                        bool is_write);
+
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+void throttle_account_batch(ThrottleState *ts, bool is_write,
+                            int64_t bytes, int64_t ops);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
@@ -53,6 +53,7 @@
 #include "signal-common.h"
 #include "loader.h"
 #include "user-mmap.h"
+#include "uring.h"
 
 #ifdef CONFIG_SEMIHOSTING
 #include "semihosting/semihost.h"
@@ -137,12 +138,14 @@ void fork_start(void)
 {
     start_exclusive();
     mmap_fork_start();
+    uring_fork_start();
     cpu_list_lock();
 }
 
 void fork_end(int child)
 {
     mmap_fork_end(child);
+    uring_fork_end(child);
     if (child) {
         CPUState *cpu, *next_cpu;
         /* Child processes created by fork() only have a single thread.
@@ -410,6 +413,13 @@ static void handle_arg_trace(const char *arg)
     trace_opt_parse(arg);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static void handle_arg_io_uring(const char *arg)
+{
+    enable_io_uring = true;
+}
+#endif
+
 #if defined(TARGET_XTENSA)
 static void handle_arg_abi_call0(const char *arg)
 {
@@ -473,6 +483,10 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+#ifdef CONFIG_LINUX_IO_URING
+    {"iouring",    "QEMU_IOURING",     false, handle_arg_io_uring,
+     "",           "experimental: send vectored I/O through host io_uring"},
+#endif
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_seed,
      "",           "Seed for pseudo-random number generator"},
     {"trace",      "QEMU_TRACE",       true,  handle_arg_trace,
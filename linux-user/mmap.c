@@ -22,7 +22,19 @@
 #include "qemu.h"
 #include "user-internals.h"
 #include "user-mmap.h"
+#include "uring.h"
 
+/*
+ * mmap_lock serializes all changes to the guest address space, including
+ * the updates of the page flags interval tree.  Only lookups of the page
+ * flags (page_get_flags, page_check_range) can skip it.
+ *
+ * mmap, munmap and mprotect of disjoint ranges are serialized as well.
+ * Besides the tree, the lock covers mmap_next_start and the search for a
+ * free range, invalidation of translated code, and the partial host pages
+ * at either end of a guest range, whose host protection depends on the
+ * flags of neighbouring guest pages.
+ */
 static pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
 static __thread int mmap_lock_count;
 
@@ -262,49 +274,31 @@ unsigned long last_brk;
 static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size,
                                         abi_ulong align)
 {
-    abi_ulong addr, end_addr, incr = qemu_host_page_size;
-    int prot;
-    bool looped = false;
+    target_ulong ret;
 
     if (size > reserved_va) {
         return (abi_ulong)-1;
     }
 
-    /* Note that start and size have already been aligned by mmap_find_vma. */
-
-    end_addr = start + size;
-    if (start > reserved_va - size) {
-        /* Start at the top of the address space.  */
-        end_addr = ((reserved_va - size) & -align) + size;
-        looped = true;
+    /*
+     * Note that start and size have already been aligned by mmap_find_vma.
+     * The free space is looked up in the interval tree of the page flags,
+     * which skips whole mappings at a time instead of probing every page.
+     */
+    ret = -1;
+    if (start < reserved_va) {
+        ret = page_find_range_empty(start, reserved_va - 1, size, align);
     }
-
-    /* Search downward from END_ADDR, checking to see if a page is in use.  */
-    addr = end_addr;
-    while (1) {
-        addr -= incr;
-        if (addr > end_addr) {
-            if (looped) {
-                /* Failure.  The entire address space has been searched.  */
-                return (abi_ulong)-1;
-            }
-            /* Re-start at the top of the address space.  */
-            addr = end_addr = ((reserved_va - size) & -align) + size;
-            looped = true;
-        } else {
-            prot = page_get_flags(addr);
-            if (prot) {
-                /* Page in use.  Restart below this page.  */
-                addr = end_addr = ((addr - size) & -align) + size;
-            } else if (addr && addr + size == end_addr) {
-                /* Success!  All pages between ADDR and END_ADDR are free.  */
-                if (start == mmap_next_start) {
-                    mmap_next_start = addr;
-                }
-                return addr;
-            }
-        }
+    if (ret == -1 && MIN(start, reserved_va) > mmap_min_addr) {
+        /* Restart at the beginning of the address space. */
+        ret = page_find_range_empty(mmap_min_addr, MIN(start, reserved_va) - 1,
+                                    size, align);
     }
+    if (ret != -1 && start == mmap_next_start) {
+        mmap_next_start = ret + size;
+    }
+
+    return ret;
 }
 
 /*
@@ -453,6 +447,15 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int target_prot,
         goto fail;
     }
 
+    /* The rings of a guest io_uring are in memory allocated by QEMU */
+    if (!(flags & MAP_ANONYMOUS)) {
+        fd = uring_guest_mmap_fd(fd, &offset, len);
+        if (fd < 0) {
+            errno = EINVAL;
+            goto fail;
+        }
+    }
+
     /*
      * If we're mapping shared memory, ensure we generate code for parallel
      * execution and flush old translations.  This will work up to the level
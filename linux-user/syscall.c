@@ -150,6 +150,7 @@
 #include "signal-common.h"
 #include "loader.h"
 #include "user-mmap.h"
+#include "uring.h"
 #include "user/safe-syscall.h"
 #include "qemu/guest-random.h"
 #include "qemu/selfmap.h"
@@ -2969,6 +2970,36 @@ static void target_to_host_low_high(abi_ulong tlow,
     *hhigh = (off >> HOST_LONG_BITS / 2) >> HOST_LONG_BITS / 2;
 }
 
+/*
+ * Vectored I/O is forwarded to the host io_uring when enabled with
+ * -iouring.  @write selects between readv and writev; @low and @high are
+ * the host offset as split by target_to_host_low_high(), and are only
+ * used if @positional is true.
+ */
+static ssize_t do_host_rw_vec(bool write, int fd, const struct iovec *vec,
+                              int count, bool positional,
+                              unsigned long low, unsigned long high)
+{
+    if (positional) {
+        off_t offset = low |
+            ((unsigned long long)high << HOST_LONG_BITS / 2) <<
+            HOST_LONG_BITS / 2;
+
+        /* io_uring would take -1 as the current position, preadv fails */
+        if (offset >= 0 && uring_rw_available(true)) {
+            return uring_rw(write, fd, vec, count, offset);
+        }
+        return write ? safe_pwritev(fd, vec, count, low, high)
+                     : safe_preadv(fd, vec, count, low, high);
+    }
+
+    if (uring_rw_available(false)) {
+        return uring_rw(write, fd, vec, count, -1);
+    }
+    return write ? safe_writev(fd, vec, count)
+                 : safe_readv(fd, vec, count);
+}
+
 static struct iovec *lock_iovec(int type, abi_ulong target_addr,
                                 abi_ulong count, int copy)
 {
@@ -8609,6 +8640,7 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
                 do_sys_futex(g2h(cpu, ts->child_tidptr),
                              FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
             }
+            uring_thread_exit();
             thread_cpu = NULL;
             g_free(ts);
             rcu_unregister_thread();
@@ -8685,7 +8717,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         return ret;
 #endif
     case TARGET_NR_close:
+        if (uring_fd_reserved(arg1)) {
+            return -TARGET_EBADF;
+        }
         fd_trans_unregister(arg1);
+        uring_guest_close(arg1);
         return get_errno(close(arg1));
 
     case TARGET_NR_brk:
@@ -9251,6 +9287,10 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         return ret;
 #ifdef TARGET_NR_dup2
     case TARGET_NR_dup2:
+        if (uring_fd_reserved(arg2)) {
+            return -TARGET_EBADF;
+        }
+        uring_guest_dup(arg1, arg2);
         ret = get_errno(dup2(arg1, arg2));
         if (ret >= 0) {
             fd_trans_dup(arg1, arg2);
@@ -9266,6 +9306,10 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
             return -EINVAL;
         }
         host_flags = target_to_host_bitmask(arg3, fcntl_flags_tbl);
+        if (uring_fd_reserved(arg2)) {
+            return -TARGET_EBADF;
+        }
+        uring_guest_dup(arg1, arg2);
         ret = get_errno(dup3(arg1, arg2, host_flags));
         if (ret >= 0) {
             fd_trans_dup(arg1, arg2);
@@ -10669,7 +10713,8 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         {
             struct iovec *vec = lock_iovec(VERIFY_WRITE, arg2, arg3, 0);
             if (vec != NULL) {
-                ret = get_errno(safe_readv(arg1, vec, arg3));
+                ret = get_errno(do_host_rw_vec(false, arg1, vec, arg3,
+                                               false, 0, 0));
                 unlock_iovec(vec, arg2, arg3, 1);
             } else {
                 ret = -host_to_target_errno(errno);
@@ -10680,7 +10725,8 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         {
             struct iovec *vec = lock_iovec(VERIFY_READ, arg2, arg3, 1);
             if (vec != NULL) {
-                ret = get_errno(safe_writev(arg1, vec, arg3));
+                ret = get_errno(do_host_rw_vec(true, arg1, vec, arg3,
+                                               false, 0, 0));
                 unlock_iovec(vec, arg2, arg3, 0);
             } else {
                 ret = -host_to_target_errno(errno);
@@ -10695,7 +10741,8 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
                 unsigned long low, high;
 
                 target_to_host_low_high(arg4, arg5, &low, &high);
-                ret = get_errno(safe_preadv(arg1, vec, arg3, low, high));
+                ret = get_errno(do_host_rw_vec(false, arg1, vec, arg3,
+                                               true, low, high));
                 unlock_iovec(vec, arg2, arg3, 1);
             } else {
                 ret = -host_to_target_errno(errno);
@@ -10711,7 +10758,8 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
                 unsigned long low, high;
 
                 target_to_host_low_high(arg4, arg5, &low, &high);
-                ret = get_errno(safe_pwritev(arg1, vec, arg3, low, high));
+                ret = get_errno(do_host_rw_vec(true, arg1, vec, arg3,
+                                               true, low, high));
                 unlock_iovec(vec, arg2, arg3, 0);
             } else {
                 ret = -host_to_target_errno(errno);
@@ -13119,6 +13167,16 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
     case TARGET_NR_membarrier:
         return get_errno(membarrier(arg1, arg2));
 #endif
+#if defined(TARGET_NR_io_uring_setup) && defined(CONFIG_LINUX_IO_URING)
+    case TARGET_NR_io_uring_setup:
+        ret = get_errno(uring_guest_setup(arg1, arg2));
+        fd_trans_unregister(ret);
+        return ret;
+    case TARGET_NR_io_uring_enter:
+        return get_errno(uring_guest_enter(arg1, arg2, arg3, arg4, arg5, arg6));
+    case TARGET_NR_io_uring_register:
+        return get_errno(uring_guest_register(arg1, arg2, arg3, arg4));
+#endif
 
 #if defined(TARGET_NR_copy_file_range) && defined(__NR_copy_file_range)
     case TARGET_NR_copy_file_range:
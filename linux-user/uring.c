@@ -0,0 +1,1310 @@
+/*
+ * Host io_uring backend for guest I/O syscalls
+ *
+ * Each guest thread lazily gets a small host io_uring, to which the
+ * vectored read and write syscalls are forwarded when -iouring is given.
+ * Waiting for the completion goes through safe_syscall(), so that guest
+ * signals interrupt the I/O exactly like they interrupt the blocking
+ * syscalls it replaces.
+ *
+ * Every syscall is submitted and waited for on its own, so this does not
+ * save any host syscalls compared to calling readv/writev directly.
+ * Batching would need the guest to submit several requests at once,
+ * which is what the guest io_uring support below is for.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "qemu/osdep.h"
+#include <sys/syscall.h>
+#include <liburing.h>
+#include "qapi/error.h"
+#include "qemu/bitops.h"
+#include "qemu/futex.h"
+#include "qemu/host-utils.h"
+#include "qemu/memfd.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu.h"
+#include "user-internals.h"
+#include "user/safe-syscall.h"
+#include "special-errno.h"
+#include "uring.h"
+
+#define URING_ENTRIES       8
+
+/* user_data of the two kinds of requests in flight */
+#define URING_TAG_RW        1
+#define URING_TAG_CANCEL    2
+
+typedef struct ThreadRing {
+    struct io_uring ring;
+    bool cur_pos;
+    QLIST_ENTRY(ThreadRing) next;
+} ThreadRing;
+
+bool enable_io_uring;
+
+/* Set if the host kernel does not have io_uring at all */
+static bool uring_unavailable;
+
+/* All rings, so that they can be dropped in a forked child */
+static pthread_mutex_t uring_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static QLIST_HEAD(, ThreadRing) uring_list =
+    QLIST_HEAD_INITIALIZER(uring_list);
+
+/*
+ * File descriptors that QEMU's own rings use.  They are in the same
+ * space as the guest's, which must not close or replace them under
+ * QEMU's feet.  Protected by uring_list_lock.
+ */
+static GHashTable *uring_fds;
+
+static __thread ThreadRing *thread_ring;
+
+static ThreadRing *uring_get(void)
+{
+    struct io_uring_params p = { };
+    ThreadRing *tr;
+    int ret;
+
+    if (likely(thread_ring)) {
+        return thread_ring;
+    }
+    if (qatomic_read(&uring_unavailable)) {
+        return NULL;
+    }
+
+    tr = g_new0(ThreadRing, 1);
+    ret = io_uring_queue_init_params(URING_ENTRIES, &tr->ring, &p);
+    if (ret < 0) {
+        /*
+         * Not being able to create a ring is not an error for the guest,
+         * which just keeps using the plain syscalls.
+         */
+        if (ret == -ENOSYS || ret == -EPERM) {
+            qatomic_set(&uring_unavailable, true);
+        }
+        g_free(tr);
+        return NULL;
+    }
+    tr->cur_pos = p.features & IORING_FEAT_RW_CUR_POS;
+
+    pthread_mutex_lock(&uring_list_lock);
+    QLIST_INSERT_HEAD(&uring_list, tr, next);
+    g_hash_table_add(uring_fds, GINT_TO_POINTER(tr->ring.ring_fd));
+    pthread_mutex_unlock(&uring_list_lock);
+
+    thread_ring = tr;
+    return tr;
+}
+
+bool uring_rw_available(bool positional)
+{
+    ThreadRing *tr;
+
+    if (!enable_io_uring) {
+        return false;
+    }
+    tr = uring_get();
+    return tr && (positional || tr->cur_pos);
+}
+
+bool uring_fd_reserved(int fd)
+{
+    bool ret;
+
+    pthread_mutex_lock(&uring_list_lock);
+    ret = g_hash_table_contains(uring_fds, GINT_TO_POINTER(fd));
+    pthread_mutex_unlock(&uring_list_lock);
+    return ret;
+}
+
+/*
+ * Wait for a completion without being interruptible by guest signals.
+ * Returns NULL if the ring itself is broken.
+ */
+static struct io_uring_cqe *uring_wait_uninterruptible(struct io_uring *ring)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    do {
+        ret = io_uring_wait_cqe(ring, &cqe);
+    } while (ret == -EINTR);
+
+    return ret == 0 ? cqe : NULL;
+}
+
+/*
+ * The wait for the I/O was interrupted.  Try to cancel it and collect
+ * both completions; return true if the I/O did not take place, or false
+ * with its result in *@res if it completed anyway.
+ */
+static bool uring_cancel(struct io_uring *ring, int *res)
+{
+    struct io_uring_sqe *sqe;
+    bool rw_done = false, cancel_done = false;
+
+    sqe = io_uring_get_sqe(ring);
+    assert(sqe);
+    io_uring_prep_rw(IORING_OP_ASYNC_CANCEL, sqe, -1, NULL, 0, 0);
+    sqe->addr = URING_TAG_RW;
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)URING_TAG_CANCEL);
+
+    if (io_uring_submit(ring) != 1) {
+        /* Cannot cancel, the I/O runs to completion */
+        cancel_done = true;
+    }
+
+    while (!rw_done || !cancel_done) {
+        struct io_uring_cqe *cqe = uring_wait_uninterruptible(ring);
+
+        if (!cqe) {
+            /*
+             * Whether the I/O took place cannot be known anymore, and
+             * its completion could show up later; start afresh with a
+             * new ring next time.
+             */
+            uring_thread_exit();
+            *res = -EIO;
+            return false;
+        }
+        if ((uintptr_t)io_uring_cqe_get_data(cqe) == URING_TAG_RW) {
+            *res = cqe->res;
+            rw_done = true;
+        } else {
+            cancel_done = true;
+        }
+        io_uring_cqe_seen(ring, cqe);
+    }
+
+    /*
+     * A request which was waiting in the io-wq workers and got aborted
+     * by the cancellation completes with -EINTR.
+     */
+    return *res == -ECANCELED || *res == -EINTR;
+}
+
+ssize_t uring_rw(bool write, int fd, const struct iovec *iov, int iovcnt,
+                 off_t offset)
+{
+    struct io_uring *ring = &thread_ring->ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int ret, res;
+
+    sqe = io_uring_get_sqe(ring);
+    assert(sqe);
+    if (write) {
+        io_uring_prep_writev(sqe, fd, iov, iovcnt, offset);
+    } else {
+        io_uring_prep_readv(sqe, fd, iov, iovcnt, offset);
+    }
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)URING_TAG_RW);
+
+    /*
+     * Submission does not block, it is only the wait below that must be
+     * a safe_syscall(): the signal can come in at any point before the
+     * host starts waiting, and then the I/O must be cancelled.
+     */
+    ret = io_uring_submit(ring);
+    if (ret != 1) {
+        /* Leave the ring empty and let the caller see the error */
+        errno = ret < 0 ? -ret : EAGAIN;
+        return -1;
+    }
+
+    while (io_uring_peek_cqe(ring, &cqe) != 0) {
+        ret = safe_syscall(__NR_io_uring_enter, ring->ring_fd, 0, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            int err = errno;
+
+            if (err != QEMU_ERESTARTSYS && err != EINTR) {
+                /* Cannot wait, so pull the request back anyway */
+                err = EINTR;
+            }
+            if (uring_cancel(ring, &res)) {
+                errno = err;
+                return -1;
+            }
+            goto done;
+        }
+    }
+    res = cqe->res;
+    io_uring_cqe_seen(ring, cqe);
+
+done:
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+static void uring_free(ThreadRing *tr)
+{
+    QLIST_REMOVE(tr, next);
+    g_hash_table_remove(uring_fds, GINT_TO_POINTER(tr->ring.ring_fd));
+    io_uring_queue_exit(&tr->ring);
+    g_free(tr);
+}
+
+void uring_thread_exit(void)
+{
+    if (thread_ring) {
+        pthread_mutex_lock(&uring_list_lock);
+        uring_free(thread_ring);
+        pthread_mutex_unlock(&uring_list_lock);
+        thread_ring = NULL;
+    }
+}
+
+/*
+ * Guest io_uring
+ *
+ * The guest gets a file descriptor for a host io_uring, but the rings
+ * that it maps are in a memfd owned by QEMU: the SQEs contain guest
+ * pointers and guest-endian values and must be translated before they
+ * reach the host kernel.  io_uring_enter() consumes the guest SQ ring,
+ * while a reaper thread per ring waits for host completions and posts
+ * them to the guest CQ ring, so that completions show up without a
+ * syscall just like with a native io_uring.
+ */
+
+#define GUEST_URING_MAX_ENTRIES     32768
+#define GUEST_URING_MAX_CQ_ENTRIES  (2 * GUEST_URING_MAX_ENTRIES)
+
+/* Layout of the rings in the memfd, all fields are 32-bit guest-endian */
+#define SQ_OFF_HEAD         0
+#define SQ_OFF_TAIL         4
+#define SQ_OFF_RING_MASK    8
+#define SQ_OFF_RING_ENTRIES 12
+#define SQ_OFF_FLAGS        16
+#define SQ_OFF_DROPPED      20
+#define SQ_OFF_ARRAY        24
+
+#define CQ_OFF_HEAD         0
+#define CQ_OFF_TAIL         4
+#define CQ_OFF_RING_MASK    8
+#define CQ_OFF_RING_ENTRIES 12
+#define CQ_OFF_OVERFLOW     16
+#define CQ_OFF_FLAGS        20
+#define CQ_OFF_CQES         32
+
+/* user_data of the host NOP that stops the reaper thread */
+#define GUEST_URING_TAG_EXIT    0
+
+/* Host user_data of cancellations whose target was not found */
+#define GUEST_URING_TAG_NONE    UINT64_MAX
+
+typedef struct GuestURingReq {
+    /* user_data of the host SQE, never reused within a ring */
+    uint64_t id;
+    uint64_t user_data;
+    /* If nonzero, the result that is posted instead of the host one */
+    int error;
+    struct iovec *iov;
+    struct __kernel_timespec ts;
+} GuestURingReq;
+
+typedef struct GuestURingCQE {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+    QSIMPLEQ_ENTRY(GuestURingCQE) next;
+} GuestURingCQE;
+
+typedef struct GuestRing {
+    int fd;
+    int refcnt;
+    struct io_uring host;
+    QemuThread reaper;
+
+    /* Shared with the guest */
+    int memfd;
+    void *mem;
+    size_t mem_size;
+    size_t sq_size, cq_size, sqes_size;
+    uint32_t sq_entries, cq_entries;
+    uint32_t *sq_head, *sq_tail, *sq_flags, *sq_dropped, *sq_array;
+    struct io_uring_sqe *sqes;
+    uint32_t *cq_head, *cq_tail, *cq_overflow, *cq_flags;
+    struct io_uring_cqe *cqes;
+
+    /*
+     * Protects everything below, as well as the submission side of the
+     * host ring.  The reaper thread is the only consumer of host CQEs.
+     */
+    QemuMutex lock;
+    uint32_t sq_head_val;
+    uint32_t cq_tail_val;
+    int eventfd;
+    GHashTable *inflight;
+    uint64_t next_id;
+    QSIMPLEQ_HEAD(, GuestURingCQE) overflow;
+
+    /* Set by the reaper thread when it stops reaping */
+    bool dead;
+
+    /* Incremented and woken up whenever a CQE is posted */
+    uint32_t cq_seq;
+} GuestRing;
+
+static QemuMutex guest_ring_lock;
+static GHashTable *guest_rings;
+
+static void __attribute__((__constructor__)) guest_ring_init(void)
+{
+    qemu_mutex_init(&guest_ring_lock);
+    guest_rings = g_hash_table_new(NULL, NULL);
+    uring_fds = g_hash_table_new(NULL, NULL);
+}
+
+static GuestRing *guest_ring_get(int fd)
+{
+    GuestRing *r;
+
+    qemu_mutex_lock(&guest_ring_lock);
+    r = g_hash_table_lookup(guest_rings, GINT_TO_POINTER(fd));
+    if (r) {
+        r->refcnt++;
+    }
+    qemu_mutex_unlock(&guest_ring_lock);
+    return r;
+}
+
+static void guest_ring_req_free(gpointer opaque)
+{
+    GuestURingReq *req = opaque;
+
+    g_free(req->iov);
+    g_free(req);
+}
+
+static void guest_ring_free(GuestRing *r)
+{
+    GuestURingCQE *cqe, *next_cqe;
+
+    /* Closing the host ring cancels whatever is still in flight */
+    pthread_mutex_lock(&uring_list_lock);
+    g_hash_table_remove(uring_fds, GINT_TO_POINTER(r->host.ring_fd));
+    g_hash_table_remove(uring_fds, GINT_TO_POINTER(r->memfd));
+    io_uring_queue_exit(&r->host);
+    qemu_memfd_free(r->mem, r->mem_size, r->memfd);
+    pthread_mutex_unlock(&uring_list_lock);
+
+    g_hash_table_destroy(r->inflight);
+    QSIMPLEQ_FOREACH_SAFE(cqe, &r->overflow, next, next_cqe) {
+        g_free(cqe);
+    }
+    qemu_mutex_destroy(&r->lock);
+    g_free(r);
+}
+
+static void guest_ring_put(GuestRing *r)
+{
+    bool last;
+
+    qemu_mutex_lock(&guest_ring_lock);
+    last = --r->refcnt == 0;
+    qemu_mutex_unlock(&guest_ring_lock);
+
+    if (last) {
+        guest_ring_free(r);
+    }
+}
+
+static inline uint32_t guest_ring_load(uint32_t *p)
+{
+    return tswap32(qatomic_load_acquire(p));
+}
+
+static inline void guest_ring_store(uint32_t *p, uint32_t val)
+{
+    qatomic_store_release(p, tswap32(val));
+}
+
+/* Called with r->lock held.  Returns false if the guest CQ ring is full. */
+static bool guest_ring_post_locked(GuestRing *r, uint64_t user_data,
+                                   int32_t res, uint32_t flags)
+{
+    struct io_uring_cqe *cqe;
+    uint32_t tail = r->cq_tail_val;
+
+    if (tail - guest_ring_load(r->cq_head) >= r->cq_entries) {
+        return false;
+    }
+    cqe = &r->cqes[tail & (r->cq_entries - 1)];
+    cqe->user_data = tswap64(user_data);
+    cqe->res = tswap32(res);
+    cqe->flags = tswap32(flags);
+    r->cq_tail_val = tail + 1;
+    guest_ring_store(r->cq_tail, tail + 1);
+    return true;
+}
+
+/* Called with r->lock held. */
+static void guest_ring_flush_overflow_locked(GuestRing *r)
+{
+    GuestURingCQE *cqe;
+
+    while ((cqe = QSIMPLEQ_FIRST(&r->overflow)) != NULL) {
+        if (!guest_ring_post_locked(r, cqe->user_data, cqe->res, cqe->flags)) {
+            return;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&r->overflow, next);
+        g_free(cqe);
+    }
+    guest_ring_store(r->sq_flags,
+                     guest_ring_load(r->sq_flags) & ~IORING_SQ_CQ_OVERFLOW);
+}
+
+/* Post a completion to the guest, keeping it aside if the ring is full. */
+static void guest_ring_post(GuestRing *r, uint64_t user_data,
+                            int32_t res, uint32_t flags)
+{
+    int efd;
+
+    qemu_mutex_lock(&r->lock);
+    if (!QSIMPLEQ_EMPTY(&r->overflow) ||
+        !guest_ring_post_locked(r, user_data, res, flags)) {
+        GuestURingCQE *cqe = g_new(GuestURingCQE, 1);
+
+        cqe->user_data = user_data;
+        cqe->res = res;
+        cqe->flags = flags;
+        QSIMPLEQ_INSERT_TAIL(&r->overflow, cqe, next);
+        guest_ring_store(r->sq_flags,
+                         guest_ring_load(r->sq_flags) | IORING_SQ_CQ_OVERFLOW);
+    }
+    qatomic_set(&r->cq_seq, r->cq_seq + 1);
+    qemu_mutex_unlock(&r->lock);
+
+    qemu_futex_wake(&r->cq_seq, INT_MAX);
+    efd = qatomic_read(&r->eventfd);
+    if (efd >= 0 &&
+        !(guest_ring_load(r->cq_flags) & IORING_CQ_EVENTFD_DISABLED)) {
+        uint64_t one = 1;
+
+        if (write(efd, &one, sizeof(one)) < 0) {
+            /* Nothing to do, as for a native io_uring */
+        }
+    }
+}
+
+static void *guest_ring_reaper(void *opaque)
+{
+    GuestRing *r = opaque;
+
+    for (;;) {
+        struct io_uring_cqe *cqe;
+        GuestURingReq *req;
+        uint64_t id;
+        int32_t res;
+        uint32_t flags;
+        int ret;
+
+        ret = io_uring_wait_cqe(&r->host, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            /* The host ring is unusable and no completion will ever come */
+            break;
+        }
+        id = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        io_uring_cqe_seen(&r->host, cqe);
+
+        if (id == GUEST_URING_TAG_EXIT) {
+            break;
+        }
+
+        qemu_mutex_lock(&r->lock);
+        req = g_hash_table_lookup(r->inflight, &id);
+        if (!(flags & IORING_CQE_F_MORE)) {
+            g_hash_table_steal(r->inflight, &id);
+        }
+        qemu_mutex_unlock(&r->lock);
+
+        guest_ring_post(r, req->user_data, req->error ?: res, flags);
+        if (!(flags & IORING_CQE_F_MORE)) {
+            guest_ring_req_free(req);
+        }
+    }
+
+    /*
+     * Nothing is reaped anymore, either because the ring was closed or
+     * because it failed.  Other guest threads may still be waiting for
+     * completions in io_uring_enter(); wake them up so that they fail
+     * instead of hanging.
+     */
+    qemu_mutex_lock(&r->lock);
+    r->dead = true;
+    qatomic_set(&r->cq_seq, r->cq_seq + 1);
+    qemu_mutex_unlock(&r->lock);
+    qemu_futex_wake(&r->cq_seq, INT_MAX);
+    return NULL;
+}
+
+int uring_guest_setup(uint32_t entries, abi_ulong params)
+{
+    struct io_uring_params *target_p;
+    struct io_uring_params p = { };
+    size_t align = MAX(qemu_real_host_page_size(), TARGET_PAGE_SIZE);
+    uint32_t flags, cq_entries;
+    Error *local_err = NULL;
+    GuestRing *r;
+    uint8_t *mem;
+    int ret;
+
+    if (!lock_user_struct(VERIFY_WRITE, target_p, params, 1)) {
+        errno = EFAULT;
+        return -1;
+    }
+    __get_user(flags, &target_p->flags);
+    __get_user(cq_entries, &target_p->cq_entries);
+
+    /*
+     * Polling modes would need QEMU itself to poll the guest rings, and
+     * sharing the work queue of another ring is not possible since it
+     * belongs to the host.
+     */
+    if (flags & ~(IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP)) {
+        ret = EINVAL;
+        goto fail;
+    }
+    if (!entries) {
+        ret = EINVAL;
+        goto fail;
+    }
+    if (entries > GUEST_URING_MAX_ENTRIES) {
+        if (!(flags & IORING_SETUP_CLAMP)) {
+            ret = EINVAL;
+            goto fail;
+        }
+        entries = GUEST_URING_MAX_ENTRIES;
+    }
+    entries = pow2ceil(entries);
+    if (flags & IORING_SETUP_CQSIZE) {
+        if (!cq_entries) {
+            ret = EINVAL;
+            goto fail;
+        }
+        if (cq_entries > GUEST_URING_MAX_CQ_ENTRIES) {
+            if (!(flags & IORING_SETUP_CLAMP)) {
+                ret = EINVAL;
+                goto fail;
+            }
+            cq_entries = GUEST_URING_MAX_CQ_ENTRIES;
+        }
+        cq_entries = pow2ceil(cq_entries);
+        if (cq_entries < entries) {
+            ret = EINVAL;
+            goto fail;
+        }
+    } else {
+        cq_entries = 2 * entries;
+    }
+
+    r = g_new0(GuestRing, 1);
+    r->sq_entries = entries;
+    r->cq_entries = cq_entries;
+    r->eventfd = -1;
+    qemu_mutex_init(&r->lock);
+    QSIMPLEQ_INIT(&r->overflow);
+
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    ret = io_uring_queue_init_params(entries, &r->host, &p);
+    if (ret < 0) {
+        qemu_mutex_destroy(&r->lock);
+        g_free(r);
+        ret = -ret;
+        goto fail;
+    }
+
+    /*
+     * The guest gets a file descriptor of its own, so that closing or
+     * replacing it never pulls the host ring from under QEMU's feet.
+     */
+    r->fd = fcntl(r->host.ring_fd, F_DUPFD_CLOEXEC, 0);
+    if (r->fd < 0) {
+        ret = errno;
+        io_uring_queue_exit(&r->host);
+        qemu_mutex_destroy(&r->lock);
+        g_free(r);
+        goto fail;
+    }
+
+    r->sq_size = ROUND_UP(SQ_OFF_ARRAY + entries * sizeof(uint32_t), align);
+    r->cq_size = ROUND_UP(CQ_OFF_CQES +
+                          cq_entries * sizeof(struct io_uring_cqe), align);
+    r->sqes_size = ROUND_UP(entries * sizeof(struct io_uring_sqe), align);
+    r->mem_size = r->sq_size + r->cq_size + r->sqes_size;
+    r->mem = qemu_memfd_alloc("io_uring", r->mem_size, 0, &r->memfd,
+                              &local_err);
+    if (!r->mem) {
+        error_free(local_err);
+        close(r->fd);
+        io_uring_queue_exit(&r->host);
+        qemu_mutex_destroy(&r->lock);
+        g_free(r);
+        ret = ENOMEM;
+        goto fail;
+    }
+
+    mem = r->mem;
+    r->sq_head = (uint32_t *)(mem + SQ_OFF_HEAD);
+    r->sq_tail = (uint32_t *)(mem + SQ_OFF_TAIL);
+    r->sq_flags = (uint32_t *)(mem + SQ_OFF_FLAGS);
+    r->sq_dropped = (uint32_t *)(mem + SQ_OFF_DROPPED);
+    r->sq_array = (uint32_t *)(mem + SQ_OFF_ARRAY);
+    *(uint32_t *)(mem + SQ_OFF_RING_MASK) = tswap32(entries - 1);
+    *(uint32_t *)(mem + SQ_OFF_RING_ENTRIES) = tswap32(entries);
+
+    mem += r->sq_size;
+    r->cq_head = (uint32_t *)(mem + CQ_OFF_HEAD);
+    r->cq_tail = (uint32_t *)(mem + CQ_OFF_TAIL);
+    r->cq_overflow = (uint32_t *)(mem + CQ_OFF_OVERFLOW);
+    r->cq_flags = (uint32_t *)(mem + CQ_OFF_FLAGS);
+    r->cqes = (struct io_uring_cqe *)(mem + CQ_OFF_CQES);
+    *(uint32_t *)(mem + CQ_OFF_RING_MASK) = tswap32(cq_entries - 1);
+    *(uint32_t *)(mem + CQ_OFF_RING_ENTRIES) = tswap32(cq_entries);
+
+    r->sqes = (struct io_uring_sqe *)(mem + r->cq_size);
+
+    __put_user(entries, &target_p->sq_entries);
+    __put_user(cq_entries, &target_p->cq_entries);
+    /*
+     * Completions are never dropped thanks to the overflow list, and
+     * SQEs are copied when they are consumed.  Without SINGLE_MMAP the
+     * guest maps the three areas separately.
+     */
+    __put_user(IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE |
+               (p.features & (IORING_FEAT_RW_CUR_POS | IORING_FEAT_FAST_POLL |
+                              IORING_FEAT_POLL_32BITS)),
+               &target_p->features);
+    __put_user(SQ_OFF_HEAD, &target_p->sq_off.head);
+    __put_user(SQ_OFF_TAIL, &target_p->sq_off.tail);
+    __put_user(SQ_OFF_RING_MASK, &target_p->sq_off.ring_mask);
+    __put_user(SQ_OFF_RING_ENTRIES, &target_p->sq_off.ring_entries);
+    __put_user(SQ_OFF_FLAGS, &target_p->sq_off.flags);
+    __put_user(SQ_OFF_DROPPED, &target_p->sq_off.dropped);
+    __put_user(SQ_OFF_ARRAY, &target_p->sq_off.array);
+    __put_user(CQ_OFF_HEAD, &target_p->cq_off.head);
+    __put_user(CQ_OFF_TAIL, &target_p->cq_off.tail);
+    __put_user(CQ_OFF_RING_MASK, &target_p->cq_off.ring_mask);
+    __put_user(CQ_OFF_RING_ENTRIES, &target_p->cq_off.ring_entries);
+    __put_user(CQ_OFF_OVERFLOW, &target_p->cq_off.overflow);
+    __put_user(CQ_OFF_CQES, &target_p->cq_off.cqes);
+    __put_user(CQ_OFF_FLAGS, &target_p->cq_off.flags);
+    unlock_user_struct(target_p, params, 1);
+
+    /* Request ids start at 1, 0 is GUEST_URING_TAG_EXIT */
+    r->inflight = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                        guest_ring_req_free);
+    r->next_id = 1;
+    r->refcnt = 1;
+
+    pthread_mutex_lock(&uring_list_lock);
+    g_hash_table_add(uring_fds, GINT_TO_POINTER(r->host.ring_fd));
+    g_hash_table_add(uring_fds, GINT_TO_POINTER(r->memfd));
+    pthread_mutex_unlock(&uring_list_lock);
+    qemu_thread_create(&r->reaper, "io_uring", guest_ring_reaper, r,
+                       QEMU_THREAD_JOINABLE);
+
+    qemu_mutex_lock(&guest_ring_lock);
+    g_hash_table_insert(guest_rings, GINT_TO_POINTER(r->fd), r);
+    qemu_mutex_unlock(&guest_ring_lock);
+    return r->fd;
+
+fail:
+    unlock_user_struct(target_p, params, 0);
+    errno = ret;
+    return -1;
+}
+
+/*
+ * Find the host user_data of an in-flight request.  Called with r->lock.
+ * Ids are not reused, so if the target completes before the host looks
+ * for it, the cancellation fails with -ENOENT just like a native one.
+ */
+static uint64_t guest_ring_find_locked(GuestRing *r, uint64_t user_data)
+{
+    GHashTableIter iter;
+    GuestURingReq *req;
+
+    g_hash_table_iter_init(&iter, r->inflight);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&req)) {
+        if (req->user_data == user_data) {
+            return req->id;
+        }
+    }
+    return GUEST_URING_TAG_NONE;
+}
+
+static bool guest_ring_access(int type, uint64_t addr, uint64_t len)
+{
+    return addr == (abi_ulong)addr && len == (abi_ulong)len &&
+           access_ok(thread_cpu, type, addr, len);
+}
+
+/*
+ * Translate the guest SQE @gsqe into @sqe, filling in @req with the
+ * memory that lives until completion.  Called with r->lock held.
+ * Returns 0 or a negative errno to be posted as the result.
+ */
+static int guest_ring_translate_locked(GuestRing *r,
+                                       const struct io_uring_sqe *gsqe,
+                                       struct io_uring_sqe *sqe,
+                                       GuestURingReq *req)
+{
+    struct target_iovec *target_vec;
+    uint64_t addr;
+    uint32_t len, poll;
+    int i;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = gsqe->opcode;
+    sqe->flags = gsqe->flags;
+    sqe->ioprio = tswap16(gsqe->ioprio);
+    sqe->fd = tswap32(gsqe->fd);
+    sqe->off = tswap64(gsqe->off);
+    sqe->len = len = tswap32(gsqe->len);
+    sqe->rw_flags = tswap32(gsqe->rw_flags);
+    sqe->buf_index = tswap16(gsqe->buf_index);
+    sqe->personality = tswap16(gsqe->personality);
+    sqe->splice_fd_in = tswap32(gsqe->splice_fd_in);
+    sqe->user_data = req->id;
+    addr = tswap64(gsqe->addr);
+
+    if (sqe->flags & IOSQE_BUFFER_SELECT) {
+        /* Provided buffers are not supported */
+        return -EINVAL;
+    }
+
+    switch (sqe->opcode) {
+    case IORING_OP_NOP:
+    case IORING_OP_FSYNC:
+    case IORING_OP_SYNC_FILE_RANGE:
+    case IORING_OP_FALLOCATE:
+    case IORING_OP_FADVISE:
+        /* addr is a length for fallocate, not a pointer */
+        sqe->addr = addr;
+        break;
+
+    case IORING_OP_POLL_ADD:
+        /* The two halves of a 32-bit mask are swapped on big-endian */
+        poll = sqe->poll32_events;
+#if HOST_BIG_ENDIAN != TARGET_BIG_ENDIAN
+        poll = ror32(poll, 16);
+#endif
+        sqe->poll32_events = poll;
+        break;
+
+    case IORING_OP_READ:
+    case IORING_OP_READ_FIXED:
+    case IORING_OP_RECV:
+    case IORING_OP_WRITE:
+    case IORING_OP_WRITE_FIXED:
+    case IORING_OP_SEND:
+        if (!guest_ring_access(sqe->opcode == IORING_OP_READ ||
+                               sqe->opcode == IORING_OP_READ_FIXED ||
+                               sqe->opcode == IORING_OP_RECV
+                               ? VERIFY_WRITE : VERIFY_READ, addr, len)) {
+            return -EFAULT;
+        }
+        sqe->addr = (uintptr_t)g2h_untagged(addr);
+        break;
+
+    case IORING_OP_READV:
+    case IORING_OP_WRITEV:
+        if (len > IOV_MAX) {
+            return -EINVAL;
+        }
+        target_vec = lock_user(VERIFY_READ, addr,
+                               len * sizeof(struct target_iovec), 1);
+        if (!target_vec) {
+            return -EFAULT;
+        }
+        req->iov = g_new(struct iovec, len);
+        for (i = 0; i < len; i++) {
+            abi_ulong base = tswapal(target_vec[i].iov_base);
+            abi_ulong iov_len = tswapal(target_vec[i].iov_len);
+
+            if (!guest_ring_access(sqe->opcode == IORING_OP_READV
+                                   ? VERIFY_WRITE : VERIFY_READ,
+                                   base, iov_len)) {
+                unlock_user(target_vec, addr, 0);
+                return -EFAULT;
+            }
+            req->iov[i].iov_base = g2h_untagged(base);
+            req->iov[i].iov_len = iov_len;
+        }
+        unlock_user(target_vec, addr, 0);
+        sqe->addr = (uintptr_t)req->iov;
+        break;
+
+    case IORING_OP_TIMEOUT:
+    case IORING_OP_LINK_TIMEOUT:
+        if (get_user_s64(req->ts.tv_sec, addr) ||
+            get_user_s64(req->ts.tv_nsec, addr + 8)) {
+            return -EFAULT;
+        }
+        sqe->addr = (uintptr_t)&req->ts;
+        break;
+
+    case IORING_OP_POLL_REMOVE:
+    case IORING_OP_TIMEOUT_REMOVE:
+    case IORING_OP_ASYNC_CANCEL:
+        /* These refer to another request by its user_data */
+        sqe->addr = guest_ring_find_locked(r, addr);
+        break;
+
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Consume up to @to_submit guest SQEs.  Returns the number consumed. */
+static int guest_ring_submit(GuestRing *r, uint32_t to_submit)
+{
+    uint32_t mask = r->sq_entries - 1;
+    uint32_t head, tail;
+    int submitted = 0;
+    bool linked = false;
+
+    qemu_mutex_lock(&r->lock);
+    head = r->sq_head_val;
+    tail = guest_ring_load(r->sq_tail);
+
+    /*
+     * As in Linux, at most a ring's worth of SQEs is consumed at once.
+     * The host ring is as large as the guest one, so link chains reach
+     * the host in a single submission.
+     */
+    to_submit = MIN(to_submit, MIN(tail - head, r->sq_entries));
+
+    while (submitted < to_submit) {
+        struct io_uring_sqe *gsqe, *sqe, tmp;
+        GuestURingReq *req;
+        uint32_t idx;
+        int ret;
+
+        idx = tswap32(qatomic_read(&r->sq_array[head & mask]));
+        head++;
+        submitted++;
+        if (idx >= r->sq_entries) {
+            guest_ring_store(r->sq_dropped,
+                             guest_ring_load(r->sq_dropped) + 1);
+            continue;
+        }
+        gsqe = &r->sqes[idx];
+
+        req = g_new0(GuestURingReq, 1);
+        req->id = r->next_id++;
+        req->user_data = tswap64(gsqe->user_data);
+        ret = guest_ring_translate_locked(r, gsqe, &tmp, req);
+        if (ret < 0 && !linked &&
+            !(gsqe->flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK))) {
+            /* Complete the request here, it never reaches the host */
+            qemu_mutex_unlock(&r->lock);
+            guest_ring_post(r, req->user_data, ret, 0);
+            qemu_mutex_lock(&r->lock);
+            guest_ring_req_free(req);
+            continue;
+        }
+        if (ret < 0) {
+            /*
+             * Dropping the request would join the two halves of its link
+             * chain.  Send the host an operation that fails instead, so
+             * that the rest of the chain is cancelled, and post the
+             * translation error as its result.
+             */
+            memset(&tmp, 0, sizeof(tmp));
+            io_uring_prep_rw(IORING_OP_READ, &tmp, -1, NULL, 0, 0);
+            tmp.flags = gsqe->flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK);
+            tmp.user_data = req->id;
+            req->error = ret;
+        }
+        linked = tmp.flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK);
+
+        sqe = io_uring_get_sqe(&r->host);
+        if (!sqe) {
+            io_uring_submit(&r->host);
+            sqe = io_uring_get_sqe(&r->host);
+            assert(sqe);
+        }
+        *sqe = tmp;
+        g_hash_table_insert(r->inflight, &req->id, req);
+    }
+
+    r->sq_head_val = head;
+    guest_ring_store(r->sq_head, head);
+    io_uring_submit(&r->host);
+    qemu_mutex_unlock(&r->lock);
+    return submitted;
+}
+
+int uring_guest_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+                      uint32_t flags, abi_ulong sig, abi_ulong sigsz)
+{
+    GuestRing *r;
+    int submitted = 0;
+
+    if (flags & ~(IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP |
+                  IORING_ENTER_SQ_WAIT)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sig) {
+        /* Changing the signal mask for the wait is not implemented */
+        errno = EINVAL;
+        return -1;
+    }
+
+    r = guest_ring_get(fd);
+    if (!r) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (to_submit) {
+        submitted = guest_ring_submit(r, to_submit);
+    }
+
+    if (flags & IORING_ENTER_GETEVENTS) {
+        min_complete = MIN(min_complete, r->cq_entries);
+        for (;;) {
+            uint32_t avail, seq;
+            bool dead;
+            int ret;
+
+            qemu_mutex_lock(&r->lock);
+            guest_ring_flush_overflow_locked(r);
+            avail = r->cq_tail_val - guest_ring_load(r->cq_head);
+            seq = r->cq_seq;
+            dead = r->dead;
+            qemu_mutex_unlock(&r->lock);
+            if (avail >= min_complete) {
+                break;
+            }
+
+            if (dead) {
+                errno = EIO;
+            } else {
+                ret = safe_syscall(__NR_futex, &r->cq_seq, FUTEX_WAIT_PRIVATE,
+                                   seq, NULL, NULL, 0);
+                if (ret == 0 || errno == EAGAIN) {
+                    continue;
+                }
+            }
+
+            /* As in Linux, report the submissions if there were any */
+            if (!submitted) {
+                guest_ring_put(r);
+                return -1;
+            }
+            break;
+        }
+    }
+
+    guest_ring_put(r);
+    return submitted;
+}
+
+static int guest_ring_register_buffers(GuestRing *r, abi_ulong arg,
+                                       uint32_t nr_args)
+{
+    struct target_iovec *target_vec;
+    struct iovec *iov;
+    int i, ret;
+
+    if (!nr_args || nr_args > UIO_MAXIOV) {
+        return -EINVAL;
+    }
+    target_vec = lock_user(VERIFY_READ, arg,
+                           nr_args * sizeof(struct target_iovec), 1);
+    if (!target_vec) {
+        return -EFAULT;
+    }
+    iov = g_new(struct iovec, nr_args);
+    for (i = 0; i < nr_args; i++) {
+        abi_ulong base = tswapal(target_vec[i].iov_base);
+        abi_ulong len = tswapal(target_vec[i].iov_len);
+
+        if (!guest_ring_access(VERIFY_WRITE, base, len)) {
+            ret = -EFAULT;
+            goto out;
+        }
+        iov[i].iov_base = g2h_untagged(base);
+        iov[i].iov_len = len;
+    }
+    ret = io_uring_register_buffers(&r->host, iov, nr_args);
+
+out:
+    unlock_user(target_vec, arg, 0);
+    g_free(iov);
+    return ret;
+}
+
+static int guest_ring_register_files(GuestRing *r, abi_ulong arg,
+                                     uint32_t nr_args)
+{
+    int32_t *target_fds;
+    int *fds;
+    int i, ret;
+
+    if (!nr_args) {
+        return -EINVAL;
+    }
+    target_fds = lock_user(VERIFY_READ, arg, nr_args * sizeof(int32_t), 1);
+    if (!target_fds) {
+        return -EFAULT;
+    }
+    fds = g_new(int, nr_args);
+    for (i = 0; i < nr_args; i++) {
+        fds[i] = tswap32(target_fds[i]);
+        /* The guest must not get at QEMU's own descriptors this way */
+        if (uring_fd_reserved(fds[i])) {
+            ret = -EBADF;
+            goto out;
+        }
+    }
+    ret = io_uring_register_files(&r->host, fds, nr_args);
+
+out:
+    unlock_user(target_fds, arg, 0);
+    g_free(fds);
+    return ret;
+}
+
+static const uint8_t guest_ring_ops[] = {
+    IORING_OP_NOP, IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_FSYNC,
+    IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_POLL_ADD,
+    IORING_OP_POLL_REMOVE, IORING_OP_SYNC_FILE_RANGE, IORING_OP_TIMEOUT,
+    IORING_OP_TIMEOUT_REMOVE, IORING_OP_ASYNC_CANCEL,
+    IORING_OP_LINK_TIMEOUT, IORING_OP_FALLOCATE, IORING_OP_FADVISE,
+    IORING_OP_READ, IORING_OP_WRITE, IORING_OP_SEND, IORING_OP_RECV,
+};
+
+static int guest_ring_register_probe(abi_ulong arg, uint32_t nr_args)
+{
+    struct io_uring_probe *probe;
+    size_t size = sizeof(*probe) + nr_args * sizeof(probe->ops[0]);
+    uint8_t last_op = 0;
+    int i;
+
+    probe = lock_user(VERIFY_WRITE, arg, size, 0);
+    if (!probe) {
+        return -EFAULT;
+    }
+    memset(probe, 0, size);
+    for (i = 0; i < ARRAY_SIZE(guest_ring_ops); i++) {
+        uint8_t op = guest_ring_ops[i];
+
+        last_op = MAX(last_op, op);
+        if (op < nr_args) {
+            probe->ops[op].op = op;
+            probe->ops[op].flags = tswap16(IO_URING_OP_SUPPORTED);
+        }
+    }
+    probe->last_op = last_op;
+    probe->ops_len = MIN(nr_args, last_op + 1);
+    unlock_user(probe, arg, size);
+    return 0;
+}
+
+int uring_guest_register(int fd, uint32_t opcode, abi_ulong arg,
+                         uint32_t nr_args)
+{
+    GuestRing *r;
+    int32_t efd;
+    int ret;
+
+    r = guest_ring_get(fd);
+    if (!r) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    switch (opcode) {
+    case IORING_REGISTER_BUFFERS:
+        ret = guest_ring_register_buffers(r, arg, nr_args);
+        break;
+    case IORING_UNREGISTER_BUFFERS:
+        ret = io_uring_unregister_buffers(&r->host);
+        break;
+    case IORING_REGISTER_FILES:
+        ret = guest_ring_register_files(r, arg, nr_args);
+        break;
+    case IORING_UNREGISTER_FILES:
+        ret = io_uring_unregister_files(&r->host);
+        break;
+    case IORING_REGISTER_EVENTFD:
+    case IORING_REGISTER_EVENTFD_ASYNC:
+        /* The reaper thread signals the eventfd after posting the CQE */
+        if (nr_args != 1) {
+            ret = -EINVAL;
+        } else if (get_user_s32(efd, arg)) {
+            ret = -EFAULT;
+        } else if (qatomic_read(&r->eventfd) >= 0) {
+            ret = -EBUSY;
+        } else {
+            qatomic_set(&r->eventfd, efd);
+            ret = 0;
+        }
+        break;
+    case IORING_UNREGISTER_EVENTFD:
+        if (qatomic_read(&r->eventfd) < 0) {
+            ret = -ENXIO;
+        } else {
+            qatomic_set(&r->eventfd, -1);
+            ret = 0;
+        }
+        break;
+    case IORING_REGISTER_PROBE:
+        ret = guest_ring_register_probe(arg, nr_args);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    guest_ring_put(r);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+int uring_guest_mmap_fd(int fd, abi_ulong *offset, abi_ulong len)
+{
+    GuestRing *r = guest_ring_get(fd);
+    size_t start, size;
+    int ret;
+
+    if (!r) {
+        return fd;
+    }
+
+    switch (*offset) {
+    case IORING_OFF_SQ_RING:
+        start = 0;
+        size = r->sq_size;
+        break;
+    case IORING_OFF_CQ_RING:
+        start = r->sq_size;
+        size = r->cq_size;
+        break;
+    case IORING_OFF_SQES:
+        start = r->sq_size + r->cq_size;
+        size = r->sqes_size;
+        break;
+    default:
+        guest_ring_put(r);
+        return -1;
+    }
+
+    if (len > size) {
+        ret = -1;
+    } else {
+        *offset = start;
+        ret = r->memfd;
+    }
+    guest_ring_put(r);
+    return ret;
+}
+
+void uring_guest_close(int fd)
+{
+    struct io_uring_sqe *sqe;
+    GuestRing *r;
+
+    qemu_mutex_lock(&guest_ring_lock);
+    r = g_hash_table_lookup(guest_rings, GINT_TO_POINTER(fd));
+    if (r) {
+        g_hash_table_remove(guest_rings, GINT_TO_POINTER(fd));
+    }
+    qemu_mutex_unlock(&guest_ring_lock);
+    if (!r) {
+        return;
+    }
+
+    qemu_mutex_lock(&r->lock);
+    sqe = io_uring_get_sqe(&r->host);
+    if (!sqe) {
+        io_uring_submit(&r->host);
+        sqe = io_uring_get_sqe(&r->host);
+    }
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)GUEST_URING_TAG_EXIT);
+    io_uring_submit(&r->host);
+    qemu_mutex_unlock(&r->lock);
+    qemu_thread_join(&r->reaper);
+
+    /* The host ring is closed with the last reference */
+    guest_ring_put(r);
+}
+
+void uring_guest_dup(int oldfd, int newfd)
+{
+    /* dup2() and dup3() leave @newfd alone if @oldfd is not valid */
+    if (oldfd != newfd && fcntl(oldfd, F_GETFD) >= 0) {
+        uring_guest_close(newfd);
+    }
+}
+
+void uring_fork_start(void)
+{
+    pthread_mutex_lock(&uring_list_lock);
+    qemu_mutex_lock(&guest_ring_lock);
+}
+
+void uring_fork_end(int child)
+{
+    if (child) {
+        ThreadRing *tr, *next;
+
+        /*
+         * The rings are shared memory with the parent, which keeps using
+         * them; the child creates its own when it needs one.
+         */
+        QLIST_FOREACH_SAFE(tr, &uring_list, next, next) {
+            uring_free(tr);
+        }
+        thread_ring = NULL;
+
+        /* Nothing in the child uses the guest rings' descriptors */
+        g_hash_table_remove_all(uring_fds);
+        pthread_mutex_init(&uring_list_lock, NULL);
+
+        /*
+         * Guest rings are served by reaper threads that only exist in
+         * the parent.  The child keeps the file descriptors, but cannot
+         * use them as io_uring instances anymore; the GuestRing structs
+         * may be in use by the parent's threads and are just leaked.
+         */
+        g_hash_table_remove_all(guest_rings);
+        qemu_mutex_unlock(&guest_ring_lock);
+    } else {
+        qemu_mutex_unlock(&guest_ring_lock);
+        pthread_mutex_unlock(&uring_list_lock);
+    }
+}
@@ -0,0 +1,116 @@
+/*
+ * uring.h: host io_uring backend for guest I/O syscalls
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LINUX_USER_URING_H
+#define LINUX_USER_URING_H
+
+#ifdef CONFIG_LINUX_IO_URING
+
+extern bool enable_io_uring;
+
+/*
+ * Returns true if vectored I/O may be sent to the host io_uring of the
+ * calling thread.  @positional is false for readv/writev, which need
+ * the kernel to support I/O at the current file position.
+ */
+bool uring_rw_available(bool positional);
+
+/*
+ * Perform a readv (@write false) or writev (@write true) on the host
+ * file descriptor @fd through the io_uring of the calling thread.
+ * An @offset of -1 uses and updates the current file position.
+ *
+ * Like safe_syscall(), returns -1 with errno set to QEMU_ERESTARTSYS
+ * if a guest signal arrived before the I/O was done, or to EINTR if it
+ * interrupted the I/O and the host kernel decided not to restart it.
+ */
+ssize_t uring_rw(bool write, int fd, const struct iovec *iov, int iovcnt,
+                 off_t offset);
+
+/*
+ * Returns true if @fd belongs to one of QEMU's io_uring instances, which
+ * the guest is not allowed to close or replace.
+ */
+bool uring_fd_reserved(int fd);
+
+void uring_thread_exit(void);
+void uring_fork_start(void);
+void uring_fork_end(int child);
+
+/*
+ * Guest io_uring instances.  The rings live in memory allocated by QEMU,
+ * which the guest maps through target_mmap(), and the SQEs are translated
+ * and forwarded to a host io_uring.  All of these follow the libc
+ * convention of returning -1 with errno set on failure.
+ */
+int uring_guest_setup(uint32_t entries, abi_ulong params);
+int uring_guest_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+                      uint32_t flags, abi_ulong sig, abi_ulong sigsz);
+int uring_guest_register(int fd, uint32_t opcode, abi_ulong arg,
+                         uint32_t nr_args);
+
+/*
+ * If @fd is a guest io_uring, return the file descriptor that backs the
+ * ring selected by *@offset and update *@offset to its position in that
+ * file; -1 if the offset or @len is invalid.  Other file descriptors are
+ * returned unchanged.
+ */
+int uring_guest_mmap_fd(int fd, abi_ulong *offset, abi_ulong len);
+
+/*
+ * Tear down the guest io_uring behind @fd, if there is one.  Called
+ * before the guest closes @fd, which the caller still has to do.
+ */
+void uring_guest_close(int fd);
+
+/* Likewise, before @newfd is replaced with a duplicate of @oldfd. */
+void uring_guest_dup(int oldfd, int newfd);
+
+#else
+
+static inline bool uring_rw_available(bool positional)
+{
+    return false;
+}
+
+static inline ssize_t uring_rw(bool write, int fd, const struct iovec *iov,
+                               int iovcnt, off_t offset)
+{
+    g_assert_not_reached();
+}
+
+static inline bool uring_fd_reserved(int fd)
+{
+    return false;
+}
+
+static inline void uring_thread_exit(void) {}
+static inline void uring_fork_start(void) {}
+static inline void uring_fork_end(int child) {}
+
+static inline int uring_guest_mmap_fd(int fd, abi_ulong *offset,
+                                      abi_ulong len)
+{
+    return fd;
+}
+
+static inline void uring_guest_close(int fd) {}
+static inline void uring_guest_dup(int oldfd, int newfd) {}
+
+#endif /* CONFIG_LINUX_IO_URING */
+
+#endif /* LINUX_USER_URING_H */
@@ -99,6 +99,8 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    bool zero_copy; /* send read data with blk_co_sendfile() if possible */
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -1772,6 +1774,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = !arg->has_zero_copy || arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1888,6 +1891,63 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Whether the data of read replies can be sent straight from the image file
+ * to the client socket.  Not with TLS, where the data must be encrypted on
+ * the way.
+ */
+static bool nbd_can_send_zero_copy(NBDClient *client)
+{
+    return client->exp->zero_copy &&
+           client->ioc == QIO_CHANNEL(client->sioc) &&
+           blk_can_sendfile(client->exp->common.blk);
+}
+
+/*
+ * Like nbd_co_send_iov(), but follow @iov with @size bytes at @offset of
+ * the export, sent with blk_co_sendfile().
+ */
+static int coroutine_fn nbd_co_send_iov_zero_copy(NBDClient *client,
+                                                  struct iovec *iov,
+                                                  unsigned niov,
+                                                  uint64_t offset,
+                                                  size_t size,
+                                                  Error **errp)
+{
+    BlockBackend *blk = client->exp->common.blk;
+    int ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    qio_channel_set_cork(client->ioc, true);
+    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    while (!ret && size) {
+        int n = blk_co_sendfile(blk, offset, size, client->sioc->fd);
+
+        if (n < 0) {
+            /*
+             * The header is already out, so this cannot be reported as an
+             * error reply; the connection has to be dropped.
+             */
+            error_setg_errno(errp, -n, "sending data from file failed");
+            ret = -EIO;
+        } else if (n == 0) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+        } else {
+            offset += n;
+            size -= n;
+        }
+    }
+    qio_channel_set_cork(client->ioc, false);
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1966,6 +2026,47 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+/*
+ * Send a successful read reply for @size bytes at @offset, simple or
+ * structured depending on the client, with the data taken straight from
+ * the export.  Only if nbd_can_send_zero_copy() is true.
+ */
+static int coroutine_fn nbd_co_send_read_zero_copy(NBDClient *client,
+                                                   uint64_t handle,
+                                                   uint64_t offset,
+                                                   size_t size,
+                                                   bool final,
+                                                   Error **errp)
+{
+    assert(size);
+
+    if (client->structured_reply) {
+        NBDStructuredReadData chunk;
+        struct iovec iov[] = {
+            {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+        };
+
+        trace_nbd_co_send_structured_read(handle, offset, NULL, size);
+        set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                     NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                     sizeof(chunk) - sizeof(chunk.h) + size);
+        stq_be_p(&chunk.offset, offset);
+
+        return nbd_co_send_iov_zero_copy(client, iov, 1, offset, size, errp);
+    } else {
+        NBDSimpleReply reply;
+        struct iovec iov[] = {
+            {.iov_base = &reply, .iov_len = sizeof(reply)},
+        };
+
+        assert(final);
+        trace_nbd_co_send_simple_reply(handle, 0, nbd_err_lookup(0), size);
+        set_be_simple_reply(&reply, 0, handle);
+
+        return nbd_co_send_iov_zero_copy(client, iov, 1, offset, size, errp);
+    }
+}
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
                                                      uint32_t error,
@@ -1993,12 +2094,15 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
 /* Do a sparse read and send the structured reply to the client.
  * Returns -errno if sending fails. bdrv_block_status_above() failure is
  * reported to the client, at which point this function succeeds.
+ * With @zero_copy, data chunks are sent with nbd_co_send_read_zero_copy()
+ * and @data is not used.
  */
 static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                                                 uint64_t handle,
                                                 uint64_t offset,
                                                 uint8_t *data,
                                                 size_t size,
+                                                bool zero_copy,
                                                 Error **errp)
 {
     int ret = 0;
@@ -2038,6 +2142,9 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stq_be_p(&chunk.offset, offset + progress);
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
+        } else if (zero_copy) {
+            ret = nbd_co_send_read_zero_copy(client, handle, offset + progress,
+                                             pnum, final, errp);
         } else {
             ret = blk_pread(exp->common.blk, offset + progress, pnum,
                             data + progress, 0);
@@ -2332,7 +2439,10 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
             return -EINVAL;
         }
 
-        if (request->type != NBD_CMD_CACHE) {
+        /* Zero-copy reads go from the image to the socket, no buffer needed */
+        if (request->type == NBD_CMD_WRITE ||
+            (request->type == NBD_CMD_READ &&
+             !nbd_can_send_zero_copy(client))) {
             req->data = blk_try_blockalign(client->exp->common.blk,
                                            request->len);
             if (req->data == NULL) {
@@ -2425,9 +2535,24 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
 {
     int ret;
     NBDExport *exp = client->exp;
+    QEMU_AUTO_VFREE uint8_t *bounce = NULL;
+    bool zero_copy = !data;
 
     assert(request->type == NBD_CMD_READ);
 
+    /*
+     * nbd_co_receive_request() did not allocate a buffer because zero-copy
+     * was possible, but the block graph may have changed since.
+     */
+    if (zero_copy && !nbd_can_send_zero_copy(client)) {
+        data = bounce = blk_try_blockalign(exp->common.blk, request->len);
+        if (!data) {
+            return nbd_send_generic_reply(client, request->handle, -ENOMEM,
+                                          "No memory", errp);
+        }
+        zero_copy = false;
+    }
+
     /* XXX: NBD Protocol only documents use of FUA with WRITE */
     if (request->flags & NBD_CMD_FLAG_FUA) {
         ret = blk_co_flush(exp->common.blk);
@@ -2441,7 +2566,13 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         request->len)
     {
         return nbd_co_send_sparse_read(client, request->handle, request->from,
-                                       data, request->len, errp);
+                                       data, request->len, zero_copy, errp);
+    }
+
+    if (zero_copy && request->len) {
+        return nbd_co_send_read_zero_copy(client, request->handle,
+                                          request->from, request->len, true,
+                                          errp);
     }
 
     ret = blk_pread(exp->common.blk, request->from, request->len, data, 0);
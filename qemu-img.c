@@ -85,6 +85,7 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_SKIP_IDENTICAL = 278,
 };
 
 typedef enum OutputFormat {
@@ -662,16 +663,24 @@ static void dump_human_image_check(ImageCheck *check, bool quiet)
     }
 }
 
+static void check_status_cb(BlockDriverState *bs,
+                            int64_t offset, int64_t total_work_size,
+                            void *opaque)
+{
+    qemu_progress_print(100.f * offset / total_work_size, 0);
+}
+
 static int collect_image_check(BlockDriverState *bs,
                    ImageCheck *check,
                    const char *filename,
                    const char *fmt,
-                   int fix)
+                   int fix,
+                   BlockDriverCheckStatusCB *status_cb)
 {
     int ret;
     BdrvCheckResult result;
 
-    ret = bdrv_check(bs, &result, fix);
+    ret = bdrv_check(bs, &result, fix, status_cb, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -721,7 +730,7 @@ static int img_check(int argc, char **argv)
     int flags = BDRV_O_CHECK;
     bool writethrough;
     ImageCheck *check;
-    bool quiet = false;
+    bool quiet = false, progress = false;
     bool image_opts = false;
     bool force_share = false;
 
@@ -741,7 +750,7 @@ static int img_check(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:r:T:qU",
+        c = getopt_long(argc, argv, ":hf:r:T:pqU",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -777,6 +786,9 @@ static int img_check(int argc, char **argv)
         case 'T':
             cache = optarg;
             break;
+        case 'p':
+            progress = true;
+            break;
         case 'q':
             quiet = true;
             break;
@@ -796,6 +808,10 @@ static int img_check(int argc, char **argv)
     }
     filename = argv[optind++];
 
+    if (quiet) {
+        progress = false;
+    }
+
     if (output && !strcmp(output, "json")) {
         output_format = OFORMAT_JSON;
     } else if (output && !strcmp(output, "human")) {
@@ -805,6 +821,11 @@ static int img_check(int argc, char **argv)
         return 1;
     }
 
+    /* The progress bar would end up in the middle of the JSON output */
+    if (output_format == OFORMAT_JSON) {
+        progress = false;
+    }
+
     ret = bdrv_parse_cache_mode(cache, &flags, &writethrough);
     if (ret < 0) {
         error_report("Invalid source cache option: %s", cache);
@@ -819,7 +840,12 @@ static int img_check(int argc, char **argv)
     bs = blk_bs(blk);
 
     check = g_new0(ImageCheck, 1);
-    ret = collect_image_check(bs, check, filename, fmt, fix);
+    qemu_progress_init(progress, 1.f);
+    qemu_progress_print(0.f, 0);
+    ret = collect_image_check(bs, check, filename, fmt, fix,
+                              &check_status_cb);
+    qemu_progress_print(100.f, 0);
+    qemu_progress_end();
 
     if (ret == -ENOTSUP) {
         error_report("This image format does not support checks");
@@ -848,7 +874,7 @@ static int img_check(int argc, char **argv)
 
         qapi_free_ImageCheck(check);
         check = g_new0(ImageCheck, 1);
-        ret = collect_image_check(bs, check, filename, fmt, 0);
+        ret = collect_image_check(bs, check, filename, fmt, 0, NULL);
 
         check->leaks_fixed          = leaks_fixed;
         check->has_leaks_fixed      = has_leaks_fixed;
@@ -1644,6 +1670,19 @@ enum ImgConvertBlockStatus {
 #define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+/*
+ * Limit for the block status map built while counting the allocated
+ * sectors; beyond this, block status is queried again during the copy.
+ */
+#define CONVERT_MAX_EXTENTS (1024 * 1024)
+
+/* A run of sectors with the same status, as found by the first pass */
+typedef struct ImgConvertExtent {
+    int64_t sector_num;
+    int64_t end;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1656,6 +1695,10 @@ typedef struct ImgConvertState {
     int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
+    /* Block status map, complete once extents_done is set */
+    GArray *extents;
+    bool extents_done;
+    guint extent_idx;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
@@ -1666,6 +1709,7 @@ typedef struct ImgConvertState {
     bool copy_range;
     bool salvage;
     bool quiet;
+    bool skip_identical;
     int min_sparse;
     int alignment;
     size_t cluster_sectors;
@@ -1690,6 +1734,62 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+/*
+ * Record the status found for [sector_num, s->sector_next_status) in the
+ * block status map, merging it with the previous extent if possible.
+ */
+static void convert_record_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ImgConvertExtent *last;
+
+    if (!s->extents) {
+        return;
+    }
+
+    if (s->extents->len) {
+        last = &g_array_index(s->extents, ImgConvertExtent,
+                              s->extents->len - 1);
+        if (last->end == sector_num && last->status == s->status) {
+            last->end = s->sector_next_status;
+            return;
+        }
+    }
+
+    if (s->extents->len >= CONVERT_MAX_EXTENTS) {
+        g_array_free(s->extents, true);
+        s->extents = NULL;
+        return;
+    }
+
+    g_array_append_val(s->extents, ((ImgConvertExtent) {
+        .sector_num = sector_num,
+        .end        = s->sector_next_status,
+        .status     = s->status,
+    }));
+}
+
+/*
+ * Set s->status and s->sector_next_status for sector_num from the block
+ * status map, if it covers sector_num.  Lookups must be done in ascending
+ * order.
+ */
+static void convert_lookup_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ImgConvertExtent *ext;
+
+    while (s->extent_idx < s->extents->len) {
+        ext = &g_array_index(s->extents, ImgConvertExtent, s->extent_idx);
+        if (ext->end > sector_num) {
+            if (ext->sector_num <= sector_num) {
+                s->status = ext->status;
+                s->sector_next_status = ext->end;
+            }
+            return;
+        }
+        s->extent_idx++;
+    }
+}
+
 static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
     int64_t src_cur_offset;
@@ -1711,6 +1811,11 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
+    if (s->sector_next_status <= sector_num && s->extents_done) {
+        /* Use what the first pass found, if it covers sector_num */
+        convert_lookup_extent(s, sector_num);
+    }
+
     if (s->sector_next_status <= sector_num) {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
@@ -1774,6 +1879,9 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         s->sector_next_status = sector_num + n;
+        if (!s->extents_done) {
+            convert_record_extent(s, sector_num);
+        }
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
@@ -1914,6 +2022,60 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
     return 0;
 }
 
+/*
+ * Write only those clusters of buf that differ from what the target already
+ * reads (e.g. from its backing file), and leave the others alone.
+ */
+static int coroutine_fn convert_co_write_changed(ImgConvertState *s,
+                                                 int64_t sector_num,
+                                                 int nb_sectors, uint8_t *buf,
+                                                 uint8_t *cmp_buf)
+{
+    int64_t granularity = s->cluster_sectors ?: s->alignment;
+    int ret;
+
+    ret = blk_co_pread(s->target, sector_num << BDRV_SECTOR_BITS,
+                       nb_sectors << BDRV_SECTOR_BITS, cmp_buf, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (nb_sectors > 0) {
+        bool changed = false;
+        int n = 0;
+
+        /* Find a run of clusters that are either all changed or all not */
+        while (n < nb_sectors) {
+            int64_t cur = sector_num + n;
+            int len = MIN(nb_sectors - n,
+                          granularity - cur % granularity);
+            bool cur_changed = memcmp(buf + n * BDRV_SECTOR_SIZE,
+                                      cmp_buf + n * BDRV_SECTOR_SIZE,
+                                      len * BDRV_SECTOR_SIZE);
+
+            if (n && cur_changed != changed) {
+                break;
+            }
+            changed = cur_changed;
+            n += len;
+        }
+
+        if (changed) {
+            ret = convert_co_write(s, sector_num, n, buf, BLK_DATA);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+        cmp_buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector_num,
                                               int nb_sectors)
 {
@@ -1949,6 +2111,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
+    uint8_t *cmp_buf = NULL;
     int ret, i;
     int index = -1;
 
@@ -1962,12 +2125,16 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
     s->running_coroutines++;
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    if (s->skip_identical) {
+        cmp_buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    }
 
     while (1) {
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
         bool copy_range;
+        bool copy_range_failed = false;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1998,7 +2165,8 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         }
 
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        copy_range = s->copy_range && !copy_range_failed &&
+                     status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -2024,9 +2192,19 @@ retry:
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
                 if (ret) {
-                    s->copy_range = false;
+                    /*
+                     * Offloading may fail for just some requests (e.g.
+                     * unaligned ones); only stop trying it for the rest of
+                     * the image if it is not supported at all.
+                     */
+                    if (ret == -ENOTSUP) {
+                        s->copy_range = false;
+                    }
+                    copy_range_failed = true;
                     goto retry;
                 }
+            } else if (s->skip_identical && status == BLK_DATA) {
+                ret = convert_co_write_changed(s, sector_num, n, buf, cmp_buf);
             } else {
                 ret = convert_co_write(s, sector_num, n, buf, status);
             }
@@ -2056,6 +2234,7 @@ retry:
     }
 
     qemu_vfree(buf);
+    qemu_vfree(cmp_buf);
     s->co[index] = NULL;
     s->running_coroutines--;
     if (!s->running_coroutines && s->ret == -EINPROGRESS) {
@@ -2085,10 +2264,18 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
+    /*
+     * Remember the block status found while counting the allocated sectors,
+     * so the copy does not have to query it again.  Adjacent runs with the
+     * same status are merged, so the copy can handle zero and unallocated
+     * areas in as few requests as possible.
+     */
+    s->extents = g_array_new(false, false, sizeof(ImgConvertExtent));
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            return n;
+            ret = n;
+            goto out;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
@@ -2099,6 +2286,8 @@ static int convert_do_copy(ImgConvertState *s)
 
     /* Do the copy */
     s->sector_next_status = 0;
+    s->extents_done = s->extents != NULL;
+    s->extent_idx = 0;
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
@@ -2112,15 +2301,18 @@ static int convert_do_copy(ImgConvertState *s)
         main_loop_wait(false);
     }
 
-    if (s->compressed && !s->ret) {
+    ret = s->ret;
+    if (s->compressed && !ret) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, 0, NULL);
-        if (ret < 0) {
-            return ret;
-        }
     }
 
-    return s->ret;
+out:
+    if (s->extents) {
+        g_array_free(s->extents, true);
+        s->extents = NULL;
+    }
+    return ret;
 }
 
 /* Check that bitmaps can be copied, or output an error */
@@ -2243,6 +2435,7 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"skip-identical", no_argument, 0, OPTION_SKIP_IDENTICAL},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2377,6 +2570,9 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_SKIP_IDENTICAL:
+            s.skip_identical = true;
+            break;
         }
     }
 
@@ -2404,6 +2600,11 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (s.copy_range && s.skip_identical) {
+        error_report("Cannot use copy offloading with --skip-identical");
+        goto fail_getopt;
+    }
+
     if (tgt_image_opts && !skip_create) {
         error_report("--target-image-opts requires use of -n flag");
         goto fail_getopt;
@@ -15,6 +15,12 @@
 #include "replay-internal.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
+#include "qemu/bswap.h"
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 
 /* Mutex to protect reading and writing events to the log.
    data_kind and has_unread_data are also protected
@@ -30,6 +36,59 @@ static unsigned long mutex_head, mutex_tail;
 static bool write_error;
 FILE *replay_file;
 
+/*
+ * The event stream is not written to the file byte by byte. It is
+ * accumulated in the memory buffer and stored as a sequence of blocks,
+ * each of them optionally compressed with zstd:
+ *
+ *   1-byte block codec (REPLAY_BLOCK_*)
+ *   4-byte size of the uncompressed block data
+ *   4-byte size of the stored (maybe compressed) block data
+ *   8-byte instruction count at the start of the block
+ *   stored block data
+ *
+ * When recording is finished, the index of all blocks is appended
+ * after the last one and its position is saved into the log header.
+ * Until then the header has a zero position, and the blocks are found
+ * by scanning the log if the recording was cut short.
+ * The index allows jumping to any offset of the event stream
+ * without decompressing the preceding blocks.
+ */
+#define REPLAY_BLOCK_RAW            0
+#define REPLAY_BLOCK_ZSTD           1
+#define REPLAY_BLOCK_HEADER_SIZE    (1 + 2 * sizeof(uint32_t) + sizeof(uint64_t))
+/* Uncompressed size of the block */
+#define REPLAY_BLOCK_SIZE           (256 * KiB)
+/*
+ * Blocks are preferably cut at checkpoints, when the buffer is
+ * at least this full. This makes block boundaries match the
+ * synchronization points of the log.
+ */
+#define REPLAY_BLOCK_CHECKPOINT_CUT (REPLAY_BLOCK_SIZE / 2)
+
+/* Buffer with the current block of the event stream */
+static uint8_t *log_buf;
+/* Number of valid bytes in the buffer */
+static size_t log_len;
+/* Read/write position in the buffer */
+static size_t log_pos;
+/* Offset of the buffer start in the event stream */
+static uint64_t log_offset;
+/* Instruction count at the start of the current block */
+static uint64_t log_icount;
+/* Index of the current block in the replay_log_index array */
+static unsigned int log_block;
+/* Set when the reading reached the end of the event stream */
+static bool log_eof;
+/* Set when the log could not be read or decompressed */
+static bool log_error;
+/* Buffer for the stored (compressed) block data */
+static uint8_t *log_zbuf;
+static size_t log_zbuf_size;
+
+/* Index of the blocks of the log */
+static GArray *replay_log_index;
+
 static void replay_write_error(void)
 {
     if (!write_error) {
@@ -44,12 +103,383 @@ static void replay_read_error(void)
     exit(1);
 }
 
+static void replay_file_put_dword(uint32_t dword)
+{
+    uint32_t val = cpu_to_be32(dword);
+
+    if (fwrite(&val, sizeof(val), 1, replay_file) != 1) {
+        replay_write_error();
+    }
+}
+
+static void replay_file_put_qword(uint64_t qword)
+{
+    uint64_t val = cpu_to_be64(qword);
+
+    if (fwrite(&val, sizeof(val), 1, replay_file) != 1) {
+        replay_write_error();
+    }
+}
+
+static bool replay_file_get_dword(uint32_t *dword)
+{
+    uint32_t val;
+
+    if (fread(&val, sizeof(val), 1, replay_file) != 1) {
+        return false;
+    }
+    *dword = be32_to_cpu(val);
+    return true;
+}
+
+static bool replay_file_get_qword(uint64_t *qword)
+{
+    uint64_t val;
+
+    if (fread(&val, sizeof(val), 1, replay_file) != 1) {
+        return false;
+    }
+    *qword = be64_to_cpu(val);
+    return true;
+}
+
+#ifdef CONFIG_ZSTD
+static uint8_t *replay_log_zbuf(size_t size)
+{
+    if (log_zbuf_size < size) {
+        g_free(log_zbuf);
+        log_zbuf = g_malloc(size);
+        log_zbuf_size = size;
+    }
+    return log_zbuf;
+}
+#endif
+
+/*! Compresses and writes the current block to the file. */
+static void replay_log_write_block(void)
+{
+    ReplayLogIndexEntry entry;
+    const uint8_t *data = log_buf;
+    uint32_t stored = log_len;
+    uint8_t codec = REPLAY_BLOCK_RAW;
+    off_t pos;
+
+    if (!log_len) {
+        return;
+    }
+
+#ifdef CONFIG_ZSTD
+    {
+        size_t bound = ZSTD_compressBound(log_len);
+        uint8_t *zbuf = replay_log_zbuf(bound);
+        size_t ret = ZSTD_compress(zbuf, bound, log_buf, log_len, 1);
+
+        if (!ZSTD_isError(ret) && ret < log_len) {
+            data = zbuf;
+            stored = ret;
+            codec = REPLAY_BLOCK_ZSTD;
+        }
+    }
+#endif
+
+    pos = ftello(replay_file);
+    if (pos < 0) {
+        replay_write_error();
+        return;
+    }
+
+    entry.offset = log_offset;
+    entry.file_pos = pos;
+    entry.icount = log_icount;
+    g_array_append_val(replay_log_index, entry);
+
+    if (putc(codec, replay_file) == EOF) {
+        replay_write_error();
+    }
+    replay_file_put_dword(log_len);
+    replay_file_put_dword(stored);
+    replay_file_put_qword(log_icount);
+    if (fwrite(data, 1, stored, replay_file) != stored) {
+        replay_write_error();
+    }
+
+    log_offset += log_len;
+    log_len = 0;
+    log_pos = 0;
+    log_icount = replay_state.current_icount;
+}
+
+/*! Reads and decompresses the specified block of the log. */
+static bool replay_log_read_block(unsigned int block)
+{
+    ReplayLogIndexEntry *entry;
+    uint32_t raw_size, stored;
+    uint64_t icount;
+    int codec;
+
+    if (block >= replay_log_index->len) {
+        return false;
+    }
+    entry = &g_array_index(replay_log_index, ReplayLogIndexEntry, block);
+
+    if (fseeko(replay_file, entry->file_pos, SEEK_SET) < 0) {
+        goto fail;
+    }
+    codec = getc(replay_file);
+    if (codec == EOF
+        || !replay_file_get_dword(&raw_size)
+        || !replay_file_get_dword(&stored)
+        || !replay_file_get_qword(&icount)
+        || raw_size > REPLAY_BLOCK_SIZE) {
+        goto fail;
+    }
+
+    switch (codec) {
+    case REPLAY_BLOCK_RAW:
+        if (stored != raw_size
+            || fread(log_buf, 1, raw_size, replay_file) != raw_size) {
+            goto fail;
+        }
+        break;
+#ifdef CONFIG_ZSTD
+    case REPLAY_BLOCK_ZSTD:
+    {
+        uint8_t *zbuf = replay_log_zbuf(stored);
+        size_t ret;
+
+
+        if (fread(zbuf, 1, stored, replay_file) != stored) {
+            goto fail;
+        }
+        ret = ZSTD_decompress(log_buf, REPLAY_BLOCK_SIZE, zbuf, stored);
+        if (ZSTD_isError(ret) || ret != raw_size) {
+            goto fail;
+        }
+        break;
+    }
+#endif
+    default:
+        error_report("Replay: unsupported log block encoding %d", codec);
+        goto fail;
+    }
+
+    log_block = block;
+    log_offset = entry->offset;
+    log_icount = icount;
+    log_len = raw_size;
+    log_pos = 0;
+    return true;
+
+fail:
+    log_error = true;
+    return false;
+}
+
+/*! Makes sure that at least one byte can be read from the buffer. */
+static bool replay_log_fill(void)
+{
+    while (log_pos == log_len) {
+        if (log_eof || log_error
+            || !replay_log_read_block(log_block + 1)) {
+            log_eof = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*! Builds the block index of the log which was not finalized. */
+static void replay_log_scan_blocks(void)
+{
+    ReplayLogIndexEntry entry = {
+        .file_pos = HEADER_SIZE,
+    };
+    uint32_t raw_size, stored;
+    off_t file_size;
+
+    if (fseeko(replay_file, 0, SEEK_END) < 0) {
+        return;
+    }
+    file_size = ftello(replay_file);
+    if (file_size < 0) {
+        return;
+    }
+
+    /* The last block may be truncated, skip it in that case */
+    while (fseeko(replay_file, entry.file_pos, SEEK_SET) == 0
+           && getc(replay_file) != EOF
+           && replay_file_get_dword(&raw_size)
+           && replay_file_get_dword(&stored)
+           && replay_file_get_qword(&entry.icount)
+           && entry.file_pos + REPLAY_BLOCK_HEADER_SIZE + stored
+              <= file_size) {
+        g_array_append_val(replay_log_index, entry);
+        entry.offset += raw_size;
+        entry.file_pos += REPLAY_BLOCK_HEADER_SIZE + stored;
+    }
+}
+
+static bool replay_log_load_index(uint64_t index_pos)
+{
+    ReplayLogIndexEntry entry;
+    uint32_t count, i;
+
+    if (index_pos > INT64_MAX
+        || fseeko(replay_file, index_pos, SEEK_SET) < 0
+        || !replay_file_get_dword(&count)) {
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        if (!replay_file_get_qword(&entry.offset)
+            || !replay_file_get_qword(&entry.file_pos)
+            || !replay_file_get_qword(&entry.icount)) {
+            g_array_set_size(replay_log_index, 0);
+            return false;
+        }
+        g_array_append_val(replay_log_index, entry);
+    }
+    return true;
+}
+
+void replay_log_open(void)
+{
+    replay_log_index = g_array_new(false, false, sizeof(ReplayLogIndexEntry));
+    log_buf = g_malloc(REPLAY_BLOCK_SIZE);
+    log_len = 0;
+    log_pos = 0;
+    log_offset = 0;
+    log_icount = 0;
+    log_eof = false;
+    log_error = false;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        /*
+         * The position of the index is filled in when recording is
+         * finished; zero tells a log that was not finished properly.
+         */
+        replay_file_put_dword(REPLAY_VERSION);
+        replay_file_put_qword(0);
+        fflush(replay_file);
+    } else if (replay_mode == REPLAY_MODE_PLAY) {
+        uint32_t version;
+        uint64_t index_pos;
+
+        if (!replay_file_get_dword(&version)
+            || version != REPLAY_VERSION) {
+            fprintf(stderr, "Replay: invalid input log file version\n");
+            exit(1);
+        }
+        if (!replay_file_get_qword(&index_pos)) {
+            replay_read_error();
+        }
+        if (!index_pos || !replay_log_load_index(index_pos)) {
+            warn_report("Replay: log index is missing, "
+                        "the recording was not finished properly");
+            replay_log_scan_blocks();
+        }
+        /* Position before the first block */
+        log_block = -1;
+    }
+}
+
+void replay_log_close(void)
+{
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        ReplayLogIndexEntry *entry;
+        off_t index_pos;
+        unsigned int i;
+
+        replay_log_write_block();
+
+        index_pos = ftello(replay_file);
+        if (index_pos < 0) {
+            replay_write_error();
+            index_pos = 0;
+        }
+        replay_file_put_dword(replay_log_index->len);
+        for (i = 0; i < replay_log_index->len; i++) {
+            entry = &g_array_index(replay_log_index, ReplayLogIndexEntry, i);
+            replay_file_put_qword(entry->offset);
+            replay_file_put_qword(entry->file_pos);
+            replay_file_put_qword(entry->icount);
+        }
+
+        /* point the header to the index */
+        if (fseeko(replay_file, sizeof(uint32_t), SEEK_SET) < 0) {
+            replay_write_error();
+        } else {
+            replay_file_put_qword(index_pos);
+        }
+    }
+
+    g_array_free(replay_log_index, true);
+    replay_log_index = NULL;
+    g_free(log_buf);
+    log_buf = NULL;
+    g_free(log_zbuf);
+    log_zbuf = NULL;
+    log_zbuf_size = 0;
+}
+
+uint64_t replay_log_tell(void)
+{
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        return log_offset + log_len;
+    }
+    return log_offset + log_pos;
+}
+
+bool replay_log_seek(uint64_t offset)
+{
+    ReplayLogIndexEntry *entry;
+    unsigned int lo = 0, hi = replay_log_index->len;
+
+    assert(replay_mode == REPLAY_MODE_PLAY);
+
+    log_eof = false;
+    if (offset >= log_offset && offset < log_offset + log_len) {
+        /* Already in the current block */
+        log_pos = offset - log_offset;
+        return true;
+    }
+    if (!hi) {
+        /* Nothing was recorded, or no block of the log could be found */
+        return false;
+    }
+
+    /* Find the last block which starts at or before the offset */
+    while (hi - lo > 1) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        entry = &g_array_index(replay_log_index, ReplayLogIndexEntry, mid);
+        if (entry->offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!replay_log_read_block(lo) || offset - log_offset > log_len) {
+        return false;
+    }
+    log_pos = offset - log_offset;
+    return true;
+}
+
+void replay_log_checkpoint(void)
+{
+    if (replay_mode == REPLAY_MODE_RECORD
+        && log_len >= REPLAY_BLOCK_CHECKPOINT_CUT) {
+        replay_log_write_block();
+    }
+}
+
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        if (putc(byte, replay_file) == EOF) {
-            replay_write_error();
+        if (log_len == REPLAY_BLOCK_SIZE) {
+            replay_log_write_block();
         }
+        log_buf[log_len++] = byte;
     }
 }
 
@@ -82,8 +512,17 @@ void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        if (fwrite(buf, 1, size, replay_file) != size) {
-            replay_write_error();
+        while (size) {
+            size_t chunk;
+
+            if (log_len == REPLAY_BLOCK_SIZE) {
+                replay_log_write_block();
+            }
+            chunk = MIN(size, REPLAY_BLOCK_SIZE - log_len);
+            memcpy(log_buf + log_len, buf, chunk);
+            log_len += chunk;
+            buf += chunk;
+            size -= chunk;
         }
     }
 }
@@ -92,11 +531,10 @@ uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        int r = getc(replay_file);
-        if (r == EOF) {
+        if (!replay_log_fill()) {
             replay_read_error();
         }
-        byte = r;
+        byte = log_buf[log_pos++];
     }
     return byte;
 }
@@ -134,13 +572,27 @@ int64_t replay_get_qword(void)
     return qword;
 }
 
+static void replay_get_data(uint8_t *buf, size_t size)
+{
+    while (size) {
+        size_t chunk;
+
+        if (!replay_log_fill()) {
+            replay_read_error();
+        }
+        chunk = MIN(size, log_len - log_pos);
+        memcpy(buf, log_buf + log_pos, chunk);
+        log_pos += chunk;
+        buf += chunk;
+        size -= chunk;
+    }
+}
+
 void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
-            replay_read_error();
-        }
+        replay_get_data(buf, *size);
     }
 }
 
@@ -149,23 +601,21 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
-            replay_read_error();
-        }
+        replay_get_data(*buf, *size);
     }
 }
 
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
-            error_report("replay file is over");
-            qemu_system_vmstop_request_prepare();
-            qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        if (log_error) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
+        } else if (log_eof) {
+            error_report("replay file is over");
+            qemu_system_vmstop_request_prepare();
+            qemu_system_vmstop_request(RUN_STATE_PAUSED);
         }
     }
 }
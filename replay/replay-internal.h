@@ -12,6 +12,12 @@
  *
  */
 
+/* Current version of the replay mechanism.
+   Increase it when file format changes. */
+#define REPLAY_VERSION              0xe0200d
+/* Size of replay log header: version and position of the block index */
+#define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
+
 /* Asynchronous events IDs */
 
 typedef enum ReplayAsyncEventKind {
@@ -74,7 +80,7 @@ typedef struct ReplayState {
     unsigned int data_kind;
     /*! Flag which indicates that event is not processed yet. */
     unsigned int has_unread_data;
-    /*! Temporary variable for saving current log offset. */
+    /*! Temporary variable for saving current event stream offset. */
     uint64_t file_offset;
     /*! Next block operation id.
         This counter is global, because requests from different
@@ -87,6 +93,16 @@ typedef struct ReplayState {
 } ReplayState;
 extern ReplayState replay_state;
 
+/* Entry of the replay log block index */
+typedef struct ReplayLogIndexEntry {
+    /*! Offset of the block data in the event stream. */
+    uint64_t offset;
+    /*! Position of the block in the log file. */
+    uint64_t file_pos;
+    /*! Instruction count at the start of the block. */
+    uint64_t icount;
+} ReplayLogIndexEntry;
+
 /* File for replay writing */
 extern FILE *replay_file;
 /* Instruction count of the replay breakpoint */
@@ -94,6 +110,22 @@ extern uint64_t replay_break_icount;
 /* Timer for the replay breakpoint callback */
 extern QEMUTimer *replay_break_timer;
 
+/*! Sets up the buffered event stream of the opened log file.
+    Checks the header and loads the block index in play mode. */
+void replay_log_open(void);
+/*! Flushes the event stream, writes the block index and the header
+    in record mode and frees the buffers. */
+void replay_log_close(void);
+/*! Returns current offset in the event stream. */
+uint64_t replay_log_tell(void);
+/*! Moves to the specified event stream offset
+    by decompressing the single block containing it.
+    Returns false if the offset is not in the log. */
+bool replay_log_seek(uint64_t offset);
+/*! Starts new log block at the checkpoint if the current one
+    is big enough. */
+void replay_log_checkpoint(void);
+
 void replay_put_byte(uint8_t byte);
 void replay_put_event(uint8_t event);
 void replay_put_word(uint16_t word);
@@ -20,12 +20,6 @@
 #include "sysemu/cpus.h"
 #include "qemu/error-report.h"
 
-/* Current version of the replay mechanism.
-   Increase it when file format changes. */
-#define REPLAY_VERSION              0xe0200c
-/* Size of replay log header */
-#define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
-
 ReplayMode replay_mode = REPLAY_MODE_NONE;
 char *replay_snapshot;
 
@@ -184,6 +178,7 @@ bool replay_checkpoint(ReplayCheckpoint checkpoint)
         }
     } else if (replay_mode == REPLAY_MODE_RECORD) {
         g_assert(replay_mutex_locked());
+        replay_log_checkpoint();
         replay_put_event(EVENT_CHECKPOINT + checkpoint);
     }
     return true;
@@ -261,17 +256,9 @@ static void replay_enable(const char *fname, int mode)
     replay_state.current_icount = 0;
     replay_state.has_unread_data = 0;
 
-    /* skip file header for RECORD and check it for PLAY */
-    if (replay_mode == REPLAY_MODE_RECORD) {
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
-    } else if (replay_mode == REPLAY_MODE_PLAY) {
-        unsigned int version = replay_get_dword();
-        if (version != REPLAY_VERSION) {
-            fprintf(stderr, "Replay: invalid input log file version\n");
-            exit(1);
-        }
-        /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+    /* write file header for RECORD and check it for PLAY */
+    replay_log_open();
+    if (replay_mode == REPLAY_MODE_PLAY) {
         replay_fetch_data_kind();
     }
 
@@ -357,12 +344,10 @@ void replay_finish(void)
             replay_shutdown_request(SHUTDOWN_CAUSE_HOST_SIGNAL);
             /* write end event */
             replay_put_event(EVENT_END);
-
-            /* write header */
-            fseek(replay_file, 0, SEEK_SET);
-            replay_put_dword(REPLAY_VERSION);
         }
 
+        /* write the last block, the index and the header */
+        replay_log_close();
         fclose(replay_file);
         replay_file = NULL;
     }
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+#
+# Latency percentiles of block request stages from the block layer flight
+# recorder (x-debug-query-block-trace)
+#
+# Usage: block_trace_stats.py <QMP socket | JSON file>
+#
+# With a QMP socket, the events are queried in the binary format; a JSON
+# file must contain the return value of x-debug-query-block-trace in either
+# format.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import base64
+import json
+import os
+import stat
+import struct
+import sys
+from collections import defaultdict
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', 'python'))
+from qemu.qmp.legacy import QEMUMonitorProtocol
+
+
+# Same order as XDbgBlockTraceEvent; every stage has a start and an end
+# event
+STAGES = ['read', 'write', 'discard', 'drain-wait', 'throttle',
+          'serialise-wait', 'driver', 'lock-wait', 'cache-miss', 'host-io']
+
+RECORD = struct.Struct('<qQQqIHH')
+
+
+def decode(context):
+    '''Return the events of @context as (time, request, node, event)'''
+    if 'records' in context:
+        return [(r['time'], r['request'], r['node'], r['event'])
+                for r in context['records']]
+
+    events = []
+    data = base64.b64decode(context.get('data', ''))
+    for time, request, node, _offset, _bytes, event, _ in \
+            RECORD.iter_unpack(data):
+        stage, end = divmod(event, 2)
+        events.append((time, request, node,
+                       STAGES[stage] + ('-end' if end else '-start')))
+    return events
+
+
+def stage_latencies(trace):
+    '''Return {(node name, stage): [latency in ns]}'''
+    names = {n['id']: n['name'] for n in trace['nodes']}
+    latencies = defaultdict(list)
+
+    for context in trace['contexts']:
+        started = defaultdict(list)
+        for time, request, node, event in decode(context):
+            stage, _, kind = event.rpartition('-')
+            key = (request, node, stage)
+            if kind == 'start':
+                started[key].append(time)
+            elif started[key]:
+                # An end without a start was cut off by the ring
+                name = names.get(node, f'<deleted {node:#x}>')
+                latencies[(name, stage)].append(time - started[key].pop())
+
+    return latencies
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, len(values) * p // 100)]
+
+
+def print_stats(trace):
+    for context in trace['contexts']:
+        if context['dropped']:
+            print(f"{context.get('iothread', 'main loop')}: "
+                  f"{context['dropped']} older events dropped")
+
+    print(f"{'node':<24} {'stage':<16} {'count':>8} {'p50':>10} "
+          f"{'p90':>10} {'p99':>10} {'max':>10}")
+    for (name, stage), values in sorted(stage_latencies(trace).items()):
+        values.sort()
+        us = [percentile(values, p) / 1000 for p in (50, 90, 99)]
+        us.append(values[-1] / 1000)
+        print(f'{name:<24} {stage:<16} {len(values):>8} ' +
+              ' '.join(f'{v:>10.1f}' for v in us))
+    print('(latencies in microseconds)')
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        sys.exit(f'Usage: {sys.argv[0]} <QMP socket | JSON file>')
+
+    path = sys.argv[1]
+    if stat.S_ISSOCK(os.stat(path).st_mode):
+        qmp = QEMUMonitorProtocol(path)
+        qmp.connect()
+        trace = qmp.command('x-debug-query-block-trace', format='binary')
+        qmp.close()
+    else:
+        with open(path, encoding='utf-8') as f:
+            trace = json.load(f)
+        trace = trace.get('return', trace)
+
+    print_stats(trace)
@@ -20,7 +20,7 @@
 
 import argparse
 import struct
-from collections import namedtuple
+from collections import namedtuple, Counter
 
 # This mirrors some of the global replay state which some of the
 # stream loading refers to. Some decoders may read the next event so
@@ -34,6 +34,8 @@ def __init__(self):
         self.already_read = False
         self.current_checkpoint = 0
         self.checkpoint = 0
+        self.quiet = False
+        self.histogram = Counter()
 
     def set_event(self, ev):
         self.event = ev
@@ -94,11 +96,15 @@ def call_decode(table, index, dumpfile):
         print("Decode Table is:\n%s" % (table))
         return False
     else:
+        replay_state.histogram[decoder.name] += 1
         return decoder.fn(decoder.eid, decoder.name, dumpfile)
 
 # Print event
 def print_event(eid, name, string=None, event_count=None):
     "Print event with count"
+    if replay_state.quiet:
+        return
+
     if not event_count:
         event_count = replay_state.event_count
 
@@ -268,24 +274,241 @@ def decode_clock(eid, name, dumpfile):
                   Decoder(28, "EVENT_CP_RESET", decode_checkpoint),
 ]
 
+# Decoders for the events of the current log format
+def decode_no_data(eid, name, dumpfile):
+    print_event(eid, name)
+    return True
+
+def decode_end(eid, name, dumpfile):
+    print_event(eid, name)
+    return False
+
+def read_array(dumpfile):
+    "Read an array stored as 4-byte length and data"
+    size = read_dword(dumpfile)
+    return dumpfile.read(size)
+
+def decode_async_id(eid, name, dumpfile):
+    event_id = read_qword(dumpfile)
+    print_event(eid, name, "id 0x%x" % (event_id))
+    return True
+
+def decode_async_input(eid, name, dumpfile):
+    input_type = read_dword(dumpfile)
+    if input_type == 0:
+        # key: key value type and the value, down flag
+        key_type = read_dword(dumpfile)
+        if key_type == 0:
+            value = read_qword(dumpfile)
+        else:
+            value = read_dword(dumpfile)
+        down = read_byte(dumpfile)
+        print_event(eid, name, "key 0x%x down %d" % (value, down))
+    elif input_type == 1:
+        button = read_dword(dumpfile)
+        down = read_byte(dumpfile)
+        print_event(eid, name, "button %d down %d" % (button, down))
+    else:
+        axis = read_dword(dumpfile)
+        value = read_qword(dumpfile)
+        print_event(eid, name, "axis %d value 0x%x" % (axis, value))
+    return True
+
+def decode_async_char_read(eid, name, dumpfile):
+    char_id = read_byte(dumpfile)
+    data = read_array(dumpfile)
+    print_event(eid, name, "chardev %d, %d bytes" % (char_id, len(data)))
+    return True
+
+def decode_async_net(eid, name, dumpfile):
+    net_id = read_byte(dumpfile)
+    flags = read_dword(dumpfile)
+    data = read_array(dumpfile)
+    print_event(eid, name, "netdev %d flags 0x%x, %d bytes" %
+                (net_id, flags, len(data)))
+    return True
+
+def decode_char_write(eid, name, dumpfile):
+    res = read_dword(dumpfile)
+    offset = read_dword(dumpfile)
+    print_event(eid, name, "%d bytes written at %d" % (res, offset))
+    return True
+
+def decode_char_read_all(eid, name, dumpfile):
+    data = read_array(dumpfile)
+    print_event(eid, name, "%d bytes" % (len(data)))
+    return True
+
+def decode_char_read_all_error(eid, name, dumpfile):
+    res = read_dword(dumpfile)
+    print_event(eid, name, "%d" % (res))
+    return True
+
+def decode_audio_out_qword(eid, name, dumpfile):
+    played = read_qword(dumpfile)
+    print_event(eid, name, "%d" % (played))
+    return True
+
+def decode_audio_in(eid, name, dumpfile):
+    recorded = read_qword(dumpfile)
+    wpos = read_qword(dumpfile)
+    # left and right channel values of every recorded sample
+    dumpfile.read(recorded * 16)
+    print_event(eid, name, "%d samples, wpos %d" % (recorded, wpos))
+    return True
+
+def decode_random(eid, name, dumpfile):
+    ret = read_dword(dumpfile)
+    data = read_array(dumpfile)
+    print_event(eid, name, "ret %d, %d bytes" % (ret, len(data)))
+    return True
+
+def decode_checkpoint_v13(eid, name, dumpfile):
+    print_event(eid, name)
+    return True
+
+# Block-compressed stream, async checkpoint byte removed
+v13_event_table = [Decoder(0, "EVENT_INSTRUCTION", decode_instruction),
+                   Decoder(1, "EVENT_INTERRUPT", decode_interrupt),
+                   Decoder(2, "EVENT_EXCEPTION", decode_no_data),
+                   Decoder(3, "EVENT_ASYNC_BH", decode_async_id),
+                   Decoder(4, "EVENT_ASYNC_BH_ONESHOT", decode_async_id),
+                   Decoder(5, "EVENT_ASYNC_INPUT", decode_async_input),
+                   Decoder(6, "EVENT_ASYNC_INPUT_SYNC", decode_no_data),
+                   Decoder(7, "EVENT_ASYNC_CHAR_READ", decode_async_char_read),
+                   Decoder(8, "EVENT_ASYNC_BLOCK", decode_async_id),
+                   Decoder(9, "EVENT_ASYNC_NET", decode_async_net),
+                   Decoder(10, "EVENT_SHUTDOWN", decode_no_data),
+                   Decoder(11, "EVENT_SHUTDOWN_HOST_ERR", decode_no_data),
+                   Decoder(12, "EVENT_SHUTDOWN_HOST_QMP_QUIT", decode_no_data),
+                   Decoder(13, "EVENT_SHUTDOWN_HOST_QMP_RESET", decode_no_data),
+                   Decoder(14, "EVENT_SHUTDOWN_HOST_SIGNAL", decode_no_data),
+                   Decoder(15, "EVENT_SHUTDOWN_HOST_UI", decode_no_data),
+                   Decoder(16, "EVENT_SHUTDOWN_GUEST_SHUTDOWN", decode_no_data),
+                   Decoder(17, "EVENT_SHUTDOWN_GUEST_RESET", decode_no_data),
+                   Decoder(18, "EVENT_SHUTDOWN_GUEST_PANIC", decode_no_data),
+                   Decoder(19, "EVENT_SHUTDOWN_SUBSYS_RESET", decode_no_data),
+                   Decoder(20, "EVENT_SHUTDOWN___MAX", decode_no_data),
+                   Decoder(21, "EVENT_CHAR_WRITE", decode_char_write),
+                   Decoder(22, "EVENT_CHAR_READ_ALL", decode_char_read_all),
+                   Decoder(23, "EVENT_CHAR_READ_ALL_ERROR",
+                           decode_char_read_all_error),
+                   Decoder(24, "EVENT_AUDIO_OUT", decode_audio_out_qword),
+                   Decoder(25, "EVENT_AUDIO_IN", decode_audio_in),
+                   Decoder(26, "EVENT_RANDOM", decode_random),
+                   Decoder(27, "EVENT_CLOCK_HOST", decode_clock),
+                   Decoder(28, "EVENT_CLOCK_VIRTUAL_RT", decode_clock),
+                   Decoder(29, "EVENT_CP_CLOCK_WARP_START",
+                           decode_checkpoint_v13),
+                   Decoder(30, "EVENT_CP_CLOCK_WARP_ACCOUNT",
+                           decode_checkpoint_v13),
+                   Decoder(31, "EVENT_CP_RESET_REQUESTED",
+                           decode_checkpoint_v13),
+                   Decoder(32, "EVENT_CP_SUSPEND_REQUESTED",
+                           decode_checkpoint_v13),
+                   Decoder(33, "EVENT_CP_CLOCK_VIRTUAL", decode_checkpoint_v13),
+                   Decoder(34, "EVENT_CP_CLOCK_HOST", decode_checkpoint_v13),
+                   Decoder(35, "EVENT_CP_CLOCK_VIRTUAL_RT",
+                           decode_checkpoint_v13),
+                   Decoder(36, "EVENT_CP_INIT", decode_checkpoint_v13),
+                   Decoder(37, "EVENT_CP_RESET", decode_checkpoint_v13),
+                   Decoder(38, "EVENT_END", decode_end),
+]
+
+class BlockStream(object):
+    """Event stream of the block-compressed log.
+
+    Blocks are read one at a time and decompressed when needed,
+    see replay-internal.c for the description of the format.
+    """
+    HEADER = struct.Struct('>BIIQ')
+
+    def __init__(self, fin, index_pos):
+        self.fin = fin
+        self.index_pos = index_pos
+        self.data = b''
+        self.pos = 0
+        self.blocks = []
+
+    def next_block(self):
+        if self.index_pos and self.fin.tell() >= self.index_pos:
+            return False
+        hdr = self.fin.read(self.HEADER.size)
+        if len(hdr) < self.HEADER.size:
+            return False
+        codec, raw_size, stored, icount = self.HEADER.unpack(hdr)
+        data = self.fin.read(stored)
+        if codec == 1:
+            try:
+                import zstandard
+            except ImportError:
+                raise SystemExit("zstandard module is required to read "
+                                 "compressed replay logs")
+            data = zstandard.ZstdDecompressor().decompress(
+                data, max_output_size=raw_size)
+        elif codec != 0:
+            raise SystemExit("unknown block encoding %d" % (codec))
+        self.blocks.append((icount, raw_size, stored))
+        self.data = self.data[self.pos:] + data
+        self.pos = 0
+        return True
+
+    def read(self, size):
+        while len(self.data) - self.pos < size:
+            if not self.next_block():
+                break
+        res = self.data[self.pos:self.pos + size]
+        self.pos += len(res)
+        return res
+
+    def close(self):
+        self.fin.close()
+
+def print_histogram():
+    "Print the number of events of each kind"
+    total = sum(replay_state.histogram.values())
+    print("%d events" % (total))
+    for name, count in replay_state.histogram.most_common():
+        print("%12d %6.2f%% %s" % (count, count * 100.0 / total, name))
+
+def print_blocks(blocks):
+    "Print the statistics of the log blocks"
+    raw = sum(b[1] for b in blocks)
+    stored = sum(b[2] for b in blocks)
+    print("%d blocks, %d bytes of events stored in %d bytes" %
+          (len(blocks), raw, stored))
+    for i, (icount, raw_size, stored_size) in enumerate(blocks):
+        print("  block %d: icount %d, %d -> %d bytes" %
+              (i, icount, raw_size, stored_size))
+
 def parse_arguments():
     "Grab arguments for script"
     parser = argparse.ArgumentParser()
     parser.add_argument("-f", "--file", help='record/replay dump to read from',
                         required=True)
+    parser.add_argument("--histogram", action="store_true",
+                        help='print the number of events of each kind '
+                        'instead of the events themselves')
+    parser.add_argument("--blocks", action="store_true",
+                        help='print the compression statistics '
+                        'of the log blocks')
     return parser.parse_args()
 
-def decode_file(filename):
+def decode_file(filename, histogram=False, blocks=False):
     "Decode a record/replay dump"
     dumpfile = open(filename, "rb")
 
-    # read and throwaway the header
+    # read the header, newer logs store the block index position there
     version = read_dword(dumpfile)
-    junk = read_qword(dumpfile)
+    index_pos = read_qword(dumpfile)
 
     print("HEADER: version 0x%x" % (version))
+    replay_state.quiet = histogram
 
-    if version == 0xe02007:
+    if version == 0xe0200d:
+        event_decode_table = v13_event_table
+        dumpfile = BlockStream(dumpfile, index_pos)
+    elif version == 0xe02007:
         event_decode_table = v7_event_table
         replay_state.checkpoint_start = 12
     elif version == 0xe02006:
@@ -303,6 +526,11 @@ def decode_file(filename):
     finally:
         dumpfile.close()
 
+    if histogram:
+        print_histogram()
+    if blocks and isinstance(dumpfile, BlockStream):
+        print_blocks(dumpfile.blocks)
+
 if __name__ == "__main__":
     args = parse_arguments()
-    decode_file(args.file)
+    decode_file(args.file, args.histogram, args.blocks)
@@ -78,7 +78,7 @@ bool cpu_is_stopped(CPUState *cpu)
 
 bool cpu_work_list_empty(CPUState *cpu)
 {
-    return QSIMPLEQ_EMPTY_ATOMIC(&cpu->work_list);
+    return QSLIST_EMPTY_ATOMIC(&cpu->work_list);
 }
 
 bool cpu_thread_is_idle(CPUState *cpu)
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/bswap.h"
 #include "crypto/init.h"
 #include "crypto/cipher.h"
 
@@ -99,6 +100,95 @@ static void test_cipher_speed(size_t chunk_size,
     g_free(key);
 }
 
+/*
+ * Like the block layer does for LUKS and qcow2 encryption: every 512 byte
+ * sector of a chunk is encrypted with a plain64 IV of its own.
+ */
+static void test_cipher_speed_xts_sectors(size_t chunk_size,
+                                          QCryptoCipherAlgorithm alg)
+{
+    const QCryptoCipherMode mode = QCRYPTO_CIPHER_MODE_XTS;
+    const size_t sector_size = 512;
+    QCryptoCipher *cipher;
+    Error *err = NULL;
+    uint8_t *key = NULL, *iv = NULL;
+    uint8_t *plaintext = NULL, *ciphertext = NULL;
+    size_t nkey;
+    size_t niv;
+    const size_t total = 2 * GiB;
+    uint64_t sector = 0;
+    size_t remain, i;
+
+    if (!qcrypto_cipher_supports(alg, mode)) {
+        return;
+    }
+
+    nkey = qcrypto_cipher_get_key_len(alg) * 2;
+    niv = qcrypto_cipher_get_iv_len(alg, mode);
+
+    key = g_new0(uint8_t, nkey);
+    memset(key, g_test_rand_int(), nkey);
+
+    iv = g_new0(uint8_t, niv);
+
+    ciphertext = g_new0(uint8_t, chunk_size);
+
+    plaintext = g_new0(uint8_t, chunk_size);
+    memset(plaintext, g_test_rand_int(), chunk_size);
+
+    cipher = qcrypto_cipher_new(alg, mode,
+                                key, nkey, &err);
+    g_assert(cipher != NULL);
+
+    g_test_timer_start();
+    remain = total;
+    while (remain) {
+        for (i = 0; i < chunk_size; i += sector_size) {
+            stq_le_p(iv, sector++);
+            g_assert(qcrypto_cipher_setiv(cipher, iv, niv, &err) == 0);
+            g_assert(qcrypto_cipher_encrypt(cipher,
+                                            plaintext + i,
+                                            ciphertext + i,
+                                            sector_size,
+                                            &err) == 0);
+        }
+        remain -= chunk_size;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("enc(%s-%s) sectors chunk %zu bytes %.2f MB/sec ",
+                   QCryptoCipherAlgorithm_str(alg),
+                   QCryptoCipherMode_str(mode),
+                   chunk_size, (double)total / MiB / g_test_timer_last());
+
+    g_test_timer_start();
+    remain = total;
+    while (remain) {
+        for (i = 0; i < chunk_size; i += sector_size) {
+            stq_le_p(iv, sector++);
+            g_assert(qcrypto_cipher_setiv(cipher, iv, niv, &err) == 0);
+            g_assert(qcrypto_cipher_decrypt(cipher,
+                                            ciphertext + i,
+                                            plaintext + i,
+                                            sector_size,
+                                            &err) == 0);
+        }
+        remain -= chunk_size;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("dec(%s-%s) sectors chunk %zu bytes %.2f MB/sec ",
+                   QCryptoCipherAlgorithm_str(alg),
+                   QCryptoCipherMode_str(mode),
+                   chunk_size, (double)total / MiB / g_test_timer_last());
+
+    qcrypto_cipher_free(cipher);
+    g_free(plaintext);
+    g_free(ciphertext);
+    g_free(iv);
+    g_free(key);
+}
+
 
 static void test_cipher_speed_ecb_aes_128(const void *opaque)
 {
@@ -164,6 +254,18 @@ static void test_cipher_speed_xts_aes_256(const void *opaque)
                       QCRYPTO_CIPHER_ALG_AES_256);
 }
 
+static void test_cipher_speed_xts_sectors_aes_128(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    test_cipher_speed_xts_sectors(chunk_size, QCRYPTO_CIPHER_ALG_AES_128);
+}
+
+static void test_cipher_speed_xts_sectors_aes_256(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    test_cipher_speed_xts_sectors(chunk_size, QCRYPTO_CIPHER_ALG_AES_256);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -197,6 +299,8 @@ int main(int argc, char **argv)
         ADD_TEST(ctr, aes, 256, chunk);         \
         ADD_TEST(xts, aes, 128, chunk);         \
         ADD_TEST(xts, aes, 256, chunk);         \
+        ADD_TEST(xts_sectors, aes, 128, chunk); \
+        ADD_TEST(xts_sectors, aes, 256, chunk); \
     } while (0)
 
     ADD_TESTS(512);
@@ -0,0 +1,117 @@
+/*
+ * Throttle group speed benchmark
+ *
+ * Measures how many requests per second can go through
+ * throttle_group_co_io_limits_intercept() when the limits are generous
+ * enough that no request ever has to wait, with one or more group
+ * members submitting requests from different threads.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/thread.h"
+#include "qemu/throttle.h"
+#include "block/throttle-groups.h"
+#include "sysemu/block-backend.h"
+
+#define BENCH_REQS_PER_THREAD   (2 * 1000 * 1000)
+#define BENCH_REQ_SIZE          4096
+
+typedef struct BenchThread {
+    QemuThread thread;
+    BlockBackend *blk;
+    ThrottleGroupMember *tgm;
+    bool is_write;
+} BenchThread;
+
+static void coroutine_fn bench_co_entry(void *opaque)
+{
+    BenchThread *bt = opaque;
+    int i;
+
+    for (i = 0; i < BENCH_REQS_PER_THREAD; i++) {
+        throttle_group_co_io_limits_intercept(bt->tgm, BENCH_REQ_SIZE,
+                                              bt->is_write);
+    }
+}
+
+static void *bench_thread_fn(void *opaque)
+{
+    Coroutine *co = qemu_coroutine_create(bench_co_entry, opaque);
+
+    qemu_coroutine_enter(co);
+    return NULL;
+}
+
+static void test_throttle_group_speed(const void *opaque)
+{
+    int nr_threads = GPOINTER_TO_INT(opaque);
+    BenchThread *threads = g_new0(BenchThread, nr_threads);
+    ThrottleConfig cfg;
+    double total;
+    int i;
+
+    for (i = 0; i < nr_threads; i++) {
+        BenchThread *bt = &threads[i];
+
+        /* No actual I/O is performed on these devices */
+        bt->blk = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+        bt->tgm = &blk_get_public(bt->blk)->throttle_group_member;
+        bt->is_write = i & 1;
+        throttle_group_register_tgm(bt->tgm, "bench",
+                                    blk_get_aio_context(bt->blk));
+    }
+
+    /* Limits high enough that the benchmark never has to wait */
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1ULL << 50;
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 1ULL << 40;
+    throttle_group_config(threads[0].tgm, &cfg);
+
+    g_test_timer_start();
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&threads[i].thread, "bench", bench_thread_fn,
+                           &threads[i], QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&threads[i].thread);
+    }
+    total = g_test_timer_elapsed();
+
+    g_test_message("throttle group, %d thread(s): %.2f Mreq/sec",
+                   nr_threads,
+                   (double)nr_threads * BENCH_REQS_PER_THREAD / total / 1e6);
+
+    for (i = 0; i < nr_threads; i++) {
+        throttle_group_unregister_tgm(threads[i].tgm);
+        blk_unref(threads[i].blk);
+    }
+    g_free(threads);
+}
+
+int main(int argc, char **argv)
+{
+    static const int nr_threads[] = { 1, 2, 4, 8 };
+    int i;
+
+    qemu_init_main_loop(&error_fatal);
+    bdrv_init();
+    module_call_init(MODULE_INIT_QOM);
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(nr_threads); i++) {
+        char *path = g_strdup_printf("/throttle/group/speed/threads-%d",
+                                     nr_threads[i]);
+        g_test_add_data_func(path, GINT_TO_POINTER(nr_threads[i]),
+                             test_throttle_group_speed);
+        g_free(path);
+    }
+
+    return g_test_run();
+}
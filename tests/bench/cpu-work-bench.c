@@ -0,0 +1,265 @@
+/*
+ * Benchmark of cross-CPU work queues, as used for broadcast TLB flushes
+ *
+ * This links the real cpus-common.c and drives it like TCG does.  Each
+ * vCPU thread runs bursts of busy work between cpu_exec_start() and
+ * cpu_exec_end(), cut short when qemu_cpu_kick() sets exit_request, and
+ * runs process_queued_cpu_work() in between.  Some of the vCPUs
+ * broadcast flushes the way tlb_flush_all_cpus_synced() does: an
+ * async_run_on_cpu() on every other vCPU and an async_safe_run_on_cpu()
+ * on themselves.  The latency of a broadcast is the time until the
+ * exclusive work has run, i.e. until the broadcasting vCPU may go on;
+ * it is reported as a function of the number of vCPUs.
+ *
+ * cputlb.c is built per target and cannot be linked here, so the flushes
+ * only clear a TLB-sized buffer and are not merged with pending ones.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/processor.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "qemu/memalign.h"
+#include "hw/core/cpu.h"
+
+#define TLB_SIZE 8192
+
+struct vcpu {
+    CPUState *cpu;
+    QemuThread thread;
+    bool broadcaster;
+    unsigned long flushes;
+    unsigned long broadcasts;
+    uint64_t latency_ns;
+    int64_t broadcast_start;
+    char tlb[TLB_SIZE];
+} QEMU_ALIGNED(64);
+
+static struct vcpu *vcpus;
+static unsigned int n_vcpus = 4;
+static unsigned int n_broadcasters = 1;
+static unsigned int duration = 1;
+static unsigned int burst = 10000;
+static unsigned int interval = 1;
+static unsigned int n_ready_threads;
+static bool test_start;
+static bool test_stop;
+
+static const char commands_string[] =
+    " -n = number of vCPU threads\n"
+    " -r = number of vCPUs that broadcast flushes\n"
+    " -d = duration in seconds\n"
+    " -b = iterations of busy work per burst\n"
+    " -i = bursts between two broadcasts of a vCPU";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/* What cpus-common.c needs from the accelerator */
+void qemu_cpu_kick(CPUState *cpu)
+{
+    qatomic_set(&cpu->exit_request, true);
+}
+
+bool qemu_cpu_is_self(CPUState *cpu)
+{
+    return current_cpu == cpu;
+}
+
+static void flush_work(CPUState *cpu, run_on_cpu_data data)
+{
+    struct vcpu *v = &vcpus[cpu->cpu_index];
+
+    memset(v->tlb, -1, sizeof(v->tlb));
+    v->flushes++;
+}
+
+static void flush_synced_work(CPUState *cpu, run_on_cpu_data data)
+{
+    struct vcpu *v = &vcpus[cpu->cpu_index];
+
+    flush_work(cpu, data);
+    v->latency_ns += get_clock() - v->broadcast_start;
+    v->broadcasts++;
+}
+
+static void flush_all_cpus_synced(struct vcpu *v)
+{
+    CPUState *cpu;
+
+    v->broadcast_start = get_clock();
+    CPU_FOREACH(cpu) {
+        if (cpu != v->cpu) {
+            async_run_on_cpu(cpu, flush_work, RUN_ON_CPU_NULL);
+        }
+    }
+    async_safe_run_on_cpu(v->cpu, flush_synced_work, RUN_ON_CPU_NULL);
+}
+
+/* Stands in for the execution of translated code */
+static void run_burst(CPUState *cpu)
+{
+    unsigned int i;
+
+    for (i = 0; i < burst; i++) {
+        if (qatomic_read(&cpu->exit_request)) {
+            break;
+        }
+        cpu_relax();
+    }
+}
+
+static void *vcpu_func(void *arg)
+{
+    struct vcpu *v = arg;
+    CPUState *cpu = v->cpu;
+    unsigned int n = 0;
+
+    rcu_register_thread();
+    current_cpu = cpu;
+
+    qatomic_inc(&n_ready_threads);
+    while (!qatomic_read(&test_start)) {
+        cpu_relax();
+    }
+
+    while (!qatomic_read(&test_stop)) {
+        cpu_exec_start(cpu);
+        run_burst(cpu);
+        cpu_exec_end(cpu);
+
+        qatomic_set(&cpu->exit_request, false);
+        /* Clear exit_request before looking at the work list, as TCG does */
+        smp_mb();
+        if (v->broadcaster && ++n == interval) {
+            flush_all_cpus_synced(v);
+            n = 0;
+        }
+        process_queued_cpu_work(cpu);
+    }
+
+    current_cpu = NULL;
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void create_threads(void)
+{
+    unsigned int i;
+
+    qemu_init_cpu_list();
+    vcpus = qemu_memalign(64, sizeof(*vcpus) * n_vcpus);
+    memset(vcpus, 0, sizeof(*vcpus) * n_vcpus);
+    for (i = 0; i < n_vcpus; i++) {
+        struct vcpu *v = &vcpus[i];
+
+        v->cpu = g_new0(CPUState, 1);
+        v->cpu->cpu_index = UNASSIGNED_CPU_INDEX;
+        cpu_list_add(v->cpu);
+        v->broadcaster = i < n_broadcasters;
+    }
+    for (i = 0; i < n_vcpus; i++) {
+        qemu_thread_create(&vcpus[i].thread, NULL, vcpu_func, &vcpus[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void run_test(void)
+{
+    unsigned int i;
+
+    while (qatomic_read(&n_ready_threads) != n_vcpus) {
+        cpu_relax();
+    }
+
+    qatomic_set(&test_start, true);
+    g_usleep(duration * G_USEC_PER_SEC);
+    qatomic_set(&test_stop, true);
+
+    for (i = 0; i < n_vcpus; i++) {
+        qemu_thread_join(&vcpus[i].thread);
+    }
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" # of vCPUs:         %u\n", n_vcpus);
+    printf(" # of broadcasters:  %u\n", n_broadcasters);
+    printf(" duration:           %u\n", duration);
+    printf(" burst length:       %u\n", burst);
+    printf(" broadcast interval: %u\n", interval);
+}
+
+static void pr_stats(void)
+{
+    unsigned long broadcasts = 0, flushes = 0;
+    uint64_t latency_ns = 0;
+    unsigned int i;
+
+    for (i = 0; i < n_vcpus; i++) {
+        broadcasts += vcpus[i].broadcasts;
+        latency_ns += vcpus[i].latency_ns;
+        flushes += vcpus[i].flushes;
+    }
+
+    printf("Results:\n");
+    printf(" Broadcasts:         %.2f Kops/s\n",
+           (double)broadcasts / duration / 1e3);
+    printf(" Flushes per vCPU:   %.2f Kops/s\n",
+           (double)flushes / n_vcpus / duration / 1e3);
+    printf(" Broadcast latency:  %.2f us\n",
+           broadcasts ? (double)latency_ns / broadcasts / 1e3 : 0.0);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:n:r:b:i:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_vcpus = atoi(optarg);
+            break;
+        case 'r':
+            n_broadcasters = atoi(optarg);
+            break;
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 'i':
+            interval = MAX(atoi(optarg), 1);
+            break;
+        }
+    }
+    if (!n_vcpus) {
+        usage_complete(argv);
+        exit(1);
+    }
+    n_broadcasters = MIN(n_broadcasters, n_vcpus);
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    pr_params();
+    create_threads();
+    run_test();
+    pr_stats();
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * I/O syscall microbenchmark
+ *
+ * Issue many small vectored reads and writes, as done by programs
+ * that log or serialize records, and report the rate.  The data is
+ * checked so that this also works as a test; the runs with and
+ * without QEMU_IOURING set should behave identically.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NR_IOV      8
+#define CHUNK_SIZE  64
+#define RECORD_SIZE (NR_IOV * CHUNK_SIZE)
+
+static int iterations = 2000;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_record(char *buf, int n)
+{
+    int i;
+
+    for (i = 0; i < RECORD_SIZE; i++) {
+        buf[i] = (char)(n * 31 + i);
+    }
+}
+
+static void setup_iov(struct iovec *iov, char *buf)
+{
+    int i;
+
+    for (i = 0; i < NR_IOV; i++) {
+        iov[i].iov_base = buf + i * CHUNK_SIZE;
+        iov[i].iov_len = CHUNK_SIZE;
+    }
+}
+
+static void report(const char *what, double start)
+{
+    double elapsed = now() - start;
+
+    printf("%-8s %8d ops in %.3fs, %.0f ops/s\n", what, iterations,
+           elapsed, iterations / elapsed);
+}
+
+static void bench_sequential(int fd)
+{
+    char buf[RECORD_SIZE], ref[RECORD_SIZE];
+    struct iovec iov[NR_IOV];
+    double start;
+    ssize_t ret;
+    off_t pos;
+    int i;
+
+    setup_iov(iov, buf);
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        fill_record(buf, i);
+        ret = writev(fd, iov, NR_IOV);
+        assert(ret == RECORD_SIZE);
+    }
+    report("writev", start);
+
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        ret = readv(fd, iov, NR_IOV);
+        assert(ret == RECORD_SIZE);
+        fill_record(ref, i);
+        assert(memcmp(buf, ref, RECORD_SIZE) == 0);
+    }
+    report("readv", start);
+
+    /* At EOF, and the file position must have followed the I/O */
+    ret = readv(fd, iov, NR_IOV);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == (off_t)iterations * RECORD_SIZE);
+}
+
+static void bench_positional(int fd)
+{
+    char buf[RECORD_SIZE], ref[RECORD_SIZE];
+    struct iovec iov[NR_IOV];
+    double start;
+    ssize_t ret;
+    off_t pos;
+    int i;
+
+    setup_iov(iov, buf);
+
+    /* Rewrite the records in reverse order */
+    start = now();
+    for (i = iterations - 1; i >= 0; i--) {
+        fill_record(buf, ~i);
+        ret = pwritev(fd, iov, NR_IOV, (off_t)i * RECORD_SIZE);
+        assert(ret == RECORD_SIZE);
+    }
+    report("pwritev", start);
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        ret = preadv(fd, iov, NR_IOV, (off_t)i * RECORD_SIZE);
+        assert(ret == RECORD_SIZE);
+        fill_record(ref, ~i);
+        assert(memcmp(buf, ref, RECORD_SIZE) == 0);
+    }
+    report("preadv", start);
+
+    /* Positional I/O does not move the file position */
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == (off_t)iterations * RECORD_SIZE);
+
+    /* Negative offsets are rejected, and not taken as the file position */
+    errno = 0;
+    ret = preadv(fd, iov, NR_IOV, -1);
+    assert(ret == -1 && errno == EINVAL);
+}
+
+static void alarm_handler(int sig)
+{
+}
+
+/* A signal without SA_RESTART interrupts a read that has no data. */
+static void test_interrupted(void)
+{
+    struct sigaction sa = { .sa_handler = alarm_handler };
+    struct itimerval it = { .it_value.tv_usec = 100000 };
+    struct iovec iov;
+    ssize_t ret;
+    char c;
+    int p[2];
+
+    ret = pipe(p);
+    assert(ret == 0);
+    ret = sigaction(SIGALRM, &sa, NULL);
+    assert(ret == 0);
+    ret = setitimer(ITIMER_REAL, &it, NULL);
+    assert(ret == 0);
+
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    errno = 0;
+    ret = readv(p[0], &iov, 1);
+    assert(ret == -1 && errno == EINTR);
+
+    /* The interrupted read must not consume data written afterwards */
+    c = 'x';
+    ret = write(p[1], &c, 1);
+    assert(ret == 1);
+    c = 0;
+    ret = readv(p[0], &iov, 1);
+    assert(ret == 1 && c == 'x');
+
+    close(p[0]);
+    close(p[1]);
+}
+
+int main(int argc, char **argv)
+{
+    char name[] = "io-bench-XXXXXX";
+    int fd;
+
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+        assert(iterations > 0);
+    }
+
+    fd = mkstemp(name);
+    assert(fd >= 0);
+    unlink(name);
+
+    bench_sequential(fd);
+    bench_positional(fd);
+    close(fd);
+
+    test_interrupted();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+/*
+ * Guest io_uring test
+ *
+ * Drive an io_uring through the raw syscalls, without liburing, so that
+ * the ring layout and SQE translation of the emulation are exercised.
+ * The test is skipped if io_uring is not available.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#define ENTRIES 4
+#define BUF_SIZE 4096
+
+struct ring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    assert(p != MAP_FAILED);
+    return p;
+}
+
+static int ring_init(struct ring *r)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = io_uring_setup(ENTRIES, &p);
+    if (r->fd < 0) {
+        return -errno;
+    }
+    assert(p.sq_entries == ENTRIES);
+    assert(p.cq_entries >= ENTRIES);
+
+    sq = map_ring(r->fd, p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                  IORING_OFF_SQ_RING);
+    cq = map_ring(r->fd, p.cq_off.cqes +
+                  p.cq_entries * sizeof(struct io_uring_cqe),
+                  IORING_OFF_CQ_RING);
+    r->sqes = map_ring(r->fd, p.sq_entries * sizeof(struct io_uring_sqe),
+                       IORING_OFF_SQES);
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    assert(*r->sq_mask == ENTRIES - 1);
+    return 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct ring *r)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* Submit what is queued, wait for one completion and return its result */
+static int submit_and_wait(struct ring *r, unsigned to_submit,
+                           uint64_t user_data)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    int res;
+
+    assert(io_uring_enter(r->fd, to_submit, 1, IORING_ENTER_GETEVENTS)
+           == to_submit);
+
+    head = *r->cq_head;
+    assert(__atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) != head);
+    cqe = &r->cqes[head & *r->cq_mask];
+    assert(cqe->user_data == user_data);
+    res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+int main(void)
+{
+    static char wbuf[BUF_SIZE], rbuf[BUF_SIZE], fbuf[BUF_SIZE];
+    char name[] = "io-uring-XXXXXX";
+    struct io_uring_sqe *sqe;
+    struct iovec iov[2];
+    struct ring r;
+    int fd, i, ret;
+
+    ret = ring_init(&r);
+    if (ret == -ENOSYS || ret == -EPERM) {
+        printf("io_uring not available, skipping\n");
+        return EXIT_SUCCESS;
+    }
+    assert(ret == 0);
+
+    fd = mkstemp(name);
+    assert(fd >= 0);
+    unlink(name);
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        wbuf[i] = i * 7;
+    }
+
+    /* NOP carries the user_data through */
+    sqe = get_sqe(&r);
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = 0x1122334455667788ULL;
+    assert(submit_and_wait(&r, 1, 0x1122334455667788ULL) == 0);
+
+    /* WRITEV then READV, with guest iovecs */
+    iov[0].iov_base = wbuf;
+    iov[0].iov_len = BUF_SIZE / 2;
+    iov[1].iov_base = wbuf + BUF_SIZE / 2;
+    iov[1].iov_len = BUF_SIZE / 2;
+    sqe = get_sqe(&r);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = 2;
+    sqe->off = 0;
+    sqe->user_data = 1;
+    assert(submit_and_wait(&r, 1, 1) == BUF_SIZE);
+
+    iov[0].iov_base = rbuf;
+    iov[1].iov_base = rbuf + BUF_SIZE / 2;
+    sqe = get_sqe(&r);
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = 2;
+    sqe->off = 0;
+    sqe->user_data = 2;
+    assert(submit_and_wait(&r, 1, 2) == BUF_SIZE);
+    assert(memcmp(wbuf, rbuf, BUF_SIZE) == 0);
+
+    /* READ_FIXED from a registered buffer */
+    iov[0].iov_base = fbuf;
+    iov[0].iov_len = BUF_SIZE;
+    ret = io_uring_register(r.fd, IORING_REGISTER_BUFFERS, iov, 1);
+    assert(ret == 0);
+    sqe = get_sqe(&r);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)fbuf;
+    sqe->len = BUF_SIZE;
+    sqe->off = 0;
+    sqe->buf_index = 0;
+    sqe->user_data = 3;
+    assert(submit_and_wait(&r, 1, 3) == BUF_SIZE);
+    assert(memcmp(wbuf, fbuf, BUF_SIZE) == 0);
+    assert(io_uring_register(r.fd, IORING_UNREGISTER_BUFFERS, NULL, 0) == 0);
+
+    /* Bad pointers complete with -EFAULT, not with a crash */
+    sqe = get_sqe(&r);
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = 0;
+    sqe->len = 1;
+    sqe->user_data = 4;
+    assert(submit_and_wait(&r, 1, 4) == -EFAULT);
+
+    assert(*r.sq_head == *r.sq_tail);
+    close(fd);
+    assert(close(r.fd) == 0);
+    return EXIT_SUCCESS;
+}
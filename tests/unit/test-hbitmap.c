@@ -1042,6 +1042,101 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+/* Long runs of set bits, crossing the boundaries of the internal chunks */
+static void test_hbitmap_runs(TestHBitmapData *data,
+                              const void *unused)
+{
+    hbitmap_test_init(data, L3 * 2 + 17, 0);
+    hbitmap_test_set(data, 0, L3);
+    hbitmap_test_set(data, L3 * 2 - L1, L1 + 17);
+    hbitmap_test_check_get(data);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, INT64_MAX), ==, L3);
+
+    hbitmap_test_reset(data, L2 + 5, L3 / 2);
+    hbitmap_test_set(data, L3 / 2 - L1, L3);
+    hbitmap_test_reset(data, L3 / 4, L3 / 4);
+    hbitmap_test_check_get(data);
+
+    hbitmap_test_reset(data, 0, L3 * 2 + 17);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 0);
+    hbitmap_test_set(data, L3 * 2 + 16, 1);
+    hbitmap_test_check_get(data);
+}
+
+static void test_hbitmap_changes(TestHBitmapData *data,
+                                 const void *unused)
+{
+    hbitmap_test_init(data, L3 * 2, 0);
+    g_assert(hbitmap_changed(data->hb, 0, L3 * 2));
+
+    hbitmap_clear_changes(data->hb);
+    g_assert(!hbitmap_changed(data->hb, 0, L3 * 2));
+
+    /* Resetting clean bits is not a change */
+    hbitmap_test_reset(data, 0, L3);
+    g_assert(!hbitmap_changed(data->hb, 0, L3 * 2));
+
+    hbitmap_test_set(data, L3 + L1, 1);
+    g_assert(hbitmap_changed(data->hb, 0, L3 * 2));
+    g_assert(hbitmap_changed(data->hb, L3 + L1, 1));
+    g_assert(!hbitmap_changed(data->hb, 0, L2));
+    g_assert(!hbitmap_changed(data->hb, L3 * 2 - L2, L2));
+
+    /* Neither is setting dirty bits */
+    hbitmap_clear_changes(data->hb);
+    hbitmap_test_set(data, L3 + L1, 1);
+    g_assert(!hbitmap_changed(data->hb, 0, L3 * 2));
+
+    hbitmap_test_reset_all(data);
+    g_assert(hbitmap_changed(data->hb, 0, L2));
+}
+
+static void test_hbitmap_merge_runs(TestHBitmapData *data,
+                                    const void *unused)
+{
+    HBitmap *a, *b;
+    uint64_t i;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    a = hbitmap_alloc(L3 * 2, 0);
+    b = hbitmap_alloc(L3 * 2, 0);
+
+    hbitmap_set(a, 0, L3);
+    hbitmap_set(b, L3 - L1, L2);
+    hbitmap_set(b, L3 + L2 * 4, 3);
+    hbitmap_test_set(data, 0, L3);
+    hbitmap_test_set(data, L3 - L1, L2);
+    hbitmap_test_set(data, L3 + L2 * 4, 3);
+
+    /* Merge into a third bitmap, then in place */
+    hbitmap_merge(a, b, data->hb);
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check_get(data);
+
+    hbitmap_merge(a, b, a);
+    g_assert_cmpint(hbitmap_count(a), ==, hbitmap_count(data->hb));
+    for (i = 0; i < L3 * 2; i += L1 / 2) {
+        g_assert_cmpint(hbitmap_get(a, i), ==, hbitmap_get(data->hb, i));
+    }
+
+    hbitmap_free(a);
+    hbitmap_free(b);
+}
+
+/* Ones deserialized past the end of the bitmap must not be counted */
+static void test_hbitmap_deserialize_ones_unaligned(TestHBitmapData *data,
+                                                    const void *unused)
+{
+    hbitmap_test_init(data, L3 + 5, 0);
+    hbitmap_deserialize_ones(data->hb, 0, L3 + 5, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, L3 + 5);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, INT64_MAX), ==, -1);
+
+    hbitmap_deserialize_zeroes(data->hb, L3, 5, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, L3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, INT64_MAX), ==, L3);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1208,12 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/chunks/runs", test_hbitmap_runs);
+    hbitmap_test_add("/hbitmap/chunks/changes", test_hbitmap_changes);
+    hbitmap_test_add("/hbitmap/chunks/merge", test_hbitmap_merge_runs);
+    hbitmap_test_add("/hbitmap/chunks/deserialize_ones_unaligned",
+                     test_hbitmap_deserialize_ones_unaligned);
+
     g_test_run();
 
     return 0;
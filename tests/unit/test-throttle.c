@@ -738,6 +738,63 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+#ifdef CONFIG_ATOMIC64
+static void coroutine_fn test_cached_tokens_entry(void *opaque)
+{
+    ThrottleGroupMember *tgm1 = opaque;
+
+    throttle_group_co_io_limits_intercept(tgm1, 4096, true);
+}
+
+static void test_cached_tokens_intercept(ThrottleGroupMember *tgm1)
+{
+    Coroutine *co = qemu_coroutine_create(test_cached_tokens_entry, tgm1);
+
+    qemu_coroutine_enter(co);
+}
+
+static void test_groups_cached_tokens(void)
+{
+    ThrottleConfig cfg1;
+    BlockBackend *blk1;
+    ThrottleGroupMember *tgm1;
+    ThrottleState *ts1;
+    uint64_t tokens;
+
+    /* No actual I/O is performed on this device */
+    blk1 = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+    tgm1 = &blk_get_public(blk1)->throttle_group_member;
+    throttle_group_register_tgm(tgm1, "baz", blk_get_aio_context(blk1));
+    ts1 = tgm1->throttle_state;
+
+    /* Plenty of room: the first request caches tokens for the next ones */
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_OPS_WRITE].avg = 10000;
+    throttle_group_config(tgm1, &cfg1);
+
+    test_cached_tokens_intercept(tgm1);
+    tokens = qatomic_read__nocheck(&tgm1->cached_tokens[1]);
+    g_assert(tokens != 0);
+    g_assert(ts1->cfg.buckets[THROTTLE_OPS_WRITE].level > 16);
+
+    test_cached_tokens_intercept(tgm1);
+    g_assert(qatomic_read__nocheck(&tgm1->cached_tokens[1]) < tokens);
+
+    /* Changing the configuration drops the cache */
+    cfg1.buckets[THROTTLE_OPS_WRITE].avg = 100;
+    throttle_group_config(tgm1, &cfg1);
+    g_assert(qatomic_read__nocheck(&tgm1->cached_tokens[1]) == 0);
+
+    /* Tokens are not cached if that would make the next request wait */
+    test_cached_tokens_intercept(tgm1);
+    g_assert(qatomic_read__nocheck(&tgm1->cached_tokens[1]) == 0);
+    g_assert(ts1->cfg.buckets[THROTTLE_OPS_WRITE].level <= 1);
+
+    throttle_group_unregister_tgm(tgm1);
+    blk_unref(blk1);
+}
+#endif
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -765,6 +822,10 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+#ifdef CONFIG_ATOMIC64
+    g_test_add_func("/throttle/groups/cached_tokens",
+                    test_groups_cached_tokens);
+#endif
     return g_test_run();
 }
 
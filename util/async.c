@@ -329,6 +329,7 @@ aio_ctx_finalize(GSource     *source)
     unsigned flags;
 
     thread_pool_free(ctx->thread_pool);
+    g_free(ctx->block_trace);
 
 #ifdef CONFIG_LINUX_AIO
     if (ctx->linux_aio) {
@@ -427,7 +428,7 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(0, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -11,6 +11,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
+#include "qemu/bitmap.h"
 #include "qemu/host-utils.h"
 #include "trace.h"
 #include "crypto/hash.h"
@@ -50,8 +51,31 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level, which is the only one of considerable size, is split
+ * into chunks of HB_CHUNK_WORDS words.  A chunk without set bits is not
+ * allocated at all, and all chunks whose bits are all set share a single
+ * read-only copy, so that the memory taken by a bitmap depends on how
+ * fragmented the set bits are rather than on the size of the bitmap.
+ * Dirty bitmaps of large disks are mostly made of long clean or dirty
+ * runs.  Every chunk also remembers whether it was modified since
+ * hbitmap_clear_changes(), so that users that store the bitmap somewhere
+ * only need to write out the parts that changed.
  */
 
+#define HB_CHUNK_SHIFT      9
+#define HB_CHUNK_WORDS      (1 << HB_CHUNK_SHIFT)
+#define HB_CHUNK_BIT_SHIFT  (HB_CHUNK_SHIFT + BITS_PER_LEVEL)
+#define HB_CHUNK_BITS       (1U << HB_CHUNK_BIT_SHIFT)
+
+static const unsigned long hb_zero_chunk[HB_CHUNK_WORDS];
+static const unsigned long hb_ones_chunk[HB_CHUNK_WORDS] = {
+    [0 ... HB_CHUNK_WORDS - 1] = ~0UL
+};
+
+/* Chunks that are full point here; they must never be written through */
+#define HB_ONES_CHUNK ((unsigned long *)hb_ones_chunk)
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -93,14 +117,130 @@ struct HBitmap {
      * actual bitmap.
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
-     * bitmap will still allocate HBITMAP_LEVELS arrays.
+     * bitmap will still allocate HBITMAP_LEVELS arrays.  The last level is
+     * not kept in @levels but in @chunks.
      */
-    unsigned long *levels[HBITMAP_LEVELS];
+    unsigned long *levels[HBITMAP_LEVELS - 1];
 
-    /* The length of each levels[] array. */
+    /* The length of each level in words, including the last one. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* The last level: each chunk is NULL, HB_ONES_CHUNK or allocated. */
+    unsigned long **chunks;
+
+    /* Number of set bits in each chunk. */
+    uint32_t *chunk_count;
+
+    uint64_t nb_chunks;
+
+    /* Chunks that may have changed since hbitmap_clear_changes(). */
+    unsigned long *chunk_changed;
 };
 
+/* Return word @pos of the last level. */
+static inline unsigned long hb_leaf_word(const HBitmap *hb, uint64_t pos)
+{
+    const unsigned long *chunk = hb->chunks[pos >> HB_CHUNK_SHIFT];
+
+    return chunk ? chunk[pos & (HB_CHUNK_WORDS - 1)] : 0;
+}
+
+/* Return word @pos of @level. */
+static inline unsigned long hb_word(const HBitmap *hb, int level, uint64_t pos)
+{
+    if (level == HBITMAP_LEVELS - 1) {
+        return hb_leaf_word(hb, pos);
+    }
+    return hb->levels[level][pos];
+}
+
+static void hb_chunk_free(HBitmap *hb, uint64_t c)
+{
+    if (hb->chunks[c] != HB_ONES_CHUNK) {
+        g_free(hb->chunks[c]);
+    }
+    hb->chunks[c] = NULL;
+}
+
+/* Return chunk @c, after making sure that it can be written to. */
+static unsigned long *hb_chunk_get_mutable(HBitmap *hb, uint64_t c)
+{
+    unsigned long *chunk = hb->chunks[c];
+
+    if (!chunk) {
+        chunk = g_new0(unsigned long, HB_CHUNK_WORDS);
+    } else if (chunk == HB_ONES_CHUNK) {
+        chunk = g_memdup2(hb_ones_chunk, sizeof(hb_ones_chunk));
+    }
+    hb->chunks[c] = chunk;
+    return chunk;
+}
+
+/* Record that chunk @c has @count bits set, and drop its words if they
+ * are all zero or all one.
+ */
+static void hb_chunk_set_count(HBitmap *hb, uint64_t c, uint32_t count)
+{
+    hb->chunk_count[c] = count;
+    if (count == 0) {
+        hb_chunk_free(hb, c);
+    } else if (count == HB_CHUNK_BITS && hb->chunks[c] != HB_ONES_CHUNK) {
+        g_free(hb->chunks[c]);
+        hb->chunks[c] = HB_ONES_CHUNK;
+    }
+}
+
+/* Count the bits of chunk @c after its words were written directly. */
+static void hb_chunk_update(HBitmap *hb, uint64_t c)
+{
+    const unsigned long *chunk = hb->chunks[c];
+    uint32_t count = 0;
+    unsigned i;
+
+    if (chunk == NULL || chunk == HB_ONES_CHUNK) {
+        hb->chunk_count[c] = chunk ? HB_CHUNK_BITS : 0;
+        return;
+    }
+
+    for (i = 0; i < HB_CHUNK_WORDS; i++) {
+        count += ctpopl(chunk[i]);
+    }
+    hb_chunk_set_count(hb, c, count);
+}
+
+/* Write word @pos of the last level, without updating the other levels. */
+static void hb_leaf_store(HBitmap *hb, uint64_t pos, unsigned long el)
+{
+    uint64_t c = pos >> HB_CHUNK_SHIFT;
+
+    set_bit(c, hb->chunk_changed);
+    if (hb_leaf_word(hb, pos) != el) {
+        hb_chunk_get_mutable(hb, c)[pos & (HB_CHUNK_WORDS - 1)] = el;
+    }
+}
+
+/* Write @count words of the last level starting at @pos with @el, which
+ * must be either 0 or ~0UL, without updating the other levels.
+ */
+static void hb_leaf_fill(HBitmap *hb, uint64_t pos, uint64_t count,
+                         unsigned long el)
+{
+    uint64_t end = pos + count;
+
+    while (pos < end) {
+        uint64_t c = pos >> HB_CHUNK_SHIFT;
+
+        if (!(pos & (HB_CHUNK_WORDS - 1)) && end - pos >= HB_CHUNK_WORDS) {
+            hb_chunk_free(hb, c);
+            hb->chunks[c] = el ? HB_ONES_CHUNK : NULL;
+            set_bit(c, hb->chunk_changed);
+            pos += HB_CHUNK_WORDS;
+        } else {
+            hb_leaf_store(hb, pos++, el);
+        }
+    }
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -136,7 +276,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +289,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_leaf_word(hbi->hb, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +322,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -220,8 +360,7 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -232,6 +371,8 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
         return -1;
     }
 
+    cur = hb_leaf_word(hb, pos);
+
     end_bit = count > hb->orig_size - start ?
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
@@ -247,13 +388,18 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+            /* Skip whole chunks in which all bits are set */
+            while (pos < sz && !(pos & (HB_CHUNK_WORDS - 1)) &&
+                   hb->chunks[pos >> HB_CHUNK_SHIFT] == HB_ONES_CHUNK) {
+                pos += HB_CHUNK_WORDS;
+            }
+        } while (pos < sz && hb_leaf_word(hb, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_leaf_word(hb, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -349,65 +495,6 @@ uint64_t hbitmap_count(const HBitmap *hb)
     return hb->count << hb->granularity;
 }
 
-/**
- * hbitmap_iter_next_word:
- * @hbi: HBitmapIter to operate on.
- * @p_cur: Location where to store the next non-zero word.
- *
- * Return the index of the next nonzero word that is set in @hbi's
- * associated HBitmap, and set *p_cur to the content of that word
- * (bits before the index that was passed to hbitmap_iter_init are
- * trimmed on the first call).  Return -1, and set *p_cur to zero,
- * if all remaining words are zero.
- */
-static size_t hbitmap_iter_next_word(HBitmapIter *hbi, unsigned long *p_cur)
-{
-    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1];
-
-    if (cur == 0) {
-        cur = hbitmap_iter_skip_words(hbi);
-        if (cur == 0) {
-            *p_cur = 0;
-            return -1;
-        }
-    }
-
-    /* The next call will resume work from the next word.  */
-    hbi->cur[HBITMAP_LEVELS - 1] = 0;
-    *p_cur = cur;
-    return hbi->pos;
-}
-
-/* Count the number of set bits between start and end, not accounting for
- * the granularity.  Also an example of how to use hbitmap_iter_next_word.
- */
-static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
-{
-    HBitmapIter hbi;
-    uint64_t count = 0;
-    uint64_t end = last + 1;
-    unsigned long cur;
-    size_t pos;
-
-    hbitmap_iter_init(&hbi, hb, start << hb->granularity);
-    for (;;) {
-        pos = hbitmap_iter_next_word(&hbi, &cur);
-        if (pos >= (end >> BITS_PER_LEVEL)) {
-            break;
-        }
-        count += ctpopl(cur);
-    }
-
-    if (pos == (end >> BITS_PER_LEVEL)) {
-        /* Drop bits representing the END-th and subsequent items.  */
-        int bit = end & (BITS_PER_LONG - 1);
-        cur &= (1UL << bit) - 1;
-        count += ctpopl(cur);
-    }
-
-    return count;
-}
-
 /* Setting starts at the last layer and propagates up if an element
  * changes.
  */
@@ -461,6 +548,70 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     return changed;
 }
 
+/* Set bits [start, last] of the last level, which must all be in chunk @c.
+ * Returns the number of bits that were not set before.
+ */
+static uint32_t hb_set_chunk(HBitmap *hb, uint64_t c, uint64_t start,
+                             uint64_t last)
+{
+    uint32_t old_count = hb->chunk_count[c];
+    uint32_t count = old_count;
+    unsigned long *chunk;
+    uint64_t next;
+
+    if (count == HB_CHUNK_BITS) {
+        return 0;
+    }
+
+    if (last - start + 1 == HB_CHUNK_BITS) {
+        count = HB_CHUNK_BITS;
+    } else {
+        chunk = hb_chunk_get_mutable(hb, c);
+        for (; start <= last; start = next) {
+            unsigned long *elem =
+                &chunk[(start >> BITS_PER_LEVEL) & (HB_CHUNK_WORDS - 1)];
+            unsigned long old = *elem;
+
+            next = (start | (BITS_PER_LONG - 1)) + 1;
+            hb_set_elem(elem, start, MIN(last, next - 1));
+            count += ctpopl(*elem) - ctpopl(old);
+        }
+    }
+
+    if (count != old_count) {
+        set_bit(c, hb->chunk_changed);
+    }
+    hb_chunk_set_count(hb, c, count);
+    return count - old_count;
+}
+
+/* Set bits [start, last] of the last level and propagate to the levels
+ * above.  Returns the number of bits that were not set before.
+ */
+static uint64_t hb_set_leaf(HBitmap *hb, uint64_t start, uint64_t last)
+{
+    uint64_t pos = start >> BITS_PER_LEVEL;
+    uint64_t lastpos = last >> BITS_PER_LEVEL;
+    uint64_t n = 0;
+
+    for (;;) {
+        uint64_t c = start >> HB_CHUNK_BIT_SHIFT;
+        uint64_t chunk_last = ((c + 1) << HB_CHUNK_BIT_SHIFT) - 1;
+
+        if (chunk_last >= last) {
+            n += hb_set_chunk(hb, c, start, last);
+            break;
+        }
+        n += hb_set_chunk(hb, c, start, chunk_last);
+        start = chunk_last + 1;
+    }
+
+    if (n) {
+        hb_set_between(hb, HBITMAP_LEVELS - 2, pos, lastpos);
+    }
+    return n;
+}
+
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
@@ -477,11 +628,10 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     first = start >> hb->granularity;
     last >>= hb->granularity;
     assert(last < hb->size);
-    n = last - first + 1;
 
-    hb->count += n - hb_count_between(hb, first, last);
-    if (hb_set_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
+    n = hb_set_leaf(hb, first, last);
+    hb->count += n;
+    if (n && hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
 }
@@ -555,10 +705,91 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
 
 }
 
+/* Reset bits [start, last] of the last level, which must all be in chunk
+ * @c.  Returns the number of bits that were set before.
+ */
+static uint32_t hb_reset_chunk(HBitmap *hb, uint64_t c, uint64_t start,
+                               uint64_t last)
+{
+    uint32_t old_count = hb->chunk_count[c];
+    uint32_t count = old_count;
+    unsigned long *chunk;
+    uint64_t next;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    if (last - start + 1 == HB_CHUNK_BITS) {
+        count = 0;
+    } else {
+        chunk = hb_chunk_get_mutable(hb, c);
+        for (; start <= last; start = next) {
+            unsigned long *elem =
+                &chunk[(start >> BITS_PER_LEVEL) & (HB_CHUNK_WORDS - 1)];
+            unsigned long old = *elem;
+
+            next = (start | (BITS_PER_LONG - 1)) + 1;
+            hb_reset_elem(elem, start, MIN(last, next - 1));
+            count -= ctpopl(old) - ctpopl(*elem);
+        }
+    }
+
+    if (count != old_count) {
+        set_bit(c, hb->chunk_changed);
+    }
+    hb_chunk_set_count(hb, c, count);
+    return old_count - count;
+}
+
+/* Reset bits [start, last] of the last level and propagate to the levels
+ * above.  Returns the number of bits that were set before.
+ */
+static uint64_t hb_reset_leaf(HBitmap *hb, uint64_t start, uint64_t last)
+{
+    uint64_t pos = start >> BITS_PER_LEVEL;
+    uint64_t lastpos = last >> BITS_PER_LEVEL;
+    uint64_t n = 0;
+
+    for (;;) {
+        uint64_t c = start >> HB_CHUNK_BIT_SHIFT;
+        uint64_t chunk_last = ((c + 1) << HB_CHUNK_BIT_SHIFT) - 1;
+
+        if (chunk_last >= last) {
+            n += hb_reset_chunk(hb, c, start, last);
+            break;
+        }
+        n += hb_reset_chunk(hb, c, start, chunk_last);
+        start = chunk_last + 1;
+    }
+
+    if (!n) {
+        return 0;
+    }
+
+    /* The words in between are zero now, but the first and the last one
+     * may still have bits set outside of the range; their bits in the
+     * level above must stay.
+     */
+    if (hb_leaf_word(hb, pos)) {
+        pos++;
+    }
+    if (hb_leaf_word(hb, lastpos)) {
+        if (lastpos == 0) {
+            return n;
+        }
+        lastpos--;
+    }
+    if (pos <= lastpos) {
+        hb_reset_between(hb, HBITMAP_LEVELS - 2, pos, lastpos);
+    }
+    return n;
+}
+
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
-    uint64_t first;
+    uint64_t first, n;
     uint64_t last = start + count - 1;
     uint64_t gran = 1ULL << hb->granularity;
 
@@ -576,9 +807,9 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     last >>= hb->granularity;
     assert(last < hb->size);
 
-    hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
+    n = hb_reset_leaf(hb, first, last);
+    hb->count -= n;
+    if (n && hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
 }
@@ -587,8 +818,16 @@ void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
 
+    uint64_t c;
+
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    for (c = 0; c < hb->nb_chunks; c++) {
+        hb_chunk_free(hb, c);
+        hb->chunk_count[c] = 0;
+    }
+    bitmap_set(hb->chunk_changed, 0, hb->nb_chunks);
+
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -621,7 +860,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_leaf_word(hb, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -638,7 +877,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -652,7 +891,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -660,7 +899,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t cur;
 
     if (!count) {
         return 0;
@@ -674,7 +913,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -683,9 +922,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_leaf_word(hb, cur);
 
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
         cur++;
@@ -697,7 +936,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -706,13 +945,11 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        unsigned long el;
 
-        if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
-        } else {
-            le64_to_cpus((uint64_t *)cur);
-        }
+        memcpy(&el, buf, sizeof(el));
+        el = (BITS_PER_LONG == 32 ? le32_to_cpu(el) : le64_to_cpu(el));
+        hb_leaf_store(hb, cur, el);
 
         buf += sizeof(unsigned long);
         cur++;
@@ -726,14 +963,14 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_leaf_fill(hb, first, el_count, 0);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -743,14 +980,14 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_leaf_fill(hb, first, el_count, ~0UL);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -759,12 +996,43 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
     int64_t i, size, prev_size;
+    unsigned tail = bitmap->size & (BITS_PER_LONG - 1);
+    uint64_t c;
     int lev;
 
-    /* restore levels starting from penultimate to zero level, assuming
-     * that the last level is ok */
-    size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
-    for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
+    /* Whole words were deserialized; drop the bits past the end */
+    if (tail) {
+        uint64_t pos = bitmap->size >> BITS_PER_LEVEL;
+        unsigned long el = hb_leaf_word(bitmap, pos);
+
+        if (el & ~((1UL << tail) - 1)) {
+            hb_leaf_store(bitmap, pos, el & ((1UL << tail) - 1));
+        }
+    }
+
+    /* count the bits in the last level and restore the penultimate one */
+    lev = HBITMAP_LEVELS - 2;
+    memset(bitmap->levels[lev], 0, bitmap->sizes[lev] * sizeof(unsigned long));
+    bitmap->count = 0;
+    for (c = 0; c < bitmap->nb_chunks; c++) {
+        hb_chunk_update(bitmap, c);
+        bitmap->count += bitmap->chunk_count[c];
+        if (!bitmap->chunks[c]) {
+            continue;
+        }
+
+        prev_size = MIN(bitmap->sizes[lev + 1], (c + 1) * HB_CHUNK_WORDS);
+        for (i = c * HB_CHUNK_WORDS; i < prev_size; ++i) {
+            if (hb_leaf_word(bitmap, i)) {
+                bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+
+    /* restore the levels above, up to zero level */
+    size = bitmap->sizes[lev];
+    while (lev-- > 0) {
         prev_size = size;
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
@@ -778,19 +1046,46 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
-    bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
 }
 
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
+    uint64_t c;
+
     assert(!hb->meta);
-    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+    for (c = 0; c < hb->nb_chunks; c++) {
+        hb_chunk_free(hb, c);
+    }
+    g_free(hb->chunks);
+    g_free(hb->chunk_count);
+    g_free(hb->chunk_changed);
+    for (i = HBITMAP_LEVELS - 1; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
 }
 
+bool hbitmap_changed(const HBitmap *hb, uint64_t start, uint64_t count)
+{
+    uint64_t first, last;
+
+    if (!count) {
+        return false;
+    }
+
+    first = (start >> hb->granularity) >> HB_CHUNK_BIT_SHIFT;
+    last = ((start + count - 1) >> hb->granularity) >> HB_CHUNK_BIT_SHIFT;
+    assert(last < hb->nb_chunks);
+
+    return find_next_bit(hb->chunk_changed, last + 1, first) <= last;
+}
+
+void hbitmap_clear_changes(HBitmap *hb)
+{
+    bitmap_zero(hb->chunk_changed, hb->nb_chunks);
+}
+
 HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
@@ -808,9 +1103,18 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i < HBITMAP_LEVELS - 1) {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
 
+    hb->nb_chunks = DIV_ROUND_UP(hb->sizes[HBITMAP_LEVELS - 1],
+                                 HB_CHUNK_WORDS);
+    hb->chunks = g_new0(unsigned long *, hb->nb_chunks);
+    hb->chunk_count = g_new0(uint32_t, hb->nb_chunks);
+    hb->chunk_changed = bitmap_new(hb->nb_chunks);
+    bitmap_set(hb->chunk_changed, 0, hb->nb_chunks);
+
     /* We necessarily have free bits in level 0 due to the definition
      * of HBITMAP_LEVELS, so use one for a sentinel.  This speeds up
      * hbitmap_iter_skip_words.
@@ -820,6 +1124,31 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     return hb;
 }
 
+/* Resize the last level to @nb_chunks chunks. */
+static void hb_truncate_chunks(HBitmap *hb, uint64_t nb_chunks)
+{
+    uint64_t c;
+
+    for (c = nb_chunks; c < hb->nb_chunks; c++) {
+        hb_chunk_free(hb, c);
+    }
+    hb->chunks = g_renew(unsigned long *, hb->chunks, nb_chunks);
+    hb->chunk_count = g_renew(uint32_t, hb->chunk_count, nb_chunks);
+    if (nb_chunks > hb->nb_chunks) {
+        hb->chunk_changed = bitmap_zero_extend(hb->chunk_changed,
+                                               hb->nb_chunks, nb_chunks);
+    }
+    for (c = hb->nb_chunks; c < nb_chunks; c++) {
+        hb->chunks[c] = NULL;
+        hb->chunk_count[c] = 0;
+    }
+
+    /* The last chunk may have gained or lost words */
+    c = MIN(hb->nb_chunks, nb_chunks) - 1;
+    bitmap_set(hb->chunk_changed, c, nb_chunks - c);
+    hb->nb_chunks = nb_chunks;
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
@@ -862,6 +1191,10 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_truncate_chunks(hb, DIV_ROUND_UP(size, HB_CHUNK_WORDS));
+            continue;
+        }
         hb->levels[i] = g_renew(unsigned long, hb->levels[i], size);
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -892,6 +1225,47 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/* Let chunk @c of @result be the union of those of @a and @b. */
+static void hb_merge_chunk(const HBitmap *a, const HBitmap *b,
+                           HBitmap *result, uint64_t c)
+{
+    const unsigned long *ca = a->chunks[c];
+    const unsigned long *cb = b->chunks[c];
+    unsigned long *dst;
+    unsigned i;
+
+    if (ca == HB_ONES_CHUNK || cb == HB_ONES_CHUNK) {
+        if (result->chunks[c] != HB_ONES_CHUNK) {
+            set_bit(c, result->chunk_changed);
+            hb_chunk_set_count(result, c, HB_CHUNK_BITS);
+        }
+        return;
+    }
+
+    if (!ca || !cb) {
+        const unsigned long *src = ca ?: cb;
+
+        if (result->chunks[c] == src) {
+            return;
+        }
+
+        set_bit(c, result->chunk_changed);
+        if (!src) {
+            hb_chunk_set_count(result, c, 0);
+            return;
+        }
+        dst = hb_chunk_get_mutable(result, c);
+        memcpy(dst, src, sizeof(hb_zero_chunk));
+    } else {
+        set_bit(c, result->chunk_changed);
+        dst = hb_chunk_get_mutable(result, c);
+        for (i = 0; i < HB_CHUNK_WORDS; i++) {
+            dst[i] = ca[i] | cb[i];
+        }
+    }
+    hb_chunk_update(result, c);
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -932,24 +1306,40 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
      * It may be possible to improve running times for sparsely populated maps
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     * Chunks of the last level that are empty or full are merged without
+     * looking at their words, though.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
 
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    result->count = 0;
+    for (j = 0; j < result->nb_chunks; j++) {
+        hb_merge_chunk(a, b, result, j);
+        result->count += result->chunk_count[j];
+    }
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t words = bitmap->sizes[HBITMAP_LEVELS - 1];
+    g_autofree struct iovec *iov = g_new(struct iovec, bitmap->nb_chunks);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+    uint64_t c;
+
+    /* Hash the last level as if it were one array of longs */
+    for (c = 0; c < bitmap->nb_chunks; c++) {
+        const unsigned long *chunk = bitmap->chunks[c] ?: hb_zero_chunk;
+
+        iov[c].iov_base = (void *)chunk;
+        iov[c].iov_len = MIN(words - c * HB_CHUNK_WORDS, HB_CHUNK_WORDS) *
+                         sizeof(unsigned long);
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, bitmap->nb_chunks,
+                         &hash, errp);
 
     return hash;
 }
@@ -0,0 +1,395 @@
+/*
+ * Interval tree of closed integer ranges, based on a red-black tree
+ * augmented with the highest last value of every subtree.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/interval-tree.h"
+
+/*
+ * All updates of the child pointers, which are followed by the lockless
+ * lookups, are done with qatomic_set().  Every intermediate state of the
+ * tree is then a valid binary tree without cycles, although a node
+ * being rotated may temporarily be unreachable from the root.
+ */
+
+static uint64_t interval_tree_compute_last(IntervalTreeNode *node)
+{
+    uint64_t max = node->last;
+
+    if (node->left && node->left->subtree_last > max) {
+        max = node->left->subtree_last;
+    }
+    if (node->right && node->right->subtree_last > max) {
+        max = node->right->subtree_last;
+    }
+    return max;
+}
+
+/* Recompute subtree_last of @node and of all its ancestors. */
+static void interval_tree_propagate(IntervalTreeNode *node)
+{
+    for (; node; node = node->parent) {
+        node->subtree_last = interval_tree_compute_last(node);
+    }
+}
+
+static void interval_tree_change_child(IntervalTreeNode *old,
+                                       IntervalTreeNode *new,
+                                       IntervalTreeNode *parent,
+                                       IntervalTreeRoot *root)
+{
+    if (!parent) {
+        qatomic_set(&root->root, new);
+    } else if (parent->left == old) {
+        qatomic_set(&parent->left, new);
+    } else {
+        qatomic_set(&parent->right, new);
+    }
+}
+
+/* The right child of @node takes its place, @node becomes its left child. */
+static void interval_tree_rotate_left(IntervalTreeNode *node,
+                                      IntervalTreeRoot *root)
+{
+    IntervalTreeNode *pivot = node->right;
+    IntervalTreeNode *parent = node->parent;
+
+    qatomic_set(&node->right, pivot->left);
+    if (pivot->left) {
+        pivot->left->parent = node;
+    }
+    qatomic_set(&pivot->left, node);
+    pivot->parent = parent;
+    node->parent = pivot;
+    interval_tree_change_child(node, pivot, parent, root);
+
+    node->subtree_last = interval_tree_compute_last(node);
+    pivot->subtree_last = interval_tree_compute_last(pivot);
+}
+
+/* The left child of @node takes its place, @node becomes its right child. */
+static void interval_tree_rotate_right(IntervalTreeNode *node,
+                                       IntervalTreeRoot *root)
+{
+    IntervalTreeNode *pivot = node->left;
+    IntervalTreeNode *parent = node->parent;
+
+    qatomic_set(&node->left, pivot->right);
+    if (pivot->right) {
+        pivot->right->parent = node;
+    }
+    qatomic_set(&pivot->right, node);
+    pivot->parent = parent;
+    node->parent = pivot;
+    interval_tree_change_child(node, pivot, parent, root);
+
+    node->subtree_last = interval_tree_compute_last(node);
+    pivot->subtree_last = interval_tree_compute_last(pivot);
+}
+
+static bool interval_tree_is_red(IntervalTreeNode *node)
+{
+    return node && node->red;
+}
+
+static IntervalTreeNode *interval_tree_next_node(IntervalTreeNode *node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return node;
+    }
+    while (node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+static void interval_tree_insert_fixup(IntervalTreeNode *node,
+                                       IntervalTreeRoot *root)
+{
+    IntervalTreeNode *parent, *gparent, *uncle;
+
+    while ((parent = node->parent) && parent->red) {
+        /* A red node is never the root, the grandparent exists */
+        gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (interval_tree_is_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                interval_tree_rotate_left(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            interval_tree_rotate_right(gparent, root);
+        } else {
+            uncle = gparent->left;
+            if (interval_tree_is_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                interval_tree_rotate_right(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            interval_tree_rotate_left(gparent, root);
+        }
+    }
+    root->root->red = false;
+}
+
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode **link = &root->root, *parent = NULL;
+    uint64_t start = node->start, last = node->last;
+    bool leftmost = true;
+
+    while (*link) {
+        parent = *link;
+        if (parent->subtree_last < last) {
+            parent->subtree_last = last;
+        }
+        if (start < parent->start) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    node->subtree_last = last;
+    if (leftmost) {
+        qatomic_set(&root->leftmost, node);
+    }
+    qatomic_set(link, node);
+
+    interval_tree_insert_fixup(node, root);
+}
+
+/*
+ * Restore the red-black properties after a black node was removed
+ * from under @parent.  @node is the child which took its place and
+ * may be NULL.
+ */
+static void interval_tree_remove_fixup(IntervalTreeNode *node,
+                                       IntervalTreeNode *parent,
+                                       IntervalTreeRoot *root)
+{
+    IntervalTreeNode *sibling;
+
+    while (node != root->root && !interval_tree_is_red(node)) {
+        if (node == parent->left) {
+            sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                interval_tree_rotate_left(parent, root);
+                sibling = parent->right;
+            }
+            if (!interval_tree_is_red(sibling->left) &&
+                !interval_tree_is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!interval_tree_is_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                interval_tree_rotate_right(sibling, root);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            interval_tree_rotate_left(parent, root);
+        } else {
+            sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                interval_tree_rotate_right(parent, root);
+                sibling = parent->left;
+            }
+            if (!interval_tree_is_red(sibling->left) &&
+                !interval_tree_is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!interval_tree_is_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                interval_tree_rotate_left(sibling, root);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            interval_tree_rotate_right(parent, root);
+        }
+        node = root->root;
+        break;
+    }
+    if (node) {
+        node->red = false;
+    }
+}
+
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode *child, *parent;
+    bool black_removed;
+
+    if (root->leftmost == node) {
+        qatomic_set(&root->leftmost, interval_tree_next_node(node));
+    }
+
+    if (!node->left || !node->right) {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        black_removed = !node->red;
+
+        if (child) {
+            child->parent = parent;
+        }
+        interval_tree_change_child(node, child, parent, root);
+    } else {
+        /* Replace @node with its successor, which has no left child */
+        IntervalTreeNode *succ = node->right;
+
+        while (succ->left) {
+            succ = succ->left;
+        }
+        child = succ->right;
+        black_removed = !succ->red;
+
+        if (succ->parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->parent;
+            qatomic_set(&parent->left, child);
+            if (child) {
+                child->parent = parent;
+            }
+            qatomic_set(&succ->right, node->right);
+            node->right->parent = succ;
+        }
+        qatomic_set(&succ->left, node->left);
+        node->left->parent = succ;
+        succ->parent = node->parent;
+        succ->red = node->red;
+        interval_tree_change_child(node, succ, node->parent, root);
+    }
+
+    interval_tree_propagate(parent);
+    if (black_removed) {
+        interval_tree_remove_fixup(child, parent, root);
+    }
+}
+
+/*
+ * Find the leftmost node of the subtree rooted at @node which intersects
+ * [@start, @last].  @node's subtree_last must be at least @start.
+ */
+static IntervalTreeNode *interval_tree_subtree_search(IntervalTreeNode *node,
+                                                      uint64_t start,
+                                                      uint64_t last)
+{
+    while (true) {
+        IntervalTreeNode *left = qatomic_read(&node->left);
+
+        if (left && start <= left->subtree_last) {
+            /*
+             * Some nodes in the left subtree satisfy start <= node->last,
+             * and all of them have a lower node->start.
+             */
+            node = left;
+            continue;
+        }
+        if (node->start > last) {
+            /* This node and all of its right subtree start too late */
+            return NULL;
+        }
+        if (start <= node->last) {
+            return node;
+        }
+        node = qatomic_read(&node->right);
+        if (!node || start > node->subtree_last) {
+            return NULL;
+        }
+    }
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node = qatomic_read(&root->root);
+    IntervalTreeNode *leftmost;
+
+    if (!node || node->subtree_last < start) {
+        return NULL;
+    }
+    leftmost = qatomic_read(&root->leftmost);
+    if (leftmost && leftmost->start > last) {
+        return NULL;
+    }
+    return interval_tree_subtree_search(node, start, last);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *right = node->right, *prev;
+
+    while (true) {
+        /* All nodes in the right subtree start at or after @node */
+        if (right && start <= right->subtree_last) {
+            return interval_tree_subtree_search(right, start, last);
+        }
+
+        /* Move up until we come from the left child of a node */
+        do {
+            prev = node;
+            node = node->parent;
+            if (!node) {
+                return NULL;
+            }
+            right = node->right;
+        } while (prev == right);
+
+        if (node->start > last) {
+            return NULL;
+        }
+        if (start <= node->last) {
+            return node;
+        }
+    }
+}
@@ -444,6 +444,22 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+/* Check whether an I/O request would have to wait, without arming a timer
+ *
+ * @clock_type: the clock used by the throttled device
+ * @is_write:   the type of operation (read/write)
+ * @ret:        true if the request would be throttled
+ */
+bool throttle_must_wait(ThrottleState *ts,
+                        QEMUClockType clock_type,
+                        bool is_write)
+{
+    int64_t now = qemu_clock_get_ns(clock_type);
+    int64_t next_timestamp;
+
+    return throttle_compute_timer(ts, is_write, now, &next_timestamp);
+}
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
@@ -484,6 +500,47 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
     }
 }
 
+static void throttle_bucket_add(LeakyBucket *bkt, double amount)
+{
+    bkt->level = MAX(bkt->level + amount, 0);
+    if (bkt->burst_length > 1) {
+        bkt->burst_level = MAX(bkt->burst_level + amount, 0);
+    }
+}
+
+/* do the accounting for several operations at once, or give back
+ * previously accounted ones if @bytes and @ops are negative
+ *
+ * This does not take cfg.op_size into account, so callers must only
+ * use it when op_size is zero.
+ *
+ * @is_write: the type of operation (read/write)
+ * @bytes:    the total size of the operations
+ * @ops:      the number of operations
+ */
+void throttle_account_batch(ThrottleState *ts, bool is_write,
+                            int64_t bytes, int64_t ops)
+{
+    const BucketType bucket_types_size[2][2] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+    };
+    const BucketType bucket_types_units[2][2] = {
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+    };
+    unsigned i;
+
+    assert(!ts->cfg.op_size);
+
+    for (i = 0; i < 2; i++) {
+        throttle_bucket_add(&ts->cfg.buckets[bucket_types_size[is_write][i]],
+                            bytes);
+        throttle_bucket_add(&ts->cfg.buckets[bucket_types_units[is_write][i]],
+                            ops);
+    }
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from